@@ -25,6 +25,7 @@
 #include <linux/mm.h>
 #include <linux/vmalloc.h>
 #include <linux/io.h>
+#include <linux/smp.h>
 
 #include <asm/cputype.h>
 #include <asm/cacheflush.h>
@@ -259,6 +260,113 @@ void __iomem * __arm_ioremap_pfn_caller(unsigned long pfn,
 	return (void __iomem *) (offset + addr);
 }
 
+#ifndef CONFIG_ARM_LPAE
+/*
+ * DROBO: a permanent section mapping of part of the reserved NAS shared
+ * memory window, so the drivers can copy to and from it without a TLB entry
+ * per 4K page. Supersections are used where both addresses allow it.
+ *
+ * Unlike ioremap() sections are fine on SMP here because the area is never
+ * unmapped (there is no iounmap() for it), and every CPU resyncs its copy of
+ * the kernel page tables before the address is handed out. phys_addr and
+ * size must be PMD_SIZE aligned.
+ */
+static void ioremap_sections_sync(void *info)
+{
+	unsigned long *range = info;
+
+	if (current->active_mm->context.kvm_seq != init_mm.context.kvm_seq)
+		__check_kvm_seq(current->active_mm);
+	local_flush_tlb_kernel_range(range[0], range[1]);
+}
+
+static void ioremap_sections_free_table(pmd_t *pmdp)
+{
+	pmd_t pmd = *pmdp;
+
+	if ((pmd_val(pmd) & PMD_TYPE_MASK) == PMD_TYPE_TABLE)
+		pte_free_kernel(&init_mm, pmd_page_vaddr(pmd));
+}
+
+void __iomem *__arm_ioremap_sections(unsigned long phys_addr, size_t size,
+				     unsigned int mtype)
+{
+	const struct mem_type *type;
+	struct vm_struct *area;
+	unsigned long addr, end, pfn = __phys_to_pfn(phys_addr);
+	unsigned long range[2];
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	int super, i;
+
+	if (!size || ((phys_addr | size) & ~PMD_MASK))
+		return NULL;
+
+	type = get_mem_type(mtype);
+	if (!type)
+		return NULL;
+
+	area = get_vm_area_caller(size, VM_IOREMAP,
+				  __builtin_return_address(0));
+	if (!area)
+		return NULL;
+
+	addr = (unsigned long)area->addr;
+	if (addr & ~PMD_MASK) {
+		free_vm_area(area);
+		return NULL;
+	}
+	area->flags |= VM_ARM_SECTION_MAPPING;
+
+	super = DOMAIN_IO == 0 &&
+		((cpu_architecture() >= CPU_ARCH_ARMv6 && (get_cr() & CR_XP)) ||
+		 cpu_is_xsc3());
+
+	range[0] = addr;
+	range[1] = end = addr + size;
+
+	pgd = pgd_offset_k(addr);
+	pud = pud_offset(pgd, addr);
+	pmd = pmd_offset(pud, addr);
+	while (addr < end) {
+		if (super && end - addr >= SUPERSECTION_SIZE &&
+		    !((__pfn_to_phys(pfn) | addr) & ~SUPERSECTION_MASK)) {
+			unsigned long super_pmd_val;
+
+			super_pmd_val = __pfn_to_phys(pfn) | type->prot_sect |
+					PMD_SECT_SUPER;
+			for (i = 0; i < 8; i++) {
+				ioremap_sections_free_table(pmd);
+				pmd[0] = __pmd(super_pmd_val);
+				pmd[1] = __pmd(super_pmd_val);
+				flush_pmd_entry(pmd);
+
+				addr += PMD_SIZE;
+				pmd += 2;
+			}
+			pfn += SUPERSECTION_SIZE >> PAGE_SHIFT;
+		} else {
+			ioremap_sections_free_table(pmd);
+			pmd[0] = __pmd(__pfn_to_phys(pfn) | type->prot_sect);
+			pfn += SZ_1M >> PAGE_SHIFT;
+			pmd[1] = __pmd(__pfn_to_phys(pfn) | type->prot_sect);
+			pfn += SZ_1M >> PAGE_SHIFT;
+			flush_pmd_entry(pmd);
+
+			addr += PMD_SIZE;
+			pmd += 2;
+		}
+	}
+
+	init_mm.context.kvm_seq++;
+	on_each_cpu(ioremap_sections_sync, range, 1);
+
+	return (void __iomem *)area->addr;
+}
+EXPORT_SYMBOL(__arm_ioremap_sections);
+#endif
+
 void __iomem *__arm_ioremap_caller(unsigned long phys_addr, size_t size,
 	unsigned int mtype, void *caller)
 {
@@ -0,0 +1,969 @@
+/*******************************************************************************
+Copyright (C) Marvell International Ltd. and its affiliates
+
+This software file (the "File") is owned and distributed by Marvell
+International Ltd. and/or its affiliates ("Marvell") under the following
+alternative licensing terms.  Once you have made an election to distribute the
+File under one of the following license alternatives, please (i) delete this
+introductory statement regarding license alternatives, (ii) delete the two
+license alternatives that you have not elected to use and (iii) preserve the
+Marvell copyright notice above.
+
+
+********************************************************************************
+Marvell GPL License Option
+
+If you received this File from Marvell, you may opt to use, redistribute and/or
+modify this File in accordance with the terms and conditions of the General
+Public License Version 2, June 1991 (the "GPL License"), a copy of which is
+available along with the File in the license.txt file or by writing to the Free
+Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 or
+on the worldwide web at http://www.gnu.org/licenses/gpl.txt.
+
+THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE IMPLIED
+WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE ARE EXPRESSLY
+DISCLAIMED.  The GPL License provides additional details about this warranty
+disclaimer.
+*******************************************************************************/
+
+
+/*
+ * Software model of the NETA port: register window, RX/TX descriptor rings,
+ * per-CPU interrupt cause/mask and RX interrupt coalescing.
+ *
+ * Every MV_REG_READ/MV_REG_WRITE of a modelled port lands here (see mvNeta.h).
+ * A packet transmitted on a modelled port is written into the next free RX
+ * descriptor of its peer port, the same way the DMA engine would do it, so
+ * mv_netdev.c runs its real rx/tx/txdone/NAPI code against the model.
+ * The SMI and PHY address registers still go to the hardware.
+ */
+
+#include "mvCommon.h"
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/netdevice.h>
+#include <linux/interrupt.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <net/ip.h>
+#include <net/checksum.h>
+#include <net/ip6_checksum.h>
+#include <asm/div64.h>
+
+#include "mvOs.h"
+#include "gbe/mvNeta.h"
+#ifdef CONFIG_MV_CPU_PERF_CNTRS
+#include "cpu/mvCpuCntrs.h"
+#endif /* CONFIG_MV_CPU_PERF_CNTRS */
+
+#include "mv_netdev.h"
+
+#define MV_ETH_SIM_WIN_SIZE     0x4000
+#define MV_ETH_SIM_MIN_PKT      ETH_ZLEN
+
+#define MV_ETH_SIM_REG(sp, reg) ((sp)->regs[((reg) - NETA_REG_BASE((sp)->port)) >> 2])
+
+struct mv_eth_sim_port;
+
+struct mv_eth_sim_rxq {
+	struct mv_eth_sim_port *sp;
+	int             q;
+	int             size;       /* descriptors in the ring, 0 - not configured */
+	int             next;       /* next descriptor to be filled by the model */
+	int             occup;
+	int             free;
+	int             latched;    /* occupied interrupt is raised */
+	int             coal_armed;
+	struct hrtimer  coal_timer;
+	u32             pkts;
+	u32             drops;
+	u32             errs;
+	u64             bytes;
+	u64             stamp;      /* first status read that saw occupied descriptors */
+	u64             proc_time;
+	u32             proc_pkts;
+};
+
+struct mv_eth_sim_txq {
+	int             size;
+	int             next;       /* next descriptor to be sent by the model */
+	int             pend;
+	int             sent;
+	u32             pkts;
+	u32             descs;
+	u32             errs;
+	u64             bytes;
+	u64             stamp;      /* first status read that saw sent descriptors */
+	u64             done_time;
+	u32             done_descs;
+};
+
+struct mv_eth_sim_kick {
+	struct mv_eth_sim_port *sp;
+	int             cpu;
+	struct hrtimer  timer;
+#ifdef CONFIG_SMP
+	struct call_single_data csd;
+	unsigned long   pending;
+#endif /* CONFIG_SMP */
+};
+
+struct mv_eth_sim_port {
+	int             port;
+	int             peer;
+	u32             regs[MV_ETH_SIM_WIN_SIZE / 4];
+	u32             mask[CONFIG_NR_CPUS];   /* NETA_INTR_NEW_MASK_REG is banked per CPU */
+	struct mv_eth_sim_rxq rxq[MV_ETH_MAX_RXQ];
+	struct mv_eth_sim_txq txq[MV_ETH_MAX_TXQ];
+	struct mv_eth_sim_kick kick[CONFIG_NR_CPUS];
+	u64             model_time;
+	u32             model_pkts;
+	unsigned long   start;
+};
+
+static struct mv_eth_sim_port *mv_eth_sim_ports[MV_ETH_MAX_PORTS];
+static unsigned int mv_eth_sim_port_mask = CONFIG_MV_ETH_NETA_SIM_PORTS;
+static DEFINE_SPINLOCK(mv_eth_sim_lock);
+
+static int __init mv_eth_sim_cmdline(char *s)
+{
+	mv_eth_sim_port_mask = simple_strtoul(s, NULL, 16);
+	return 1;
+}
+__setup("mv_eth_sim=", mv_eth_sim_cmdline);
+
+/* CPU cycles when the PJ4 counters are configured, nanoseconds otherwise */
+static inline u64 mv_eth_sim_clock(void)
+{
+#ifdef CONFIG_MV_CPU_PERF_CNTRS
+	return mvCpuCyclesCntrRead();
+#else
+	return sched_clock();
+#endif /* CONFIG_MV_CPU_PERF_CNTRS */
+}
+
+static inline int mv_eth_sim_queue(MV_U32 offs, MV_U32 reg0, int num)
+{
+	MV_U32 delta = offs - reg0;
+
+	return (delta < (num << 2)) ? (delta >> 2) : -1;
+}
+
+/* Only lowmem is accessible to the model through its linear mapping */
+static void *mv_eth_sim_virt(MV_U32 phys)
+{
+	unsigned long pfn = phys >> PAGE_SHIFT;
+
+	if (!phys || !pfn_valid(pfn) || PageHighMem(pfn_to_page(pfn)))
+		return NULL;
+
+	return phys_to_virt(phys);
+}
+
+static struct mv_eth_sim_port *mv_eth_sim_port_get(MV_U32 offs)
+{
+	struct mv_eth_sim_port *sp;
+	int port;
+
+	for (port = 0; port < MV_ETH_MAX_PORTS; port++) {
+		sp = mv_eth_sim_ports[port];
+		if (sp && ((MV_U32)(offs - NETA_REG_BASE(port)) < MV_ETH_SIM_WIN_SIZE)) {
+			/* SMI of the port is shared by all PHYs on the board */
+			if ((offs == ETH_PHY_ADDR_REG(port)) || (offs == ETH_SMI_REG(port)))
+				return NULL;
+
+			return sp;
+		}
+	}
+	return NULL;
+}
+
+/******************************************************
+ * interrupts --                                      *
+ ******************************************************/
+static MV_U32 mv_eth_sim_cause(struct mv_eth_sim_port *sp, int cpu)
+{
+	MV_U32 map = MV_ETH_SIM_REG(sp, NETA_CPU_MAP_REG(sp->port, cpu));
+	MV_U32 cause = 0;
+	int q, thresh;
+
+	for (q = 0; q < MV_ETH_MAX_RXQ; q++) {
+		if (sp->rxq[q].latched && sp->rxq[q].occup && (map & NETA_CPU_RXQ_ACCESS_MASK(q)))
+			cause |= NETA_CAUSE_RXQ_OCCUP_DESC_MASK(q);
+	}
+	for (q = 0; q < MV_ETH_MAX_TXQ; q++) {
+		thresh = (MV_ETH_SIM_REG(sp, NETA_TXQ_SIZE_REG(sp->port, 0, q)) & NETA_TXQ_SENT_DESC_TRESH_ALL_MASK) >>
+				NETA_TXQ_SENT_DESC_TRESH_OFFS;
+
+		if (sp->txq[q].sent && (sp->txq[q].sent >= thresh) && (map & NETA_CPU_TXQ_ACCESS_MASK(q)))
+			cause |= NETA_CAUSE_TXQ_SENT_DESC_MASK(q);
+	}
+	if (MV_ETH_SIM_REG(sp, NETA_INTR_MISC_CAUSE_REG(sp->port)))
+		cause |= NETA_CAUSE_MISC_SUM_MASK;
+
+	return cause;
+}
+
+/* Runs on the target CPU in interrupt context, as the real NETA interrupt would */
+static void mv_eth_sim_deliver(struct mv_eth_sim_kick *kick)
+{
+	struct mv_eth_sim_port *sp = kick->sp;
+	struct eth_port *pp;
+	unsigned long flags;
+	MV_U32 cause;
+
+	spin_lock_irqsave(&mv_eth_sim_lock, flags);
+	cause = mv_eth_sim_cause(sp, kick->cpu) & sp->mask[kick->cpu];
+	spin_unlock_irqrestore(&mv_eth_sim_lock, flags);
+
+	if (!cause)
+		return;
+
+	pp = mv_eth_port_by_id(sp->port);
+	if (pp && pp->dev)
+		mv_eth_isr(pp->dev->irq, pp);
+}
+
+static enum hrtimer_restart mv_eth_sim_kick_timer(struct hrtimer *timer)
+{
+	mv_eth_sim_deliver(container_of(timer, struct mv_eth_sim_kick, timer));
+
+	return HRTIMER_NORESTART;
+}
+
+#ifdef CONFIG_SMP
+static void mv_eth_sim_kick_ipi(void *info)
+{
+	struct mv_eth_sim_kick *kick = info;
+
+	clear_bit(0, &kick->pending);
+	mv_eth_sim_deliver(kick);
+}
+#endif /* CONFIG_SMP */
+
+/* Called with mv_eth_sim_lock held: never deliver from inside a register access */
+static void mv_eth_sim_kick(struct mv_eth_sim_port *sp, int cpu)
+{
+	struct mv_eth_sim_kick *kick = &sp->kick[cpu];
+
+	if (cpu == smp_processor_id()) {
+		hrtimer_start(&kick->timer, ktime_set(0, 0), HRTIMER_MODE_REL_PINNED);
+		return;
+	}
+#ifdef CONFIG_SMP
+	if (!test_and_set_bit(0, &kick->pending))
+		__smp_call_function_single(cpu, &kick->csd, 0);
+#endif /* CONFIG_SMP */
+}
+
+static void mv_eth_sim_irq(struct mv_eth_sim_port *sp)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		if (sp->mask[cpu] && (mv_eth_sim_cause(sp, cpu) & sp->mask[cpu]))
+			mv_eth_sim_kick(sp, cpu);
+	}
+}
+
+/* Raise RXQ occupied interrupt according to packets and time coalescing */
+static void mv_eth_sim_rx_coal(struct mv_eth_sim_port *sp, int q)
+{
+	struct mv_eth_sim_rxq *rxq = &sp->rxq[q];
+	MV_U32 thresh, usec, mhz;
+
+	if (rxq->latched || !rxq->occup)
+		return;
+
+	thresh = (MV_ETH_SIM_REG(sp, NETA_RXQ_THRESHOLD_REG(sp->port, q)) & NETA_RXQ_OCCUPIED_DESC_ALL_MASK) >>
+			NETA_RXQ_OCCUPIED_DESC_OFFS;
+	mhz = mvNetaHalData.tClk / 1000000;
+	usec = mhz ? (MV_ETH_SIM_REG(sp, NETA_RXQ_INTR_TIME_COAL_REG(sp->port, q)) / mhz) : 0;
+
+	if ((rxq->occup >= MV_MAX(thresh, 1)) || (usec == 0)) {
+		rxq->latched = 1;
+		mv_eth_sim_irq(sp);
+		return;
+	}
+	if (!rxq->coal_armed) {
+		rxq->coal_armed = 1;
+		hrtimer_start(&rxq->coal_timer, ns_to_ktime((u64)usec * NSEC_PER_USEC), HRTIMER_MODE_REL_PINNED);
+	}
+}
+
+static enum hrtimer_restart mv_eth_sim_coal_timer(struct hrtimer *timer)
+{
+	struct mv_eth_sim_rxq *rxq = container_of(timer, struct mv_eth_sim_rxq, coal_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&mv_eth_sim_lock, flags);
+	rxq->coal_armed = 0;
+	if (rxq->occup && !rxq->latched) {
+		rxq->latched = 1;
+		mv_eth_sim_irq(rxq->sp);
+	}
+	spin_unlock_irqrestore(&mv_eth_sim_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/******************************************************
+ * packet path --                                     *
+ ******************************************************/
+
+/* TX checksum generation: L3 offset and IP header length come from the descriptor */
+static void mv_eth_sim_tx_csum(u8 *frame, int len, MV_U32 cmd)
+{
+	int l3 = (cmd & NETA_TX_L3_OFFSET_MASK) >> NETA_TX_L3_OFFSET_OFFS;
+	int hlen = ((cmd & NETA_TX_IP_HLEN_MASK) >> NETA_TX_IP_HLEN_OFFS) << 2;
+	int proto = (cmd & NETA_TX_L4_UDP) ? IPPROTO_UDP : IPPROTO_TCP;
+	int l4len, check;
+	__sum16 *sum;
+	__wsum csum;
+
+	if ((l3 + hlen > len) || (hlen < sizeof(struct iphdr)))
+		return;
+
+	if (!(cmd & NETA_TX_L3_IP6) && (cmd & NETA_TX_IP_CSUM_MASK)) {
+		struct iphdr *iph = (struct iphdr *)(frame + l3);
+
+		iph->check = 0;
+		iph->check = ip_fast_csum((u8 *)iph, hlen >> 2);
+	}
+	/* Partial checksum is generated as a full one */
+	if ((cmd & NETA_TX_L4_CSUM_MASK) == NETA_TX_L4_CSUM_NOT)
+		return;
+
+	if (cmd & NETA_TX_L3_IP6)
+		l4len = ntohs(((struct ipv6hdr *)(frame + l3))->payload_len) + sizeof(struct ipv6hdr) - hlen;
+	else
+		l4len = ntohs(((struct iphdr *)(frame + l3))->tot_len) - hlen;
+
+	check = (proto == IPPROTO_UDP) ? offsetof(struct udphdr, check) : offsetof(struct tcphdr, check);
+	if ((l4len < check + 2) || (l3 + hlen + l4len > len))
+		return;
+
+	sum = (__sum16 *)(frame + l3 + hlen + check);
+	*sum = 0;
+	csum = csum_partial(frame + l3 + hlen, l4len, 0);
+
+	if (cmd & NETA_TX_L3_IP6) {
+		struct ipv6hdr *ip6h = (struct ipv6hdr *)(frame + l3);
+
+		*sum = csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, l4len, proto, csum);
+	} else {
+		struct iphdr *iph = (struct iphdr *)(frame + l3);
+
+		*sum = csum_tcpudp_magic(iph->saddr, iph->daddr, l4len, proto, csum);
+	}
+	if ((proto == IPPROTO_UDP) && (*sum == 0))
+		*sum = CSUM_MANGLED_0;
+}
+
+static int mv_eth_sim_l4_parse(NETA_RX_DESC *rx_desc, int proto, int l4len)
+{
+	if (proto == IPPROTO_TCP) {
+		NETA_RX_L4_SET_TCP(rx_desc);
+		return l4len >= sizeof(struct tcphdr);
+	}
+	if (proto == IPPROTO_UDP) {
+		NETA_RX_L4_SET_UDP(rx_desc);
+		return l4len >= sizeof(struct udphdr);
+	}
+	NETA_RX_L4_SET_OTHER(rx_desc);
+	return 0;
+}
+
+/* RX parser: L3/L4 type, IPv4 header check, fragments and L4 checksum */
+static void mv_eth_sim_rx_parse(NETA_RX_DESC *rx_desc, u8 *frame, int len)
+{
+	int l3 = ETH_HLEN;
+	__be16 type = ((struct ethhdr *)frame)->h_proto;
+	int hlen, l4len, proto;
+	__wsum csum;
+
+	if ((type == htons(ETH_P_8021Q)) && (len >= VLAN_ETH_HLEN)) {
+		NETA_RX_SET_VLAN(rx_desc);
+		type = ((struct vlan_ethhdr *)frame)->h_vlan_encapsulated_proto;
+		l3 = VLAN_ETH_HLEN;
+	}
+
+	if ((type == htons(ETH_P_IP)) && (len >= l3 + sizeof(struct iphdr))) {
+		struct iphdr *iph = (struct iphdr *)(frame + l3);
+
+		hlen = iph->ihl << 2;
+		if ((iph->version != 4) || (hlen < sizeof(struct iphdr)) || (l3 + hlen > len) ||
+		    ip_fast_csum((u8 *)iph, iph->ihl)) {
+			NETA_RX_L3_SET_IP4_ERR(rx_desc);
+			return;
+		}
+		NETA_RX_L3_SET_IP4(rx_desc);
+
+		if (iph->frag_off & htons(IP_MF | IP_OFFSET)) {
+			NETA_RX_IP_SET_FRAG(rx_desc);
+			NETA_RX_L4_SET_OTHER(rx_desc);
+			return;
+		}
+		l4len = ntohs(iph->tot_len) - hlen;
+		if ((l4len < 0) || (l3 + hlen + l4len > len))
+			return;
+
+		proto = iph->protocol;
+		if (!mv_eth_sim_l4_parse(rx_desc, proto, l4len))
+			return;
+
+		if ((proto == IPPROTO_UDP) && (((struct udphdr *)(frame + l3 + hlen))->check == 0)) {
+			NETA_RX_L4_CSUM_SET_OK(rx_desc);
+			return;
+		}
+		csum = csum_partial(frame + l3 + hlen, l4len, 0);
+		if (!csum_tcpudp_magic(iph->saddr, iph->daddr, l4len, proto, csum))
+			NETA_RX_L4_CSUM_SET_OK(rx_desc);
+		return;
+	}
+
+	if ((type == htons(ETH_P_IPV6)) && (len >= l3 + sizeof(struct ipv6hdr))) {
+		struct ipv6hdr *ip6h = (struct ipv6hdr *)(frame + l3);
+
+		NETA_RX_L3_SET_IP6(rx_desc);
+		hlen = sizeof(struct ipv6hdr);
+		l4len = ntohs(ip6h->payload_len);
+		if (l3 + hlen + l4len > len)
+			return;
+
+		proto = ip6h->nexthdr;
+		if (!mv_eth_sim_l4_parse(rx_desc, proto, l4len))
+			return;
+
+		csum = csum_partial(frame + l3 + hlen, l4len, 0);
+		if (!csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, l4len, proto, csum))
+			NETA_RX_L4_CSUM_SET_OK(rx_desc);
+		return;
+	}
+	NETA_RX_L3_SET_UN(rx_desc);
+}
+
+/* Copy one packet (descs descriptors starting at tx_desc) into the peer RX ring */
+static int mv_eth_sim_xmit(struct mv_eth_sim_port *sp, int txq, NETA_TX_DESC *tx_ring, int first, int descs)
+{
+	struct mv_eth_sim_port *dp = mv_eth_sim_ports[sp->peer];
+	struct mv_eth_sim_txq *txq_ctrl = &sp->txq[txq];
+	struct mv_eth_sim_rxq *rxq_ctrl;
+	NETA_TX_DESC *tx_desc = tx_ring + first;
+	NETA_RX_DESC *rx_desc;
+	MV_U32 cmd = tx_desc->command, regVal;
+	int rxq, offs, room, skip, len, i, size;
+	u8 *buf, *data, *src;
+
+	if (!dp)
+		return -ENODEV;
+
+	/* Model maps TXQ to the RXQ with the same number, else to the default RXQ */
+	regVal = MV_ETH_SIM_REG(dp, ETH_RX_QUEUE_COMMAND_REG(dp->port)) & ETH_RXQ_ENABLE_MASK;
+	rxq = txq;
+	if ((rxq >= MV_ETH_MAX_RXQ) || !(regVal & (1 << rxq)) || !dp->rxq[rxq].size)
+		rxq = (MV_ETH_SIM_REG(dp, ETH_PORT_CONFIG_REG(dp->port)) & ETH_DEF_RX_QUEUE_ALL_MASK) >>
+				ETH_DEF_RX_QUEUE_OFFSET;
+	rxq_ctrl = &dp->rxq[rxq];
+
+	if (!(regVal & (1 << rxq)) || !rxq_ctrl->size || !rxq_ctrl->free) {
+		rxq_ctrl->drops++;
+		return 0;
+	}
+
+	rx_desc = mv_eth_sim_virt(MV_ETH_SIM_REG(dp, NETA_RXQ_BASE_ADDR_REG(dp->port, rxq)));
+	if (!rx_desc) {
+		rxq_ctrl->errs++;
+		return -EFAULT;
+	}
+	rx_desc += rxq_ctrl->next;
+	buf = mv_eth_sim_virt(rx_desc->bufPhysAddr);
+	if (!buf) {
+		rxq_ctrl->errs++;
+		return -EFAULT;
+	}
+
+	offs = ((MV_ETH_SIM_REG(dp, NETA_RXQ_CONFIG_REG(dp->port, rxq)) & NETA_RXQ_PACKET_OFFSET_ALL_MASK) >>
+			NETA_RXQ_PACKET_OFFSET_OFFS) << 3;
+	room = ((MV_ETH_SIM_REG(dp, NETA_RXQ_SIZE_REG(dp->port, rxq)) & NETA_RXQ_BUF_SIZE_MASK) >>
+			NETA_RXQ_BUF_SIZE_OFFS) << 3;
+	room = (room > offs) ? (room - offs) : 0;
+	data = buf + offs;
+
+	/* With Marvell header enabled TX data already starts with it, else RX inserts 2 bytes */
+	skip = (MV_ETH_SIM_REG(sp, ETH_PORT_MARVELL_HEADER_REG(sp->port)) & ETH_MH_EN_MASK) ? 0 : MV_ETH_MH_SIZE;
+	if (room >= skip)
+		memset(data, 0, skip);
+
+	len = 0;
+	for (i = 0; i < descs; i++) {
+		tx_desc = tx_ring + ((first + i) % txq_ctrl->size);
+		src = mv_eth_sim_virt(tx_desc->bufPhysAddr);
+		if (!src) {
+			txq_ctrl->errs++;
+			return -EFAULT;
+		}
+		if (skip + len + tx_desc->dataSize <= room)
+			memcpy(data + skip + len, src, tx_desc->dataSize);
+		len += tx_desc->dataSize;
+	}
+	if (!(cmd & NETA_TX_Z_PAD_MASK) && (len < MV_ETH_SIM_MIN_PKT)) {
+		if (skip + MV_ETH_SIM_MIN_PKT <= room)
+			memset(data + skip + len, 0, MV_ETH_SIM_MIN_PKT - len);
+		len = MV_ETH_SIM_MIN_PKT;
+	}
+	size = skip + len + MV_ETH_CRC_SIZE;
+
+	rx_desc->status = NETA_RX_F_DESC_MASK | NETA_RX_L_DESC_MASK;
+	rx_desc->pncInfo = 0;
+	rx_desc->pncFlowId = 0;
+	rx_desc->pncExtra = 0;
+	rx_desc->csumL4 = 0;
+	rx_desc->dataSize = size;
+
+	if ((size > room) || (size < MV_ETH_MH_SIZE + ETH_HLEN + MV_ETH_CRC_SIZE)) {
+		rx_desc->status |= NETA_RX_ES_MASK | NETA_RX_ERR_LEN;
+		rxq_ctrl->errs++;
+	} else {
+		/* CRC bytes are not checked by the driver, keep them deterministic */
+		memset(data + skip + len, 0, MV_ETH_CRC_SIZE);
+		mv_eth_sim_tx_csum(data + skip, len, cmd);
+		mv_eth_sim_rx_parse(rx_desc, data + MV_ETH_MH_SIZE, skip + len - MV_ETH_MH_SIZE);
+		mvOsCacheFlush(NULL, data, size);
+	}
+	mvOsCacheLineFlush(NULL, rx_desc);
+
+	rxq_ctrl->next = (rxq_ctrl->next + 1) % rxq_ctrl->size;
+	rxq_ctrl->free--;
+	rxq_ctrl->occup++;
+	rxq_ctrl->pkts++;
+	rxq_ctrl->bytes += len;
+
+	txq_ctrl->pkts++;
+	txq_ctrl->bytes += len;
+
+	mv_eth_sim_rx_coal(dp, rxq);
+
+	return 0;
+}
+
+/* TX DMA: send all complete packets of pending descriptors */
+static void mv_eth_sim_tx(struct mv_eth_sim_port *sp, int txq)
+{
+	struct mv_eth_sim_txq *txq_ctrl = &sp->txq[txq];
+	NETA_TX_DESC *tx_ring, *tx_desc;
+	u64 start;
+	int descs, pkts = 0;
+
+	if (!txq_ctrl->size || !txq_ctrl->pend ||
+	    !(MV_ETH_SIM_REG(sp, ETH_TX_QUEUE_COMMAND_REG(sp->port, 0)) & (1 << txq)))
+		return;
+
+	tx_ring = mv_eth_sim_virt(MV_ETH_SIM_REG(sp, NETA_TXQ_BASE_ADDR_REG(sp->port, 0, txq)));
+	if (!tx_ring) {
+		txq_ctrl->errs++;
+		return;
+	}
+
+	start = mv_eth_sim_clock();
+	while (txq_ctrl->pend) {
+		/* Find the last descriptor of the packet among pending ones */
+		for (descs = 1; descs <= txq_ctrl->pend; descs++) {
+			tx_desc = tx_ring + ((txq_ctrl->next + descs - 1) % txq_ctrl->size);
+			if (tx_desc->command & NETA_TX_L_DESC_MASK)
+				break;
+		}
+		if (descs > txq_ctrl->pend)
+			break;
+
+		if (!(tx_ring[txq_ctrl->next].command & NETA_TX_F_DESC_MASK))
+			txq_ctrl->errs++;
+		else if (mv_eth_sim_xmit(sp, txq, tx_ring, txq_ctrl->next, descs) == 0)
+			pkts++;
+
+		txq_ctrl->next = (txq_ctrl->next + descs) % txq_ctrl->size;
+		txq_ctrl->pend -= descs;
+		txq_ctrl->sent += descs;
+		txq_ctrl->descs += descs;
+	}
+	sp->model_time += mv_eth_sim_clock() - start;
+	sp->model_pkts += pkts;
+
+	mv_eth_sim_irq(sp);
+}
+
+/******************************************************
+ * register access --                                 *
+ ******************************************************/
+static void mv_eth_sim_rxq_reset(struct mv_eth_sim_port *sp, int q)
+{
+	struct mv_eth_sim_rxq *rxq = &sp->rxq[q];
+
+	rxq->size = (MV_ETH_SIM_REG(sp, NETA_RXQ_SIZE_REG(sp->port, q)) & NETA_RXQ_DESC_NUM_MASK) >>
+			NETA_RXQ_DESC_NUM_OFFS;
+	rxq->next = rxq->occup = rxq->free = rxq->latched = 0;
+	rxq->stamp = 0;
+}
+
+static void mv_eth_sim_txq_reset(struct mv_eth_sim_port *sp, int q)
+{
+	struct mv_eth_sim_txq *txq = &sp->txq[q];
+
+	txq->size = (MV_ETH_SIM_REG(sp, NETA_TXQ_SIZE_REG(sp->port, 0, q)) & NETA_TXQ_DESC_NUM_ALL_MASK) >>
+			NETA_TXQ_DESC_NUM_OFFS;
+	txq->next = txq->pend = txq->sent = 0;
+	txq->stamp = 0;
+}
+
+static MV_U32 mv_eth_sim_read(struct mv_eth_sim_port *sp, MV_U32 offs)
+{
+	int port = sp->port, cpu = smp_processor_id();
+	int q;
+
+	q = mv_eth_sim_queue(offs, NETA_RXQ_STATUS_REG(port, 0), MV_ETH_MAX_RXQ);
+	if (q >= 0) {
+		if (sp->rxq[q].occup && !sp->rxq[q].stamp)
+			sp->rxq[q].stamp = mv_eth_sim_clock();
+
+		return NETA_RXQ_OCCUPIED_DESC_MASK(sp->rxq[q].occup) | NETA_RXQ_NON_OCCUPIED_DESC_MASK(sp->rxq[q].free);
+	}
+	q = mv_eth_sim_queue(offs, NETA_RXQ_INDEX_REG(port, 0), MV_ETH_MAX_RXQ);
+	if (q >= 0)
+		return sp->rxq[q].next;
+
+	q = mv_eth_sim_queue(offs, NETA_TXQ_STATUS_REG(port, 0, 0), MV_ETH_MAX_TXQ);
+	if (q >= 0) {
+		if (sp->txq[q].sent && !sp->txq[q].stamp)
+			sp->txq[q].stamp = mv_eth_sim_clock();
+
+		return (sp->txq[q].pend << NETA_TXQ_PENDING_DESC_OFFS) | (sp->txq[q].sent << NETA_TXQ_SENT_DESC_OFFS);
+	}
+	q = mv_eth_sim_queue(offs, NETA_TXQ_SENT_DESC_REG(port, 0, 0), MV_ETH_MAX_TXQ);
+	if (q >= 0)
+		return sp->txq[q].sent << NETA_TXQ_SENT_DESC_OFFS;
+
+	q = mv_eth_sim_queue(offs, NETA_TXQ_INDEX_REG(port, 0, 0), MV_ETH_MAX_TXQ);
+	if (q >= 0)
+		return sp->txq[q].next;
+
+	if (offs == NETA_INTR_NEW_CAUSE_REG(port))
+		return mv_eth_sim_cause(sp, cpu);
+
+	if (offs == NETA_INTR_NEW_MASK_REG(port))
+		return sp->mask[cpu];
+
+	/* Model has no TX FIFO: it is always empty and idle */
+	if (offs == ETH_PORT_STATUS_REG(port))
+#ifdef MV_ETH_GMAC_NEW
+		return (MV_ETH_SIM_REG(sp, offs) & ~ETH_TX_IN_PROGRESS_ALL_MASK) | ETH_TX_FIFO_EMPTY_ALL_MASK;
+#else
+		return (MV_ETH_SIM_REG(sp, offs) & ~ETH_TX_IN_PROGRESS_MASK) | ETH_TX_FIFO_EMPTY_MASK;
+#endif /* MV_ETH_GMAC_NEW */
+
+	if (offs == NETA_GMAC_STATUS_REG(port))
+		return MV_ETH_SIM_REG(sp, offs) | NETA_GMAC_LINK_UP_MASK | NETA_GMAC_SPEED_1000_MASK |
+			NETA_GMAC_FULL_DUPLEX_MASK;
+
+	return MV_ETH_SIM_REG(sp, offs);
+}
+
+static void mv_eth_sim_write(struct mv_eth_sim_port *sp, MV_U32 offs, MV_U32 val)
+{
+	int port = sp->port, cpu = smp_processor_id();
+	MV_U32 old = MV_ETH_SIM_REG(sp, offs);
+	int q, dec, add;
+
+	q = mv_eth_sim_queue(offs, NETA_RXQ_STATUS_UPDATE_REG(port, 0), MV_ETH_MAX_RXQ);
+	if (q >= 0) {
+		struct mv_eth_sim_rxq *rxq = &sp->rxq[q];
+
+		dec = MV_MIN((val & NETA_RXQ_DEC_OCCUPIED_MASK) >> NETA_RXQ_DEC_OCCUPIED_OFFS, rxq->occup);
+		add = (val & NETA_RXQ_ADD_NON_OCCUPIED_MASK) >> NETA_RXQ_ADD_NON_OCCUPIED_OFFS;
+
+		if (dec && rxq->stamp) {
+			rxq->proc_time += mv_eth_sim_clock() - rxq->stamp;
+			rxq->proc_pkts += dec;
+			rxq->stamp = 0;
+		}
+		rxq->occup -= dec;
+		rxq->free = MV_MIN(rxq->free + add, rxq->size - rxq->occup);
+		if (!rxq->occup)
+			rxq->latched = 0;
+		else
+			mv_eth_sim_rx_coal(sp, q);
+		return;
+	}
+
+	q = mv_eth_sim_queue(offs, NETA_TXQ_UPDATE_REG(port, 0, 0), MV_ETH_MAX_TXQ);
+	if (q >= 0) {
+		struct mv_eth_sim_txq *txq = &sp->txq[q];
+
+		dec = MV_MIN((val & NETA_TXQ_DEC_SENT_MASK) >> NETA_TXQ_DEC_SENT_OFFS, txq->sent);
+		add = (val & NETA_TXQ_ADD_PENDING_MASK) >> NETA_TXQ_ADD_PENDING_OFFS;
+
+		if (dec && txq->stamp) {
+			txq->done_time += mv_eth_sim_clock() - txq->stamp;
+			txq->done_descs += dec;
+			txq->stamp = 0;
+		}
+		txq->sent -= dec;
+		txq->pend = MV_MIN(txq->pend + add, txq->size - txq->sent);
+		if (add)
+			mv_eth_sim_tx(sp, q);
+		return;
+	}
+
+	MV_ETH_SIM_REG(sp, offs) = val;
+
+	q = mv_eth_sim_queue(offs, NETA_RXQ_BASE_ADDR_REG(port, 0), MV_ETH_MAX_RXQ);
+	if (q >= 0) {
+		mv_eth_sim_rxq_reset(sp, q);
+		return;
+	}
+	q = mv_eth_sim_queue(offs, NETA_RXQ_SIZE_REG(port, 0), MV_ETH_MAX_RXQ);
+	if (q >= 0) {
+		if ((old ^ val) & NETA_RXQ_DESC_NUM_MASK)
+			mv_eth_sim_rxq_reset(sp, q);
+		return;
+	}
+	q = mv_eth_sim_queue(offs, NETA_RXQ_THRESHOLD_REG(port, 0), MV_ETH_MAX_RXQ);
+	if (q >= 0) {
+		mv_eth_sim_rx_coal(sp, q);
+		return;
+	}
+	q = mv_eth_sim_queue(offs, NETA_TXQ_BASE_ADDR_REG(port, 0, 0), MV_ETH_MAX_TXQ);
+	if (q >= 0) {
+		mv_eth_sim_txq_reset(sp, q);
+		return;
+	}
+	q = mv_eth_sim_queue(offs, NETA_TXQ_SIZE_REG(port, 0, 0), MV_ETH_MAX_TXQ);
+	if (q >= 0) {
+		if ((old ^ val) & NETA_TXQ_DESC_NUM_ALL_MASK)
+			mv_eth_sim_txq_reset(sp, q);
+		else
+			mv_eth_sim_irq(sp);
+		return;
+	}
+
+	if (offs == ETH_RX_QUEUE_COMMAND_REG(port)) {
+		MV_ETH_SIM_REG(sp, offs) = (old | (val & ETH_RXQ_ENABLE_MASK)) &
+						~((val & ETH_RXQ_DISABLE_MASK) >> ETH_RXQ_DISABLE_OFFSET);
+		return;
+	}
+	if (offs == ETH_TX_QUEUE_COMMAND_REG(port, 0)) {
+		MV_ETH_SIM_REG(sp, offs) = (old | (val & ETH_TXQ_ENABLE_MASK)) &
+						~((val & ETH_TXQ_DISABLE_MASK) >> ETH_TXQ_DISABLE_OFFSET);
+
+		for (q = 0; q < MV_ETH_MAX_TXQ; q++) {
+			if (val & (1 << q))
+				mv_eth_sim_tx(sp, q);
+		}
+		return;
+	}
+	if (offs == NETA_INTR_NEW_MASK_REG(port)) {
+		sp->mask[cpu] = val;
+		if (mv_eth_sim_cause(sp, cpu) & val)
+			mv_eth_sim_kick(sp, cpu);
+		return;
+	}
+	if (offs == NETA_INTR_NEW_CAUSE_REG(port)) {
+		/* Clearing RXQ occupied bit re-arms coalescing of the queue */
+		for (q = 0; q < MV_ETH_MAX_RXQ; q++) {
+			if (!(val & NETA_CAUSE_RXQ_OCCUP_DESC_MASK(q)))
+				sp->rxq[q].latched = 0;
+		}
+		return;
+	}
+	if (offs == NETA_INTR_MISC_CAUSE_REG(port))
+		mv_eth_sim_irq(sp);
+}
+
+MV_U32 mvNetaSimRegRead(MV_U32 offs)
+{
+	struct mv_eth_sim_port *sp = mv_eth_sim_port_get(offs);
+	unsigned long flags;
+	MV_U32 val;
+
+	if (!sp)
+		return MV_MEMIO_LE32_READ(INTER_REGS_BASE | offs);
+
+	spin_lock_irqsave(&mv_eth_sim_lock, flags);
+	val = mv_eth_sim_read(sp, offs);
+	spin_unlock_irqrestore(&mv_eth_sim_lock, flags);
+
+	return val;
+}
+
+void mvNetaSimRegWrite(MV_U32 offs, MV_U32 val)
+{
+	struct mv_eth_sim_port *sp = mv_eth_sim_port_get(offs);
+	unsigned long flags;
+
+	if (!sp) {
+		MV_MEMIO_LE32_WRITE((INTER_REGS_BASE | offs), val);
+		return;
+	}
+
+	spin_lock_irqsave(&mv_eth_sim_lock, flags);
+	mv_eth_sim_write(sp, offs, val);
+	spin_unlock_irqrestore(&mv_eth_sim_lock, flags);
+}
+
+/******************************************************
+ * sysfs --                                           *
+ ******************************************************/
+static u32 mv_eth_sim_per_pkt(u64 time, u32 pkts)
+{
+	if (!pkts)
+		return 0;
+
+	do_div(time, pkts);
+	return (u32)time;
+}
+
+void mv_eth_sim_show(int port)
+{
+	struct mv_eth_sim_port *sp;
+	struct mv_eth_sim_rxq *rxq;
+	struct mv_eth_sim_txq *txq;
+	unsigned int msec;
+	u64 rate;
+	int q;
+
+	if ((port < 0) || (port >= MV_ETH_MAX_PORTS) || !mv_eth_sim_ports[port]) {
+		printk(KERN_ERR "port %d is not modelled (mask=0x%x)\n", port, mv_eth_sim_port_mask);
+		return;
+	}
+	sp = mv_eth_sim_ports[port];
+	msec = MV_MAX(jiffies_to_msecs(jiffies - sp->start), 1);
+
+	printk(KERN_ERR "\n[NETA model: port=%d, peer=%d, %u msec, time in %s]\n",
+		port, sp->peer, msec,
+#ifdef CONFIG_MV_CPU_PERF_CNTRS
+		"cycles");
+#else
+		"nsec");
+#endif /* CONFIG_MV_CPU_PERF_CNTRS */
+
+	printk(KERN_ERR "rxq: size occup  free       pkts    drops     errs     kpps     Mbps  proc/pkt\n");
+	for (q = 0; q < MV_ETH_MAX_RXQ; q++) {
+		rxq = &sp->rxq[q];
+		if (!rxq->size)
+			continue;
+
+		rate = rxq->bytes * 8;
+		do_div(rate, msec * 1000);
+		printk(KERN_ERR "%3d: %4d %5d %5d %10u %8u %8u %8u %8u %9u\n",
+			q, rxq->size, rxq->occup, rxq->free, rxq->pkts, rxq->drops, rxq->errs,
+			rxq->pkts / msec, (u32)rate, mv_eth_sim_per_pkt(rxq->proc_time, rxq->proc_pkts));
+	}
+
+	printk(KERN_ERR "txq: size  pend  sent       pkts    descs     errs     kpps     Mbps  done/desc\n");
+	for (q = 0; q < MV_ETH_MAX_TXQ; q++) {
+		txq = &sp->txq[q];
+		if (!txq->size)
+			continue;
+
+		rate = txq->bytes * 8;
+		do_div(rate, msec * 1000);
+		printk(KERN_ERR "%3d: %4d %5d %5d %10u %8u %8u %8u %8u %9u\n",
+			q, txq->size, txq->pend, txq->sent, txq->pkts, txq->descs, txq->errs,
+			txq->pkts / msec, (u32)rate, mv_eth_sim_per_pkt(txq->done_time, txq->done_descs));
+	}
+	printk(KERN_ERR "model: %u pkts, %u per packet\n",
+		sp->model_pkts, mv_eth_sim_per_pkt(sp->model_time, sp->model_pkts));
+}
+
+void mv_eth_sim_clear(int port)
+{
+	struct mv_eth_sim_port *sp;
+	unsigned long flags;
+	int q;
+
+	if ((port < 0) || (port >= MV_ETH_MAX_PORTS) || !mv_eth_sim_ports[port])
+		return;
+
+	sp = mv_eth_sim_ports[port];
+	spin_lock_irqsave(&mv_eth_sim_lock, flags);
+	for (q = 0; q < MV_ETH_MAX_RXQ; q++) {
+		sp->rxq[q].pkts = sp->rxq[q].drops = sp->rxq[q].errs = sp->rxq[q].proc_pkts = 0;
+		sp->rxq[q].bytes = sp->rxq[q].proc_time = 0;
+	}
+	for (q = 0; q < MV_ETH_MAX_TXQ; q++) {
+		sp->txq[q].pkts = sp->txq[q].descs = sp->txq[q].errs = sp->txq[q].done_descs = 0;
+		sp->txq[q].bytes = sp->txq[q].done_time = 0;
+	}
+	sp->model_time = 0;
+	sp->model_pkts = 0;
+	sp->start = jiffies;
+	spin_unlock_irqrestore(&mv_eth_sim_lock, flags);
+}
+
+int mv_eth_sim_peer_set(int port, int peer)
+{
+	unsigned long flags;
+
+	if ((port < 0) || (port >= MV_ETH_MAX_PORTS) || !mv_eth_sim_ports[port] ||
+	    (peer < 0) || (peer >= MV_ETH_MAX_PORTS) || !mv_eth_sim_ports[peer]) {
+		printk(KERN_ERR "%s: ports %d and %d must be modelled (mask=0x%x)\n",
+			__func__, port, peer, mv_eth_sim_port_mask);
+		return -EINVAL;
+	}
+	spin_lock_irqsave(&mv_eth_sim_lock, flags);
+	mv_eth_sim_ports[port]->peer = peer;
+	spin_unlock_irqrestore(&mv_eth_sim_lock, flags);
+
+	return 0;
+}
+
+/* Must be ready before mv_eth_init() touches the port registers */
+static int __init mv_eth_sim_init(void)
+{
+	struct mv_eth_sim_port *sp;
+	int port, q, cpu;
+
+	for (port = 0; port < MV_ETH_MAX_PORTS; port++) {
+		if (!(mv_eth_sim_port_mask & (1 << port)))
+			continue;
+
+		sp = kzalloc(sizeof(struct mv_eth_sim_port), GFP_KERNEL);
+		if (!sp) {
+			printk(KERN_ERR "%s: port %d: out of memory\n", __func__, port);
+			continue;
+		}
+		sp->port = port;
+		sp->peer = port;
+		sp->start = jiffies;
+
+		for (q = 0; q < MV_ETH_MAX_RXQ; q++) {
+			sp->rxq[q].sp = sp;
+			sp->rxq[q].q = q;
+			hrtimer_init(&sp->rxq[q].coal_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+			sp->rxq[q].coal_timer.function = mv_eth_sim_coal_timer;
+		}
+		for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+			sp->kick[cpu].sp = sp;
+			sp->kick[cpu].cpu = cpu;
+			hrtimer_init(&sp->kick[cpu].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+			sp->kick[cpu].timer.function = mv_eth_sim_kick_timer;
+#ifdef CONFIG_SMP
+			sp->kick[cpu].csd.func = mv_eth_sim_kick_ipi;
+			sp->kick[cpu].csd.info = &sp->kick[cpu];
+#endif /* CONFIG_SMP */
+		}
+		mv_eth_sim_ports[port] = sp;
+		printk(KERN_INFO "NETA port %d: software model, no traffic on the wire\n", port);
+	}
+	return 0;
+}
+arch_initcall(mv_eth_sim_init);
@@ -48,6 +48,11 @@ static ssize_t mv_eth_help(char *buf)
 	off += sprintf(buf+off, "echo p             > mac           - show MAC info for port <p>\n");
 	off += sprintf(buf+off, "echo p             > vprio         - show VLAN priority map for port <p>\n");
 	off += sprintf(buf+off, "echo p             > napi          - show port NAPI groups: CPUs and RXQs\n");
+#ifdef CONFIG_MV_ETH_NETA_SIM
+	off += sprintf(buf+off, "echo p             > sim           - show NETA model rings, rates and per packet cost for <p>\n");
+	off += sprintf(buf+off, "echo p             > sim_clear     - clear NETA model statistics for <p>\n");
+	off += sprintf(buf+off, "echo p peer        > sim_peer      - deliver packets sent on modelled port <p> to port <peer>\n");
+#endif /* CONFIG_MV_ETH_NETA_SIM */
 	off += sprintf(buf+off, "echo p             > p_regs        - show port registers for <p>\n");
 #ifdef MV_ETH_GMAC_NEW
 	off += sprintf(buf+off, "echo p             > gmac_regs     - show gmac registers for <p>\n");
@@ -239,6 +244,14 @@ static ssize_t mv_eth_port_store(struct device *dev,
 #endif /* CONFIG_MV_ETH_PNC */
 	} else if (!strcmp(name, "napi")) {
 		mv_eth_napi_group_show(p);
+#ifdef CONFIG_MV_ETH_NETA_SIM
+	} else if (!strcmp(name, "sim")) {
+		mv_eth_sim_show(p);
+	} else if (!strcmp(name, "sim_clear")) {
+		mv_eth_sim_clear(p);
+	} else if (!strcmp(name, "sim_peer")) {
+		err = mv_eth_sim_peer_set(p, v);
+#endif /* CONFIG_MV_ETH_NETA_SIM */
 	} else {
 		err = 1;
 		printk(KERN_ERR "%s: illegal operation <%s>\n", __func__, attr->attr.name);
@@ -455,6 +468,11 @@ static DEVICE_ATTR(napi,        S_IWUSR, mv_eth_show, mv_eth_port_store);
 static DEVICE_ATTR(txq_mask,    S_IWUSR, mv_eth_show, mv_eth_3_hex_store);
 static DEVICE_ATTR(txq_shared,  S_IWUSR, mv_eth_show, mv_eth_4_store);
 static DEVICE_ATTR(pm_mode,	S_IWUSR, mv_eth_show, mv_eth_port_store);
+#ifdef CONFIG_MV_ETH_NETA_SIM
+static DEVICE_ATTR(sim,         S_IWUSR, mv_eth_show, mv_eth_port_store);
+static DEVICE_ATTR(sim_clear,   S_IWUSR, mv_eth_show, mv_eth_port_store);
+static DEVICE_ATTR(sim_peer,    S_IWUSR, mv_eth_show, mv_eth_port_store);
+#endif /* CONFIG_MV_ETH_NETA_SIM */
 
 static struct attribute *mv_eth_attrs[] = {
 
@@ -510,6 +528,11 @@ static struct attribute *mv_eth_attrs[] = {
 	&dev_attr_txq_mask.attr,
 	&dev_attr_txq_shared.attr,
 	&dev_attr_pm_mode.attr,
+#ifdef CONFIG_MV_ETH_NETA_SIM
+	&dev_attr_sim.attr,
+	&dev_attr_sim_clear.attr,
+	&dev_attr_sim_peer.attr,
+#endif /* CONFIG_MV_ETH_NETA_SIM */
 	NULL
 };
 
@@ -478,6 +478,18 @@ int mv_eth_tool_get_coalesce(struct net_device *netdev,
 	cmd->rx_coalesce_usecs = mvNetaRxqTimeCoalGet(pp->port, 0);
 	cmd->rx_max_coalesced_frames = mvNetaRxqPktsCoalGet(pp->port, 0);
 	cmd->tx_max_coalesced_frames = mvNetaTxDonePktsCoalGet(pp->port, 0, 0);
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	cmd->use_adaptive_rx_coalesce = pp->coal_adapt.rx_en;
+	cmd->use_adaptive_tx_coalesce = pp->coal_adapt.tx_en;
+	cmd->pkt_rate_low = pp->coal_adapt.pkt_rate_low;
+	cmd->pkt_rate_high = pp->coal_adapt.pkt_rate_high;
+	cmd->rx_coalesce_usecs_low = pp->coal_adapt.rx_usecs_low;
+	cmd->rx_coalesce_usecs_high = pp->coal_adapt.rx_usecs_high;
+	cmd->rx_max_coalesced_frames_low = pp->coal_adapt.rx_pkts_low;
+	cmd->rx_max_coalesced_frames_high = pp->coal_adapt.rx_pkts_high;
+	cmd->tx_max_coalesced_frames_low = pp->coal_adapt.txdone_pkts_low;
+	cmd->tx_max_coalesced_frames_high = pp->coal_adapt.txdone_pkts_high;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 	return 0;
 }
 
@@ -504,6 +516,40 @@ int mv_eth_tool_set_coalesce(struct net_device *netdev,
 	if ((!cmd->rx_coalesce_usecs && !cmd->rx_max_coalesced_frames) || (!cmd->tx_max_coalesced_frames))
 		return -EPERM;
 
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	if (cmd->use_adaptive_rx_coalesce || cmd->use_adaptive_tx_coalesce) {
+		/* adaptive values are interpolated from low to high as the packet rate grows */
+		if (cmd->pkt_rate_low >= cmd->pkt_rate_high)
+			return -EINVAL;
+		if (cmd->use_adaptive_rx_coalesce &&
+		    ((!cmd->rx_coalesce_usecs_low && !cmd->rx_max_coalesced_frames_low) ||
+		     (cmd->rx_coalesce_usecs_low > cmd->rx_coalesce_usecs_high) ||
+		     (cmd->rx_max_coalesced_frames_low > cmd->rx_max_coalesced_frames_high)))
+			return -EINVAL;
+		if (cmd->use_adaptive_tx_coalesce &&
+		    (!cmd->tx_max_coalesced_frames_low ||
+		     (cmd->tx_max_coalesced_frames_low > cmd->tx_max_coalesced_frames_high)))
+			return -EINVAL;
+	}
+
+	spin_lock_bh(&pp->coal_adapt.lock);
+	pp->coal_adapt.rx_en = cmd->use_adaptive_rx_coalesce;
+	pp->coal_adapt.tx_en = cmd->use_adaptive_tx_coalesce;
+	pp->coal_adapt.pkt_rate_low = cmd->pkt_rate_low;
+	pp->coal_adapt.pkt_rate_high = cmd->pkt_rate_high;
+	pp->coal_adapt.rx_usecs_low = cmd->rx_coalesce_usecs_low;
+	pp->coal_adapt.rx_usecs_high = cmd->rx_coalesce_usecs_high;
+	pp->coal_adapt.rx_pkts_low = cmd->rx_max_coalesced_frames_low;
+	pp->coal_adapt.rx_pkts_high = cmd->rx_max_coalesced_frames_high;
+	pp->coal_adapt.txdone_pkts_low = cmd->tx_max_coalesced_frames_low;
+	pp->coal_adapt.txdone_pkts_high = cmd->tx_max_coalesced_frames_high;
+	pp->coal_adapt.last = jiffies;
+	spin_unlock_bh(&pp->coal_adapt.lock);
+#else
+	if (cmd->use_adaptive_rx_coalesce || cmd->use_adaptive_tx_coalesce)
+		return -EOPNOTSUPP;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
+
 	for (rxq = 0; rxq < CONFIG_MV_ETH_RXQ; rxq++) {
 		mv_eth_rx_ptks_coal_set(pp->port, rxq, cmd->rx_max_coalesced_frames);
 		mv_eth_rx_time_coal_set(pp->port, rxq, cmd->rx_coalesce_usecs);
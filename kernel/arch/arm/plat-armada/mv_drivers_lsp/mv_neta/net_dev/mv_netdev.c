@@ -58,6 +58,10 @@ disclaimer.
 #include "mv_netdev.h"
 #include "mv_eth_tool.h"
 
+#ifdef MV_ETH_RFS_ACCEL
+#include <linux/cpu_rmap.h>
+#endif /* MV_ETH_RFS_ACCEL */
+
 #include "cpu/mvCpuCntrs.h"
 
 #ifdef CONFIG_MV_CPU_PERF_CNTRS
@@ -92,6 +96,8 @@ int mv_eth_ctrl_pnc(int en)
 int mv_ctrl_recycle = CONFIG_NET_SKB_RECYCLE_DEF;
 EXPORT_SYMBOL(mv_ctrl_recycle);
 
+struct skb_recycle_pool *mv_eth_recycle_pool;
+
 int mv_eth_ctrl_recycle(int en)
 {
 	mv_ctrl_recycle = en;
@@ -955,6 +961,188 @@ static int mv_eth_set_features(struct net_device *dev, u32 features)
 }
 #endif
 
+#ifdef CONFIG_MV_ETH_RFS
+/* One CPU per NAPI group, RXQs dealt round robin between the groups in use */
+static void mv_eth_rfs_spread(struct eth_port *pp)
+{
+	int cpu, rxq, group, groups = 0;
+	MV_U32 rxq_affinity[CONFIG_MV_ETH_NAPI_GROUPS];
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		if (!(MV_BIT_CHECK(pp->cpuMask, cpu)))
+			continue;
+		set_cpu_affinity(pp, 1 << cpu, groups % CONFIG_MV_ETH_NAPI_GROUPS);
+		groups++;
+	}
+	if (groups > CONFIG_MV_ETH_NAPI_GROUPS)
+		groups = CONFIG_MV_ETH_NAPI_GROUPS;
+	if (groups == 0)
+		return;
+
+	memset(rxq_affinity, 0, sizeof(rxq_affinity));
+	for (rxq = 0; rxq < CONFIG_MV_ETH_RXQ; rxq++)
+		rxq_affinity[rxq % groups] |= (1 << rxq);
+
+	for (group = 0; group < groups; group++)
+		set_rxq_affinity(pp, rxq_affinity[group], group);
+}
+#endif /* CONFIG_MV_ETH_RFS */
+
+#ifdef MV_ETH_RFS_ACCEL
+static void mv_eth_rfs_rmap_init(struct net_device *dev, struct eth_port *pp)
+{
+	int group;
+
+	dev->rx_cpu_rmap = alloc_cpu_rmap(CONFIG_MV_ETH_NAPI_GROUPS, GFP_KERNEL);
+	if (dev->rx_cpu_rmap == NULL) {
+		printk(KERN_ERR "%s: can't allocate RFS cpu map, flows are steered in software\n", dev->name);
+		return;
+	}
+	for (group = 0; group < CONFIG_MV_ETH_NAPI_GROUPS; group++)
+		cpu_rmap_add(dev->rx_cpu_rmap, pp->napiGroup[group]);
+}
+
+/* Point RFS at the NAPI group (Linux RX queue) polled on each CPU */
+static void mv_eth_rfs_rmap_update(struct eth_port *pp)
+{
+	int cpu, group;
+	cpumask_t mask;
+
+	if ((pp->dev == NULL) || (pp->dev->rx_cpu_rmap == NULL))
+		return;
+
+	for (group = 0; group < CONFIG_MV_ETH_NAPI_GROUPS; group++) {
+		cpumask_clear(&mask);
+		for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+			if (!(MV_BIT_CHECK(pp->cpuMask, cpu)))
+				continue;
+			if (pp->cpu_config[cpu]->napiCpuGroup == group)
+				cpumask_set_cpu(cpu, &mask);
+		}
+		if (!cpumask_empty(&mask))
+			cpu_rmap_update(pp->dev->rx_cpu_rmap, group, &mask);
+	}
+}
+
+/* First RXQ served by the group, the one steered flows are sent to */
+static int mv_eth_rfs_group_rxq(struct eth_port *pp, int group)
+{
+	int cpu;
+	struct cpu_ctrl	*cpuCtrl;
+
+	for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+		if (!(MV_BIT_CHECK(pp->cpuMask, cpu)))
+			continue;
+		cpuCtrl = pp->cpu_config[cpu];
+		if ((cpuCtrl->napiCpuGroup == group) && (cpuCtrl->cpuRxqMask & 0xff))
+			return ffs(cpuCtrl->cpuRxqMask & 0xff) - 1;
+	}
+	return -1;
+}
+
+/* Remove the PnC rules of all steered flows, RFS installs them again as packets arrive */
+static void mv_eth_rfs_flush(struct eth_port *pp)
+{
+	int i;
+	struct mv_eth_rfs_filter *filter;
+
+	spin_lock_bh(&pp->rfs_lock);
+	for (i = 0; i < MV_ETH_RFS_FILTERS; i++) {
+		filter = &pp->rfs_filter[i];
+		if (!filter->used)
+			continue;
+		pnc_ip4_5tuple_rxq(pp->port, filter->sip, filter->dip, filter->ports, filter->proto, -2);
+		filter->used = 0;
+	}
+	pp->rfs_filters = 0;
+	spin_unlock_bh(&pp->rfs_lock);
+}
+
+/* Called with rfs_lock held when the table is full; returns a free slot or -1 */
+static int mv_eth_rfs_expire(struct net_device *dev, struct eth_port *pp)
+{
+	int i, idx = -1;
+	struct mv_eth_rfs_filter *filter;
+
+	for (i = 0; i < MV_ETH_RFS_FILTERS; i++) {
+		filter = &pp->rfs_filter[i];
+		if (!filter->used || !rps_may_expire_flow(dev, filter->group, filter->flow_id, i))
+			continue;
+		pnc_ip4_5tuple_rxq(pp->port, filter->sip, filter->dip, filter->ports, filter->proto, -2);
+		filter->used = 0;
+		pp->rfs_filters--;
+		if (idx == -1)
+			idx = i;
+	}
+	return idx;
+}
+
+static int mv_eth_rx_flow_steer(struct net_device *dev, const struct sk_buff *skb,
+				u16 rxq_index, u32 flow_id)
+{
+	struct eth_port *pp = MV_ETH_PRIV(dev);
+	struct mv_eth_rfs_filter *filter;
+	const struct iphdr *iph;
+	const __be16 *l4ports;
+	MV_U32 ports;
+	int i, rxq, idx = -1;
+
+	if (skb->protocol != htons(ETH_P_IP))
+		return -EPROTONOSUPPORT;
+
+	iph = ip_hdr(skb);
+	if (ip_is_fragment(iph) || ((iph->protocol != IPPROTO_TCP) && (iph->protocol != IPPROTO_UDP)))
+		return -EPROTONOSUPPORT;
+
+	l4ports = (const __be16 *)((const u8 *)iph + 4 * iph->ihl);
+	ports = (l4ports[1] << 16) | l4ports[0];
+
+	rxq = mv_eth_rfs_group_rxq(pp, rxq_index);
+	if (rxq < 0)
+		return -EINVAL;
+
+	spin_lock(&pp->rfs_lock);
+	for (i = 0; i < MV_ETH_RFS_FILTERS; i++) {
+		filter = &pp->rfs_filter[i];
+		if (!filter->used) {
+			if (idx == -1)
+				idx = i;
+			continue;
+		}
+		if ((filter->sip == iph->saddr) && (filter->dip == iph->daddr) &&
+		    (filter->ports == ports) && (filter->proto == iph->protocol)) {
+			idx = i;
+			break;
+		}
+	}
+	if (idx == -1)
+		idx = mv_eth_rfs_expire(dev, pp);
+	if (idx == -1) {
+		spin_unlock(&pp->rfs_lock);
+		return -EBUSY;
+	}
+
+	filter = &pp->rfs_filter[idx];
+	if (pnc_ip4_5tuple_rxq(pp->port, iph->saddr, iph->daddr, ports, iph->protocol, rxq)) {
+		spin_unlock(&pp->rfs_lock);
+		return -EIO;
+	}
+	if (!filter->used) {
+		filter->used = 1;
+		filter->sip = iph->saddr;
+		filter->dip = iph->daddr;
+		filter->ports = ports;
+		filter->proto = iph->protocol;
+		pp->rfs_filters++;
+	}
+	filter->group = rxq_index;
+	filter->flow_id = flow_id;
+	spin_unlock(&pp->rfs_lock);
+
+	return idx;
+}
+#endif /* MV_ETH_RFS_ACCEL */
+
 static const struct net_device_ops mv_eth_netdev_ops = {
 	.ndo_open = mv_eth_open,
 	.ndo_stop = mv_eth_stop,
@@ -967,6 +1155,9 @@ static const struct net_device_ops mv_eth_netdev_ops = {
 #if defined(MV_ETH_PNC_LB) && defined(CONFIG_MV_ETH_PNC)
 	.ndo_set_features = mv_eth_set_features,
 #endif
+#ifdef MV_ETH_RFS_ACCEL
+	.ndo_rx_flow_steer = mv_eth_rx_flow_steer,
+#endif /* MV_ETH_RFS_ACCEL */
 };
 
 #ifdef CONFIG_MV_ETH_SWITCH
@@ -1141,7 +1332,7 @@ void mv_eth_skb_print(struct sk_buff *skb)
 	       skb_shinfo(skb)->nr_frags, skb_shinfo(skb)->gso_size, skb_shinfo(skb)->gso_segs);
 	printk(KERN_ERR "\t proto=%d, ip_summed=%d, priority=%d\n", ntohs(skb->protocol), skb->ip_summed, skb->priority);
 #ifdef CONFIG_NET_SKB_RECYCLE
-	printk(KERN_ERR "\t skb_recycle=%p, hw_cookie=%p\n", skb->skb_recycle, skb->hw_cookie);
+	printk(KERN_ERR "\t recycle_pool=%p, recycle_cookie=0x%lx\n", skb->recycle_pool, skb->recycle_cookie);
 #endif /* CONFIG_NET_SKB_RECYCLE */
 }
 
@@ -1276,9 +1467,11 @@ static inline int mv_eth_tx_policy(struct eth_port *pp, struct sk_buff *skb)
 }
 
 #ifdef CONFIG_NET_SKB_RECYCLE
-int mv_eth_skb_recycle(struct sk_buff *skb)
+/* skb was reset by skb_recycle_put(), give its buffer back to the BM pool */
+static int mv_eth_skb_recycle(struct skb_recycle_pool *rpool, struct sk_buff *skb,
+			      unsigned long cookie)
 {
-	struct eth_pbuf *pkt = skb->hw_cookie;
+	struct eth_pbuf *pkt = (struct eth_pbuf *)cookie;
 	struct bm_pool  *pool;
 	int             status = 0;
 
@@ -1290,7 +1483,7 @@ int mv_eth_skb_recycle(struct sk_buff *skb)
 		mv_eth_skb_print(skb);
 		mvDebugMemDump(skb->head, (skb->data - skb->head), 1);
 		printk(KERN_ERR "\n");
-		goto err;
+		return 1;
 	}
 #endif /* CONFIG_MV_ETH_DEBUG_CODE && CONFIG_MV_ETH_BM_CPU */
 
@@ -1301,11 +1494,11 @@ int mv_eth_skb_recycle(struct sk_buff *skb)
 		mv_eth_pkt_print(pkt);
 		mv_eth_skb_print(skb);
 		printk(KERN_ERR "\n");
-		goto err;
+		return 1;
 	}
 
 	pool = &mv_eth_pool[pkt->pool];
-	if (skb_recycle_check(skb, pool->pkt_size)) {
+	if (skb_end_pointer(skb) - skb->head >= SKB_DATA_ALIGN(RX_BUF_SIZE(pool->pkt_size))) {
 
 #ifdef CONFIG_MV_ETH_DEBUG_CODE
 		/* Sanity check */
@@ -1317,7 +1510,9 @@ int mv_eth_skb_recycle(struct sk_buff *skb)
 #endif /* CONFIG_MV_ETH_DEBUG_CODE */
 
 		STAT_DBG(pool->stats.skb_recycled_ok++);
-		mvOsCacheInvalidate(NULL, skb->head, RX_BUF_SIZE(pool->pkt_size));
+		/* Lines past the old tail were never written by the CPU */
+		mvOsCacheInvalidate(NULL, skb->head,
+				    min_t(unsigned int, SKB_RECYCLE_CB(skb)->dirty, RX_BUF_SIZE(pool->pkt_size)));
 
 		status = mv_eth_pool_put(pool, pkt);
 
@@ -1331,13 +1526,20 @@ int mv_eth_skb_recycle(struct sk_buff *skb)
 	STAT_DBG(pool->stats.skb_recycled_err++);
 
 	/* printk(KERN_ERR "mv_eth_skb_recycle failed: pool=%d, pkt=%p, skb=%p\n", pkt->pool, pkt, skb); */
-err:
-	mvOsFree(pkt);
-	skb->hw_cookie = NULL;
-
 	return 1;
 }
-EXPORT_SYMBOL(mv_eth_skb_recycle);
+
+/* skb is freed by the stack, only pkt is left */
+static void mv_eth_skb_release(struct skb_recycle_pool *rpool, struct sk_buff *skb,
+			       unsigned long cookie)
+{
+	mvOsFree((struct eth_pbuf *)cookie);
+}
+
+static const struct skb_recycle_ops mv_eth_recycle_ops = {
+	.recycle = mv_eth_skb_recycle,
+	.release = mv_eth_skb_release,
+};
 
 #endif /* CONFIG_NET_SKB_RECYCLE */
 
@@ -1430,6 +1632,9 @@ inline u32 mv_eth_txq_done(struct eth_port *pp, struct tx_queue *txq_ctrl)
 
 	txq_ctrl->txq_count -= tx_done;
 	STAT_DBG(txq_ctrl->stats.txq_txdone += tx_done);
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	txq_ctrl->adapt_pkts += tx_done;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 
 	return tx_done;
 }
@@ -1629,6 +1834,9 @@ static inline int mv_eth_rx(struct eth_port *pp, int rx_todo, int rxq)
 
 		rx_bytes = rx_desc->dataSize - (MV_ETH_CRC_SIZE + MV_ETH_MH_SIZE);
 		dev->stats.rx_bytes += rx_bytes;
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+		pp->rxq_ctrl[rxq].adapt_bytes += rx_bytes;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 
 #ifndef CONFIG_MV_ETH_PNC
 	/* Update IP offset and IP header len in RX descriptor */
@@ -1702,10 +1910,15 @@ static inline int mv_eth_rx(struct eth_port *pp, int rx_todo, int rxq)
 
 		skb->protocol = eth_type_trans(skb, dev);
 
+#ifdef CONFIG_MV_ETH_RFS
+		/* RPS hashes from the network header; the NAPI group is the Linux RX queue */
+		skb_reset_network_header(skb);
+		skb_record_rx_queue(skb, pp->cpu_config[smp_processor_id()]->napiCpuGroup);
+#endif /* CONFIG_MV_ETH_RFS */
+
 #ifdef CONFIG_NET_SKB_RECYCLE
 		if (mv_eth_is_recycle()) {
-			skb->skb_recycle = mv_eth_skb_recycle;
-			skb->hw_cookie = pkt;
+			skb_recycle_attach(mv_eth_recycle_pool, skb, (unsigned long)pkt);
 			pkt = NULL;
 		}
 #endif /* CONFIG_NET_SKB_RECYCLE */
@@ -1743,6 +1956,10 @@ static inline int mv_eth_rx(struct eth_port *pp, int rx_todo, int rxq)
 	mvOsCacheIoSync();
 	mvNetaRxqDescNumUpdate(pp->port, rxq, rx_done, rx_filled);
 
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	pp->rxq_ctrl[rxq].adapt_pkts += rx_done;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
+
 	return rx_done;
 }
 
@@ -1915,7 +2132,12 @@ out:
 
 #ifndef CONFIG_MV_ETH_TXDONE_ISR
 	if (txq_ctrl) {
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+		/* adaptive TX_DONE threshold is kept per TXQ */
+		if (txq_ctrl->txq_count >= (pp->coal_adapt.tx_en ? txq_ctrl->txq_done_pkts_coal : mv_ctrl_txdone)) {
+#else
 		if (txq_ctrl->txq_count >= mv_ctrl_txdone) {
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 			STAT_DIST(u32 tx_done = )mv_eth_txq_done(pp, txq_ctrl);
 
 			STAT_DIST((tx_done < pp->dist_stats.tx_done_dist_size) ? pp->dist_stats.tx_done_dist[tx_done]++ : 0);
@@ -2715,6 +2937,84 @@ void mv_eth_link_event(struct eth_port *pp, int print)
 }
 
 /***********************************************************************************************/
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+/* Interpolate between the low and high values by the packet rate, low <= high */
+static MV_U32 mv_eth_coal_moder(struct coal_adapt *ca, MV_U32 rate, MV_U32 low, MV_U32 high)
+{
+	if (rate <= ca->pkt_rate_low)
+		return low;
+	if (rate >= ca->pkt_rate_high)
+		return high;
+
+	return low + (MV_U32)div_u64((u64)(high - low) * (rate - ca->pkt_rate_low),
+				     ca->pkt_rate_high - ca->pkt_rate_low);
+}
+
+/***********************************************************
+ * mv_eth_coal_adapt --                                    *
+ *   sample packet rate of every RXQ and TXQ since the     *
+ *   last call and retune the coalescing thresholds        *
+ ***********************************************************/
+static void mv_eth_coal_adapt(struct eth_port *pp)
+{
+	struct coal_adapt *ca = &pp->coal_adapt;
+	struct rx_queue *rxq_ctrl;
+	struct tx_queue *txq_ctrl;
+	MV_U32 pkts, bytes, rate, usecs, coal;
+	unsigned long period;
+	int rxq, txp, txq;
+
+	/* one CPU samples the port, the others go on polling */
+	if (!spin_trylock(&ca->lock))
+		return;
+
+	period = jiffies - ca->last;
+	if (period < MV_ETH_COAL_ADAPT_PERIOD) {
+		spin_unlock(&ca->lock);
+		return;
+	}
+	ca->last = jiffies;
+
+	for (rxq = 0; ca->rx_en && (rxq < CONFIG_MV_ETH_RXQ); rxq++) {
+		rxq_ctrl = &pp->rxq_ctrl[rxq];
+
+		pkts = rxq_ctrl->adapt_pkts - rxq_ctrl->adapt_last_pkts;
+		bytes = rxq_ctrl->adapt_bytes - rxq_ctrl->adapt_last_bytes;
+		rxq_ctrl->adapt_last_pkts += pkts;
+		rxq_ctrl->adapt_last_bytes += bytes;
+
+		/* small packets are latency bound whatever their rate */
+		rate = pkts * HZ / period;
+		if (pkts && ((bytes / pkts) < MV_ETH_COAL_SMALL_PKT))
+			rate = 0;
+
+		usecs = mv_eth_coal_moder(ca, rate, ca->rx_usecs_low, ca->rx_usecs_high);
+		coal = mv_eth_coal_moder(ca, rate, ca->rx_pkts_low, ca->rx_pkts_high);
+
+		if (usecs != rxq_ctrl->rxq_time_coal)
+			mv_eth_rx_time_coal_set(pp->port, rxq, usecs);
+		if (coal != rxq_ctrl->rxq_pkts_coal)
+			mv_eth_rx_ptks_coal_set(pp->port, rxq, coal);
+	}
+
+	for (txp = 0; ca->tx_en && (txp < pp->txp_num); txp++) {
+		for (txq = 0; txq < CONFIG_MV_ETH_TXQ; txq++) {
+			txq_ctrl = &pp->txq_ctrl[txp * CONFIG_MV_ETH_TXQ + txq];
+
+			pkts = txq_ctrl->adapt_pkts - txq_ctrl->adapt_last_pkts;
+			txq_ctrl->adapt_last_pkts += pkts;
+
+			rate = pkts * HZ / period;
+			coal = mv_eth_coal_moder(ca, rate, ca->txdone_pkts_low, ca->txdone_pkts_high);
+
+			if (coal != txq_ctrl->txq_done_pkts_coal)
+				mv_eth_tx_done_ptks_coal_set(pp->port, txp, txq, coal);
+		}
+	}
+	spin_unlock(&ca->lock);
+}
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
+
 int mv_eth_poll(struct napi_struct *napi, int budget)
 {
 	int rx_done = 0;
@@ -2798,6 +3098,12 @@ int mv_eth_poll(struct napi_struct *napi, int budget)
 
 	STAT_DIST((rx_done < pp->dist_stats.rx_dist_size) ? pp->dist_stats.rx_dist[rx_done]++ : 0);
 
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	if ((pp->coal_adapt.rx_en || pp->coal_adapt.tx_en) &&
+	    time_after_eq(jiffies, pp->coal_adapt.last + MV_ETH_COAL_ADAPT_PERIOD))
+		mv_eth_coal_adapt(pp);
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
+
 #ifdef CONFIG_MV_ETH_DEBUG_CODE
 	if (pp->flags & MV_ETH_F_DBG_POLL) {
 		printk(KERN_ERR "%s  EXIT: port=%d, cpu=%d, budget=%d, rx_done=%d\n",
@@ -2946,6 +3252,14 @@ static MV_STATUS mv_eth_bm_pools_init(void)
 		mv_eth_pool[i].pkt_size = 0;
 #endif /* CONFIG_MV_ETH_BM */
 	}
+
+#ifdef CONFIG_NET_SKB_RECYCLE
+	/* Buffer size differs per BM pool, mv_eth_skb_recycle() checks it */
+	mv_eth_recycle_pool = skb_recycle_pool_create("neta", 0, 0, NULL, &mv_eth_recycle_ops, NULL);
+	if (!mv_eth_recycle_pool)
+		printk(KERN_ERR "%s: can't create skb recycle pool, recycle disabled\n", __func__);
+#endif /* CONFIG_NET_SKB_RECYCLE */
+
 	return 0;
 }
 
@@ -3483,7 +3797,11 @@ struct net_device *mv_eth_netdev_init(struct eth_port *pp, int mtu, u8 *mac,
 	struct eth_dev_priv *dev_priv;
 	struct cpu_ctrl	*cpuCtrl;
 
+#ifdef CONFIG_MV_ETH_RFS
+	dev = alloc_etherdev_mqs(sizeof(struct eth_dev_priv), CONFIG_MV_ETH_TXQ, CONFIG_MV_ETH_NAPI_GROUPS);
+#else
 	dev = alloc_etherdev_mq(sizeof(struct eth_dev_priv), CONFIG_MV_ETH_TXQ);
+#endif /* CONFIG_MV_ETH_RFS */
 	if (!dev)
 		return NULL;
 
@@ -3558,8 +3876,15 @@ struct net_device *mv_eth_netdev_init(struct eth_port *pp, int mtu, u8 *mac,
 
 	if (pp->flags & MV_ETH_F_CONNECT_LINUX) {
 		mv_eth_netdev_set_features(dev);
+#ifdef MV_ETH_RFS_ACCEL
+		if (dev->netdev_ops == &mv_eth_netdev_ops)
+			mv_eth_rfs_rmap_init(dev, pp);
+#endif /* MV_ETH_RFS_ACCEL */
 		if (register_netdev(dev)) {
 			printk(KERN_ERR "failed to register %s\n", dev->name);
+#ifdef MV_ETH_RFS_ACCEL
+			free_cpu_rmap(dev->rx_cpu_rmap);
+#endif /* MV_ETH_RFS_ACCEL */
 			free_netdev(dev);
 			return NULL;
 		} else {
@@ -3876,11 +4201,24 @@ int mv_eth_napi_set_cpu_affinity(int port, int group, int affinity)
 		return -EINVAL;
 	}
 	set_cpu_affinity(pp, affinity, group);
+#ifdef MV_ETH_RFS_ACCEL
+	mv_eth_rfs_flush(pp);
+	mv_eth_rfs_rmap_update(pp);
+#endif /* MV_ETH_RFS_ACCEL */
 	return 0;
 
 }
 void handle_group_affinity(int port)
 {
+#ifdef CONFIG_MV_ETH_RFS
+	struct eth_port *pp = mv_eth_port_by_id(port);
+
+	if (pp == NULL)
+		return;
+
+	/* Flows are steered to the CPUs, so each CPU gets a group of its own */
+	mv_eth_rfs_spread(pp);
+#else
 	int group;
 	struct eth_port *pp;
 	MV_U32 group_cpu_affinity[CONFIG_MV_ETH_NAPI_GROUPS];
@@ -3912,6 +4250,10 @@ void handle_group_affinity(int port)
 		set_cpu_affinity(pp, group_cpu_affinity[group], group);
 	for (group = 0; group < CONFIG_MV_ETH_NAPI_GROUPS; group++)
 		set_rxq_affinity(pp, rxq_affinity[group], group);
+#endif /* CONFIG_MV_ETH_RFS */
+#ifdef MV_ETH_RFS_ACCEL
+	mv_eth_rfs_rmap_update(pp);
+#endif /* MV_ETH_RFS_ACCEL */
 
 }
 
@@ -3933,6 +4275,9 @@ int	mv_eth_napi_set_rxq_affinity(int port, int group, int rxqAffinity)
 	}
 
 	set_rxq_affinity(pp, rxqAffinity, group);
+#ifdef MV_ETH_RFS_ACCEL
+	mv_eth_rfs_flush(pp);
+#endif /* MV_ETH_RFS_ACCEL */
 	return MV_OK;
 }
 
@@ -3961,6 +4306,9 @@ void mv_eth_napi_group_show(int port)
 		}
 		printk(KERN_INFO "\n");
 	}
+#ifdef MV_ETH_RFS_ACCEL
+	printk(KERN_INFO "RFS: %d of %d flows steered by PnC rules\n", pp->rfs_filters, MV_ETH_RFS_FILTERS);
+#endif /* MV_ETH_RFS_ACCEL */
 }
 
 void mv_eth_priv_cleanup(struct eth_port *pp)
@@ -5148,6 +5496,21 @@ static int mv_eth_priv_init(struct eth_port *pp, int port)
 
 	/* Init pool of external buffers for TSO, fragmentation, etc */
 	spin_lock_init(&pp->extLock);
+#ifdef MV_ETH_RFS_ACCEL
+	spin_lock_init(&pp->rfs_lock);
+#endif /* MV_ETH_RFS_ACCEL */
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	spin_lock_init(&pp->coal_adapt.lock);
+	pp->coal_adapt.last = jiffies;
+	pp->coal_adapt.pkt_rate_low = MV_ETH_COAL_RATE_LOW;
+	pp->coal_adapt.pkt_rate_high = MV_ETH_COAL_RATE_HIGH;
+	pp->coal_adapt.rx_usecs_low = MV_ETH_COAL_RX_USEC_LOW;
+	pp->coal_adapt.rx_usecs_high = MV_ETH_COAL_RX_USEC_HIGH;
+	pp->coal_adapt.rx_pkts_low = MV_ETH_COAL_RX_PKTS_LOW;
+	pp->coal_adapt.rx_pkts_high = MV_ETH_COAL_RX_PKTS_HIGH;
+	pp->coal_adapt.txdone_pkts_low = MV_ETH_COAL_TXDONE_PKTS_LOW;
+	pp->coal_adapt.txdone_pkts_high = MV_ETH_COAL_TXDONE_PKTS_HIGH;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 	pp->extBufSize = CONFIG_MV_ETH_EXTRA_BUF_SIZE;
 	pp->extArrStack = mvStackCreate(CONFIG_MV_ETH_EXTRA_BUF_NUM);
 	if (pp->extArrStack == NULL) {
@@ -5696,6 +6059,10 @@ static int mv_eth_port_cleanup(int port)
 
 	mvNetaPortDestroy(port);
 
+#ifdef MV_ETH_RFS_ACCEL
+	mv_eth_rfs_flush(pp);
+#endif /* MV_ETH_RFS_ACCEL */
+
 	if (pp->flags & MV_ETH_F_CONNECT_LINUX)
 		for (i = 0; i < CONFIG_MV_ETH_NAPI_GROUPS; i++)
 			netif_napi_del(pp->napiGroup[i]);
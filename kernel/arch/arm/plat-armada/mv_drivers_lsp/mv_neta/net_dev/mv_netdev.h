@@ -31,6 +31,7 @@ disclaimer.
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/skbuff.h>
+#include <linux/skb_recycle.h>
 #include <net/ip.h>
 
 #include "mvCommon.h"
@@ -89,8 +90,9 @@ extern int mv_ctrl_txdone;
 #ifdef CONFIG_NET_SKB_RECYCLE
 extern int mv_ctrl_recycle;
 
-#define mv_eth_is_recycle()     (mv_ctrl_recycle)
-int mv_eth_skb_recycle(struct sk_buff *skb);
+extern struct skb_recycle_pool *mv_eth_recycle_pool;
+
+#define mv_eth_is_recycle()     (mv_ctrl_recycle && mv_eth_recycle_pool)
 #else
 #define mv_eth_is_recycle()     0
 #endif /* CONFIG_NET_SKB_RECYCLE */
@@ -113,6 +115,23 @@ int mv_eth_skb_recycle(struct sk_buff *skb);
 /* NAPI CPU defualt group */
 #define CPU_GROUP_DEF 0
 
+/* RFS steers flows between NAPI groups with PnC 5-tuple rules */
+#if defined(CONFIG_MV_ETH_RFS) && defined(CONFIG_RFS_ACCEL) && defined(CONFIG_MV_ETH_PNC_L3_FLOW)
+#define MV_ETH_RFS_ACCEL
+
+#define MV_ETH_RFS_FILTERS	32
+
+struct mv_eth_rfs_filter {
+	MV_U32	sip;
+	MV_U32	dip;
+	MV_U32	ports;		/* dport << 16 | sport, as for pnc_ip4_5tuple_rxq */
+	MV_U8	proto;
+	MV_U8	used;
+	MV_U16	group;		/* Linux RX queue the flow is steered to */
+	MV_U32	flow_id;
+};
+#endif /* CONFIG_MV_ETH_RFS && CONFIG_RFS_ACCEL && CONFIG_MV_ETH_PNC_L3_FLOW */
+
 #define MV_ETH_TRYLOCK(lock, flags)                           \
 	(in_interrupt() ? spin_trylock((lock)) :              \
 		spin_trylock_irqsave((lock), (flags)))
@@ -314,6 +333,10 @@ struct tx_queue {
 	MV_U32              txq_done_pkts_coal;
 	unsigned long       flags;
 	int		    nfpCounter;
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	MV_U32              adapt_pkts;		/* free running, sampled by mv_eth_coal_adapt */
+	MV_U32              adapt_last_pkts;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 };
 
 struct rx_queue {
@@ -322,8 +345,43 @@ struct rx_queue {
 	int                 missed;
 	MV_U32	            rxq_pkts_coal;
 	MV_U32	            rxq_time_coal;
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	MV_U32              adapt_pkts;		/* free running, sampled by mv_eth_coal_adapt */
+	MV_U32              adapt_bytes;
+	MV_U32              adapt_last_pkts;
+	MV_U32              adapt_last_bytes;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
 };
 
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+/* Sampling period and defaults of the adaptive coalescing */
+#define MV_ETH_COAL_ADAPT_PERIOD	(HZ / 20)
+#define MV_ETH_COAL_SMALL_PKT		256	/* average RX packet size treated as latency bound */
+#define MV_ETH_COAL_RATE_LOW		10000	/* [pkts/sec] */
+#define MV_ETH_COAL_RATE_HIGH		80000
+#define MV_ETH_COAL_RX_USEC_LOW		10
+#define MV_ETH_COAL_RX_USEC_HIGH	200
+#define MV_ETH_COAL_RX_PKTS_LOW		1
+#define MV_ETH_COAL_RX_PKTS_HIGH	64
+#define MV_ETH_COAL_TXDONE_PKTS_LOW	4
+#define MV_ETH_COAL_TXDONE_PKTS_HIGH	64
+
+struct coal_adapt {
+	spinlock_t          lock;
+	int                 rx_en;
+	int                 tx_en;
+	unsigned long       last;	/* jiffies of the last sample */
+	MV_U32              pkt_rate_low;
+	MV_U32              pkt_rate_high;
+	MV_U32              rx_usecs_low;
+	MV_U32              rx_usecs_high;
+	MV_U32              rx_pkts_low;
+	MV_U32              rx_pkts_high;
+	MV_U32              txdone_pkts_low;
+	MV_U32              txdone_pkts_high;
+};
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
+
 struct dist_stats {
 	u32     *rx_dist;
 	int     rx_dist_size;
@@ -393,6 +451,14 @@ struct eth_port {
 	MV_U32 cpuMask;
 	MV_U32 rx_indir_table[256];
 	struct cpu_ctrl	*cpu_config[CONFIG_NR_CPUS];
+#ifdef CONFIG_MV_ETH_COAL_ADAPTIVE
+	struct coal_adapt   coal_adapt;
+#endif /* CONFIG_MV_ETH_COAL_ADAPTIVE */
+#ifdef MV_ETH_RFS_ACCEL
+	spinlock_t               rfs_lock;
+	int                      rfs_filters;
+	struct mv_eth_rfs_filter rfs_filter[MV_ETH_RFS_FILTERS];
+#endif /* MV_ETH_RFS_ACCEL */
 	MV_U32  sgmii_serdes;
 	int	pm_mode;
 };
@@ -642,11 +708,6 @@ static inline void mv_eth_pkt_free(struct eth_pbuf *pkt)
 {
 	struct sk_buff *skb = (struct sk_buff *)pkt->osInfo;
 
-#ifdef CONFIG_NET_SKB_RECYCLE
-	skb->skb_recycle = NULL;
-	skb->hw_cookie = NULL;
-#endif /* CONFIG_NET_SKB_RECYCLE */
-
 	dev_kfree_skb_any(skb);
 	mvOsFree(pkt);
 }
@@ -851,6 +912,12 @@ MV_STATUS mv_eth_hwf_bm_create(int port, int mtuPktSize);
 void      mv_hwf_bm_dump(void);
 #endif /* CONFIG_MV_ETH_HWF && !CONFIG_MV_ETH_BM_CPU */
 
+#ifdef CONFIG_MV_ETH_NETA_SIM
+void mv_eth_sim_show(int port);
+void mv_eth_sim_clear(int port);
+int  mv_eth_sim_peer_set(int port, int peer);
+#endif /* CONFIG_MV_ETH_NETA_SIM */
+
 
 
 #endif /* __mv_netdev_h__ */
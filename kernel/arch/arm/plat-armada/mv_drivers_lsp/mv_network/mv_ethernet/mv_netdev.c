@@ -296,6 +296,8 @@ static inline int mv_eth_skb_check(struct sk_buff *skb, int skb_size)
 
 #ifdef CONFIG_NET_SKB_RECYCLE
 int eth_skb_recycle_enable = CONFIG_NET_SKB_RECYCLE_DEF;
+static struct skb_recycle_pool *eth_recycle_pool;
+
 static void eth_skb_recycle_clear(mv_eth_priv* priv)
 {
 	struct sk_buff *skb;
@@ -304,45 +306,16 @@ static void eth_skb_recycle_clear(mv_eth_priv* priv)
 
     while (!mvStackIsEmpty(priv->skbRecyclePool)) {
 		skb = (struct sk_buff*)mvStackPop(priv->skbRecyclePool);
-		skb->skb_recycle = NULL;
         dev_kfree_skb_any(skb);
 		ETH_STAT_DBG(priv->eth_stat.skb_recycle_del++);
     }
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
-static inline void mv_eth_skb_recycle_reset(struct sk_buff *skb)
-{
-    /* Reset skb before reuse */
-    skb_shinfo(skb)->gso_size = 0;
- 
-    skb->dst = NULL;
-    skb->destructor = NULL;
-
-#if defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE)
-    skb->nfct = 0;
-    skb->nfct_reasm = 0;
-#endif /* CONFIG_NF_CONNTRACK || CONFIG_NF_CONNTRACK_MODULE */
-
-#ifdef CONFIG_BRIDGE_NETFILTER
-    skb->nf_bridge = 0;
-#endif /* CONFIG_BRIDGE_NETFILTER */
-
-    skb->truesize = (skb->end - skb->head) + sizeof(struct sk_buff);
-    skb->next = NULL;
-    skb->pkt_type = 0; 
-    skb->iif = 0;
-    skb->sk = 0; 
-    skb->len = 0;
-    skb->data = skb->tail = skb->head + NET_SKB_PAD; 
-
-    return;
-}
-#endif /* LINUX_VERSION_CODE < 2.6.24 */
-
-static int eth_skb_recycle(struct sk_buff *skb)
+/* skb was reset by skb_recycle_put(), keep it for the next rx refill */
+static int eth_skb_recycle(struct skb_recycle_pool *pool, struct sk_buff *skb,
+                           unsigned long cookie)
 {
-    mv_eth_priv *priv = (mv_eth_priv*)skb->hw_cookie;
+    mv_eth_priv *priv = (mv_eth_priv*)cookie;
     unsigned long flags = 0;
 
     if (!eth_skb_recycle_enable)
@@ -356,19 +329,11 @@ static int eth_skb_recycle(struct sk_buff *skb)
 		goto out;
 	}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
-    if (mv_eth_skb_check(skb, priv->skbRecycleMTU)) {
-        mv_eth_skb_recycle_reset(skb);
-#else
-    if (skb_recycle_check(skb, priv->skbRecycleMTU)) {
-#endif /* LINUX_VERSION_CODE < 2.6.24 */
+    if (skb_end_pointer(skb) - skb->head >= SKB_DATA_ALIGN(priv->skbRecycleMTU + NET_SKB_PAD)) {
 
 	spin_lock_irqsave(priv->lock, flags);
 
       	ETH_STAT_DBG(priv->eth_stat.skb_recycle_put++);
-        skb->skb_recycle = eth_skb_recycle;
-        skb->hw_cookie = priv;
-
 	mvStackPush(priv->skbRecyclePool, (MV_U32)skb);
         spin_unlock_irqrestore(priv->lock, flags);    
         return 0;
@@ -378,6 +343,10 @@ out:
 	ETH_STAT_DBG(priv->eth_stat.skb_recycle_rej++);
 	return 1;
 }
+
+static const struct skb_recycle_ops eth_recycle_ops = {
+	.recycle = eth_skb_recycle,
+};
 #endif
 
 static INLINE struct sk_buff* eth_skb_alloc(mv_eth_priv *priv, MV_PKT_INFO* pPktInfo,
@@ -405,8 +374,8 @@ static INLINE struct sk_buff* eth_skb_alloc(mv_eth_priv *priv, MV_PKT_INFO* pPkt
         return NULL;
     }
 #ifdef CONFIG_NET_SKB_RECYCLE
-    skb->skb_recycle = eth_skb_recycle;
-    skb->hw_cookie = priv;
+    if (eth_recycle_pool)
+        skb_recycle_attach(eth_recycle_pool, skb, (unsigned long)priv);
 #endif /* CONFIG_NET_SKB_RECYCLE */
 
     ETH_STAT_DBG(priv->eth_stat.skb_alloc_ok++);
@@ -2015,6 +1984,9 @@ int __init mv_eth_priv_init(mv_eth_priv *priv, int port)
         printk("%s: port %d, failed to allocate pool\n", __FUNCTION__, port);
         return -ENOMEM;
     }	
+    /* One pool for all ports, each port keeps its buffers in skbRecyclePool */
+    if (!eth_recycle_pool)
+        eth_recycle_pool = skb_recycle_pool_create("mv_eth", 0, 0, NULL, &eth_recycle_ops, NULL);
 #endif /* CONFIG_NET_SKB_RECYCLE */
 
 #ifdef ETH_MV_TX_EN
@@ -33,6 +33,7 @@ disclaimer.
 #include <linux/etherdevice.h>
 #include <linux/mii.h>
 #include <linux/skbuff.h>
+#include <linux/skb_recycle.h>
 #include <linux/pci.h>
 #include <linux/ip.h>
 #include <linux/in.h>
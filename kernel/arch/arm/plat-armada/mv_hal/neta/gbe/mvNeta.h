@@ -76,6 +76,24 @@ extern "C" {
 #include "mvNetaRegs.h"
 #include "mvEthRegs.h"
 
+#ifdef CONFIG_MV_ETH_NETA_SIM
+/* Register access of modelled ports goes to the software model (mv_eth_sim.c) */
+MV_U32 mvNetaSimRegRead(MV_U32 offset);
+void mvNetaSimRegWrite(MV_U32 offset, MV_U32 data);
+
+#undef MV_REG_READ
+#undef MV_REG_WRITE
+#undef MV_REG_BIT_SET
+#undef MV_REG_BIT_RESET
+
+#define MV_REG_READ(offset)             mvNetaSimRegRead(offset)
+#define MV_REG_WRITE(offset, data)      mvNetaSimRegWrite((offset), (data))
+#define MV_REG_BIT_SET(offset, bitMask)                                 \
+	mvNetaSimRegWrite((offset), mvNetaSimRegRead(offset) | (bitMask))
+#define MV_REG_BIT_RESET(offset, bitMask)                               \
+	mvNetaSimRegWrite((offset), mvNetaSimRegRead(offset) & ~(bitMask))
+#endif /* CONFIG_MV_ETH_NETA_SIM */
+
 #ifdef CONFIG_MV_ETH_PNC
 # include "pnc/mvPnc.h"
 #endif /* CONFIG_MV_ETH_PNC */
@@ -77,6 +77,7 @@
 #include <linux/sysfs.h>
 #include <linux/miscdevice.h>
 #include <linux/falloc.h>
+#include <linux/mempool.h>
 
 #include <asm/uaccess.h>
 
@@ -402,6 +403,503 @@ lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 	return ret;
 }
 
+/*
+ * Direct mode (LO_FLAGS_DIRECT_IO).
+ *
+ * The blocks backing the device are looked up once, when the mode is
+ * switched on, and bios are then remapped onto the block device holding
+ * them and submitted from loop_make_request() without the loop thread.
+ * This bypasses the backing file's page cache, so the data is not
+ * cached twice, and keeps as many requests in flight as the caller
+ * issues.
+ *
+ * Like a swap file, the backing file must be fully allocated on a
+ * filesystem that maps its blocks in place on its one device (->bmap and
+ * s_bdev, what swapon relies on): no holes, no unwritten, shared or
+ * encoded extents.  The file is marked S_SWAPFILE while the mode is on,
+ * which keeps truncate, fallocate and extent moving away from it, and
+ * discard (hole punching) is disabled.  Bios that are not aligned to the
+ * logical block size of the underlying device, and flushes, still go
+ * through the loop thread.
+ *
+ * loop_make_request() only remaps a bio that needs a single clone and
+ * only if that can be had without waiting: its clone sits on
+ * current->bio_list until make_request returns, so waiting there for the
+ * bioset could mean waiting for clones the same task holds.  Everything
+ * else is split by the loop thread, which submits each piece before it
+ * allocates the next.
+ */
+struct loop_extent {
+	loff_t			pos;		/* byte offset in the device */
+	sector_t		sector;		/* where it is on map->bdev */
+	loff_t			len;
+};
+
+struct loop_map {
+	struct block_device	*bdev;
+	unsigned int		align;		/* logical block size - 1 */
+	struct loop_extent	*extents;	/* sorted by pos */
+	int			nr_extents;
+	int			max_extents;
+	atomic_t		inflight;	/* bios being remapped */
+	wait_queue_head_t	wait;
+	struct bio_set		*bio_set;
+	mempool_t		*dio_pool;
+};
+
+/* One bio remapped onto map->bdev, possibly in several pieces */
+struct loop_dio {
+	struct bio		*bio;
+	struct loop_map		*map;
+	atomic_t		pending;
+	int			error;
+};
+
+#define LOOP_DIO_POOL_SIZE	16
+#define LOOP_FIEMAP_BATCH	32
+#define LOOP_FIEMAP_BAD		(FIEMAP_EXTENT_UNKNOWN |		\
+				 FIEMAP_EXTENT_DELALLOC |		\
+				 FIEMAP_EXTENT_ENCODED |		\
+				 FIEMAP_EXTENT_DATA_ENCRYPTED |		\
+				 FIEMAP_EXTENT_NOT_ALIGNED |		\
+				 FIEMAP_EXTENT_DATA_INLINE |		\
+				 FIEMAP_EXTENT_DATA_TAIL |		\
+				 FIEMAP_EXTENT_UNWRITTEN |		\
+				 FIEMAP_EXTENT_SHARED)
+
+static int loop_map_add(struct loop_map *map, loff_t pos, sector_t sector,
+			loff_t len)
+{
+	struct loop_extent *ext;
+
+	if (map->nr_extents) {
+		ext = &map->extents[map->nr_extents - 1];
+		if (ext->pos + ext->len == pos &&
+		    ext->sector + (ext->len >> 9) == sector) {
+			ext->len += len;
+			return 0;
+		}
+	}
+	if (map->nr_extents == map->max_extents) {
+		int max = map->max_extents ? map->max_extents * 2 : 16;
+
+		ext = krealloc(map->extents, max * sizeof(*ext), GFP_KERNEL);
+		if (!ext)
+			return -ENOMEM;
+		map->extents = ext;
+		map->max_extents = max;
+	}
+	ext = &map->extents[map->nr_extents++];
+	ext->pos = pos;
+	ext->sector = sector;
+	ext->len = len;
+	return 0;
+}
+
+/* Map [start, start + len) of the file through ->fiemap */
+static int loop_map_fiemap(struct loop_map *map, struct inode *inode,
+			   loff_t start, loff_t len)
+{
+	struct fiemap_extent_info fieinfo;
+	struct fiemap_extent *fe;
+	loff_t pos = start, end = start + len;
+	mm_segment_t old_fs;
+	int i, err = 0;
+
+	fe = kmalloc(LOOP_FIEMAP_BATCH * sizeof(*fe), GFP_KERNEL);
+	if (!fe)
+		return -ENOMEM;
+
+	while (pos < end && !err) {
+		loff_t last = pos;
+
+		memset(&fieinfo, 0, sizeof(fieinfo));
+		fieinfo.fi_extents_max = LOOP_FIEMAP_BATCH;
+		fieinfo.fi_extents_start = (struct fiemap_extent __user *)fe;
+
+		old_fs = get_fs();
+		set_fs(get_ds());
+		err = inode->i_op->fiemap(inode, &fieinfo, pos, end - pos);
+		set_fs(old_fs);
+		if (err)
+			break;
+		if (!fieinfo.fi_extents_mapped) {
+			err = -EINVAL;		/* hole up to the end */
+			break;
+		}
+
+		for (i = 0; i < fieinfo.fi_extents_mapped && pos < end; i++) {
+			struct fiemap_extent *e = &fe[i];
+			loff_t n;
+
+			if (e->fe_logical + e->fe_length <= pos)
+				continue;
+			if (e->fe_logical > pos ||
+			    (e->fe_flags & LOOP_FIEMAP_BAD) ||
+			    ((e->fe_logical | e->fe_physical |
+			      e->fe_length) & 511)) {
+				err = -EINVAL;
+				break;
+			}
+			/* fiemap must agree with the blocks bmap gives */
+			if (bmap(inode, pos >> inode->i_blkbits) !=
+			    (e->fe_physical + pos - e->fe_logical) >>
+			    inode->i_blkbits) {
+				err = -EINVAL;
+				break;
+			}
+			n = min_t(loff_t, e->fe_logical + e->fe_length, end) -
+				pos;
+			err = loop_map_add(map, pos - start,
+				(e->fe_physical + pos - e->fe_logical) >> 9, n);
+			if (err)
+				break;
+			pos += n;
+		}
+		if (!err && pos == last)
+			err = -EINVAL;
+	}
+
+	kfree(fe);
+	return err;
+}
+
+/* Map [start, start + len) of the file one block at a time */
+static int loop_map_bmap(struct loop_map *map, struct inode *inode,
+			 loff_t start, loff_t len)
+{
+	unsigned blkbits = inode->i_blkbits;
+	loff_t pos = start, end = start + len;
+	int err;
+
+	while (pos < end) {
+		unsigned off = pos & ((1 << blkbits) - 1);
+		loff_t n = min_t(loff_t, (1 << blkbits) - off, end - pos);
+		sector_t block = bmap(inode, pos >> blkbits);
+
+		if (!block)
+			return -EINVAL;
+		err = loop_map_add(map, pos - start,
+				   (((loff_t)block << blkbits) + off) >> 9, n);
+		if (err)
+			return err;
+		pos += n;
+		cond_resched();
+	}
+	return 0;
+}
+
+static void loop_free_map(struct loop_map *map)
+{
+	wait_event(map->wait, !atomic_read(&map->inflight));
+	if (map->dio_pool)
+		mempool_destroy(map->dio_pool);
+	if (map->bio_set)
+		bioset_free(map->bio_set);
+	kfree(map->extents);
+	kfree(map);
+}
+
+/*
+ * Keep the backing file's blocks where the map says they are, as swapon
+ * does.  lo_ctl_mutex held, or the loop thread.
+ */
+static int loop_pin_layout(struct loop_device *lo)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+	int err = 0;
+
+	if (!S_ISREG(inode->i_mode))
+		return 0;
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode))
+		err = -EBUSY;
+	else
+		inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+static void loop_unpin_layout(struct loop_device *lo)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+	mutex_lock(&inode->i_mutex);
+	inode->i_flags &= ~S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+}
+
+/* Look up where the blocks of the device are.  lo_ctl_mutex held. */
+static struct loop_map *loop_build_map(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	loff_t size = (loff_t)get_capacity(lo->lo_disk) << 9;
+	struct loop_map *map;
+	int err = -EINVAL;
+
+	if (lo->transfer != transfer_none || (lo->lo_offset & 511))
+		return ERR_PTR(-EINVAL);
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+	atomic_set(&map->inflight, 0);
+	init_waitqueue_head(&map->wait);
+
+	if (S_ISBLK(inode->i_mode)) {
+		map->bdev = inode->i_bdev;
+		err = loop_map_add(map, 0, lo->lo_offset >> 9, size);
+	} else if (inode->i_sb->s_bdev && mapping->a_ops->bmap) {
+		map->bdev = inode->i_sb->s_bdev;
+		/* allocate delayed blocks so that they can be looked up */
+		err = filemap_write_and_wait(mapping);
+		if (!err && inode->i_op->fiemap)
+			err = loop_map_fiemap(map, inode, lo->lo_offset, size);
+		else if (!err)
+			err = loop_map_bmap(map, inode, lo->lo_offset, size);
+	}
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	map->align = bdev_logical_block_size(map->bdev) - 1;
+	if (lo->lo_offset & map->align)
+		goto out;
+
+	err = -ENOMEM;
+	map->bio_set = bioset_create(LOOP_DIO_POOL_SIZE, 0);
+	map->dio_pool = mempool_create_kmalloc_pool(LOOP_DIO_POOL_SIZE,
+						    sizeof(struct loop_dio));
+	if (!map->bio_set || !map->dio_pool)
+		goto out;
+	return map;
+
+out:
+	loop_free_map(map);
+	return ERR_PTR(err);
+}
+
+static struct loop_extent *loop_find_extent(struct loop_map *map, loff_t pos)
+{
+	int lo = 0, hi = map->nr_extents - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		struct loop_extent *ext = &map->extents[mid];
+
+		if (pos < ext->pos)
+			hi = mid - 1;
+		else if (pos >= ext->pos + ext->len)
+			lo = mid + 1;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
+/* Can @bio be remapped, rather than go through the page cache? */
+static int loop_dio_bio(struct loop_map *map, struct bio *bio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	if (!map || !bio->bi_size || (bio->bi_rw & (REQ_FLUSH | REQ_DISCARD)))
+		return 0;
+	if (((bio->bi_sector << 9) | bio->bi_size) & map->align)
+		return 0;
+	bio_for_each_segment(bvec, bio, i)
+		if ((bvec->bv_offset | bvec->bv_len) & map->align)
+			return 0;
+	return 1;
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_map *map = dio->map;
+
+	if (!atomic_dec_and_test(&dio->pending))
+		return;
+	bio_endio(dio->bio, dio->error);
+	mempool_free(dio, map->dio_pool);
+	if (atomic_dec_and_test(&map->inflight))
+		wake_up(&map->wait);
+}
+
+static void loop_dio_endio(struct bio *clone, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (error)
+		dio->error = error;
+	bio_put(clone);
+	loop_dio_put(dio);
+}
+
+static void loop_dio_submit(struct loop_dio *dio, struct bio *clone)
+{
+	atomic_inc(&dio->pending);
+	generic_make_request(clone);
+}
+
+static struct loop_dio *loop_dio_alloc(struct loop_map *map, struct bio *bio,
+				       gfp_t gfp)
+{
+	struct loop_dio *dio = mempool_alloc(map->dio_pool, gfp);
+
+	if (!dio)
+		return NULL;
+	dio->bio = bio;
+	dio->map = map;
+	dio->error = 0;
+	atomic_set(&dio->pending, 1);
+	return dio;
+}
+
+/* A bio for up to @nr pages of dio->bio, going to @pos in @ext */
+static struct bio *loop_dio_clone(struct loop_dio *dio,
+				  struct loop_extent *ext, loff_t pos,
+				  unsigned int nr, gfp_t gfp)
+{
+	struct bio *bio = dio->bio;
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(gfp, min_t(unsigned int, nr, BIO_MAX_PAGES),
+				 dio->map->bio_set);
+	if (!clone)
+		return NULL;
+	clone->bi_sector = ext->sector + ((pos - ext->pos) >> 9);
+	clone->bi_bdev = dio->map->bdev;
+	clone->bi_rw = bio->bi_rw &
+		(REQ_WRITE | REQ_SYNC | REQ_META | REQ_PRIO | REQ_FUA);
+	clone->bi_end_io = loop_dio_endio;
+	clone->bi_private = dio;
+	return clone;
+}
+
+/*
+ * Remap @bio from loop_make_request() if a single clone does, and it is
+ * to be had without waiting (see the top of this section).  Returns the
+ * clone, for loop_dio_submit(), or NULL to leave @bio to the loop thread.
+ */
+static struct bio *loop_dio_prepare(struct loop_map *map, struct bio *bio)
+{
+	loff_t pos = (loff_t)bio->bi_sector << 9;
+	struct loop_extent *ext = loop_find_extent(map, pos);
+	struct loop_dio *dio;
+	struct bio *clone;
+	struct bio_vec *bvec;
+	int i;
+
+	if (!ext || pos + bio->bi_size > ext->pos + ext->len)
+		return NULL;
+	dio = loop_dio_alloc(map, bio, GFP_NOWAIT);
+	if (!dio)
+		return NULL;
+	clone = loop_dio_clone(dio, ext, pos, bio->bi_vcnt - bio->bi_idx,
+			       GFP_NOWAIT);
+	if (!clone)
+		goto out_dio;
+	bio_for_each_segment(bvec, bio, i)
+		if (bio_add_page(clone, bvec->bv_page, bvec->bv_len,
+				 bvec->bv_offset) < bvec->bv_len)
+			goto out_clone;
+	return clone;
+
+out_clone:
+	bio_put(clone);
+out_dio:
+	mempool_free(dio, map->dio_pool);
+	return NULL;
+}
+
+/*
+ * Split @bio at extent boundaries and send the pieces to the underlying
+ * device.  The caller, the loop thread, has counted it in map->inflight.
+ */
+static void loop_submit_direct(struct loop_map *map, struct bio *bio)
+{
+	struct loop_dio *dio = loop_dio_alloc(map, bio, GFP_NOIO);
+	loff_t pos = (loff_t)bio->bi_sector << 9;
+	struct loop_extent *ext = NULL;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int off = bvec->bv_offset, len = bvec->bv_len;
+
+		while (len) {
+			unsigned int n;
+
+			if (!ext || pos >= ext->pos + ext->len) {
+				if (clone)
+					loop_dio_submit(dio, clone);
+				clone = NULL;
+				ext = loop_find_extent(map, pos);
+				if (!ext) {
+					dio->error = -EIO;
+					goto out;
+				}
+			}
+			n = min_t(loff_t, len, ext->pos + ext->len - pos);
+			if (!clone)
+				clone = loop_dio_clone(dio, ext, pos,
+						       bio->bi_vcnt - i,
+						       GFP_NOIO);
+			if (bio_add_page(clone, bvec->bv_page, n, off) < n) {
+				if (!clone->bi_size) {
+					bio_put(clone);
+					clone = NULL;
+					dio->error = -EIO;
+					goto out;
+				}
+				loop_dio_submit(dio, clone);
+				clone = NULL;
+				continue;
+			}
+			pos += n;
+			off += n;
+			len -= n;
+		}
+	}
+out:
+	if (clone)
+		loop_dio_submit(dio, clone);
+	loop_dio_put(dio);
+}
+
+/*
+ * Make completed writes stable: fsync the backing file, and in direct
+ * mode the device the writes went to.
+ */
+static int loop_flush_backing(struct loop_device *lo)
+{
+	int ret = vfs_fsync(lo->lo_backing_file, 0);
+
+	if ((!ret || ret == -EINVAL) && lo->lo_map)
+		ret = blkdev_issue_flush(lo->lo_map->bdev, GFP_NOIO, NULL);
+	if (unlikely(ret && ret != -EINVAL && ret != -EOPNOTSUPP))
+		return -EIO;
+	return 0;
+}
+
+/* Write back and forget the backing file's pages for a range */
+static void loop_drop_cache(struct loop_device *lo, loff_t pos,
+			    unsigned int len)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+
+	if (!len)
+		return;
+	filemap_write_and_wait_range(mapping, pos, pos + len - 1);
+	invalidate_inode_pages2_range(mapping, pos >> PAGE_CACHE_SHIFT,
+				      (pos + len - 1) >> PAGE_CACHE_SHIFT);
+}
+
 static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 {
 	loff_t pos;
@@ -410,14 +908,10 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 	pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
 
 	if (bio_rw(bio) == WRITE) {
-		struct file *file = lo->lo_backing_file;
-
 		if (bio->bi_rw & REQ_FLUSH) {
-			ret = vfs_fsync(file, 0);
-			if (unlikely(ret && ret != -EINVAL)) {
-				ret = -EIO;
+			ret = loop_flush_backing(lo);
+			if (ret)
 				goto out;
-			}
 		}
 
 		/*
@@ -431,7 +925,7 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 			int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
 
 			if ((!file->f_op->fallocate) ||
-			    lo->lo_encrypt_key_size) {
+			    lo->lo_encrypt_key_size || lo->lo_map) {
 				ret = -EOPNOTSUPP;
 				goto out;
 			}
@@ -445,14 +939,14 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 
 		ret = lo_send(lo, bio, pos);
 
-		if ((bio->bi_rw & REQ_FUA) && !ret) {
-			ret = vfs_fsync(file, 0);
-			if (unlikely(ret && ret != -EINVAL))
-				ret = -EIO;
-		}
+		if ((bio->bi_rw & REQ_FUA) && !ret)
+			ret = loop_flush_backing(lo);
 	} else
 		ret = lo_receive(lo, bio, lo->lo_blocksize, pos);
 
+	/* in direct mode the page cache must not hold anything */
+	if (lo->lo_map)
+		loop_drop_cache(lo, pos, bio->bi_size);
 out:
 	return ret;
 }
@@ -477,6 +971,8 @@ static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 {
 	struct loop_device *lo = q->queuedata;
 	int rw = bio_rw(old_bio);
+	struct loop_map *map;
+	struct bio *clone;
 
 	if (rw == READA)
 		rw = READ;
@@ -488,6 +984,18 @@ static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	map = lo->lo_map;
+	clone = loop_dio_bio(map, old_bio) ? loop_dio_prepare(map, old_bio) :
+		NULL;
+	if (clone) {
+		struct loop_dio *dio = clone->bi_private;
+
+		atomic_inc(&map->inflight);
+		spin_unlock_irq(&lo->lo_lock);
+		loop_dio_submit(dio, clone);
+		loop_dio_put(dio);
+		return;
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -500,10 +1008,13 @@ out:
 
 struct switch_request {
 	struct file *file;
+	struct loop_map *map;
+	int set_map;		/* install map as lo_map */
 	struct completion wait;
 };
 
 static void do_loop_switch(struct loop_device *, struct switch_request *);
+static int loop_set_dio(struct loop_device *lo, int on);
 
 static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 {
@@ -511,7 +1022,19 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
 	} else {
-		int ret = do_bio_filebacked(lo, bio);
+		int ret = 0;
+
+		if (lo->lo_map && (bio->bi_rw & REQ_FLUSH)) {
+			ret = loop_flush_backing(lo);
+			bio->bi_rw &= ~REQ_FLUSH;
+		}
+		if (!ret && loop_dio_bio(lo->lo_map, bio)) {
+			atomic_inc(&lo->lo_map->inflight);
+			loop_submit_direct(lo->lo_map, bio);
+			return;
+		}
+		if (!ret)
+			ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
 	}
 }
@@ -559,21 +1082,64 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int loop_send_switch(struct loop_device *lo, struct switch_request *w)
 {
-	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
 	if (!bio)
 		return -ENOMEM;
-	init_completion(&w.wait);
-	w.file = file;
-	bio->bi_private = &w;
+	init_completion(&w->wait);
+	bio->bi_private = w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
-	wait_for_completion(&w.wait);
+	wait_for_completion(&w->wait);
 	return 0;
 }
 
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	struct switch_request w = { .file = file };
+
+	return loop_send_switch(lo, &w);
+}
+
+/*
+ * Switch direct mode on (with @map) or off (NULL) once the bios queued
+ * before have been handled.
+ */
+static int loop_switch_map(struct loop_device *lo, struct loop_map *map)
+{
+	struct switch_request w = { .map = map, .set_map = 1 };
+
+	return loop_send_switch(lo, &w);
+}
+
+/* Called from the loop thread, see loop_switch_map() */
+static void loop_install_map(struct loop_device *lo, struct loop_map *map)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	struct loop_map *old = lo->lo_map;
+
+	/* earlier buffered writes must not land on top of direct ones */
+	if (map) {
+		filemap_write_and_wait(mapping);
+		invalidate_inode_pages2(mapping);
+	}
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_map = map;
+	if (map)
+		lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	else
+		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+
+	if (old) {
+		loop_free_map(old);
+		if (!map)
+			loop_unpin_layout(lo);
+	}
+}
+
 /*
  * Helper to flush the IOs in loop, but keeping loop thread running
  */
@@ -595,6 +1161,9 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	if (p->set_map)
+		loop_install_map(lo, p->map);
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -652,6 +1221,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (get_loop_size(lo, file) != get_loop_size(lo, old_file))
 		goto out_putf;
 
+	/* the block map belongs to the old file */
+	error = loop_set_dio(lo, 0);
+	if (error)
+		goto out_putf;
+
 	/* and ... switch */
 	error = loop_switch(lo, file);
 	if (error)
@@ -742,11 +1316,19 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RO(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -754,6 +1336,7 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -784,10 +1367,11 @@ static void loop_config_discard(struct loop_device *lo)
 	 * We use punch hole to reclaim the free space used by the
 	 * image a.k.a. discard. However we do support discard if
 	 * encryption is enabled, because it may give an attacker
-	 * useful information.
+	 * useful information.  Nor in direct mode, which relies on the
+	 * blocks of the file staying where they are.
 	 */
 	if ((!file->f_op->fallocate) ||
-	    lo->lo_encrypt_key_size) {
+	    lo->lo_encrypt_key_size || lo->lo_map) {
 		q->limits.discard_granularity = 0;
 		q->limits.discard_alignment = 0;
 		q->limits.max_discard_sectors = 0;
@@ -803,6 +1387,42 @@ static void loop_config_discard(struct loop_device *lo)
 	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
 }
 
+/* Turn direct mode on, off, or remap it.  lo_ctl_mutex held. */
+static int loop_set_dio(struct loop_device *lo, int on)
+{
+	struct loop_map *map = NULL;
+	int err;
+
+	if (on) {
+		/* a remap keeps the pin of the map it replaces */
+		if (!lo->lo_map) {
+			err = loop_pin_layout(lo);
+			if (err)
+				return err;
+		}
+		map = loop_build_map(lo);
+		if (IS_ERR(map)) {
+			err = PTR_ERR(map);
+			goto out;
+		}
+	} else if (!lo->lo_map)
+		return 0;
+
+	err = loop_switch_map(lo, map);
+	if (err) {
+		if (map)
+			loop_free_map(map);
+		goto out;
+	}
+	loop_config_discard(lo);
+	return 0;
+
+out:
+	if (!lo->lo_map)
+		loop_unpin_layout(lo);
+	return err;
+}
+
 static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 		       struct block_device *bdev, unsigned int arg)
 {
@@ -987,6 +1607,12 @@ static int loop_clr_fd(struct loop_device *lo)
 
 	kthread_stop(lo->lo_thread);
 
+	if (lo->lo_map) {
+		loop_free_map(lo->lo_map);
+		lo->lo_map = NULL;
+		loop_unpin_layout(lo);
+	}
+
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
 	spin_unlock_irq(&lo->lo_lock);
@@ -1048,6 +1674,17 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	/* the block map goes stale when the offset or size changes */
+	if (lo->lo_map &&
+	    (!(info->lo_flags & LO_FLAGS_DIRECT_IO) ||
+	     info->lo_encrypt_type ||
+	     lo->lo_offset != info->lo_offset ||
+	     lo->lo_sizelimit != info->lo_sizelimit)) {
+		err = loop_set_dio(lo, 0);
+		if (err)
+			return err;
+	}
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -1104,6 +1741,9 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		lo->lo_key_owner = uid;
 	}	
 
+	if ((info->lo_flags & LO_FLAGS_DIRECT_IO) && !lo->lo_map)
+		return loop_set_dio(lo, 1);
+
 	return 0;
 }
 
@@ -1258,6 +1898,9 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = figure_loop_size(lo, lo->lo_offset, lo->lo_sizelimit);
 	if (unlikely(err))
 		goto out;
+	/* map the blocks the device has grown by, or fall back */
+	if (lo->lo_map && loop_set_dio(lo, 1))
+		loop_set_dio(lo, 0);
 	sec = get_capacity(lo->lo_disk);
 	/* the width of sector_t may be narrow for bit-shift */
 	sz = sec;
@@ -7,6 +7,12 @@
 #include <linux/fs.h>
 #include <linux/mm.h>
 #include <linux/cdev.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/dma-mapping.h>
+#include <asm/cacheflush.h>
+#include <asm/mach/map.h>
+#include <linux/highmem.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
 #include <linux/semaphore.h>
@@ -16,6 +22,8 @@
 #include <linux/mman.h>
 #include <linux/slab.h>
 #include <linux/ioctl.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include "linux/swap.h"
 #include "sharedMemCommon.h"
 #include <linux/sharedMemQueueCommon.h>
@@ -41,26 +49,97 @@
 /*______________________________________________________________________________________________*/
 
 int find_region_from_tag(shared_mem_os_info *os_info, SharedMemGetRegionOffset *offset);
-int shm_queue_recv_msg_base(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args, int from_user);
+int shm_queue_recv_msg_base(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args);
 int shm_queue_recv_msg(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args);
-int shm_queue_send_msg_base(shared_mem_dev *shm_dev, SharedMemQueueSendMsg *send_args, int from_user);
+int shm_queue_send_msg_base(shared_mem_dev *shm_dev, SharedMemQueueSendMsg *send_args);
 
 void armadaSendDoorbell(MV_U32 cpuBitMask, MV_U32 chnId);
 
+struct file_operations shared_mem_fops;
+static int shm_cache_range(void *va, unsigned long pa, size_t len, unsigned int op);
+
 #define init_MUTEX(x) sema_init(x, 1)
 
 char* region_name[] =
 {"SHMQ","SHLX","SHVX","SHJ1","read","SGLD"};
 #define MAX_REGION_NAME 6
 
+/* Bulk data regions, the only ones that may be mapped other than uncached */
+char* cacheable_region_name[] =
+{"SHLX","SHVX","SHJ1","read","HLRC"};
+#define MAX_CACHEABLE_REGION_NAME 5
+
+/* Largest scratch buffer SHARED_MEM_IOC_BENCH will time */
+#define SHM_BENCH_MAX_SIZE	(4 * 1024 * 1024)
+
+/*
+ * Regions the DNAS driver copies request data through. They get a cacheable
+ * section mapping (shm_section_map) alongside the uncached ioremap, see
+ * shm_region_map_direct() and find_region_kern_direct_addr_from_tag().
+ */
+char* direct_region_name[] =
+{"SHJ1","read","HLRC"};
+#define MAX_DIRECT_REGION_NAME 3
+
 /*
  * This means that we can only have one shared mem area to one other core. So be it.
  */
 static int shared_mem_init_done = 0;
 static shared_mem_dev *g_shm_dev = NULL;
-static unsigned int  start_time[SHM_MAX_QUEUE_PAIRS], stop_time[SHM_MAX_QUEUE_PAIRS];
 static shm_queue_os_info *global_queue_os_info;
 
+/*
+ * A software peer standing in for the VxWorks core (shared_mem_loopback.c).
+ * While one is registered the partitions live in its memory and doorbells to
+ * the other core are calls into it. shm_hw_header keeps the real header
+ * mapping for when the peer goes away again before anybody synced with it.
+ */
+static shm_peer_ops *g_shm_peer = NULL;
+static SharedMemPartitionDescHeader *shm_hw_header = NULL;
+static int shm_doorbell_inited = 0;
+
+/*
+ * Queue wait tuning. spin_usecs is the default busy-poll window a newly attached
+ * queue pair gets before a waiter sleeps on the doorbell (0 means go straight to
+ * sleep). The fallback timeout only bounds the sleep in case a doorbell is lost,
+ * the normal wakeup comes from shm_doorbell_isr().
+ */
+static unsigned int shm_queue_spin_usecs = 0;
+module_param(shm_queue_spin_usecs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(shm_queue_spin_usecs, "Default busy-poll window in usecs before sleeping on a queue doorbell");
+
+static unsigned int shm_queue_wait_fallback_ms = 100;
+module_param(shm_queue_wait_fallback_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(shm_queue_wait_fallback_ms, "Upper bound in ms on a single doorbell sleep");
+
+static unsigned int shm_section_map = 1;
+module_param(shm_section_map, uint, S_IRUGO);
+MODULE_PARM_DESC(shm_section_map, "Map the J1 and read cache regions cacheable with 1MB/16MB sections");
+
+/*
+ * Section mappings made so far. They are permanent, so a header parsed again
+ * on the next open reuses them rather than eating more vmalloc space.
+ */
+static struct
+{
+	unsigned long phys;
+	unsigned long size;
+	void *virt;
+} shm_direct_map[SHARED_MEM_MAX_PARTITIONS];
+
+/* Wake whoever waits on a queue behind doorbell db */
+static void shm_doorbell_signal(shm_queue_os_info *queue_os_info, int db)
+{
+	if( (queue_os_info->db_to_q_index[db].type == BIT_SHIFT_VX_TO_LX) ||
+	    (queue_os_info->db_to_q_index[db].type == BIT_SHIFT_LX_TO_VX) )
+	{
+	   if(queue_os_info->db_to_q_index[db].wq_to_signal)
+	   {
+	      wake_up_interruptible(queue_os_info->db_to_q_index[db].wq_to_signal);
+	   }
+	}
+}
+
 static irqreturn_t shm_doorbell_isr( int irq , void *dev_id )
 {
     unsigned int cause;
@@ -81,15 +160,7 @@ static irqreturn_t shm_doorbell_isr( int irq , void *dev_id )
 		if(cause & (1 << db))
 		{
                         //printk(KERN_INFO "%s: doorbell irq cause 0x%0x index %d\n", __func__, cause, db);
-			if( (queue_os_info->db_to_q_index[db].type == BIT_SHIFT_VX_TO_LX) ||
-			    (queue_os_info->db_to_q_index[db].type == BIT_SHIFT_LX_TO_VX) )
-			{
-			   if(queue_os_info->db_to_q_index[db].wq_to_signal)
-			   {
-                              //printk(KERN_INFO "doorbell number %d tick 0x%x\n", db, jiffies);
-			      wake_up_interruptible(queue_os_info->db_to_q_index[db].wq_to_signal);
-			   }					
-			}
+			shm_doorbell_signal(queue_os_info, db);
 			cause &= ~(1 << db);
 		}
 		db++;
@@ -99,7 +170,17 @@ static irqreturn_t shm_doorbell_isr( int irq , void *dev_id )
     return IRQ_HANDLED;
 }
 
-int shm_doorbell_init(shm_queue_os_info *queue_os_info)
+/*
+ * The doorbell is a per-cpu (percpu_devid) interrupt, so requesting it is not
+ * enough. It has to be enabled on every cpu that can be targeted by the other
+ * core or the waiters are only ever woken up by their timeout.
+ */
+static void shm_doorbell_enable_percpu(void *info)
+{
+	enable_percpu_irq(DOORBELL_IN_IRQ, 0);
+}
+
+int shm_doorbell_init(shm_queue_os_info *queue_os_info)
 {
 	int i;
 	
@@ -122,8 +203,10 @@ int shm_doorbell_init(shm_queue_os_info *queue_os_info)
         	return -1;
     	}
 
+	on_each_cpu(shm_doorbell_enable_percpu, NULL, 1);
+
         /* Unmask all doorbell interrupts */
-	for(i = 0; i <= SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT; i++)
+	for(i = 0; i < SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT; i++)
 	{
 	    //MV_REG_BIT_SET(CPU_DOORBELL_IN_MASK_REG, (1 << (SHM_DB_CAUSE_REG_SHIFT+i)));
 	    MV_REG_BIT_SET(SHM_DB_MASK_REG, (1 << (SHM_DB_CAUSE_REG_SHIFT+i)));
@@ -161,6 +244,12 @@ inline void shm_ipc_send_doorbell(MV_U32 cpuId, MV_U32 chnId)
         unsigned int cpuBitMask;
         unsigned int doorbellNum;
 
+        if (g_shm_peer)
+        {
+                g_shm_peer->doorbell(chnId);
+                return;
+        }
+
         cpuBitMask   = (1 << cpuId);
         doorbellNum  = SHM_DB_CAUSE_REG_SHIFT + chnId;
 
@@ -183,6 +272,304 @@ int shm_region_name_match(char *tag)
 	return SHMQSTATUS_GENERIC_ERROR;
 }
 
+static void shm_queue_wait_stats_add(shm_queue_wait_stats *stats, s64 usecs)
+{
+	int bucket = 0;
+
+	if (usecs > 0)
+	{
+		bucket = fls64(usecs);
+		if (bucket >= SHM_QUEUE_WAIT_HIST_BUCKETS)
+			bucket = SHM_QUEUE_WAIT_HIST_BUCKETS - 1;
+	}
+	stats->hist[bucket]++;
+}
+
+/*
+ * Wait until the other core hands the slot over to us.
+ *
+ * We busy-poll the owner field for up to spin_usecs first, since the other core
+ * usually turns a slot around in a few usecs and a sleep/wakeup costs more than
+ * that. After that we sleep on the queue's wait queue, which shm_doorbell_isr()
+ * wakes when the other core rings the doorbell for this queue.
+ *
+ * Several claimers can wait on the same slot, and another claimer may take it
+ * while we wait, so this only waits once: until the slot is Linux's, the
+ * ticket has moved on, or one sleep has ended. The caller then goes back and
+ * claims whatever slot the ticket points at now. stats are not locked, so they
+ * are only approximate with several waiters. Returns 0, or -EINTR if a signal
+ * arrived.
+ */
+static inline int shm_queue_slot_moved(shm_queue_ring *ring, unsigned int ticket,
+				       volatile SHMQueueSlotHeader *slotHeader)
+{
+	return atomic_read(&ring->ticket) != ticket ||
+	       SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) == SHM_QUEUE_SLOT_OWNER_LINUX;
+}
+
+static int shm_queue_wait_for_slot(shm_queue_ring *ring, unsigned int ticket,
+				   volatile SHMQueueSlotHeader *slotHeader, wait_queue_head_t *wq,
+				   unsigned int spin_usecs, shm_queue_wait_stats *stats)
+{
+	DEFINE_WAIT(wait);
+	ktime_t start = ktime_get();
+	int retVal = 0;
+
+	stats->waits++;
+
+	if (spin_usecs)
+	{
+		while(!shm_queue_slot_moved(ring, ticket, slotHeader))
+		{
+			if (ktime_us_delta(ktime_get(), start) >= spin_usecs)
+				break;
+			cpu_relax();
+		}
+
+		if (shm_queue_slot_moved(ring, ticket, slotHeader))
+		{
+			stats->spin_hits++;
+			goto shm_queue_wait_done;
+		}
+	}
+
+	stats->sleeps++;
+
+	prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
+	if(!shm_queue_slot_moved(ring, ticket, slotHeader))
+	{
+		schedule_timeout(msecs_to_jiffies(shm_queue_wait_fallback_ms));
+	}
+	finish_wait(wq, &wait);
+	if(signal_pending(current))
+	{
+		retVal = -EINTR;
+	}
+
+shm_queue_wait_done:
+	shm_queue_wait_stats_add(stats, ktime_us_delta(ktime_get(), start));
+
+	return retVal;
+}
+
+static void shm_queue_print_wait_stats(const char *dir, shm_queue_wait_stats *stats)
+{
+	int i;
+
+	printk("\t%s: waits: %u spin hits: %u sleeps: %u\n", dir, stats->waits, stats->spin_hits, stats->sleeps);
+	for(i = 0; i < SHM_QUEUE_WAIT_HIST_BUCKETS; i++)
+	{
+		if (!stats->hist[i])
+			continue;
+		if (i == 0)
+			printk("\t\t      < 1 us: %u\n", stats->hist[i]);
+		else if (i == SHM_QUEUE_WAIT_HIST_BUCKETS - 1)
+			printk("\t\t>= %8u us: %u\n", 1U << (i - 1), stats->hist[i]);
+		else
+			printk("\t\t<  %8u us: %u\n", 1U << i, stats->hist[i]);
+	}
+}
+
+void shm_queue_dump_stats(shm_queue_os_info *queue_os_info)
+{
+	int i;
+
+	printk("-----------------------------------------------------------------\n");
+	printk("SHARED_MEM: QUEUE WAIT STATS:\n");
+	printk("-----------------------------------------------------------------\n");
+	for(i = 0; i < SHM_MAX_QUEUE_PAIRS; i++)
+	{
+		shm_queue_pair_os_info *queue_pair_os_info = &(queue_os_info->q_pair_os_info[i]);
+
+		if(!queue_pair_os_info->shmQPairPtr)
+			continue;
+
+		printk("%d) %s spin window: %u us\n", i, queue_pair_os_info->shmQPairPtr->queuePairName, queue_pair_os_info->spin_usecs);
+		shm_queue_print_wait_stats("SEND LX TO VX", &queue_pair_os_info->send_wait_stats);
+		shm_queue_print_wait_stats("RECV VX TO LX", &queue_pair_os_info->recv_wait_stats);
+	}
+	printk("-----------------------------------------------------------------\n");
+}
+
+/*
+ * Set the busy-poll window of a queue pair. The wait stats of the pair are
+ * reset as well so each setting can be measured on its own.
+ *
+ * Kernel senders and receivers don't take the direction semaphores, so
+ * nothing is locked here: each wait reads the window once, and a wait in
+ * progress may still count itself into the stats just after the reset.
+ */
+int shm_queue_set_spin(shared_mem_dev *shm_dev, SharedMemQueueSetSpin *spin_args)
+{
+	shm_queue_os_info *queue_os_info = &(shm_dev->queue_os_info);
+	shm_queue_pair_os_info *queue_pair_os_info;
+
+	if( (spin_args->handle <= SHARED_MEM_QUEUE_INVALID_HANDLE) ||
+		(spin_args->handle >= SHM_MAX_QUEUE_PAIRS) )
+	{
+		return -EINVAL;
+	}
+
+	queue_pair_os_info = &(queue_os_info->q_pair_os_info[spin_args->handle]);
+	if(!queue_pair_os_info->shmQPairPtr)
+	{
+		return -EINVAL;
+	}
+
+	ACCESS_ONCE(queue_pair_os_info->spin_usecs) = spin_args->spinUsecs;
+	memset(&queue_pair_os_info->send_wait_stats, 0, sizeof(queue_pair_os_info->send_wait_stats));
+	memset(&queue_pair_os_info->recv_wait_stats, 0, sizeof(queue_pair_os_info->recv_wait_stats));
+
+	return 0;
+}
+EXPORT_SYMBOL(shm_queue_set_spin);
+
+/*
+ * Lock free slot handover.
+ *
+ * Each queue direction has a single reader/writer on the far side, but on our
+ * side any number of kernel threads can send or receive on it. Rather than
+ * serializing them on a semaphore, a thread claims the next slot by moving the
+ * direction's ticket on, and only while that slot is owned by Linux, so
+ * nothing is held while waiting for the other core. The ticket moves under a
+ * spinlock held just for that, which also publishes the direction's index in
+ * shared memory, so the index only ever moves on in claim order. The per slot lap
+ * count keeps a thread a whole ring ahead from claiming a slot whose previous
+ * claimer has not handed it over yet.
+ *
+ * The other core only looks at the slot owner, so the payload has to be out
+ * before the owner flips (wmb) and must not be read before we saw it flip (rmb).
+ *
+ * Slots are only ever claimed with the data ready to go (send) or a kernel
+ * buffer to copy into (recv), so a claim never spans a sleep. The user space
+ * paths bounce through a kernel buffer and keep the old semaphores among
+ * themselves.
+ */
+#define SHM_QUEUE_LAP_WRAP	0x10000
+
+#define SHM_QUEUE_SLOT_PTR(slotBuf, qInfo, slot)	\
+	((volatile SHMQueueSlotHeader *) ((slotBuf) + ((slot) * ((qInfo)->sizeSlots + sizeof(SHMQueueSlotHeader)))))
+
+static int shm_queue_ring_init(shm_queue_ring *ring, SHMQueueInfo *qInfo, unsigned int *next)
+{
+	unsigned int i, start = *next;
+
+	ring->lap = kzalloc(qInfo->numSlots * sizeof(*ring->lap), GFP_KERNEL);
+	if(!ring->lap)
+	{
+		return -ENOMEM;
+	}
+
+	/* Slots before where the queue currently is are done with the first lap */
+	for(i = 0; i < start; i++)
+	{
+		ring->lap[i] = 1;
+	}
+	atomic_set(&ring->ticket, start);
+	spin_lock_init(&ring->lock);
+	ring->next = next;
+
+	return 0;
+}
+
+/*
+ * Claim the next slot of a queue direction once it is owned by Linux. Returns
+ * the slot index with *slotHeaderOut set, -EAGAIN if no_wait and the slot is
+ * not ours, or -EINTR if a signal came in while waiting.
+ *
+ * With check_magic, a slot with a bad magic is not claimed and -EIO returned,
+ * so nothing gets written into it and the ticket stays where it is.
+ */
+static int shm_queue_claim_slot(shm_queue_ring *ring, SHMQueueInfo *qInfo, unsigned char *slotBuf,
+				int no_wait, wait_queue_head_t *wq, unsigned int spin_usecs,
+				shm_queue_wait_stats *stats, int check_magic,
+				volatile SHMQueueSlotHeader **slotHeaderOut)
+{
+	unsigned int ticket, next, slot;
+	unsigned short lap;
+	unsigned long flags;
+	volatile SHMQueueSlotHeader *slotHeader;
+
+	while(true)
+	{
+		ticket = atomic_read(&ring->ticket);
+		slot = ticket % qInfo->numSlots;
+		lap = (unsigned short) (ticket / qInfo->numSlots);
+		slotHeader = SHM_QUEUE_SLOT_PTR(slotBuf, qInfo, slot);
+
+		if(ACCESS_ONCE(ring->lap[slot]) != lap)
+		{
+			/* Claimed a lap ago and still being copied, that won't take long */
+			if(no_wait)
+			{
+				return -EAGAIN;
+			}
+			cpu_relax();
+			cond_resched();
+			continue;
+		}
+		smp_rmb();
+
+		if(SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) == SHM_QUEUE_SLOT_OWNER_LINUX)
+		{
+			next = ticket + 1;
+			if(next == qInfo->numSlots * SHM_QUEUE_LAP_WRAP)
+			{
+				next = 0;
+			}
+			spin_lock_irqsave(&ring->lock, flags);
+			if(check_magic && (atomic_read(&ring->ticket) == ticket) &&
+			   (SHM_QUEUE_GET_SLOT_HEADER_MAGIC(slotHeader) != SHM_QUEUE_SLOT_MAGIC))
+			{
+				spin_unlock_irqrestore(&ring->lock, flags);
+				printk("SHARED_MEM: Magic at slot %d invalid. SlotPtr: 0x%lx Got Value 0x%lx expected: 0x%lx\n",
+						(int) slot, (unsigned long int) slotHeader,
+						(unsigned long int) SHM_QUEUE_GET_SLOT_HEADER_MAGIC(slotHeader), (unsigned long int) SHM_QUEUE_SLOT_MAGIC);
+				return -EIO;
+			}
+			if(atomic_read(&ring->ticket) == ticket)
+			{
+				atomic_set(&ring->ticket, next);
+				*ring->next = next % qInfo->numSlots;
+				spin_unlock_irqrestore(&ring->lock, flags);
+				rmb();
+				*slotHeaderOut = slotHeader;
+				return slot;
+			}
+			spin_unlock_irqrestore(&ring->lock, flags);
+			continue;
+		}
+
+		if(no_wait)
+		{
+			return -EAGAIN;
+		}
+
+		/*
+		 * The other core rings our doorbell when it hands the slot over.
+		 * Either way, re-read the ticket, someone else may have taken it.
+		 */
+		if(shm_queue_wait_for_slot(ring, ticket, slotHeader, wq, spin_usecs, stats))
+		{
+			return -EINTR;
+		}
+	}
+}
+
+/*
+ * Give a claimed slot to the other core. size is the message size for a send
+ * and 0 once we have read a message out.
+ */
+static void shm_queue_release_slot(shm_queue_ring *ring, volatile SHMQueueSlotHeader *slotHeader,
+				   unsigned int slot, unsigned int size)
+{
+	/* Payload (or our reads of it) done before the other core can see the slot */
+	mb();
+	SHM_QUEUE_SET_SLOT_HEADER(slotHeader, SHM_QUEUE_SLOT_MAGIC, SHM_QUEUE_SLOT_OWNER_VXWORKS, size);
+	smp_wmb();
+	ring->lap[slot]++;
+}
+
 void shm_queue_init(shm_queue_os_info *queue_os_info)
 {
 	unsigned int i;
@@ -191,7 +578,6 @@ void shm_queue_init(shm_queue_os_info *queue_os_info)
 	queue_os_info->baseSlotBufferPtr = NULL;	
 	init_MUTEX(&(queue_os_info->os_info_sem));
 	memset(queue_os_info->q_pair_os_info, 0x0, sizeof(queue_os_info->q_pair_os_info));
-	shm_doorbell_init(queue_os_info);
 	for(i = 0; i < (2 * SHM_MAX_QUEUE_PAIRS) /*SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT*/; i++)
 	{
 		queue_os_info->db_to_q_index[i].type = BIT_SHIFT_NONE;
@@ -213,6 +599,13 @@ unsigned int shm_queue_sync_cores(shared_mem_dev *shm_dev)
 		return SHMQSTATUS_OK;
 	}
 
+	/* The doorbell hardware is only ours to set up if the other core is real */
+	if(!g_shm_peer && !shm_doorbell_inited)
+	{
+		shm_doorbell_init(queue_os_info);
+		shm_doorbell_inited = 1;
+	}
+
 	/* First thing is to map the shmq partitions into the kernel memory */
 	memcpy(region_offset.tag, PARTITION_TAG_SHARED_MEM_QUEUES_POOL, 4);
 	retVal = find_region_from_tag(shm_dev->os_info, &region_offset);
@@ -350,6 +743,20 @@ int shm_queue_attach(shared_mem_dev *shm_dev, SharedMemQueueAttach *attach_args)
 						return -EINTR;
 					}
 					
+					if(shm_queue_ring_init(&(queue_os_info->q_pair_os_info[i].lx_to_vx_ring),
+							       &(queue_os_info->queueHeader->queuePairInfo[i].qLxToVx),
+							       &(queue_os_info->queueHeader->queuePairInfo[i].qLxToVx.nextSlotToInsert)) ||
+					   shm_queue_ring_init(&(queue_os_info->q_pair_os_info[i].vx_to_lx_ring),
+							       &(queue_os_info->queueHeader->queuePairInfo[i].qVxToLx),
+							       &(queue_os_info->queueHeader->queuePairInfo[i].qVxToLx.nextSlotToProcess)))
+					{
+						printk("SHARED_MEM: shm_queue_attach: Unable to allocate ring state for queue pair %d\n", i);
+						kfree(queue_os_info->q_pair_os_info[i].lx_to_vx_ring.lap);
+						queue_os_info->q_pair_os_info[i].lx_to_vx_ring.lap = NULL;
+						retVal = -ENOMEM;
+						goto shm_queue_attach_error;
+					}
+
 					/* Init our data structures */
 					queue_os_info->q_pair_os_info[i].shmQPairPtr = &(queue_os_info->queueHeader->queuePairInfo[i]);
 					queue_os_info->q_pair_os_info[i].slot_buf_ptr_lx_to_vx = 
@@ -360,13 +767,14 @@ int shm_queue_attach(shared_mem_dev *shm_dev, SharedMemQueueAttach *attach_args)
 					init_MUTEX(&(queue_os_info->q_pair_os_info[i].q_vx_to_lx_mutex));
 					init_waitqueue_head(&(queue_os_info->q_pair_os_info[i].recv_vx_to_lx_wait_queue_head));
 					init_waitqueue_head(&(queue_os_info->q_pair_os_info[i].send_lx_to_vx_wait_queue_head));
+					queue_os_info->q_pair_os_info[i].spin_usecs = shm_queue_spin_usecs;
 
-					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qVxToLx.doorbellBitShift].type = BIT_SHIFT_VX_TO_LX;
-					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qVxToLx.doorbellBitShift].index = i;
-					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qVxToLx.doorbellBitShift].wq_to_signal = &(queue_os_info->q_pair_os_info[i].recv_vx_to_lx_wait_queue_head);
-					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qLxToVx.doorbellBitShift].type = BIT_SHIFT_LX_TO_VX;
-					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qLxToVx.doorbellBitShift].index = i;
-					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qLxToVx.doorbellBitShift].wq_to_signal = &(queue_os_info->q_pair_os_info[i].send_lx_to_vx_wait_queue_head);
+					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qVxToLx.doorbellBitShift].type = BIT_SHIFT_VX_TO_LX;
+					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qVxToLx.doorbellBitShift].index = i;
+					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qVxToLx.doorbellBitShift].wq_to_signal = &(queue_os_info->q_pair_os_info[i].recv_vx_to_lx_wait_queue_head);
+					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qLxToVx.doorbellBitShift].type = BIT_SHIFT_LX_TO_VX;
+					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qLxToVx.doorbellBitShift].index = i;
+					queue_os_info->db_to_q_index[queue_os_info->q_pair_os_info[i].shmQPairPtr->qLxToVx.doorbellBitShift].wq_to_signal = &(queue_os_info->q_pair_os_info[i].send_lx_to_vx_wait_queue_head);
 
 
 					//SHM_DOORBELL_ENABLE(SHM_DOORBELL_LINUX_CPU_ID, queue_os_info->queueHeader->queuePairInfo[i].qVxToLx.doorbellBitShift);
@@ -402,309 +810,610 @@ shm_queue_attach_error:
 }
 EXPORT_SYMBOL(shm_queue_attach);
 
+/*
+ * Check a queue handle and return its queue pair.
+ */
+static shm_queue_pair_os_info *shm_queue_get_pair(shm_queue_os_info *queue_os_info, SharedMemQHandle handle, const char *func)
+{
+	if(!queue_os_info->cores_synced_for_queues)
+	{
+		printk("SHARED_MEM: %s: Cannot use queues before we are done syncing between cores\n", func);
+		return NULL;
+	}
+
+	if( (handle <= SHARED_MEM_QUEUE_INVALID_HANDLE) ||
+		(handle >= SHM_MAX_QUEUE_PAIRS) )
+	{
+		printk("SHARED_MEM: %s: %d queue handle is invalid\n", func, (int) handle);
+		return NULL;
+	}
+
+	if(!queue_os_info->q_pair_os_info[handle].shmQPairPtr)
+	{
+		/* This queue hasn't been attached to yet */
+		printk("SHARED_MEM: %s: %d queue handle has not been attached to yet. Please attach first\n", func, (int) handle);
+		return NULL;
+	}
+
+	return &(queue_os_info->q_pair_os_info[handle]);
+}
+
 int shm_queue_kern_send_msg(shared_mem_dev *shm_dev, SharedMemQueueSendMsg *send_args)
 {
 	/*
 	armadaSendDoorbell(0x02, 0); //test
 	armadaSendDoorbell(0x02, 1); //test
         */
-	return shm_queue_send_msg_base(shm_dev, send_args, 0); /* From kern */
+	return shm_queue_send_msg_base(shm_dev, send_args);
 }
 EXPORT_SYMBOL(shm_queue_kern_send_msg);
 
 int shm_queue_send_msg(shared_mem_dev *shm_dev, SharedMemQueueSendMsg *send_args)
-{
-	return shm_queue_send_msg_base(shm_dev, send_args, 1); /* From User */
-}
-
-int shm_queue_send_msg_base(shared_mem_dev *shm_dev, SharedMemQueueSendMsg *send_args, int from_user)
 {
 	int retVal;
-	volatile SHMQueueSlotHeader *slotHeader = NULL;
-	DEFINE_WAIT(wait);
+	SharedMemQueueSendMsg kern_args;
+	shm_queue_pair_os_info *queue_pair_os_info;
 
-	shm_queue_os_info *queue_os_info = &(shm_dev->queue_os_info);
-	shm_queue_pair_os_info *queue_pair_os_info = NULL;
+	send_args->status = SHMQSTATUS_GENERIC_ERROR;
 
-	if(!queue_os_info || !send_args)
+	queue_pair_os_info = shm_queue_get_pair(&(shm_dev->queue_os_info), send_args->handle, __func__);
+	if(!queue_pair_os_info)
 	{
 		return -EINVAL;
 	}
 
-	send_args->status = SHMQSTATUS_GENERIC_ERROR;
-
-	if(!queue_os_info->cores_synced_for_queues)
+	if(send_args->msgSize > queue_pair_os_info->shmQPairPtr->qLxToVx.sizeSlots)
 	{
-		printk("SHARED_MEM: shm_queue_send_msg: Cannot send message before we are done syncing between cores\n");
+		printk("SHARED_MEM: shm_queue_send_msg: %d queue: msg too large: %d. max allowed msg size: %d\n", 
+				(int) send_args->handle, (int) send_args->msgSize, (int) queue_pair_os_info->shmQPairPtr->qLxToVx.sizeSlots);
 		return -EINVAL;
 	}
 
-	if( (send_args->handle <= SHARED_MEM_QUEUE_INVALID_HANDLE) ||
-		(send_args->handle >= SHM_MAX_QUEUE_PAIRS) )
-	{
-		printk("SHARED_MEM: shm_queue_send_msg: %d queue handle is invalid\n", (int) send_args->handle);
-		return -EINVAL;
-	}
-
-	if(!queue_os_info->q_pair_os_info[send_args->handle].shmQPairPtr)
+	kern_args = *send_args;
+	kern_args.msg = kmalloc(send_args->msgSize + 1, GFP_KERNEL);
+	if(!kern_args.msg)
 	{
-		/* This queue hasn't been attached to yet */
-		printk("SHARED_MEM: shm_queue_send_msg: %d queue handle has not been attached to yet. Please attach first\n", (int) send_args->handle);
-		return -EINVAL;
+		return -ENOMEM;
 	}
-	
-	queue_pair_os_info = &(queue_os_info->q_pair_os_info[send_args->handle]);
 
-	if(send_args->msgSize > queue_pair_os_info->shmQPairPtr->qLxToVx.sizeSlots)
-	{
-		printk("SHARED_MEM: shm_queue_send_msg: %d queue: msg too large: %d. max allowed msg size: %d\n", 
-				(int) send_args->handle, (int) send_args->msgSize, (int) queue_pair_os_info->shmQPairPtr->qLxToVx.sizeSlots);
-		return -EINVAL;
+	if(copy_from_user((void *) kern_args.msg, (const void __user *) send_args->msg, send_args->msgSize))
+	{
+		retVal = -EFAULT;
+		goto shm_queue_send_msg_out;
 	}
 
-	/* Take the queue specific mutex */
+	/* User space senders still queue up behind each other */
 	if(down_interruptible(&queue_pair_os_info->q_lx_to_vx_mutex))
 	{
 		printk("SHARED_MEM: shm_queue_send_msg: Waiting for  %d queue pair mutex failed. Most likely signal interruption.\n", (int) send_args->handle);
-		return -EINTR;
+		retVal = -EINTR;
+		goto shm_queue_send_msg_out;
 	}
-	
-	/* Check if the next slot to insert is owned by us */
-	slotHeader = (SHMQueueSlotHeader *) (queue_pair_os_info->slot_buf_ptr_lx_to_vx + 
-										( queue_pair_os_info->shmQPairPtr->qLxToVx.nextSlotToInsert * 
-										  (queue_pair_os_info->shmQPairPtr->qLxToVx.sizeSlots + sizeof(SHMQueueSlotHeader))));
-	if(SHM_QUEUE_GET_SLOT_HEADER_MAGIC(slotHeader) != SHM_QUEUE_SLOT_MAGIC)
-	{
-		printk("SHARED_MEM: shm_queue_send_msg: Magic at slot %d in queue %s invalid. SlotPtr: 0x%lx Got Value 0x%lx expected: 0x%lx\n", 
-				(int) queue_pair_os_info->shmQPairPtr->qLxToVx.nextSlotToInsert, queue_pair_os_info->shmQPairPtr->queuePairName, (unsigned long int) slotHeader,
-				(unsigned long int) SHM_QUEUE_GET_SLOT_HEADER_MAGIC(slotHeader), (unsigned long int) SHM_QUEUE_SLOT_MAGIC);
-		retVal = 0;
-		goto shm_queue_send_msg_error;
-	}
-
-	while(SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) != SHM_QUEUE_SLOT_OWNER_LINUX)
-	{
-#if 0
-		printk("SHARED_MEM: shm_queue_send_msg: Slot %d in queue %s not owned by us. Probably full. Next Out: %d\n", 
-				(int) queue_pair_os_info->shmQPairPtr->qLxToVx.nextSlotToInsert, queue_pair_os_info->shmQPairPtr->queuePairName, 
-				(int) queue_pair_os_info->shmQPairPtr->qLxToVx.nextSlotToProcess);
-#endif
-
-		if (send_args->flags & SHMQ_SEND_FLAG_NO_WAIT)
-		{
-			send_args->status = SHMQSTATUS_Q_FULL;
-			retVal = 0;
-			goto shm_queue_send_msg_error;
-		}
-
-		/* Currently we only support interrupt based wait */
-		prepare_to_wait(&queue_pair_os_info->send_lx_to_vx_wait_queue_head, &wait, TASK_INTERRUPTIBLE);
-		if(SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) != SHM_QUEUE_SLOT_OWNER_LINUX)
-		{
-			schedule_timeout(1);
-		}
-		finish_wait(&queue_pair_os_info->send_lx_to_vx_wait_queue_head, &wait);
-		if(signal_pending(current))
-		{
-			printk("SHARED_MEM: shm_queue_send_msg: Returning because Q is full and we got a signal while waiting for an entry in the queue for q index %d\n", (int) send_args->handle);
-			send_args->status = SHMQSTATUS_Q_FULL;
-			retVal = -EINTR;
-			goto shm_queue_send_msg_error;
-		}
-
-#if 0
-		/* sleep poll based full checking. No timeout implemented right now */
-		if(msleep_interruptible(100))
-		{
-			retVal = -EINTR;
-			printk("SHARED_MEM: shm_queue_send_msg: Waiting on poll sleep interrupted early. Most likely signal interruption.\n");
-			goto shm_queue_send_msg_error;
-		}
-#endif
-	}
-	
-	if (from_user)
-		copy_from_user((void *) (slotHeader + 1), (void __user *)send_args->msg, send_args->msgSize);
-	else
-		memcpy((void *)(slotHeader + 1), (void *)send_args->msg, send_args->msgSize);
-
-	SHM_QUEUE_SET_SLOT_HEADER(slotHeader, SHM_QUEUE_SLOT_MAGIC, SHM_QUEUE_SLOT_OWNER_VXWORKS, send_args->msgSize);
-	queue_pair_os_info->shmQPairPtr->qLxToVx.nextSlotToInsert = (queue_pair_os_info->shmQPairPtr->qLxToVx.nextSlotToInsert + 1) % queue_pair_os_info->shmQPairPtr->qLxToVx.numSlots;	
-
-	/* Now set the doorbell for the other Core */
-	//SHM_DOORBELL_SET(SHM_DOORBELL_VXWORKS_CPU_ID, queue_pair_os_info->shmQPairPtr->qLxToVx.doorbellBitShift);
-	shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, queue_pair_os_info->shmQPairPtr->qLxToVx.doorbellBitShift);
-
-	send_args->status = SHMQSTATUS_OK;
-	retVal = 0;
 
-shm_queue_send_msg_error:
+	retVal = shm_queue_send_msg_base(shm_dev, &kern_args);
 
 	up(&queue_pair_os_info->q_lx_to_vx_mutex);
 
-	return retVal;
-}
+	send_args->status = kern_args.status;
 
-int shm_queue_kern_recv_msg(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args)
-{
-	return shm_queue_recv_msg_base(shm_dev, recv_args, 0);
-}
-EXPORT_SYMBOL(shm_queue_kern_recv_msg);
+shm_queue_send_msg_out:
+	kfree(kern_args.msg);
 
-int shm_queue_recv_msg(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args)
-{
-	return shm_queue_recv_msg_base(shm_dev, recv_args, 1);
+	return retVal;
 }
 
-int shm_queue_recv_msg_base(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args, int from_user)
+int shm_queue_send_msg_base(shared_mem_dev *shm_dev, SharedMemQueueSendMsg *send_args)
 {
-	int retVal;
-	unsigned int size, prevSlot;
-	volatile SHMQueueSlotHeader *slotHeader = NULL, *prevSlotHeader;
-        int iteration_count=0;
+	int slot;
+	volatile SHMQueueSlotHeader *slotHeader = NULL;
 
 	shm_queue_os_info *queue_os_info = &(shm_dev->queue_os_info);
 	shm_queue_pair_os_info *queue_pair_os_info = NULL;
-	DEFINE_WAIT(wait);
+	SHMQueueInfo *qInfo;
 
-	if(!queue_os_info || !recv_args)
+	if(!queue_os_info || !send_args)
 	{
 		return -EINVAL;
 	}
 
-	recv_args->status = SHMQSTATUS_GENERIC_ERROR;
-	recv_args->msgRecvSize = 0x0;
+	send_args->status = SHMQSTATUS_GENERIC_ERROR;
 
-	if(!queue_os_info->cores_synced_for_queues)
+	queue_pair_os_info = shm_queue_get_pair(queue_os_info, send_args->handle, "shm_queue_send_msg");
+	if(!queue_pair_os_info)
 	{
-		printk("SHARED_MEM: shm_queue_recv_msg: Cannot send message before we are done syncing between cores\n");
 		return -EINVAL;
 	}
+	qInfo = &queue_pair_os_info->shmQPairPtr->qLxToVx;
 
-	if( (recv_args->handle <= SHARED_MEM_QUEUE_INVALID_HANDLE) ||
-		(recv_args->handle >= SHM_MAX_QUEUE_PAIRS) )
-	{
-		printk("SHARED_MEM: shm_queue_recv_msg: %d queue handle is invalid\n", (int) recv_args->handle);
-		return -EINVAL;
-	}
-
-	if(!queue_os_info->q_pair_os_info[recv_args->handle].shmQPairPtr)
+	if(send_args->msgSize > qInfo->sizeSlots)
 	{
-		/* This queue hasn't been attached to yet */
-		printk("SHARED_MEM: shm_queue_recv_msg: %d queue handle has not been attached to yet. Please attach first\n", (int) recv_args->handle);
+		printk("SHARED_MEM: shm_queue_send_msg: %d queue: msg too large: %d. max allowed msg size: %d\n", 
+				(int) send_args->handle, (int) send_args->msgSize, (int) qInfo->sizeSlots);
 		return -EINVAL;
 	}
-	
-	queue_pair_os_info = &(queue_os_info->q_pair_os_info[recv_args->handle]);
 
-	/* Take the queue specific mutex */
-	if(down_interruptible(&queue_pair_os_info->q_vx_to_lx_mutex))
+	slot = shm_queue_claim_slot(&queue_pair_os_info->lx_to_vx_ring, qInfo, queue_pair_os_info->slot_buf_ptr_lx_to_vx,
+				    send_args->flags & SHMQ_SEND_FLAG_NO_WAIT,
+				    &queue_pair_os_info->send_lx_to_vx_wait_queue_head,
+				    queue_pair_os_info->spin_usecs, &queue_pair_os_info->send_wait_stats, 1, &slotHeader);
+	if(slot == -EAGAIN)
 	{
-		printk("SHARED_MEM: shm_queue_recv_msg: Waiting for %d queue pair mutex failed. Most likely signal interruption.\n", (int) recv_args->handle);
+		send_args->status = SHMQSTATUS_Q_FULL;
+		return 0;
+	}
+	if(slot == -EIO)
+	{
+		printk("SHARED_MEM: shm_queue_send_msg: Not sending on queue %s\n", queue_pair_os_info->shmQPairPtr->queuePairName);
+		return 0;
+	}
+	if(slot < 0)
+	{
+		printk("SHARED_MEM: shm_queue_send_msg: Returning because Q is full and we got a signal while waiting for an entry in the queue for q index %d\n", (int) send_args->handle);
+		send_args->status = SHMQSTATUS_Q_FULL;
 		return -EINTR;
 	}
 
-	slotHeader = (SHMQueueSlotHeader *) (queue_pair_os_info->slot_buf_ptr_vx_to_lx + 
-										( queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess * 
-										  (queue_pair_os_info->shmQPairPtr->qVxToLx.sizeSlots + sizeof(SHMQueueSlotHeader))));
-
-        start_time[recv_args->handle] = jiffies;
-	while(SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) != SHM_QUEUE_SLOT_OWNER_LINUX)
-	{
-#if 0
-		printk("SHARED_MEM: shm_queue_recv_msg: Slot %d in queue %s not owned by us. Probably empty. Next In: %d\n", 
-				(int) queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess, queue_pair_os_info->shmQPairPtr->queuePairName, 
-				(int) queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToInsert);
-#endif
-
-		if (recv_args->flags & SHMQ_RECV_FLAG_NO_WAIT)
-		{
-			//printk("SHARED_MEM: shm_queue_recv_msg: Returning because Q is empty and no wait flag is set in request\n");
-			recv_args->status = SHMQSTATUS_Q_EMPTY;
-			retVal = 0;
-			goto shm_queue_recv_msg_error;
-		}
-
-		/* Currently we only support interrupt based wait */
-{
-                iteration_count=0;
-		prepare_to_wait(&queue_pair_os_info->recv_vx_to_lx_wait_queue_head, &wait, TASK_INTERRUPTIBLE);
-		if(SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) != SHM_QUEUE_SLOT_OWNER_LINUX)
-		{
-			schedule_timeout(1);
-		}
-		finish_wait(&queue_pair_os_info->recv_vx_to_lx_wait_queue_head, &wait);
-		if(signal_pending(current))
-		{
-			printk("SHARED_MEM: shm_queue_recv_msg: Returning because Q is empty we got a signal while waiting for an entry in the queue for q index %d\n", (int) recv_args->handle);
-			recv_args->status = SHMQSTATUS_Q_EMPTY;
-			retVal = -EINTR;
-			goto shm_queue_recv_msg_error;
-		}
-}
-//#endif
-	}
-        stop_time[recv_args->handle] = jiffies;
-/*
-        if (start_time[recv_args->handle] != stop_time[recv_args->handle]) 
-        {
-		printk("SHARED_MEM: recv_msg q %d wait time %d ticks= %x\n", recv_args->handle, 
-                                                                             stop_time[recv_args->handle] - start_time[recv_args->handle],
-                                                                             stop_time[recv_args->handle]);
+	memcpy((void *)(slotHeader + 1), (void *)send_args->msg, send_args->msgSize);
 
-        }
-*/
-	size = SHM_QUEUE_GET_SLOT_HEADER_MSG_SIZE(slotHeader);
-
-	if(size > recv_args->bufSize)
-	{
-		recv_args->msgRecvSize = recv_args->bufSize;
-	}
-	else
-	{
-		recv_args->msgRecvSize = size;
-	}
-
-	if (from_user)
-		copy_to_user((void __user *) recv_args->buf, (void *) (slotHeader + 1), recv_args->msgRecvSize);
-	else
-		memcpy((void *)recv_args->buf, (void *) (slotHeader + 1), recv_args->msgRecvSize);
+	shm_queue_release_slot(&queue_pair_os_info->lx_to_vx_ring, slotHeader, slot, send_args->msgSize);
 
-	SHM_QUEUE_SET_SLOT_HEADER(slotHeader, SHM_QUEUE_SLOT_MAGIC, SHM_QUEUE_SLOT_OWNER_VXWORKS, 0x0);
+	/* Now set the doorbell for the other Core */
+	//SHM_DOORBELL_SET(SHM_DOORBELL_VXWORKS_CPU_ID, queue_pair_os_info->shmQPairPtr->qLxToVx.doorbellBitShift);
+	shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, qInfo->doorbellBitShift);
 
-	prevSlot = (queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess > 0) ?
-                   queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess - 1 :
-                   queue_pair_os_info->shmQPairPtr->qVxToLx.numSlots - 1;
+	send_args->status = SHMQSTATUS_OK;
 
+	return 0;
+}
 
-	queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess = (queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess + 1) % queue_pair_os_info->shmQPairPtr->qVxToLx.numSlots;
+int shm_queue_kern_recv_msg(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args)
+{
+	return shm_queue_recv_msg_base(shm_dev, recv_args);
+}
+EXPORT_SYMBOL(shm_queue_kern_recv_msg);
 
-	/* Ping the other Core in case it is waiting and the queue is full */
-	//SHM_DOORBELL_SET(SHM_DOORBELL_VXWORKS_CPU_ID, queue_pair_os_info->shmQPairPtr->qVxToLx.doorbellBitShift);
-	//shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, queue_pair_os_info->shmQPairPtr->qVxToLx.doorbellBitShift);
+int shm_queue_recv_msg(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args)
+{
+	int retVal;
+	SharedMemQueueRecvMsg kern_args;
+	shm_queue_pair_os_info *queue_pair_os_info;
 
-        //nextSlot = queue_pair_os_info->shmQPairPtr->qVxToLx.nextSlotToProcess;
+	recv_args->status = SHMQSTATUS_GENERIC_ERROR;
+	recv_args->msgRecvSize = 0x0;
 
-        prevSlotHeader = (SHMQueueSlotHeader *) (queue_pair_os_info->slot_buf_ptr_vx_to_lx +
-        (prevSlot*(queue_pair_os_info->shmQPairPtr->qVxToLx.sizeSlots + sizeof(SHMQueueSlotHeader))));
+	queue_pair_os_info = shm_queue_get_pair(&(shm_dev->queue_os_info), recv_args->handle, __func__);
+	if(!queue_pair_os_info)
+	{
+		return -EINVAL;
+	}
 
-        if (SHM_QUEUE_GET_SLOT_HEADER_OWNER(prevSlotHeader) == SHM_QUEUE_SLOT_OWNER_LINUX)
-        {
-           shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID,
-                                 queue_pair_os_info->shmQPairPtr->qVxToLx.doorbellBitShift);
-        }
+	kern_args = *recv_args;
+	if(kern_args.bufSize > queue_pair_os_info->shmQPairPtr->qVxToLx.sizeSlots)
+	{
+		kern_args.bufSize = queue_pair_os_info->shmQPairPtr->qVxToLx.sizeSlots;
+	}
+	kern_args.buf = kmalloc(kern_args.bufSize + 1, GFP_KERNEL);
+	if(!kern_args.buf)
+	{
+		return -ENOMEM;
+	}
+
+	/* User space receivers still queue up behind each other */
+	if(down_interruptible(&queue_pair_os_info->q_vx_to_lx_mutex))
+	{
+		printk("SHARED_MEM: shm_queue_recv_msg: Waiting for %d queue pair mutex failed. Most likely signal interruption.\n", (int) recv_args->handle);
+		retVal = -EINTR;
+		goto shm_queue_recv_msg_out;
+	}
+
+	retVal = shm_queue_recv_msg_base(shm_dev, &kern_args);
+
+	up(&queue_pair_os_info->q_vx_to_lx_mutex);
+
+	recv_args->status = kern_args.status;
+	recv_args->msgRecvSize = kern_args.msgRecvSize;
+	if(kern_args.msgRecvSize &&
+	   copy_to_user((void __user *) recv_args->buf, (void *) kern_args.buf, kern_args.msgRecvSize))
+	{
+		retVal = -EFAULT;
+	}
+
+shm_queue_recv_msg_out:
+	kfree(kern_args.buf);
+
+	return retVal;
+}
+
+int shm_queue_recv_msg_base(shared_mem_dev *shm_dev, SharedMemQueueRecvMsg *recv_args)
+{
+	int slot;
+	unsigned int size, prevSlot;
+	volatile SHMQueueSlotHeader *slotHeader = NULL, *prevSlotHeader;
+
+	shm_queue_os_info *queue_os_info = &(shm_dev->queue_os_info);
+	shm_queue_pair_os_info *queue_pair_os_info = NULL;
+	SHMQueueInfo *qInfo;
+
+	if(!queue_os_info || !recv_args)
+	{
+		return -EINVAL;
+	}
+
+	recv_args->status = SHMQSTATUS_GENERIC_ERROR;
+	recv_args->msgRecvSize = 0x0;
+
+	queue_pair_os_info = shm_queue_get_pair(queue_os_info, recv_args->handle, "shm_queue_recv_msg");
+	if(!queue_pair_os_info)
+	{
+		return -EINVAL;
+	}
+	qInfo = &queue_pair_os_info->shmQPairPtr->qVxToLx;
+
+	slot = shm_queue_claim_slot(&queue_pair_os_info->vx_to_lx_ring, qInfo, queue_pair_os_info->slot_buf_ptr_vx_to_lx,
+				    recv_args->flags & SHMQ_RECV_FLAG_NO_WAIT,
+				    &queue_pair_os_info->recv_vx_to_lx_wait_queue_head,
+				    queue_pair_os_info->spin_usecs, &queue_pair_os_info->recv_wait_stats, 0, &slotHeader);
+	if(slot == -EAGAIN)
+	{
+		//printk("SHARED_MEM: shm_queue_recv_msg: Returning because Q is empty and no wait flag is set in request\n");
+		recv_args->status = SHMQSTATUS_Q_EMPTY;
+		return 0;
+	}
+	if(slot < 0)
+	{
+		printk("SHARED_MEM: shm_queue_recv_msg: Returning because Q is empty we got a signal while waiting for an entry in the queue for q index %d\n", (int) recv_args->handle);
+		recv_args->status = SHMQSTATUS_Q_EMPTY;
+		return -EINTR;
+	}
+
+	size = SHM_QUEUE_GET_SLOT_HEADER_MSG_SIZE(slotHeader);
+
+	if(size > recv_args->bufSize)
+	{
+		recv_args->msgRecvSize = recv_args->bufSize;
+	}
+	else
+	{
+		recv_args->msgRecvSize = size;
+	}
 
+	memcpy((void *)recv_args->buf, (void *) (slotHeader + 1), recv_args->msgRecvSize);
+
+	shm_queue_release_slot(&queue_pair_os_info->vx_to_lx_ring, slotHeader, slot, 0x0);
+
+	/* Ping the other Core in case it is waiting and the queue is full */
+	prevSlot = (slot > 0) ? slot - 1 : qInfo->numSlots - 1;
+	prevSlotHeader = SHM_QUEUE_SLOT_PTR(queue_pair_os_info->slot_buf_ptr_vx_to_lx, qInfo, prevSlot);
+
+	if (SHM_QUEUE_GET_SLOT_HEADER_OWNER(prevSlotHeader) == SHM_QUEUE_SLOT_OWNER_LINUX)
+	{
+		shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, qInfo->doorbellBitShift);
+	}
 
 	recv_args->status = SHMQSTATUS_OK;
-	retVal = 0;
 
-shm_queue_recv_msg_error:
+	return 0;
+}
 
-	up(&queue_pair_os_info->q_vx_to_lx_mutex);
+/*
+ * Fill LxToVx slots from batch_args->entries and ring the other core's
+ * doorbell once for the lot. If we have to wait for a free slot part way
+ * through, the slots filled so far are announced first so the other core can
+ * drain them. Other senders may interleave with a batch.
+ *
+ * On return numDone holds the number of messages queued. status is OK only if
+ * all of them went, Q_FULL if NO_WAIT was set and we ran out of slots.
+ */
+int shm_queue_send_batch_base(shared_mem_dev *shm_dev, SharedMemQueueBatch *batch_args)
+{
+	int retVal = 0, slot;
+	unsigned int i, pending = 0;
+	volatile SHMQueueSlotHeader *slotHeader;
+	shm_queue_os_info *queue_os_info = &(shm_dev->queue_os_info);
+	shm_queue_pair_os_info *queue_pair_os_info;
+	SHMQueueInfo *qInfo;
+
+	if(!batch_args || !batch_args->entries)
+	{
+		return -EINVAL;
+	}
+
+	batch_args->status = SHMQSTATUS_GENERIC_ERROR;
+	batch_args->numDone = 0;
+
+	queue_pair_os_info = shm_queue_get_pair(queue_os_info, batch_args->handle, __func__);
+	if(!queue_pair_os_info)
+	{
+		return -EINVAL;
+	}
+	qInfo = &queue_pair_os_info->shmQPairPtr->qLxToVx;
+
+	for(i = 0; i < batch_args->numEntries; i++)
+	{
+		if(batch_args->entries[i].msgSize > qInfo->sizeSlots)
+		{
+			printk("SHARED_MEM: %s: %d queue: msg %d too large: %d. max allowed msg size: %d\n", __func__,
+				(int) batch_args->handle, i, (int) batch_args->entries[i].msgSize, (int) qInfo->sizeSlots);
+			return -EINVAL;
+		}
+	}
+
+	for(i = 0; i < batch_args->numEntries; i++)
+	{
+		SharedMemQueueBatchEntry *entry = &batch_args->entries[i];
+
+		/* Try without waiting first so we can announce what we have before we sleep */
+		slot = shm_queue_claim_slot(&queue_pair_os_info->lx_to_vx_ring, qInfo, queue_pair_os_info->slot_buf_ptr_lx_to_vx,
+					    1, NULL, 0, NULL, 1, &slotHeader);
+		if((slot == -EAGAIN) && !(batch_args->flags & SHMQ_SEND_FLAG_NO_WAIT))
+		{
+			if(pending)
+			{
+				shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, qInfo->doorbellBitShift);
+				pending = 0;
+			}
+
+			slot = shm_queue_claim_slot(&queue_pair_os_info->lx_to_vx_ring, qInfo, queue_pair_os_info->slot_buf_ptr_lx_to_vx,
+						    0, &queue_pair_os_info->send_lx_to_vx_wait_queue_head,
+						    queue_pair_os_info->spin_usecs, &queue_pair_os_info->send_wait_stats, 1, &slotHeader);
+		}
+		if(slot == -EAGAIN)
+		{
+			batch_args->status = SHMQSTATUS_Q_FULL;
+			break;
+		}
+		if(slot == -EIO)
+		{
+			/* status stays SHMQSTATUS_GENERIC_ERROR, numDone says how far we got */
+			break;
+		}
+		if(slot < 0)
+		{
+			printk("SHARED_MEM: %s: Returning because Q is full and we got a signal while waiting for an entry in the queue for q index %d\n", __func__, (int) batch_args->handle);
+			batch_args->status = SHMQSTATUS_Q_FULL;
+			retVal = -EINTR;
+			break;
+		}
+
+		memcpy((void *) (slotHeader + 1), (void *) entry->msg, entry->msgSize);
+
+		shm_queue_release_slot(&queue_pair_os_info->lx_to_vx_ring, slotHeader, slot, entry->msgSize);
+		batch_args->numDone++;
+		pending++;
+	}
+
+	/* One doorbell for everything we queued */
+	if(pending)
+	{
+		shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, qInfo->doorbellBitShift);
+	}
+
+	if(batch_args->numDone == batch_args->numEntries)
+	{
+		batch_args->status = SHMQSTATUS_OK;
+	}
+
+	return retVal;
+}
+
+/*
+ * Drain up to numEntries VxToLx slots into batch_args->entries. Only the first
+ * message is waited for (as per flags), the rest are whatever is already
+ * queued. If the other core filled the queue up while we were draining it gets
+ * a single doorbell at the end.
+ */
+int shm_queue_recv_batch_base(shared_mem_dev *shm_dev, SharedMemQueueBatch *batch_args)
+{
+	int retVal = 0, ring = 0, slot, no_wait;
+	unsigned int size, prevSlot;
+	volatile SHMQueueSlotHeader *slotHeader, *prevSlotHeader;
+	shm_queue_os_info *queue_os_info = &(shm_dev->queue_os_info);
+	shm_queue_pair_os_info *queue_pair_os_info;
+	SHMQueueInfo *qInfo;
+
+	if(!batch_args || !batch_args->entries || !batch_args->numEntries)
+	{
+		return -EINVAL;
+	}
+
+	batch_args->status = SHMQSTATUS_GENERIC_ERROR;
+	batch_args->numDone = 0;
+
+	queue_pair_os_info = shm_queue_get_pair(queue_os_info, batch_args->handle, __func__);
+	if(!queue_pair_os_info)
+	{
+		return -EINVAL;
+	}
+	qInfo = &queue_pair_os_info->shmQPairPtr->qVxToLx;
+
+	while(batch_args->numDone < batch_args->numEntries)
+	{
+		SharedMemQueueBatchEntry *entry = &batch_args->entries[batch_args->numDone];
+
+		no_wait = batch_args->numDone || (batch_args->flags & SHMQ_RECV_FLAG_NO_WAIT);
+		slot = shm_queue_claim_slot(&queue_pair_os_info->vx_to_lx_ring, qInfo, queue_pair_os_info->slot_buf_ptr_vx_to_lx,
+					    no_wait, &queue_pair_os_info->recv_vx_to_lx_wait_queue_head,
+					    queue_pair_os_info->spin_usecs, &queue_pair_os_info->recv_wait_stats, 0, &slotHeader);
+		if(slot == -EAGAIN)
+		{
+			if(!batch_args->numDone)
+			{
+				batch_args->status = SHMQSTATUS_Q_EMPTY;
+				goto shm_queue_recv_batch_error;
+			}
+			break;
+		}
+		if(slot < 0)
+		{
+			printk("SHARED_MEM: %s: Returning because Q is empty we got a signal while waiting for an entry in the queue for q index %d\n", __func__, (int) batch_args->handle);
+			batch_args->status = SHMQSTATUS_Q_EMPTY;
+			retVal = -EINTR;
+			goto shm_queue_recv_batch_error;
+		}
+
+		size = SHM_QUEUE_GET_SLOT_HEADER_MSG_SIZE(slotHeader);
+		entry->msgRecvSize = (size > entry->msgSize) ? entry->msgSize : size;
+
+		memcpy((void *) entry->msg, (void *) (slotHeader + 1), entry->msgRecvSize);
+
+		shm_queue_release_slot(&queue_pair_os_info->vx_to_lx_ring, slotHeader, slot, 0x0);
+		batch_args->numDone++;
+
+		/* Same full queue check as shm_queue_recv_msg_base(), but only one doorbell */
+		prevSlot = (slot > 0) ? slot - 1 : qInfo->numSlots - 1;
+		prevSlotHeader = SHM_QUEUE_SLOT_PTR(queue_pair_os_info->slot_buf_ptr_vx_to_lx, qInfo, prevSlot);
+		if (SHM_QUEUE_GET_SLOT_HEADER_OWNER(prevSlotHeader) == SHM_QUEUE_SLOT_OWNER_LINUX)
+		{
+			ring = 1;
+		}
+	}
+
+	batch_args->status = SHMQSTATUS_OK;
+
+shm_queue_recv_batch_error:
+
+	if(ring)
+	{
+		shm_ipc_send_doorbell(SHM_DOORBELL_VXWORKS_CPU_ID, qInfo->doorbellBitShift);
+	}
 
 	return retVal;
 }
 
+int shm_queue_kern_send_batch(shared_mem_dev *shm_dev, SharedMemQueueBatch *batch_args)
+{
+	return shm_queue_send_batch_base(shm_dev, batch_args);
+}
+EXPORT_SYMBOL(shm_queue_kern_send_batch);
+
+int shm_queue_kern_recv_batch(shared_mem_dev *shm_dev, SharedMemQueueBatch *batch_args)
+{
+	return shm_queue_recv_batch_base(shm_dev, batch_args);
+}
+EXPORT_SYMBOL(shm_queue_kern_recv_batch);
+
+/*
+ * ioctl side of the batch calls. The entries and the messages are bounced
+ * through one kernel buffer, each message gets at most a slot's worth.
+ */
+static long shm_queue_user_batch(shared_mem_dev *shm_dev, unsigned long arg, int send)
+{
+	SharedMemQueueBatch batch_args;
+	SharedMemQueueBatchEntry *entries, *user_entries;
+	unsigned char **user_msgs, *bounce;
+	shm_queue_pair_os_info *queue_pair_os_info;
+	struct semaphore *sem;
+	unsigned int i, sizeSlots;
+	long retval = 0;
+
+	if(copy_from_user((void *) &batch_args, (const void __user *) arg, sizeof(batch_args)))
+	{
+		return -EINVAL;
+	}
+
+	if(!batch_args.numEntries || (batch_args.numEntries > SHM_QUEUE_MAX_BATCH))
+	{
+		return -EINVAL;
+	}
+
+	queue_pair_os_info = shm_queue_get_pair(&(shm_dev->queue_os_info), batch_args.handle, __func__);
+	if(!queue_pair_os_info)
+	{
+		return -EINVAL;
+	}
+
+	if(send)
+	{
+		sizeSlots = queue_pair_os_info->shmQPairPtr->qLxToVx.sizeSlots;
+		sem = &queue_pair_os_info->q_lx_to_vx_mutex;
+	}
+	else
+	{
+		sizeSlots = queue_pair_os_info->shmQPairPtr->qVxToLx.sizeSlots;
+		sem = &queue_pair_os_info->q_vx_to_lx_mutex;
+	}
+
+	entries = kmalloc(batch_args.numEntries * (sizeof(*entries) + sizeof(*user_msgs) + sizeSlots), GFP_KERNEL);
+	if(!entries)
+	{
+		return -ENOMEM;
+	}
+	user_msgs = (unsigned char **) (entries + batch_args.numEntries);
+	bounce = (unsigned char *) (user_msgs + batch_args.numEntries);
+
+	user_entries = batch_args.entries;
+	if(copy_from_user((void *) entries, (const void __user *) user_entries, batch_args.numEntries * sizeof(*entries)))
+	{
+		retval = -EINVAL;
+		goto shm_queue_user_batch_out;
+	}
+
+	for(i = 0; i < batch_args.numEntries; i++)
+	{
+		user_msgs[i] = entries[i].msg;
+		entries[i].msg = bounce + (i * sizeSlots);
+
+		if(send)
+		{
+			if(entries[i].msgSize > sizeSlots)
+			{
+				retval = -EINVAL;
+				goto shm_queue_user_batch_out;
+			}
+			if(copy_from_user((void *) entries[i].msg, (const void __user *) user_msgs[i], entries[i].msgSize))
+			{
+				retval = -EFAULT;
+				goto shm_queue_user_batch_out;
+			}
+		}
+		else if(entries[i].msgSize > sizeSlots)
+		{
+			entries[i].msgSize = sizeSlots;
+		}
+	}
+
+	if(down_interruptible(sem))
+	{
+		retval = -EINTR;
+		goto shm_queue_user_batch_out;
+	}
+
+	batch_args.entries = entries;
+	if(send)
+	{
+		retval = shm_queue_send_batch_base(shm_dev, &batch_args);
+	}
+	else
+	{
+		retval = shm_queue_recv_batch_base(shm_dev, &batch_args);
+	}
+	batch_args.entries = user_entries;
+
+	up(sem);
+
+	if(!send)
+	{
+		for(i = 0; i < batch_args.numDone; i++)
+		{
+			if(copy_to_user((void __user *) user_msgs[i], (void *) entries[i].msg, entries[i].msgRecvSize) ||
+			   put_user(entries[i].msgRecvSize, &user_entries[i].msgRecvSize))
+			{
+				retval = -EFAULT;
+			}
+		}
+	}
+
+	if(copy_to_user((void __user *) arg, (void *) &batch_args, sizeof(batch_args)))
+	{
+		retval = -EINVAL;
+	}
+
+shm_queue_user_batch_out:
+	kfree(entries);
+
+	return retval;
+}
+
 /*______________________________________________________________________________________________*/
 /*______________________________________________________________________________________________*/
 /*______________________________________________________________________________________________*/
@@ -789,6 +1498,60 @@ void wait_for_init_shared_mem(void *dev)
 
 EXPORT_SYMBOL(wait_for_init_shared_mem);
 
+/*
+ * Map a region cacheable with sections, rounded out to 2MB. The CPU then
+ * keeps the data in its caches, so whoever copies through the mapping has
+ * to call shm_region_sync() around handing data to or taking it from the
+ * other core, the same as for the cached kmap alias it replaces.
+ */
+static unsigned int shm_region_map_direct(shared_mem_region_os_info *region_info)
+{
+	unsigned long base, end;
+	void *virt;
+	int i;
+
+	if(g_shm_peer || !shm_section_map)
+	{
+		return 0;
+	}
+
+	for(i = 0; i < MAX_DIRECT_REGION_NAME; i++)
+	{
+		if(!memcmp(direct_region_name[i], region_info->tag, 4))
+			break;
+	}
+	if(i == MAX_DIRECT_REGION_NAME)
+	{
+		return 0;
+	}
+
+	base = region_info->physAddr & PMD_MASK;
+	end = ALIGN(region_info->physAddr + region_info->regionSize, PMD_SIZE);
+
+	for(i = 0; i < SHARED_MEM_MAX_PARTITIONS && shm_direct_map[i].virt; i++)
+	{
+		if(shm_direct_map[i].phys == base && shm_direct_map[i].size == end - base)
+			return (unsigned int) shm_direct_map[i].virt + (region_info->physAddr - base);
+	}
+	if(i == SHARED_MEM_MAX_PARTITIONS)
+	{
+		return 0;
+	}
+
+	virt = (void *) __arm_ioremap_sections(base, end - base, MT_MEMORY);
+	if(!virt)
+	{
+		printk("SHARED_MEM: unable to section map region %.4s, using the uncached mapping\n", region_info->tag);
+		return 0;
+	}
+
+	shm_direct_map[i].phys = base;
+	shm_direct_map[i].size = end - base;
+	shm_direct_map[i].virt = virt;
+
+	return (unsigned int) virt + (region_info->physAddr - base);
+}
+
 void parse_shared_mem_header(shared_mem_dev *shm_dev, shared_mem_os_info *info)
 {
   int i;
@@ -819,10 +1582,15 @@ void parse_shared_mem_header(shared_mem_dev *shm_dev, shared_mem_os_info *info)
 	   */
           if (shm_region_name_match(region_info->tag) == 0)
 	  {	
-	     region_info->virtKernelAddr = ioremap_nocache(region_info->physAddr, partitionInfo->size);
+	     if (g_shm_peer)
+	        region_info->virtKernelAddr = (unsigned int) g_shm_peer->map_region(partitionInfo);
+	     else
+	        region_info->virtKernelAddr = ioremap_nocache(region_info->physAddr, partitionInfo->size);
 	  }	
           region_info->virtUserAddr = 0x0;
 	  region_info->regionSize = partitionInfo->size;
+          if (shm_region_name_match(region_info->tag) == 0)
+	     region_info->directKernelAddr = shm_region_map_direct(region_info);
 	  region_info->reserved = 0x0;
 	  region_info->num_mmaps = 0x0;
           if (shm_region_name_match(region_info->tag) == 0)
@@ -981,21 +1749,172 @@ int find_region_kern_addr_from_tag(void *dev, char *tag, void **phys, void **vir
 }
 EXPORT_SYMBOL(find_region_kern_addr_from_tag);
 
-int find_region_from_tag(shared_mem_os_info *os_info, SharedMemGetRegionOffset *offset)
+static shared_mem_region_os_info *shm_region_from_direct_addr(void *kaddr)
 {
+	shared_mem_os_info *os_info;
+	unsigned int addr = (unsigned int) kaddr;
 	int i;
 
-	if(!os_info || !offset)
+	if (!g_shm_dev || !(os_info = g_shm_dev->os_info))
 	{
-		return -EINVAL;
+		return NULL;
 	}
 
-	for(i = 0; i < os_info->num_regions; i++)
+	for (i = 0; i < os_info->num_regions; i++)
 	{
-		if(!memcmp(offset->tag, os_info->region_info[i].tag, 4))
+		shared_mem_region_os_info *region = &os_info->region_info[i];
+
+		if (region->directKernelAddr && addr >= region->directKernelAddr &&
+		    addr < region->directKernelAddr + region->regionSize)
 		{
-			offset->offset = os_info->region_info[i].offset;
-			offset->virtAddr = os_info->region_info[i].virtKernelAddr;
+			return region;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The cacheable section mapping of a region, for bulk copies. Anything the
+ * other core updates in place (allocator state, flags) has to keep going
+ * through the uncached find_region_kern_addr_from_tag() address.
+ */
+int find_region_kern_direct_addr_from_tag(void *dev, char *tag, void **virt)
+{
+	int i;
+	shared_mem_dev *shm_dev = (shared_mem_dev *)dev;
+
+	if (!shm_dev || !shm_dev->os_info || !virt)
+	{
+		return -EINVAL;
+	}
+
+	for (i = 0; i < shm_dev->os_info->num_regions; i++)
+	{
+		if (!memcmp(shm_dev->os_info->region_info[i].tag, tag, 4))
+		{
+			if (!shm_dev->os_info->region_info[i].directKernelAddr)
+				return -ENODEV;
+			*virt = (void *)shm_dev->os_info->region_info[i].directKernelAddr;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+EXPORT_SYMBOL(find_region_kern_direct_addr_from_tag);
+
+/*
+ * Make a CPU copy through a find_region_kern_direct_addr_from_tag() address visible
+ * to the other core (DMA_TO_DEVICE), or drop stale lines before reading what
+ * it wrote (DMA_FROM_DEVICE). Nothing to do for uncached regions.
+ */
+void shm_region_sync(void *kaddr, size_t len, int dir)
+{
+	shared_mem_region_os_info *region = shm_region_from_direct_addr(kaddr);
+	unsigned long pa;
+
+	if (!region)
+	{
+		return;
+	}
+
+	pa = region->physAddr + ((unsigned int) kaddr - region->directKernelAddr);
+	shm_cache_range(kaddr, pa, len, dir == DMA_TO_DEVICE ? SHM_CACHE_CLEAN : SHM_CACHE_INVALIDATE);
+}
+EXPORT_SYMBOL(shm_region_sync);
+
+/*
+ * Put a software peer in place of the VxWorks core. This has to happen
+ * before anybody starts syncing with the other core, somebody holding the
+ * init mutex is already waiting on the real one.
+ */
+int shm_peer_register(shm_peer_ops *ops)
+{
+	int ret = 0;
+
+	if(!g_shm_dev || !ops || !ops->header || !ops->map_region || !ops->doorbell)
+	{
+		return -EINVAL;
+	}
+
+	if(!mutex_trylock(&init_shared_mem_mutex))
+	{
+		return -EBUSY;
+	}
+	if(g_shm_peer || shared_mem_init_done || g_shm_dev->queue_os_info.cores_synced_for_queues)
+	{
+		ret = -EBUSY;
+	}
+	else
+	{
+		shm_hw_header = g_shm_dev->sharedMemHeader;
+		g_shm_dev->sharedMemHeader = ops->header;
+		g_shm_peer = ops;
+		printk("SHARED_MEM: software peer registered, header at 0x%p\n", ops->header);
+	}
+	mutex_unlock(&init_shared_mem_mutex);
+
+	return ret;
+}
+EXPORT_SYMBOL(shm_peer_register);
+
+/*
+ * Only valid while nobody synced with the peer, after that its memory is in
+ * use for good and the peer has to stay.
+ */
+int shm_peer_unregister(shm_peer_ops *ops)
+{
+	int ret = 0;
+
+	if(!mutex_trylock(&init_shared_mem_mutex))
+	{
+		return -EBUSY;
+	}
+	if(g_shm_peer != ops)
+	{
+		ret = -EINVAL;
+	}
+	else if(shared_mem_init_done || g_shm_dev->queue_os_info.cores_synced_for_queues)
+	{
+		ret = -EBUSY;
+	}
+	else
+	{
+		g_shm_dev->sharedMemHeader = shm_hw_header;
+		g_shm_peer = NULL;
+	}
+	mutex_unlock(&init_shared_mem_mutex);
+
+	return ret;
+}
+EXPORT_SYMBOL(shm_peer_unregister);
+
+/* The peer rang one of our doorbells */
+void shm_peer_doorbell(unsigned int bitShift)
+{
+	if(g_shm_dev && bitShift < SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT)
+	{
+		shm_doorbell_signal(&(g_shm_dev->queue_os_info), bitShift);
+	}
+}
+EXPORT_SYMBOL(shm_peer_doorbell);
+
+int find_region_from_tag(shared_mem_os_info *os_info, SharedMemGetRegionOffset *offset)
+{
+	int i;
+
+	if(!os_info || !offset)
+	{
+		return -EINVAL;
+	}
+
+	for(i = 0; i < os_info->num_regions; i++)
+	{
+		if(!memcmp(offset->tag, os_info->region_info[i].tag, 4))
+		{
+			offset->offset = os_info->region_info[i].offset;
+			offset->virtAddr = os_info->region_info[i].virtKernelAddr;
 			return 0;
 		}
 	}
@@ -1042,31 +1961,6 @@ int find_region_from_offset(shared_mem_os_info *os_info, unsigned int offset, un
 	return -EINVAL;  
 }
 
-int find_region_from_user_addr(shared_mem_os_info *os_info, loff_t virtAddr, unsigned long *physAddr)
-{
-        int i;
-
-        if(!os_info)
-        {
-                return -EINVAL;
-        }
-
-        for(i = 0; i < os_info->num_regions; i++)
-        {
-                if (   (virtAddr >= os_info->region_info[i].virtUserAddr)
-                    && (virtAddr < (os_info->region_info[i].virtUserAddr + os_info->region_info[i].regionSize))) 
-                {
-                  *physAddr = os_info->region_info[i].physAddr + (virtAddr - os_info->region_info[i].virtUserAddr);
-                  return 0;
-                }
-        }
-
-//        printk("SHARED_MEM: find_region_from_offset: region not found for virt_addr 0x%lx\n", (unsigned long int) virtAddr);
-
-        return -EINVAL;
-}
-
-
 void printRegionInfo(shared_mem_os_info *os_info)
 {
 	int i,j;
@@ -1111,6 +2005,316 @@ void printRegionInfo(shared_mem_os_info *os_info)
 	}
 	printk("-----------------------------------------------------------------\n");
 }
+/*
+ * Cache maintenance for a physically contiguous range mapped cacheable at va.
+ * The inner cache is done by virtual address, the outer (L2) by physical.
+ */
+static int shm_cache_range(void *va, unsigned long pa, size_t len, unsigned int op)
+{
+	switch(op)
+	{
+	  case SHM_CACHE_CLEAN:
+		dmac_map_area(va, len, DMA_TO_DEVICE);
+		outer_clean_range(pa, pa + len);
+		break;
+
+	  case SHM_CACHE_INVALIDATE:
+		outer_inv_range(pa, pa + len);
+		dmac_unmap_area(va, len, DMA_FROM_DEVICE);
+		break;
+
+	  case SHM_CACHE_FLUSH:
+		dmac_flush_range(va, va + len);
+		outer_flush_range(pa, pa + len);
+		break;
+
+	  default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int shm_set_region_cache(shared_mem_os_info *os_info, SharedMemRegionCache *cache)
+{
+	int i, j;
+
+	if(cache->mode >= SHM_MAP_MODES)
+	{
+		return -EINVAL;
+	}
+
+	for(i = 0; i < os_info->num_regions; i++)
+	{
+		if(memcmp(os_info->region_info[i].tag, cache->tag, 4))
+		{
+			continue;
+		}
+
+		if(cache->mode != SHM_MAP_UNCACHED)
+		{
+			for(j = 0; j < MAX_CACHEABLE_REGION_NAME; j++)
+			{
+				if(!memcmp(cache->tag, cacheable_region_name[j], 4))
+				{
+					break;
+				}
+			}
+			if(j == MAX_CACHEABLE_REGION_NAME)
+			{
+				return -EPERM;
+			}
+		}
+
+		os_info->region_info[i].cacheMode = cache->mode;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * The range has to lie within one mmap of this device by the caller.
+ */
+static int shm_cache_sync(SharedMemCacheSync *sync)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	unsigned long addr = (unsigned long) sync->addr;
+	unsigned long pa;
+	int ret = -EINVAL;
+
+	if(!sync->length || addr + sync->length < addr)
+	{
+		return -EINVAL;
+	}
+
+	/* A software peer runs on our cores, its memory is coherent */
+	if(g_shm_peer)
+	{
+		return 0;
+	}
+
+	down_read(&mm->mmap_sem);
+
+	vma = find_vma(mm, addr);
+	if(vma && vma->vm_start <= addr && addr + sync->length <= vma->vm_end &&
+	   vma->vm_file && vma->vm_file->f_op == &shared_mem_fops)
+	{
+		pa = SHARED_MEMORY_HEADER_PHYS_ADDR - (vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start);
+		ret = shm_cache_range((void *) addr, pa, sync->length, sync->op);
+	}
+
+	up_read(&mm->mmap_sem);
+
+	return ret;
+}
+
+static void shm_bench_sync(void *map, struct page **pages, unsigned int npages, unsigned int op)
+{
+	unsigned int i;
+
+	for(i = 0; i < npages; i++)
+	{
+		shm_cache_range(map + i * PAGE_SIZE, page_to_phys(pages[i]), PAGE_SIZE, op);
+	}
+}
+
+static unsigned int shm_bench_mbps(unsigned int size, unsigned int iterations, s64 ns)
+{
+	if(ns <= 0)
+	{
+		return 0;
+	}
+
+	/* bytes per ns * 1000 is MB/s */
+	return (unsigned int) div64_u64((u64) size * iterations * 1000, ns);
+}
+
+/*
+ * Time memcpy to and from scratch pages mapped each way. The scratch pages
+ * stand in for a shared region so nothing the other core owns is touched.
+ */
+static int shm_bench(SharedMemBench *bench)
+{
+	unsigned int npages, mode, i, it;
+	struct page **pages;
+	void *buf, *map;
+	ktime_t start;
+	pgprot_t prot;
+	int ret = 0;
+
+	if(!bench->size || bench->size > SHM_BENCH_MAX_SIZE || !bench->iterations)
+	{
+		return -EINVAL;
+	}
+
+	npages = PAGE_ALIGN(bench->size) >> PAGE_SHIFT;
+	pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+	buf = vmalloc(bench->size);
+	if(!pages || !buf)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for(i = 0; i < npages; i++)
+	{
+		if(!(pages[i] = alloc_page(GFP_KERNEL)))
+		{
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	memset(buf, 0x5a, bench->size);
+
+	for(mode = 0; mode < SHM_MAP_MODES; mode++)
+	{
+		if(mode == SHM_MAP_UNCACHED)
+			prot = pgprot_noncached(PAGE_KERNEL);
+		else if(mode == SHM_MAP_WRITECOMBINE)
+			prot = pgprot_writecombine(PAGE_KERNEL);
+		else
+			prot = PAGE_KERNEL;
+
+		map = vmap(pages, npages, VM_MAP, prot);
+		if(!map)
+		{
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		start = ktime_get();
+		for(it = 0; it < bench->iterations; it++)
+		{
+			memcpy(map, buf, bench->size);
+			if(mode == SHM_MAP_CACHED)
+				shm_bench_sync(map, pages, npages, SHM_CACHE_CLEAN);
+		}
+		bench->writeMBps[mode] = shm_bench_mbps(bench->size, bench->iterations,
+							ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+		start = ktime_get();
+		for(it = 0; it < bench->iterations; it++)
+		{
+			if(mode == SHM_MAP_CACHED)
+				shm_bench_sync(map, pages, npages, SHM_CACHE_INVALIDATE);
+			memcpy(buf, map, bench->size);
+		}
+		bench->readMBps[mode] = shm_bench_mbps(bench->size, bench->iterations,
+						       ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+		vunmap(map);
+
+		printk("SHARED_MEM: bench %s: %u bytes x %u, write %u MB/s, read %u MB/s\n",
+		       mode == SHM_MAP_UNCACHED ? "uncached" : mode == SHM_MAP_WRITECOMBINE ? "writecombine" : "cached",
+		       bench->size, bench->iterations, bench->writeMBps[mode], bench->readMBps[mode]);
+	}
+
+out:
+	if(pages)
+	{
+		for(i = 0; i < npages; i++)
+		{
+			if(pages[i])
+				__free_page(pages[i]);
+		}
+		kfree(pages);
+	}
+	vfree(buf);
+
+	return ret;
+}
+
+/*
+ * Read a region the way the DNAS driver used to, a kmap_atomic() per 4K
+ * page, against the section mapping and the uncached ioremap. Reads only,
+ * the other core owns the data. Both cached figures include the invalidate.
+ */
+static int shm_bench_map(shared_mem_os_info *os_info, SharedMemMapBench *bench)
+{
+	shared_mem_region_os_info *region = NULL;
+	unsigned int i, it, off;
+	ktime_t start;
+	void *buf;
+
+	for(i = 0; i < os_info->num_regions; i++)
+	{
+		if(!memcmp(os_info->region_info[i].tag, bench->tag, 4))
+		{
+			region = &os_info->region_info[i];
+			break;
+		}
+	}
+
+	if(!region || !region->virtKernelAddr || g_shm_peer)
+	{
+		return -ENOENT;
+	}
+
+	if(!bench->size || bench->size > SHM_BENCH_MAX_SIZE || bench->size > region->regionSize ||
+	   (bench->size & ~PAGE_MASK) || !bench->iterations)
+	{
+		return -EINVAL;
+	}
+
+	buf = vmalloc(bench->size);
+	if(!buf)
+	{
+		return -ENOMEM;
+	}
+
+	bench->uncachedMBps = bench->kmapMBps = bench->directMBps = 0;
+
+	start = ktime_get();
+	for(it = 0; it < bench->iterations; it++)
+	{
+		memcpy(buf, (void *) region->virtKernelAddr, bench->size);
+	}
+	bench->uncachedMBps = shm_bench_mbps(bench->size, bench->iterations,
+					     ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	if(pfn_valid(region->physAddr >> PAGE_SHIFT))
+	{
+		start = ktime_get();
+		for(it = 0; it < bench->iterations; it++)
+		{
+			for(off = 0; off < bench->size; off += PAGE_SIZE)
+			{
+				struct page *page = pfn_to_page((region->physAddr + off) >> PAGE_SHIFT);
+				void *low;
+
+				__dma_page_dev_to_cpu(page, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+				low = kmap_atomic(page, KM_USER0);
+				memcpy(buf + off, low, PAGE_SIZE);
+				kunmap_atomic(low, KM_USER0);
+			}
+		}
+		bench->kmapMBps = shm_bench_mbps(bench->size, bench->iterations,
+						 ktime_to_ns(ktime_sub(ktime_get(), start)));
+	}
+
+	if(region->directKernelAddr)
+	{
+		start = ktime_get();
+		for(it = 0; it < bench->iterations; it++)
+		{
+			shm_region_sync((void *) region->directKernelAddr, bench->size, DMA_FROM_DEVICE);
+			memcpy(buf, (void *) region->directKernelAddr, bench->size);
+		}
+		bench->directMBps = shm_bench_mbps(bench->size, bench->iterations,
+						   ktime_to_ns(ktime_sub(ktime_get(), start)));
+	}
+
+	vfree(buf);
+
+	printk("SHARED_MEM: bench %.4s read: %u bytes x %u, uncached %u MB/s, kmap %u MB/s, section %u MB/s\n",
+	       region->tag, bench->size, bench->iterations, bench->uncachedMBps, bench->kmapMBps, bench->directMBps);
+
+	return 0;
+}
+
 static long shared_mem_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
   shared_mem_dev *shm_dev = (shared_mem_dev *) file->private_data;
@@ -1166,6 +2370,25 @@ static long shared_mem_unlocked_ioctl(struct file *file, unsigned int cmd, unsig
 	  break;
 	}
 
+	case SHARED_MEM_IOC_DUMP_QUEUE_STATS:
+	{
+	  shm_queue_dump_stats(&shm_dev->queue_os_info);
+	  retval = 0;
+	  break;
+	}
+
+	case SHARED_MEM_IOC_QUEUE_SET_SPIN:
+	{
+	  SharedMemQueueSetSpin spin_args;
+	  if(copy_from_user((void *) &spin_args, (const void __user *) arg, sizeof(spin_args)))
+	  {
+		  retval = -EINVAL;
+		  break;
+	  }
+	  retval = shm_queue_set_spin(shm_dev, &spin_args);
+	  break;
+	}
+
 	case SHARED_MEM_IOC_QUEUE_ATTACH:
 	{
 	  SharedMemQueueAttach attach_args;
@@ -1217,6 +2440,76 @@ static long shared_mem_unlocked_ioctl(struct file *file, unsigned int cmd, unsig
 	  break;		
 	}
 
+	case SHARED_MEM_IOC_QUEUE_SEND_BATCH:
+	{
+	  retval = shm_queue_user_batch(shm_dev, arg, 1);
+	  break;
+	}
+
+	case SHARED_MEM_IOC_QUEUE_RECV_BATCH:
+	{
+	  retval = shm_queue_user_batch(shm_dev, arg, 0);
+	  break;
+	}
+
+	case SHARED_MEM_IOC_SET_REGION_CACHE:
+	{
+	  SharedMemRegionCache cache_args;
+	  if(copy_from_user((void *) &cache_args, (const void __user *) arg, sizeof(cache_args)))
+	  {
+		  retval = -EINVAL;
+		  break;
+	  }
+	  retval = shm_set_region_cache(shm_dev->os_info, &cache_args);
+	  break;
+	}
+
+	case SHARED_MEM_IOC_CACHE_SYNC:
+	{
+	  SharedMemCacheSync sync_args;
+	  if(copy_from_user((void *) &sync_args, (const void __user *) arg, sizeof(sync_args)))
+	  {
+		  retval = -EINVAL;
+		  break;
+	  }
+	  retval = shm_cache_sync(&sync_args);
+	  break;
+	}
+
+	case SHARED_MEM_IOC_BENCH:
+	{
+	  SharedMemBench bench_args;
+	  if(copy_from_user((void *) &bench_args, (const void __user *) arg, sizeof(bench_args)))
+	  {
+		  retval = -EINVAL;
+		  break;
+	  }
+	  retval = shm_bench(&bench_args);
+
+	  if(!retval && copy_to_user((void __user *) arg, (void *) &bench_args, sizeof(bench_args)))
+	  {
+		  retval = -EINVAL;
+	  }
+	  break;
+	}
+
+	case SHARED_MEM_IOC_BENCH_MAP:
+	{
+	  SharedMemMapBench bench_args;
+	  if(copy_from_user((void *) &bench_args, (const void __user *) arg, sizeof(bench_args)))
+	  {
+		  retval = -EINVAL;
+		  break;
+	  }
+	  retval = shm_bench_map(shm_dev->os_info, &bench_args);
+
+	  if(!retval && copy_to_user((void __user *) arg, (void *) &bench_args, sizeof(bench_args)))
+	  {
+		  retval = -EINVAL;
+	  }
+	  break;
+	}
+
     default:
 	  return -ENOTTY;
   }
@@ -1239,6 +2532,12 @@ static int shared_mem_mmap(struct file *file, struct vm_area_struct *vma)
     return -EAGAIN;
   }
 
+  /* A software peer's partitions are not physically contiguous */
+  if(g_shm_peer)
+  {
+    return -ENODEV;
+  }
+
   ret = find_region_from_offset(shm_dev->os_info, vma->vm_pgoff << PAGE_SHIFT, vma->vm_end - vma->vm_start, &region_info);
 
   if(ret)
@@ -1247,7 +2546,17 @@ static int shared_mem_mmap(struct file *file, struct vm_area_struct *vma)
 	  return ret;
   }
 
-  vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+  switch(region_info->cacheMode)
+  {
+    case SHM_MAP_CACHED:
+	  break;
+    case SHM_MAP_WRITECOMBINE:
+	  vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	  break;
+    default:
+	  vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	  break;
+  }
 
   ret = remap_pfn_range(vma,
 			vma->vm_start, 
@@ -1296,128 +2605,201 @@ static ssize_t shared_mem_write(struct file *file, const char *buf, size_t count
 }
 #endif
 
-// do_shared_mem_file_read
-//
-// Implement sendfile operation for our shared memory buffers.
-// 
-// This routine will check the start address of the data to be transmitted
-// is within one of our buffers. It assumes that the whole buffer to be sent
-// is in the buffer
+// Splice support
 //
-// We assume that the virtual range to be copied is stored in physically
-// contiguous pages
+// The file position is the offset of the data from the start of the shared
+// window, the same offset a region is mmapped at, so a region found with
+// SHARED_MEM_IOC_GET_REGION_OFFSET can be used without mapping it.
 //
-// If the address is not found, we return -EINVAL to the calling code
-
-static void do_shared_mem_file_read(struct file *filp, loff_t *ppos, read_descriptor_t *desc, read_actor_t actor)
+// splice_read hands the pipe references to the region's own pages, nothing
+// is copied until the consumer (normally a socket's sendpage) reads them.
+// The caller owns the buffer until the consumer is done with it, exactly as
+// for vmsplice. splice_write copies each pipe buffer straight into the
+// region through its kernel mapping, so socket data lands there without
+// passing through a user buffer.
+
+static shared_mem_region_os_info *shm_splice_region(shared_mem_dev *shm_dev, loff_t pos, unsigned int *off)
 {
-#if 0
-        struct inode *inode = filp->f_path.dentry->d_inode;
-        struct address_space *mapping = inode->i_mapping;
-#endif
-        unsigned long index, offset;
-        struct page *page = NULL;
-        unsigned long physAddr;
-        unsigned int pfn;
-        int ret;
+        shared_mem_os_info *os_info;
+        int i;
+
+        if (!shm_dev || !(os_info = shm_dev->os_info) || pos < 0)
+        {
+                return NULL;
+        }
+
+        for (i = 0; i < os_info->num_regions; i++)
+        {
+                shared_mem_region_os_info *region = &os_info->region_info[i];
+
+                if (pos >= region->offset && pos < (loff_t) region->offset + region->regionSize)
+                {
+                        *off = pos - region->offset;
+                        return region;
+                }
+        }
 
-        shared_mem_dev *shm_dev = (shared_mem_dev *) filp->private_data;
+        return NULL;
+}
 
-        ret = find_region_from_user_addr(shm_dev->os_info, *ppos, &physAddr);
+static struct page *shm_splice_page(shared_mem_region_os_info *region, unsigned int off)
+{
+        unsigned long pfn;
 
-        index = *ppos >> PAGE_CACHE_SHIFT;
-        offset = *ppos & ~PAGE_CACHE_MASK;
+        // A software peer's regions are vmalloc memory
+        if (g_shm_peer)
+        {
+                return vmalloc_to_page((void *) (region->virtKernelAddr + off));
+        }
 
-        if (ret) 
+        // The window itself only works if it is covered by the memmap
+        pfn = (region->physAddr + off) >> PAGE_SHIFT;
+        if (!pfn_valid(pfn))
         {
-          desc->error = ret;
-//          if (desc->error == -EINVAL)
-//            desc->error = 0;
-          goto out;
+                return NULL;
         }
 
-        pfn = physAddr >> PAGE_SHIFT;
-        for (;;) {
-                unsigned long nr, ret;
+        return pfn_to_page(pfn);
+}
 
-                // Get the page for the current virtual address
+// The pages belong to the region, the pipe must not hand them on as its own
+static int shm_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+        return 1;
+}
 
-                page = pfn_to_page(pfn);
+static const struct pipe_buf_operations shm_pipe_buf_ops = {
+        .can_merge = 0,
+        .map = generic_pipe_buf_map,
+        .unmap = generic_pipe_buf_unmap,
+        .confirm = generic_pipe_buf_confirm,
+        .release = generic_pipe_buf_release,
+        .steal = shm_pipe_buf_steal,
+        .get = generic_pipe_buf_get,
+};
 
-                // Calculate number of bytes to send in this page
-                nr = PAGE_CACHE_SIZE;
-                nr -= offset;
+static ssize_t shared_mem_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                                      size_t len, unsigned int flags)
+{
+        struct page *pages[PIPE_DEF_BUFFERS];
+        struct partial_page partial[PIPE_DEF_BUFFERS];
+        struct splice_pipe_desc spd = {
+                .pages = pages,
+                .partial = partial,
+                .nr_pages_max = PIPE_DEF_BUFFERS,
+                .flags = flags,
+                .ops = &shm_pipe_buf_ops,
+                .spd_release = spd_release_page,
+        };
+        shared_mem_dev *shm_dev = (shared_mem_dev *) in->private_data;
+        shared_mem_region_os_info *region;
+        unsigned int off;
+        ssize_t ret;
+
+        region = shm_splice_region(shm_dev, *ppos, &off);
+        if (!region)
+        {
+                return -EINVAL;
+        }
 
-                if (page) {
-                        /*
-                         * If users can be writing to this page using arbitrary
-                         * virtual addresses, take care about potential aliasing
-                         * before reading the page on the kernel side.
-                         */
+        len = min_t(size_t, len, region->regionSize - off);
+        if (!len)
+        {
+                return 0;
+        }
 
-                        // Possible optimization - turn this off as our pages are in
-                        // uncached memory. 
-#if 0
-                        if (mapping_writably_mapped(mapping))
-                                flush_dcache_page(page);
-#endif
-                        /*
-                         * Mark the page accessed if we read the beginning.
-                         */
-                        if (!offset)
-                                mark_page_accessed(page);
-                } else {
-                        page = ZERO_PAGE(0);
-                        page_cache_get(page);
-                }
+        if (splice_grow_spd(pipe, &spd))
+        {
+                return -ENOMEM;
+        }
 
-                /*
-                 * Ok, we have the page, and it's up-to-date, so
-                 * now we can copy it to the network stack
-                 *
-                 * The actor routine returns how many bytes were actually used..
-                 * NOTE! This may not be the same as how much of a user buffer
-                 * we filled up (we may be padding etc), so we can only update
-                 * "pos" here (the actor routine has to update the user buffer
-                 * pointers and the remaining count).
-                 */
-                ret = actor(desc, page, offset, nr);
-                offset += ret;
-                index += offset >> PAGE_CACHE_SHIFT;
-                offset &= ~PAGE_CACHE_MASK;
-
-                // Move to the next page - we're assuming physical continuity here
-                ++pfn;
-
-//                page_cache_release(page);
-                if (ret != nr || !desc->count)
+        while (len && spd.nr_pages < spd.nr_pages_max)
+        {
+                unsigned int poff = (region->physAddr + off) & ~PAGE_MASK;
+                unsigned int plen = min_t(size_t, len, PAGE_SIZE - poff);
+                struct page *page = shm_splice_page(region, off);
+
+                if (!page)
+                {
                         break;
+                }
+
+                get_page(page);
+                spd.pages[spd.nr_pages] = page;
+                spd.partial[spd.nr_pages].offset = poff;
+                spd.partial[spd.nr_pages].len = plen;
+                spd.partial[spd.nr_pages].private = 0;
+                spd.nr_pages++;
 
-                cond_resched();
+                off += plen;
+                len -= plen;
         }
 
-out:
-        *ppos = ((loff_t) index << PAGE_CACHE_SHIFT) + offset;
-        file_accessed(filp);
+        ret = spd.nr_pages ? splice_to_pipe(pipe, &spd) : -EINVAL;
+        splice_shrink_spd(&spd);
+
+        if (ret > 0)
+        {
+                *ppos += ret;
+                file_accessed(in);
+        }
+
+        return ret;
 }
 
-ssize_t shared_mem_sendfile(struct file *in_file, loff_t *ppos,
-                         size_t count, read_actor_t actor, void *target)
+static int shm_pipe_to_region(struct pipe_inode_info *pipe, struct pipe_buffer *buf, struct splice_desc *sd)
 {
-        read_descriptor_t desc;
+        shared_mem_dev *shm_dev = (shared_mem_dev *) sd->u.file->private_data;
+        shared_mem_region_os_info *region;
+        unsigned int off, len;
+        void *src;
+        int ret;
 
-        if (!count)
-                return 0;
+        region = shm_splice_region(shm_dev, sd->pos, &off);
+        if (!region)
+        {
+                return -EINVAL;
+        }
+
+        ret = buf->ops->confirm(pipe, buf);
+        if (ret)
+        {
+                return ret;
+        }
+
+        len = min_t(unsigned int, sd->len, region->regionSize - off);
 
-        desc.written = 0;
-        desc.count = count;
-        desc.arg.data = target;
-        desc.error = 0;
+        src = buf->ops->map(pipe, buf, 0);
+        memcpy((void *) (region->virtKernelAddr + off), src + buf->offset, len);
+        buf->ops->unmap(pipe, buf, src);
+
+        return len;
+}
+
+static ssize_t shared_mem_splice_write(struct pipe_inode_info *pipe, struct file *out, loff_t *ppos,
+                                       size_t len, unsigned int flags)
+{
+        shared_mem_dev *shm_dev = (shared_mem_dev *) out->private_data;
+        shared_mem_region_os_info *region;
+        unsigned int off;
+        ssize_t ret;
+
+        region = shm_splice_region(shm_dev, *ppos, &off);
+        if (!region)
+        {
+                return -EINVAL;
+        }
+
+        // Stop at the end of the region rather than run into the next one
+        len = min_t(size_t, len, region->regionSize - off);
+
+        ret = splice_from_pipe(pipe, out, ppos, len, flags, shm_pipe_to_region);
+        if (ret > 0)
+        {
+                *ppos += ret;
+        }
 
-        do_shared_mem_file_read(in_file, ppos, &desc, actor);
-        if (desc.written)
-                return desc.written;
-        return desc.error;
+        return ret;
 }
 
 static int shared_mem_panic_event(struct notifier_block *th, unsigned long event, void *ptr)
@@ -1450,7 +2832,8 @@ struct file_operations shared_mem_fops =
 	.fsync	=	NULL,
 	.fasync	=	NULL,
 	.lock	=	NULL,
-    //.sendfile =     shared_mem_sendfile,
+	.splice_read	=	shared_mem_splice_read,
+	.splice_write	=	shared_mem_splice_write,
 };
 
 
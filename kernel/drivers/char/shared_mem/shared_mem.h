@@ -20,6 +20,8 @@ typedef struct _shared_mem_region_os_info
 	unsigned int regionSize;
 	unsigned int reserved;
 	unsigned int num_mmaps;
+	unsigned int cacheMode;		/* SHM_MAP_xxx for new mmaps */
+	unsigned int directKernelAddr;	/* Cacheable section mapping, 0 if none */
 } shared_mem_region_os_info;
 
 
@@ -43,4 +45,21 @@ typedef struct _shared_mem_dev
 	struct cdev cdev;
 } shared_mem_dev;
 
+/*
+ * Software stand-in for the VxWorks core, see shared_mem_loopback.c.
+ * header is the partition header the peer lays out, map_region returns the
+ * kernel address of one of its partitions and doorbell is called instead of
+ * ringing the hardware doorbell of the other core.
+ */
+typedef struct _shm_peer_ops
+{
+	SharedMemPartitionDescHeader *header;
+	void *(*map_region)(SharedMemPartitionInfo *partition);
+	void (*doorbell)(unsigned int bitShift);
+} shm_peer_ops;
+
+int shm_peer_register(shm_peer_ops *ops);
+int shm_peer_unregister(shm_peer_ops *ops);
+void shm_peer_doorbell(unsigned int bitShift);
+
 #endif
@@ -0,0 +1,1232 @@
+/*
+ * Loopback peer for the shared memory driver.
+ *
+ * Stands in for the VxWorks core so the Linux side of the intercore path
+ * (the shared memory queues, the DNAS SCSI driver and its J1 allocator) can
+ * run on a box without the second OS, e.g. under QEMU, and be profiled with
+ * fio. The shared memory is a vmalloc area laid out with the partitions the
+ * VxWorks core publishes, kernel threads service the SCSI, resource and core
+ * control queue pairs, and SCSI I/O completes against RAM or a file:
+ *
+ *   insmod shared_mem_loopback.ko backing=/data/lun0.img latency_us=100
+ *   insmod dri_dnas_scsi.ko
+ *
+ * The peer has to be loaded before anything opens the shared memory. Once
+ * the Linux side has synced with it, it stays loaded.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/cdev.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/time.h>
+#include <linux/moduleparam.h>
+#include <asm/uaccess.h>
+#include <asm/unaligned.h>
+#include <scsi/scsi.h>
+#include "sharedMemCommon.h"
+#include <linux/sharedMemQueueCommon.h>
+#include "shared_mem_queue.h"
+#include "shared_mem.h"
+#include <linux/shared_mem_interface.h>
+#include <linux/dri_dnas_intercore.h>
+#include <linux/dri_dnas_j1pool.h>
+
+static char *backing = "";
+module_param(backing, charp, 0444);
+MODULE_PARM_DESC(backing, "File backing the LUN, RAM if empty");
+
+static unsigned int size_mb = 64;
+module_param(size_mb, uint, 0444);
+MODULE_PARM_DESC(size_mb, "LUN size in MB, 0 takes the size of the backing file");
+
+static unsigned int latency_us = 0;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "Extra service time added to every SCSI command");
+
+static unsigned int j1_mb = 16;
+module_param(j1_mb, uint, 0444);
+MODULE_PARM_DESC(j1_mb, "Size of the J1 write buffer partition in MB");
+
+static unsigned int read_mb = 8;
+module_param(read_mb, uint, 0444);
+MODULE_PARM_DESC(read_mb, "Size of the read buffer partition in MB");
+
+static unsigned int workers = 4;
+module_param(workers, uint, 0444);
+MODULE_PARM_DESC(workers, "SCSI commands serviced concurrently");
+
+#define SHM_PEER_SECTOR_SIZE		512
+#define SHM_PEER_SLOT_SIZE		128
+#define SHM_PEER_POLL_MS		10
+#define SHM_PEER_QUEUE_POOL_SIZE	(256 * 1024)
+#define SHM_PEER_SENSE_LEN		18
+
+/* The VxWorks core publishes the HLBAT read buffers under this tag */
+#define SHM_PEER_TAG_READ		"read"
+
+/* Queue pairs, in the order the VxWorks core creates them */
+#define SHM_PEER_QP_SCSI		0
+#define SHM_PEER_QP_RES			1
+#define SHM_PEER_QP_CORE		2
+#define SHM_PEER_NUM_QP			3
+
+/* Check condition sense, key/asc/ascq packed into an int, 0 is GOOD */
+#define SHM_PEER_SENSE(key, asc, ascq)	(((key) << 16) | ((asc) << 8) | (ascq))
+#define SHM_PEER_SENSE_INVALID_OPCODE	SHM_PEER_SENSE(ILLEGAL_REQUEST, 0x20, 0x00)
+#define SHM_PEER_SENSE_LBA_RANGE	SHM_PEER_SENSE(ILLEGAL_REQUEST, 0x21, 0x00)
+#define SHM_PEER_SENSE_INVALID_FIELD	SHM_PEER_SENSE(ILLEGAL_REQUEST, 0x24, 0x00)
+#define SHM_PEER_SENSE_NO_LUN		SHM_PEER_SENSE(ILLEGAL_REQUEST, 0x25, 0x00)
+#define SHM_PEER_SENSE_READ_ERROR	SHM_PEER_SENSE(MEDIUM_ERROR, 0x11, 0x00)
+#define SHM_PEER_SENSE_WRITE_ERROR	SHM_PEER_SENSE(MEDIUM_ERROR, 0x0C, 0x00)
+#define SHM_PEER_SENSE_NO_RESOURCE	SHM_PEER_SENSE(ABORTED_COMMAND, 0x55, 0x03)
+
+/* One direction of a queue pair as seen from our side */
+typedef struct _shm_peer_queue
+{
+	SHMQueueInfo *qInfo;
+	unsigned char *slotBuf;
+	unsigned int next;
+	struct mutex lock;
+} shm_peer_queue;
+
+typedef struct _shm_peer_qpair
+{
+	shm_peer_queue rx;		/* Linux to us */
+	shm_peer_queue tx;		/* Us to Linux */
+} shm_peer_qpair;
+
+/* Page granular allocator for the partitions we hand buffers out of */
+typedef struct _shm_peer_pool
+{
+	unsigned char *base;
+	unsigned int pages;
+	unsigned long *map;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+} shm_peer_pool;
+
+typedef struct _shm_peer_cmd
+{
+	struct work_struct work;
+	InterCoreSCSICmd cmd;
+	InterCoreSGL *sgl;		/* Our copy of a Linux SGL */
+} shm_peer_cmd;
+
+typedef struct _shm_peer_dev
+{
+	unsigned char *mem;
+	unsigned int mem_size;
+	SharedMemPartitionDescHeader *header;
+	SHMQueueHeader *queueHeader;
+	unsigned char *j1;
+	unsigned char *lx_dyn;
+	SharedPartitionInfoStruct *j1_info;
+	shm_peer_pool read_pool;
+	shm_peer_pool vx_dyn_pool;
+	shm_peer_qpair qp[SHM_PEER_NUM_QP];
+	wait_queue_head_t db_wait[SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT];
+
+	unsigned char *ram;
+	struct file *filp;
+	u64 capacity;			/* In sectors */
+
+	struct task_struct *ctrl_th;
+	struct task_struct *scsi_th;
+	struct task_struct *res_th;
+	struct workqueue_struct *wq;
+	int stopping;
+	int pinned;
+
+	atomic_t cmds;
+	atomic_t errors;
+} shm_peer_dev;
+
+static shm_peer_dev shm_peer;
+
+/************************* SHARED MEMORY LAYOUT ****************************/
+
+static void *shm_peer_map_region(SharedMemPartitionInfo *partition)
+{
+	if(partition->offset + partition->size > shm_peer.mem_size)
+	{
+		return NULL;
+	}
+
+	return shm_peer.mem + partition->offset;
+}
+
+/* Linux rang the doorbell of one of our queues */
+static void shm_peer_ring(unsigned int bitShift)
+{
+	if(bitShift < SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT)
+	{
+		wake_up_interruptible(&shm_peer.db_wait[bitShift]);
+	}
+}
+
+static shm_peer_ops shm_peer_operations = {
+	.map_region	= shm_peer_map_region,
+	.doorbell	= shm_peer_ring,
+};
+
+static SharedMemPartitionInfo *shm_peer_add_partition(unsigned int *offset, const char *tag,
+						      const char *desc, unsigned int size)
+{
+	SharedMemPartitionDescHeader *header = shm_peer.header;
+	SharedMemPartitionInfo *partition = &header->partitions[header->num_partitions++];
+
+	memcpy(partition->name_tag, tag, 4);
+	partition->offset = *offset;
+	partition->alignment = PAGE_SIZE;
+	partition->size = size;
+	partition->phyAddr = 0;		/* Not physically contiguous */
+	strlcpy(partition->partition_desc, desc, SHARED_MEM_MAX_PARTITION_DESC_SIZE);
+
+	*offset += PAGE_ALIGN(size);
+
+	return partition;
+}
+
+static void shm_peer_init_queue(SHMQueueInfo *qInfo, unsigned int *poolOffset, int bitShift,
+				unsigned int numSlots, const char *desc, unsigned char owner)
+{
+	unsigned int i, stride = SHM_PEER_SLOT_SIZE + sizeof(SHMQueueSlotHeader);
+	unsigned char *slotBuf;
+
+	qInfo->doorbellBitShift = bitShift;
+	qInfo->numSlots = numSlots;
+	qInfo->sizeSlots = SHM_PEER_SLOT_SIZE;
+	qInfo->nextSlotToProcess = 0;
+	qInfo->nextSlotToInsert = 0;
+	qInfo->slotBufferSize = numSlots * stride;
+	qInfo->slotBufferOffset = *poolOffset;
+	strlcpy(qInfo->queueDescription, desc, SHM_QUEUE_DESCRIPTION_MAX_SIZE);
+
+	slotBuf = ((unsigned char *) shm_peer.queueHeader) + qInfo->slotBufferOffset;
+	for(i = 0; i < numSlots; i++)
+	{
+		SHM_QUEUE_SET_SLOT_HEADER(slotBuf + i * stride, SHM_QUEUE_SLOT_MAGIC, owner, 0);
+	}
+
+	*poolOffset += ALIGN(qInfo->slotBufferSize, 64);
+}
+
+/*
+ * Lay out the queue header the way the VxWorks core does. Lx to Vx slots
+ * start out owned by Linux (free to fill), Vx to Lx slots by us. Every
+ * direction gets its own doorbell, pair n uses 2n (Vx to Lx) and 2n + 1.
+ */
+static void shm_peer_init_queues(void)
+{
+	static const struct {
+		const char *name;
+		const char *vxToLxDesc;
+		const char *lxToVxDesc;
+		unsigned int numSlots;
+	} pairs[SHM_PEER_NUM_QP] = {
+		[SHM_PEER_QP_SCSI] = { ISCSI_SCSI_QUEUE_PAIR_NAME, ISCSI_SCSI_RESPONSE_QUEUE_DESC,
+				       ISCSI_SCSI_CMD_QUEUE_DESC, 128 },
+		[SHM_PEER_QP_RES]  = { ISCSI_RESOURCE_QUEUE_PAIR_NAME, ISCSI_LX_RESOURCE_QUEUE_DESC,
+				       ISCSI_VX_RESOURCE_QUEUE_DESC, 64 },
+		[SHM_PEER_QP_CORE] = { CORE_MSG_QUEUE_PAIR_NAME, CORE_VX_TO_LX_QUEUE_DESC,
+				       CORE_LX_TO_VX_QUEUE_DESC, 32 },
+	};
+	SHMQueueHeader *qh = shm_peer.queueHeader;
+	unsigned int i, poolOffset = SHM_QUEUE_HEADER_MAX_SIZE;
+
+	qh->cpu1_queue_wait_status = 0;
+	qh->cpu0_queue_init_status = SHM_QUEUE_CPU0_INIT_IN_PROGRESS_MARKER;
+	qh->queueHeaderMagic = SHM_QUEUE_HEADER_MAGIC;
+	qh->nextChId = SHM_PEER_NUM_QP;
+	qh->slotBufferPoolOffset = SHM_QUEUE_HEADER_MAX_SIZE;
+	qh->slotBufferPoolSize = SHM_PEER_QUEUE_POOL_SIZE - SHM_QUEUE_HEADER_MAX_SIZE;
+
+	for(i = 0; i < SHM_MAX_QUEUE_PAIRS; i++)
+	{
+		qh->queuePairInfo[i].qPairId = SHM_QUEUE_PAIR_INVALID_ID;
+	}
+
+	for(i = 0; i < SHM_PEER_NUM_QP; i++)
+	{
+		SHMQueuePairInfoStatus *pair = &qh->queuePairInfo[i];
+		shm_peer_qpair *qp = &shm_peer.qp[i];
+
+		strlcpy(pair->queuePairName, pairs[i].name, SHM_QUEUE_PAIR_NAME_MAX_SIZE);
+		shm_peer_init_queue(&pair->qVxToLx, &poolOffset, 2 * i, pairs[i].numSlots,
+				    pairs[i].vxToLxDesc, SHM_QUEUE_SLOT_OWNER_VXWORKS);
+		shm_peer_init_queue(&pair->qLxToVx, &poolOffset, 2 * i + 1, pairs[i].numSlots,
+				    pairs[i].lxToVxDesc, SHM_QUEUE_SLOT_OWNER_LINUX);
+
+		qp->rx.qInfo = &pair->qLxToVx;
+		qp->rx.slotBuf = ((unsigned char *) qh) + pair->qLxToVx.slotBufferOffset;
+		mutex_init(&qp->rx.lock);
+		qp->tx.qInfo = &pair->qVxToLx;
+		qp->tx.slotBuf = ((unsigned char *) qh) + pair->qVxToLx.slotBufferOffset;
+		mutex_init(&qp->tx.lock);
+
+		/* Published last, Linux attaches as soon as it sees the id */
+		wmb();
+		pair->qPairId = i;
+	}
+
+	BUG_ON(poolOffset > SHM_PEER_QUEUE_POOL_SIZE);
+}
+
+/*
+ * Carve the J1 partition into the transactional and bulk pools, which is
+ * the Vx core's job. A quarter goes to 16K buffers, the rest to 256K ones.
+ * The descriptors come first and the buffers start page aligned in the
+ * partition. All offsets are from the data region after the info area.
+ */
+static void shm_peer_init_j1(unsigned int size)
+{
+	SharedPartitionInfoStruct *info = (SharedPartitionInfoStruct *) shm_peer.j1;
+	WriteBufferPoolInfo *trans = &info->TransPoolInfo, *bulk = &info->BulkPoolInfo;
+	unsigned int dataSize = size - SHARED_PARTITION_INFO_AREA_SIZE;
+	unsigned int numTrans, numBulk, bufStart;
+
+	numTrans = (size / 4) / TRANS_WRITE_BUFFER_SIZE;
+	numBulk = (size - numTrans * TRANS_WRITE_BUFFER_SIZE) / BULK_WRITE_BUFFER_SIZE;
+
+	do
+	{
+		bufStart = PAGE_ALIGN(SHARED_PARTITION_INFO_AREA_SIZE +
+				      (numTrans + numBulk) * sizeof(WriteBufferDescriptor)) -
+			   SHARED_PARTITION_INFO_AREA_SIZE;
+		if(bufStart + numTrans * TRANS_WRITE_BUFFER_SIZE +
+		   numBulk * BULK_WRITE_BUFFER_SIZE <= dataSize)
+		{
+			break;
+		}
+	} while(--numBulk);
+
+	memset(info, 0, sizeof(*info));
+	info->SharedPartitionSize = size;
+	info->SharedPartitionDataRegionSize = dataSize;
+
+	trans->Type = Trans;
+	trans->NumBuffers = numTrans;
+	trans->BufferSize = TRANS_WRITE_BUFFER_SIZE;
+	trans->DescStartOffset = 0;
+	trans->DescEndOffset = numTrans * sizeof(WriteBufferDescriptor);
+	trans->BufferStartOffset = bufStart;
+	trans->BufferEndOffset = bufStart + numTrans * TRANS_WRITE_BUFFER_SIZE;
+
+	bulk->Type = Bulk;
+	bulk->NumBuffers = numBulk;
+	bulk->BufferSize = BULK_WRITE_BUFFER_SIZE;
+	bulk->DescStartOffset = trans->DescEndOffset;
+	bulk->DescEndOffset = bulk->DescStartOffset + numBulk * sizeof(WriteBufferDescriptor);
+	bulk->BufferStartOffset = trans->BufferEndOffset;
+	bulk->BufferEndOffset = bulk->BufferStartOffset + numBulk * BULK_WRITE_BUFFER_SIZE;
+
+	info->SharedPartitionBufferRegionSize = bulk->BufferEndOffset;
+	shm_peer.j1_info = info;
+
+	printk("SHM_PEER: J1 %u trans and %u bulk buffers in %u bytes\n", numTrans, numBulk, size);
+}
+
+static int shm_peer_pool_init(shm_peer_pool *pool, unsigned char *base, unsigned int size)
+{
+	pool->base = base;
+	pool->pages = size >> PAGE_SHIFT;
+	pool->map = kzalloc(BITS_TO_LONGS(pool->pages) * sizeof(long), GFP_KERNEL);
+	spin_lock_init(&pool->lock);
+	init_waitqueue_head(&pool->wait);
+
+	return pool->map ? 0 : -ENOMEM;
+}
+
+static int shm_peer_pool_get(shm_peer_pool *pool, unsigned int pages, unsigned int *offset)
+{
+	unsigned long start;
+	int ret = -ENOSPC;
+
+	spin_lock(&pool->lock);
+	start = bitmap_find_next_zero_area(pool->map, pool->pages, 0, pages, 0);
+	if(start < pool->pages)
+	{
+		bitmap_set(pool->map, start, pages);
+		*offset = start << PAGE_SHIFT;
+		ret = 0;
+	}
+	spin_unlock(&pool->lock);
+
+	return ret;
+}
+
+/* Waits for space like the Vx core does when its buffers run out */
+static int shm_peer_pool_alloc(shm_peer_pool *pool, unsigned int len, unsigned int *offset)
+{
+	unsigned int pages = DIV_ROUND_UP(len, PAGE_SIZE);
+
+	if(!pages || pages > pool->pages)
+	{
+		return -EINVAL;
+	}
+
+	wait_event(pool->wait, !shm_peer_pool_get(pool, pages, offset) || shm_peer.stopping);
+
+	return shm_peer.stopping ? -EINTR : 0;
+}
+
+static void shm_peer_pool_free(shm_peer_pool *pool, unsigned int offset, unsigned int len)
+{
+	unsigned int pages = DIV_ROUND_UP(len, PAGE_SIZE);
+
+	if((offset & ~PAGE_MASK) || !pages || (offset >> PAGE_SHIFT) + pages > pool->pages)
+	{
+		printk(KERN_WARNING "SHM_PEER: bad buffer free, offset 0x%x len %u\n", offset, len);
+		return;
+	}
+
+	spin_lock(&pool->lock);
+	bitmap_clear(pool->map, offset >> PAGE_SHIFT, pages);
+	spin_unlock(&pool->lock);
+
+	wake_up(&pool->wait);
+}
+
+/*************************** QUEUE SERVICE *******************************/
+
+#define SHM_PEER_SLOT_PTR(q, slot)	\
+	((volatile SHMQueueSlotHeader *) ((q)->slotBuf + (slot) * ((q)->qInfo->sizeSlots + sizeof(SHMQueueSlotHeader))))
+
+/*
+ * Wait for the next slot of a direction to be ours. Linux only rings when
+ * it thinks we may be waiting, so we poll as well.
+ */
+static int shm_peer_wait_slot(shm_peer_queue *q, volatile SHMQueueSlotHeader **slotHeaderOut)
+{
+	volatile SHMQueueSlotHeader *slotHeader = SHM_PEER_SLOT_PTR(q, q->next);
+
+	while(SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) != SHM_QUEUE_SLOT_OWNER_VXWORKS)
+	{
+		if(shm_peer.stopping)
+		{
+			return -EINTR;
+		}
+		wait_event_interruptible_timeout(shm_peer.db_wait[q->qInfo->doorbellBitShift],
+			SHM_QUEUE_GET_SLOT_HEADER_OWNER(slotHeader) == SHM_QUEUE_SLOT_OWNER_VXWORKS ||
+			shm_peer.stopping, msecs_to_jiffies(SHM_PEER_POLL_MS));
+	}
+	rmb();
+
+	*slotHeaderOut = slotHeader;
+	return 0;
+}
+
+/* Take the next message Linux sent, returns its size */
+static int shm_peer_recv(shm_peer_queue *q, void *buf, unsigned int size)
+{
+	volatile SHMQueueSlotHeader *slotHeader;
+	int ret;
+
+	mutex_lock(&q->lock);
+	ret = shm_peer_wait_slot(q, &slotHeader);
+	if(!ret)
+	{
+		ret = min_t(unsigned int, size, SHM_QUEUE_GET_SLOT_HEADER_MSG_SIZE(slotHeader));
+		memcpy(buf, (void *) (slotHeader + 1), ret);
+		mb();
+		SHM_QUEUE_SET_SLOT_HEADER(slotHeader, SHM_QUEUE_SLOT_MAGIC, SHM_QUEUE_SLOT_OWNER_LINUX, 0);
+		q->next = (q->next + 1) % q->qInfo->numSlots;
+		q->qInfo->nextSlotToProcess = q->next;
+	}
+	mutex_unlock(&q->lock);
+
+	/* A sender may be waiting on the queue being full */
+	if(ret >= 0)
+	{
+		shm_peer_doorbell(q->qInfo->doorbellBitShift);
+	}
+
+	return ret;
+}
+
+static int shm_peer_send(shm_peer_queue *q, void *msg, unsigned int size)
+{
+	volatile SHMQueueSlotHeader *slotHeader;
+	int ret;
+
+	mutex_lock(&q->lock);
+	ret = shm_peer_wait_slot(q, &slotHeader);
+	if(!ret)
+	{
+		memcpy((void *) (slotHeader + 1), msg, size);
+		wmb();
+		SHM_QUEUE_SET_SLOT_HEADER(slotHeader, SHM_QUEUE_SLOT_MAGIC, SHM_QUEUE_SLOT_OWNER_LINUX, size);
+		q->next = (q->next + 1) % q->qInfo->numSlots;
+		q->qInfo->nextSlotToInsert = q->next;
+	}
+	mutex_unlock(&q->lock);
+
+	if(!ret)
+	{
+		shm_peer_doorbell(q->qInfo->doorbellBitShift);
+	}
+
+	return ret;
+}
+
+/**************************** BACKING STORE ******************************/
+
+static int shm_peer_backing_rw(int write, unsigned char *buf, u64 lba, unsigned int len)
+{
+	loff_t pos = lba * SHM_PEER_SECTOR_SIZE;
+	mm_segment_t old_fs;
+	ssize_t ret = 0;
+
+	if(!shm_peer.filp)
+	{
+		if(write)
+			memcpy(shm_peer.ram + pos, buf, len);
+		else
+			memcpy(buf, shm_peer.ram + pos, len);
+		return 0;
+	}
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while(len)
+	{
+		if(write)
+			ret = vfs_write(shm_peer.filp, (const char __user *) buf, len, &pos);
+		else
+			ret = vfs_read(shm_peer.filp, (char __user *) buf, len, &pos);
+		if(ret <= 0)
+		{
+			break;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	set_fs(old_fs);
+
+	return len ? -EIO : 0;
+}
+
+/**************************** SCSI SERVICE *******************************/
+
+/* Hand data for a data-in command back in the read partition */
+static int shm_peer_data_in(InterCoreSCSIResp *rsp, const void *data, unsigned int len,
+			    unsigned int allocLen)
+{
+	unsigned int offset;
+
+	len = min(len, allocLen);
+	if(!len)
+	{
+		return 0;
+	}
+
+	if(shm_peer_pool_alloc(&shm_peer.read_pool, len, &offset))
+	{
+		return SHM_PEER_SENSE_NO_RESOURCE;
+	}
+
+	memcpy(shm_peer.read_pool.base + offset, data, len);
+	rsp->bufId1.bufOffset = offset;
+	rsp->bufId1.length = len;
+	rsp->bufId1.bufSrc = INTER_CORE_CMD_PARTITION_ID_HLBAT_CACHE;
+
+	return 0;
+}
+
+static int shm_peer_inquiry(InterCoreSCSICmd *cmd, InterCoreSCSIResp *rsp, int lun)
+{
+	unsigned char data[36];
+
+	/* No VPD pages, the mid layer copes */
+	if(cmd->cdb[1] & 0x01)
+	{
+		return SHM_PEER_SENSE_INVALID_FIELD;
+	}
+
+	memset(data, 0, sizeof(data));
+	data[0] = lun ? 0x7F : TYPE_DISK;	/* Qualifier 3, no LUN there */
+	data[2] = 0x05;				/* SPC-3 */
+	data[3] = 0x02;
+	data[4] = sizeof(data) - 5;
+	data[7] = 0x02;				/* CmdQue */
+	memcpy(&data[8], "Drobo   ", 8);
+	memcpy(&data[16], "SHM Loopback    ", 16);
+	memcpy(&data[32], "0001", 4);
+
+	return shm_peer_data_in(rsp, data, sizeof(data), get_unaligned_be16(&cmd->cdb[3]));
+}
+
+static int shm_peer_read_capacity(InterCoreSCSICmd *cmd, InterCoreSCSIResp *rsp)
+{
+	unsigned char data[32];
+	u64 last = shm_peer.capacity - 1;
+
+	memset(data, 0, sizeof(data));
+	if(cmd->cdb[0] == READ_CAPACITY)
+	{
+		put_unaligned_be32(last > 0xFFFFFFFFULL ? 0xFFFFFFFF : (u32) last, &data[0]);
+		put_unaligned_be32(SHM_PEER_SECTOR_SIZE, &data[4]);
+		return shm_peer_data_in(rsp, data, 8, 8);
+	}
+
+	put_unaligned_be64(last, &data[0]);
+	put_unaligned_be32(SHM_PEER_SECTOR_SIZE, &data[8]);
+	return shm_peer_data_in(rsp, data, sizeof(data), get_unaligned_be32(&cmd->cdb[10]));
+}
+
+/* Header only, no mode pages: not write protected, cache assumed write through */
+static int shm_peer_mode_sense(InterCoreSCSICmd *cmd, InterCoreSCSIResp *rsp)
+{
+	unsigned char data[8];
+
+	memset(data, 0, sizeof(data));
+	if(cmd->cdb[0] == MODE_SENSE)
+	{
+		data[0] = 3;
+		return shm_peer_data_in(rsp, data, 4, cmd->cdb[4]);
+	}
+
+	data[1] = 6;
+	return shm_peer_data_in(rsp, data, 8, get_unaligned_be16(&cmd->cdb[7]));
+}
+
+static int shm_peer_report_luns(InterCoreSCSICmd *cmd, InterCoreSCSIResp *rsp)
+{
+	unsigned char data[16];
+
+	memset(data, 0, sizeof(data));
+	put_unaligned_be32(8, &data[0]);	/* Just LUN 0 */
+
+	return shm_peer_data_in(rsp, data, sizeof(data), get_unaligned_be32(&cmd->cdb[6]));
+}
+
+/*
+ * Linux frees an SGL it sends once it has the response, and we still need
+ * it after that to release the J1 buffers, so keep a copy.
+ */
+static InterCoreSGL *shm_peer_copy_sgl(InterCoreBufferId *id)
+{
+	InterCoreSGL *sgl = (InterCoreSGL *) (shm_peer.lx_dyn + id->bufOffset);
+	unsigned int num = sgl->numElements;
+	unsigned int size = offsetof(InterCoreSGL, elements) + num * sizeof(InterCoreSGLElement);
+
+	if(num == 0 || num > INTER_CORE_SGL_MAX_ELEMENTS || size > id->length)
+	{
+		printk(KERN_WARNING "SHM_PEER: bad SGL at 0x%x, %u elements\n", id->bufOffset, num);
+		return NULL;
+	}
+
+	return kmemdup(sgl, size, GFP_KERNEL);
+}
+
+/* A write Linux spread over several J1 buffers */
+static int shm_peer_write_sgl(InterCoreSGL *sgl, u64 lba, unsigned int len)
+{
+	InterCoreSGLElement *e;
+	unsigned int i, n, done = 0;
+
+	if(!sgl || sgl->totalLength < len)
+	{
+		return SHM_PEER_SENSE_INVALID_FIELD;
+	}
+
+	for(i = 0; i < sgl->numElements && done < len; i++)
+	{
+		e = &sgl->elements[i];
+		n = min(e->bufLength, len - done);
+		if(e->bufSrc != INTER_CORE_CMD_PARTITION_ID_J1 ||
+		   (u64) e->bufOffset + n > (u64) j1_mb << 20 ||
+		   n % SHM_PEER_SECTOR_SIZE)
+		{
+			return SHM_PEER_SENSE_INVALID_FIELD;
+		}
+		if(shm_peer_backing_rw(1, shm_peer.j1 + e->bufOffset, lba + done / SHM_PEER_SECTOR_SIZE, n))
+		{
+			return SHM_PEER_SENSE_WRITE_ERROR;
+		}
+		done += n;
+	}
+
+	return (done < len) ? SHM_PEER_SENSE_INVALID_FIELD : 0;
+}
+
+static int shm_peer_rw(InterCoreSCSICmd *cmd, InterCoreSGL *sgl, InterCoreSCSIResp *rsp, int write)
+{
+	unsigned char *cdb = cmd->cdb, *buf;
+	unsigned int blocks, len, offset;
+	u64 lba;
+
+	switch(cdb[0])
+	{
+	case READ_6:
+	case WRITE_6:
+		lba = ((cdb[1] & 0x1F) << 16) | (cdb[2] << 8) | cdb[3];
+		blocks = cdb[4] ? cdb[4] : 256;
+		break;
+	case READ_10:
+	case WRITE_10:
+		lba = get_unaligned_be32(&cdb[2]);
+		blocks = get_unaligned_be16(&cdb[7]);
+		break;
+	default:
+		lba = get_unaligned_be64(&cdb[2]);
+		blocks = get_unaligned_be32(&cdb[10]);
+		break;
+	}
+
+	if(lba > shm_peer.capacity || blocks > shm_peer.capacity - lba)
+	{
+		return SHM_PEER_SENSE_LBA_RANGE;
+	}
+	len = blocks * SHM_PEER_SECTOR_SIZE;
+	if(!len)
+	{
+		return 0;
+	}
+
+	if(!write)
+	{
+		if(shm_peer_pool_alloc(&shm_peer.read_pool, len, &offset))
+		{
+			return SHM_PEER_SENSE_NO_RESOURCE;
+		}
+		if(shm_peer_backing_rw(0, shm_peer.read_pool.base + offset, lba, len))
+		{
+			shm_peer_pool_free(&shm_peer.read_pool, offset, len);
+			return SHM_PEER_SENSE_READ_ERROR;
+		}
+		rsp->bufId1.bufOffset = offset;
+		rsp->bufId1.length = len;
+		rsp->bufId1.bufSrc = INTER_CORE_CMD_PARTITION_ID_HLBAT_CACHE;
+		return 0;
+	}
+
+	if(cmd->bufId.bufSrc == INTER_CORE_CMD_PARTITION_ID_LINUX_SGL)
+	{
+		return shm_peer_write_sgl(sgl, lba, len);
+	}
+	if(cmd->bufId.length < len)
+	{
+		return SHM_PEER_SENSE_INVALID_FIELD;
+	}
+	if(cmd->bufId.bufSrc == INTER_CORE_CMD_PARTITION_ID_J1)
+	{
+		buf = shm_peer.j1 + cmd->bufId.bufOffset;
+	}
+	else if(cmd->bufId.bufSrc == INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM)
+	{
+		buf = shm_peer.lx_dyn + cmd->bufId.bufOffset;
+	}
+	else
+	{
+		return SHM_PEER_SENSE_INVALID_FIELD;
+	}
+
+	return shm_peer_backing_rw(1, buf, lba, len) ? SHM_PEER_SENSE_WRITE_ERROR : 0;
+}
+
+static int shm_peer_exec(InterCoreSCSICmd *cmd, InterCoreSGL *sgl, InterCoreSCSIResp *rsp)
+{
+	int lun = cmd->lun[0] || cmd->lun[1];
+
+	switch(cmd->cdb[0])
+	{
+	case INQUIRY:
+		return shm_peer_inquiry(cmd, rsp, lun);
+	case REPORT_LUNS:
+		return shm_peer_report_luns(cmd, rsp);
+	}
+
+	if(lun)
+	{
+		return SHM_PEER_SENSE_NO_LUN;
+	}
+
+	switch(cmd->cdb[0])
+	{
+	case TEST_UNIT_READY:
+	case START_STOP:
+	case VERIFY:
+		return 0;
+	case SYNCHRONIZE_CACHE:
+		if(shm_peer.filp && vfs_fsync(shm_peer.filp, 0))
+		{
+			return SHM_PEER_SENSE_WRITE_ERROR;
+		}
+		return 0;
+	case READ_CAPACITY:
+		return shm_peer_read_capacity(cmd, rsp);
+	case SERVICE_ACTION_IN:
+		if((cmd->cdb[1] & 0x1F) != SAI_READ_CAPACITY_16)
+		{
+			return SHM_PEER_SENSE_INVALID_FIELD;
+		}
+		return shm_peer_read_capacity(cmd, rsp);
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+		return shm_peer_mode_sense(cmd, rsp);
+	case READ_6:
+	case READ_10:
+	case READ_16:
+		return shm_peer_rw(cmd, sgl, rsp, 0);
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_16:
+		return shm_peer_rw(cmd, sgl, rsp, 1);
+	}
+
+	return SHM_PEER_SENSE_INVALID_OPCODE;
+}
+
+/*
+ * Give J1 buffers back the way the Vx core does once the data is safe:
+ * mark the descriptors released, then tell Linux on the resource queue.
+ */
+static void shm_peer_release_j1(InterCoreCmdTag tag, InterCoreBufferId *id)
+{
+	SharedPartitionInfoStruct *info = shm_peer.j1_info;
+	unsigned char *dataStart = shm_peer.j1 + SHARED_PARTITION_INFO_AREA_SIZE;
+	WriteBufferPoolInfo *pool;
+	WriteBufferDescriptor *desc;
+	InterCoreLxResource lxr;
+	unsigned int rel, first, num, i;
+
+	rel = id->bufOffset - SHARED_PARTITION_INFO_AREA_SIZE;
+	pool = (rel >= info->BulkPoolInfo.BufferStartOffset) ? &info->BulkPoolInfo : &info->TransPoolInfo;
+	if(id->bufOffset < SHARED_PARTITION_INFO_AREA_SIZE ||
+	   rel < pool->BufferStartOffset || rel >= pool->BufferEndOffset)
+	{
+		printk(KERN_WARNING "SHM_PEER: J1 offset 0x%x outside the pools\n", id->bufOffset);
+		return;
+	}
+
+	first = (rel - pool->BufferStartOffset) / pool->BufferSize;
+	num = id->length ? DIV_ROUND_UP(id->length, pool->BufferSize) : 1;
+	desc = (WriteBufferDescriptor *) (dataStart + pool->DescStartOffset);
+	for(i = first; i < first + num && i < pool->NumBuffers; i++)
+	{
+		ATOMIC_SET32(&desc[i].releasedToAllocator, WRITE_BUFFER_FREE);
+	}
+	wmb();
+
+	memset(&lxr, 0, sizeof(lxr));
+	lxr.version = INTER_CORE_CMD_PROTOCOL_CUR_VERSION;
+	lxr.tag = tag;
+	lxr.bufId1 = *id;
+	lxr.bufId2.bufSrc = INTER_CORE_CMD_PARTITION_ID_INVALID;
+
+	shm_peer_send(&shm_peer.qp[SHM_PEER_QP_RES].tx, &lxr, sizeof(lxr));
+}
+
+static void shm_peer_scsi_work(struct work_struct *work)
+{
+	shm_peer_cmd *c = container_of(work, shm_peer_cmd, work);
+	InterCoreSCSICmd *cmd = &c->cmd;
+	InterCoreSCSIResp rsp;
+	unsigned char *sense;
+	unsigned int offset;
+	int ret;
+
+	if(latency_us)
+	{
+		usleep_range(latency_us, latency_us + latency_us / 8 + 1);
+	}
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.version = INTER_CORE_CMD_PROTOCOL_CUR_VERSION;
+	rsp.tag = cmd->tag;
+	rsp.backEndTag = cmd->tag;
+	rsp.bufId1.bufSrc = INTER_CORE_CMD_PARTITION_ID_INVALID;
+	rsp.bufId2.bufSrc = INTER_CORE_CMD_PARTITION_ID_INVALID;
+
+	if(cmd->bufId.bufSrc == INTER_CORE_CMD_PARTITION_ID_LINUX_SGL)
+	{
+		c->sgl = shm_peer_copy_sgl(&cmd->bufId);
+	}
+
+	ret = shm_peer_exec(cmd, c->sgl, &rsp);
+	atomic_inc(&shm_peer.cmds);
+
+	/* Linux frees its dynamic buffer when it sees it in the response */
+	if(cmd->bufId.bufSrc == INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM)
+	{
+		rsp.bufId1 = cmd->bufId;
+	}
+
+	if(ret && !shm_peer_pool_alloc(&shm_peer.vx_dyn_pool, SHM_PEER_SENSE_LEN, &offset))
+	{
+		atomic_inc(&shm_peer.errors);
+		sense = shm_peer.vx_dyn_pool.base + offset;
+		memset(sense, 0, SHM_PEER_SENSE_LEN);
+		sense[0] = 0x70;
+		sense[2] = (ret >> 16) & 0x0F;
+		sense[7] = SHM_PEER_SENSE_LEN - 8;
+		sense[12] = (ret >> 8) & 0xFF;
+		sense[13] = ret & 0xFF;
+		rsp.status = SAM_STAT_CHECK_CONDITION;
+		rsp.bufId2.bufOffset = offset;
+		rsp.bufId2.length = SHM_PEER_SENSE_LEN;
+		rsp.bufId2.bufSrc = INTER_CORE_CMD_PARTITION_ID_VXWORKS_DYN_MEM;
+	}
+	else if(ret)
+	{
+		rsp.status = SAM_STAT_BUSY;
+	}
+
+	shm_peer_send(&shm_peer.qp[SHM_PEER_QP_SCSI].tx, &rsp, sizeof(rsp));
+
+	if(cmd->bufId.bufSrc == INTER_CORE_CMD_PARTITION_ID_J1)
+	{
+		shm_peer_release_j1(cmd->tag, &cmd->bufId);
+	}
+	else if(c->sgl)
+	{
+		unsigned int i;
+
+		for(i = 0; i < c->sgl->numElements; i++)
+		{
+			InterCoreBufferId id;
+
+			id.bufOffset = c->sgl->elements[i].bufOffset;
+			id.length = c->sgl->elements[i].bufLength;
+			id.bufSrc = INTER_CORE_CMD_PARTITION_ID_J1;
+			shm_peer_release_j1(cmd->tag, &id);
+		}
+		kfree(c->sgl);
+	}
+
+	kfree(c);
+}
+
+/* Pull commands off the SCSI queue and fan them out to the workers */
+static int shm_peer_scsi_thread(void *data)
+{
+	shm_peer_cmd *c = NULL;
+
+	while(!kthread_should_stop())
+	{
+		if(!c && !(c = kmalloc(sizeof(*c), GFP_KERNEL)))
+		{
+			msleep(SHM_PEER_POLL_MS);
+			continue;
+		}
+
+		if(shm_peer_recv(&shm_peer.qp[SHM_PEER_QP_SCSI].rx, &c->cmd, sizeof(c->cmd)) < 0)
+		{
+			continue;
+		}
+
+		c->sgl = NULL;
+		INIT_WORK(&c->work, shm_peer_scsi_work);
+		queue_work(shm_peer.wq, &c->work);
+		c = NULL;
+	}
+
+	kfree(c);
+	return 0;
+}
+
+/* Linux is done with read data or sense we handed it */
+static void shm_peer_free_vx_buffer(InterCoreBufferId *id)
+{
+	if(id->bufSrc == INTER_CORE_CMD_PARTITION_ID_HLBAT_CACHE)
+	{
+		shm_peer_pool_free(&shm_peer.read_pool, id->bufOffset, id->length);
+	}
+	else if(id->bufSrc == INTER_CORE_CMD_PARTITION_ID_VXWORKS_DYN_MEM)
+	{
+		shm_peer_pool_free(&shm_peer.vx_dyn_pool, id->bufOffset, id->length);
+	}
+}
+
+static int shm_peer_res_thread(void *data)
+{
+	InterCoreVxResource vxr;
+
+	while(!kthread_should_stop())
+	{
+		if(shm_peer_recv(&shm_peer.qp[SHM_PEER_QP_RES].rx, &vxr, sizeof(vxr)) < 0)
+		{
+			continue;
+		}
+
+		shm_peer_free_vx_buffer(&vxr.bufId1);
+		shm_peer_free_vx_buffer(&vxr.bufId2);
+	}
+
+	return 0;
+}
+
+/***************************** CORE CONTROL ******************************/
+
+/*
+ * Answer a Linux side "ready to wait" the way the VxWorks core does. Takes
+ * a module reference first, from here on Linux depends on our memory.
+ */
+static int shm_peer_handshake(volatile unsigned int *waitStatus, volatile unsigned int *initStatus)
+{
+	while(*waitStatus != SHARED_MEM_CPU1_READY_TO_WAIT_MARKER)
+	{
+		if(kthread_should_stop())
+		{
+			return -EINTR;
+		}
+		msleep_interruptible(SHM_PEER_POLL_MS);
+	}
+
+	if(!shm_peer.pinned)
+	{
+		if(!try_module_get(THIS_MODULE))
+		{
+			return -EINTR;
+		}
+		shm_peer.pinned = 1;
+	}
+
+	*waitStatus = SHARED_MEM_CPU0_CLEARED_TO_WAIT_MARKER;
+	wmb();
+	*initStatus = SHARED_MEM_CPU0_INIT_DONE_MARKER;
+
+	return 0;
+}
+
+static int shm_peer_ctrl_thread(void *data)
+{
+	InterCoreCtrlVxToLx enable;
+	InterCoreCtrlLxToVx msg;
+	struct timespec now;
+
+	if(shm_peer_handshake(&shm_peer.header->cpu1_wait_status, &shm_peer.header->cpu0_init_status))
+	{
+		return 0;
+	}
+	printk("SHM_PEER: shared memory synced with Linux\n");
+
+	if(shm_peer_handshake(&shm_peer.queueHeader->cpu1_queue_wait_status,
+			      &shm_peer.queueHeader->cpu0_queue_init_status))
+	{
+		return 0;
+	}
+	printk("SHM_PEER: queues synced with Linux\n");
+
+	/* Bring up the Linux target side like the Vx core does after boot */
+	getnstimeofday(&now);
+	memset(&enable, 0, sizeof(enable));
+	enable.version = INTER_CORE_CMD_PROTOCOL_CUR_VERSION;
+	enable.flags = ISCSI_ENABLE | TIME_VALID;
+	enable.secondsSinceEpoch = now.tv_sec;
+	shm_peer_send(&shm_peer.qp[SHM_PEER_QP_CORE].tx, &enable, sizeof(enable));
+
+	while(!kthread_should_stop())
+	{
+		if(shm_peer_recv(&shm_peer.qp[SHM_PEER_QP_CORE].rx, &msg, sizeof(msg)) < 0)
+		{
+			continue;
+		}
+
+		if(msg.flags & ISCSI_UP)
+		{
+			printk("SHM_PEER: Linux target side is up\n");
+		}
+	}
+
+	return 0;
+}
+
+/***************************** INIT / EXIT *******************************/
+
+static int shm_peer_backing_init(void)
+{
+	if(backing[0])
+	{
+		shm_peer.filp = filp_open(backing, O_RDWR | O_LARGEFILE, 0);
+		if(IS_ERR(shm_peer.filp))
+		{
+			printk(KERN_ERR "SHM_PEER: unable to open %s: %ld\n", backing, PTR_ERR(shm_peer.filp));
+			shm_peer.filp = NULL;
+			return -ENOENT;
+		}
+		shm_peer.capacity = size_mb ? ((u64) size_mb << 20) :
+				    i_size_read(shm_peer.filp->f_path.dentry->d_inode);
+	}
+	else
+	{
+		shm_peer.capacity = (u64) size_mb << 20;
+		shm_peer.ram = vzalloc(shm_peer.capacity);
+		if(!shm_peer.ram)
+		{
+			printk(KERN_ERR "SHM_PEER: no memory for a %u MB RAM LUN\n", size_mb);
+			return -ENOMEM;
+		}
+	}
+
+	shm_peer.capacity >>= 9;
+	if(!shm_peer.capacity)
+	{
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void shm_peer_cleanup(void)
+{
+	shm_peer.stopping = 1;
+
+	if(shm_peer.ctrl_th)
+		kthread_stop(shm_peer.ctrl_th);
+	if(shm_peer.scsi_th)
+		kthread_stop(shm_peer.scsi_th);
+	if(shm_peer.res_th)
+		kthread_stop(shm_peer.res_th);
+	if(shm_peer.wq)
+		destroy_workqueue(shm_peer.wq);
+
+	if(shm_peer.filp)
+		filp_close(shm_peer.filp, NULL);
+	vfree(shm_peer.ram);
+	kfree(shm_peer.read_pool.map);
+	kfree(shm_peer.vx_dyn_pool.map);
+	vfree(shm_peer.mem);
+}
+
+static int __init shm_peer_init(void)
+{
+	SharedMemPartitionInfo *partition, *readPartition, *vxDynPartition;
+	unsigned int i, offset = SHARED_MEM_HEADER_PARTITION_SIZE;
+	unsigned int j1Size = j1_mb << 20, readSize = read_mb << 20;
+	int ret;
+
+	if(!j1_mb || !read_mb || !workers)
+	{
+		return -EINVAL;
+	}
+
+	for(i = 0; i < SHM_QUEUE_MAX_DOORBELL_BIT_SHIFT; i++)
+	{
+		init_waitqueue_head(&shm_peer.db_wait[i]);
+	}
+
+	ret = shm_peer_backing_init();
+	if(ret)
+	{
+		goto shm_peer_init_error;
+	}
+
+	shm_peer.mem_size = SHARED_MEM_HEADER_PARTITION_SIZE + SHM_PEER_QUEUE_POOL_SIZE + j1Size + readSize +
+			    PARTITION_SIZE_LX_CORE_DYN_SHARED_MEM + PARTITION_SIZE_VX_CORE_DYN_SHARED_MEM +
+			    PARTITION_SIZE_SGL_DESC_POOL;
+	shm_peer.mem = vzalloc(shm_peer.mem_size);
+	if(!shm_peer.mem)
+	{
+		printk(KERN_ERR "SHM_PEER: no memory for %u bytes of shared memory\n", shm_peer.mem_size);
+		ret = -ENOMEM;
+		goto shm_peer_init_error;
+	}
+
+	shm_peer.header = (SharedMemPartitionDescHeader *) shm_peer.mem;
+	shm_peer.header->cpu0_init_status = SHARED_MEM_CPU0_INIT_IN_PROGRESS_MARKER;
+	shm_peer.header->header_magic = SHARED_MEM_HEADER_MAGIC;
+	shm_peer.header->header_version = SHARED_MEM_HEADER_CUR_VERSION;
+	shm_peer.header->total_shared_mem = shm_peer.mem_size;
+
+	partition = shm_peer_add_partition(&offset, PARTITION_TAG_SHARED_MEM_QUEUES_POOL,
+					   PARTITION_DESC_SHARED_MEM_QUEUES_POOL, SHM_PEER_QUEUE_POOL_SIZE);
+	shm_peer.queueHeader = (SHMQueueHeader *) shm_peer_map_region(partition);
+	partition = shm_peer_add_partition(&offset, PARTITION_TAG_J1, PARTITION_DESC_J1, j1Size);
+	shm_peer.j1 = shm_peer_map_region(partition);
+	readPartition = shm_peer_add_partition(&offset, SHM_PEER_TAG_READ, PARTITION_DESC_HLBAT_CACHE, readSize);
+	partition = shm_peer_add_partition(&offset, PARTITION_TAG_LX_CORE_DYN_SHARED_MEM,
+					   PARTITION_DESC_LX_CORE_DYN_SHARED_MEM,
+					   PARTITION_SIZE_LX_CORE_DYN_SHARED_MEM);
+	shm_peer.lx_dyn = shm_peer_map_region(partition);
+	vxDynPartition = shm_peer_add_partition(&offset, PARTITION_TAG_VX_CORE_DYN_SHARED_MEM,
+						PARTITION_DESC_VX_CORE_DYN_SHARED_MEM,
+						PARTITION_SIZE_VX_CORE_DYN_SHARED_MEM);
+	shm_peer_add_partition(&offset, PARTITION_TAG_SGL_DESC_POOL, PARTITION_DESC_SGL_DESC_POOL,
+			       PARTITION_SIZE_SGL_DESC_POOL);
+
+	if(shm_peer_pool_init(&shm_peer.read_pool, shm_peer_map_region(readPartition), readSize) ||
+	   shm_peer_pool_init(&shm_peer.vx_dyn_pool, shm_peer_map_region(vxDynPartition),
+			      PARTITION_SIZE_VX_CORE_DYN_SHARED_MEM))
+	{
+		ret = -ENOMEM;
+		goto shm_peer_init_error;
+	}
+
+	shm_peer_init_queues();
+	shm_peer_init_j1(j1Size);
+
+	shm_peer.wq = alloc_workqueue("shm_peer", WQ_UNBOUND, workers);
+	if(!shm_peer.wq)
+	{
+		ret = -ENOMEM;
+		goto shm_peer_init_error;
+	}
+
+	shm_peer.scsi_th = kthread_run(shm_peer_scsi_thread, NULL, "shm_peer_scsi");
+	shm_peer.res_th = kthread_run(shm_peer_res_thread, NULL, "shm_peer_res");
+	shm_peer.ctrl_th = kthread_run(shm_peer_ctrl_thread, NULL, "shm_peer_ctrl");
+	if(IS_ERR(shm_peer.scsi_th) || IS_ERR(shm_peer.res_th) || IS_ERR(shm_peer.ctrl_th))
+	{
+		if(IS_ERR(shm_peer.scsi_th))
+			shm_peer.scsi_th = NULL;
+		if(IS_ERR(shm_peer.res_th))
+			shm_peer.res_th = NULL;
+		if(IS_ERR(shm_peer.ctrl_th))
+			shm_peer.ctrl_th = NULL;
+		ret = -ENOMEM;
+		goto shm_peer_init_error;
+	}
+
+	shm_peer_operations.header = shm_peer.header;
+	ret = shm_peer_register(&shm_peer_operations);
+	if(ret)
+	{
+		printk(KERN_ERR "SHM_PEER: unable to stand in for the other core: %d\n", ret);
+		goto shm_peer_init_error;
+	}
+
+	printk("SHM_PEER: %llu sectors on %s, %u us latency, %u workers\n",
+	       (unsigned long long) shm_peer.capacity, backing[0] ? backing : "RAM", latency_us, workers);
+
+	return 0;
+
+shm_peer_init_error:
+	shm_peer_cleanup();
+	return ret;
+}
+
+static void __exit shm_peer_exit(void)
+{
+	/* Nobody synced with us, or we would be pinned */
+	if(shm_peer_unregister(&shm_peer_operations))
+	{
+		printk(KERN_ERR "SHM_PEER: still in use, leaking the shared memory\n");
+		shm_peer.mem = NULL;
+	}
+
+	shm_peer_cleanup();
+
+	printk("SHM_PEER: %u commands, %u failed\n", atomic_read(&shm_peer.cmds), atomic_read(&shm_peer.errors));
+}
+
+module_init(shm_peer_init);
+module_exit(shm_peer_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Loopback peer standing in for the VxWorks core");
@@ -25,6 +25,28 @@
 #define SHM_DOORBELL_VXWORKS_CPU_ID		0x0
 #define SHM_DOORBELL_LINUX_CPU_ID		0x1
 
+/* Wait time histogram. Bucket n counts waits of [2^(n-1), 2^n) usecs, bucket 0
+ * counts waits under 1 usec and the last bucket is open ended.
+ */
+#define SHM_QUEUE_WAIT_HIST_BUCKETS		20
+
+typedef struct _shm_queue_wait_stats
+{
+	unsigned int waits;			/* Times the slot was not ours when we looked */
+	unsigned int spin_hits;			/* Waits satisfied inside the busy-poll window */
+	unsigned int sleeps;			/* Waits that slept on the doorbell wait queue */
+	unsigned int hist[SHM_QUEUE_WAIT_HIST_BUCKETS];
+} shm_queue_wait_stats;
+
+/* Linux side claim state of one queue direction, see shm_queue_claim_slot() */
+typedef struct _shm_queue_ring
+{
+	atomic_t ticket;			/* Running count of slots claimed, wraps at numSlots * SHM_QUEUE_LAP_WRAP */
+	unsigned short *lap;			/* Per slot, the lap in which it can next be claimed */
+	spinlock_t lock;			/* Moves ticket on and publishes next with it */
+	unsigned int *next;			/* nextSlotToInsert/nextSlotToProcess in shared memory */
+} shm_queue_ring;
+
 typedef struct _shm_queue_pair_os_info
 {
 	SHMQueuePairInfoStatus *shmQPairPtr;
@@ -32,8 +54,13 @@ typedef struct _shm_queue_pair_os_info
 	unsigned char *slot_buf_ptr_vx_to_lx;
 	wait_queue_head_t recv_vx_to_lx_wait_queue_head;
 	wait_queue_head_t send_lx_to_vx_wait_queue_head;
-	struct semaphore q_lx_to_vx_mutex;
-	struct semaphore q_vx_to_lx_mutex;
+	shm_queue_ring lx_to_vx_ring;
+	shm_queue_ring vx_to_lx_ring;
+	struct semaphore q_lx_to_vx_mutex;	/* Only serializes user space senders */
+	struct semaphore q_vx_to_lx_mutex;	/* Only serializes user space receivers */
+	unsigned int spin_usecs;		/* Busy-poll window before sleeping on the doorbell */
+	shm_queue_wait_stats send_wait_stats;	/* Not locked, approximate with concurrent waiters */
+	shm_queue_wait_stats recv_wait_stats;
 } shm_queue_pair_os_info;
 
 typedef enum _shm_queue_bit_shift_type
@@ -0,0 +1,1003 @@
+/*
+ * raid5-log.c : write journal for md/raid4/5/6
+ *
+ * A separate block device (an SSD, or anything with fast stable writes)
+ * records stripe blocks before the array is touched: every stripe write
+ * logs its new data and parity and only then goes to the member disks, so
+ * a crash in the middle of the update can be repaired by writing the
+ * logged blocks again (the raid5 "write hole").  The journal is
+ * write-through, a write completes only once it is on the members.
+ *
+ * On-disk layout: one superblock page at sector 0, then a ring of
+ * records.  A record is a meta page listing up to R5L_MAX_ENTRIES blocks
+ * (stripe sector, disk, data or parity, crc) followed by those blocks.
+ * Records carry increasing sequence numbers; a record that is torn or
+ * out of sequence ends the log.  The superblock holds the tail: the oldest
+ * record that may still be needed, moved on once the member disks have
+ * been flushed.
+ *
+ * Replay happens when a journal with live records is attached, which must
+ * be before the array is written to.  A record holds the data and parity
+ * of each of its stripes, so every block of every complete record is
+ * simply written to its member again, oldest record first.
+ */
+
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/crc32.h>
+#include <linux/random.h>
+#include "md.h"
+#include "raid5.h"
+
+#define R5L_MAGIC		0x6433c509
+#define R5L_META_MAGIC		0x6433c50a
+#define R5L_VERSION		1
+
+#define R5L_MAX_ENTRIES		128
+#define R5L_MAX_RECORD_SECTORS	((1 + R5L_MAX_ENTRIES) * STRIPE_SECTORS)
+#define R5L_MIN_SECTORS		(16 << (20 - 9))	/* 16MB */
+#define R5L_SEQ_SKIP		65536	/* past records in flight at a crash */
+
+struct r5l_super {
+	__le32	magic;
+	__le32	version;
+	__le32	checksum;	/* crc32 of the page, this field zero */
+	__le32	pad;
+	__u8	uuid[16];	/* array uuid */
+	__le64	data_start;	/* ring of records, in sectors */
+	__le64	data_end;
+	__le64	tail;		/* first record to replay */
+	__le64	tail_seq;	/* and its sequence number */
+} __attribute__ ((packed));
+
+enum {
+	R5L_DATA = 1,
+	R5L_PARITY = 2,
+};
+
+struct r5l_entry {
+	__le64	sector;		/* stripe sector on the members */
+	__le16	disk;
+	__le16	type;
+	__le32	checksum;	/* crc32 of the block */
+} __attribute__ ((packed));
+
+struct r5l_meta {
+	__le32	magic;
+	__le32	checksum;	/* crc32 of the page, this field zero */
+	__le64	seq;
+	__le64	position;	/* sector of this meta page */
+	__le32	nr_entries;
+	__le32	pad;
+	__u8	uuid[16];
+	struct r5l_entry entries[0];
+} __attribute__ ((packed));
+
+/* A record being filled or written */
+struct r5l_io_unit {
+	struct r5l_log		*log;
+	struct page		*meta_page;
+	struct page		*pages[R5L_MAX_ENTRIES];
+	int			nr_entries;
+	sector_t		pos;
+	u64			seq;
+	struct list_head	stripe_list;	/* stripes waiting for it */
+	struct list_head	list;		/* running_ios and after */
+	atomic_t		pending_bios;
+	int			error;
+	int			done;
+};
+
+struct r5l_log {
+	struct r5conf		*conf;
+	struct block_device	*bdev;
+	sector_t		data_start;
+	sector_t		data_end;
+	int			need_flush;	/* volatile write cache */
+	int			failed;
+
+	struct mutex		io_mutex;	/* protects the fields below */
+	struct r5l_io_unit	*current_io;
+	sector_t		head;		/* where the next record goes */
+	u64			seq;		/* and its sequence number */
+	sector_t		sb_tail;	/* tail in the superblock */
+	u64			sb_tail_seq;
+
+	spinlock_t		stripes_lock;
+	struct list_head	stripe_list;	/* stripes in the log, by age */
+	struct list_head	no_space_stripes;
+
+	spinlock_t		io_list_lock;
+	struct list_head	running_ios;	/* submitted, by sequence */
+	struct list_head	io_end_ios;	/* written, need a flush */
+	struct list_head	flushing_ios;
+	int			flushing;
+
+	mempool_t		*io_pool;
+	mempool_t		*meta_pool;
+	struct page		*sb_page;
+	wait_queue_head_t	wait;
+};
+
+static sector_t r5l_ring_size(struct r5l_log *log)
+{
+	return log->data_end - log->data_start;
+}
+
+static sector_t r5l_ring_distance(struct r5l_log *log, sector_t start,
+				  sector_t end)
+{
+	if (end >= start)
+		return end - start;
+	return end - log->data_start + log->data_end - start;
+}
+
+/* A record never straddles the end of the ring */
+static sector_t r5l_ring_wrap(struct r5l_log *log, sector_t pos)
+{
+	if (log->data_end - pos < R5L_MAX_RECORD_SECTORS)
+		return log->data_start;
+	return pos;
+}
+
+/* Sectors left for new records.  io_mutex held. */
+static sector_t r5l_free_space(struct r5l_log *log)
+{
+	sector_t used;
+
+	used = r5l_ring_distance(log, log->sb_tail, log->head);
+	if (log->current_io)
+		used += (1 + log->current_io->nr_entries) * STRIPE_SECTORS;
+	/* the gap at the end of the ring, and never catch the tail */
+	used += R5L_MAX_RECORD_SECTORS;
+	if (used >= r5l_ring_size(log))
+		return 0;
+	return r5l_ring_size(log) - used;
+}
+
+static u32 r5l_page_checksum(struct page *page)
+{
+	return crc32_le(~0, page_address(page), PAGE_SIZE);
+}
+
+static void r5l_log_failed(struct r5l_log *log)
+{
+	char b[BDEVNAME_SIZE];
+
+	if (!log->failed)
+		printk(KERN_ERR "md/raid:%s: journal %s failed, "
+		       "continuing without it\n",
+		       mdname(log->conf->mddev), bdevname(log->bdev, b));
+	log->failed = 1;
+	md_wakeup_thread(log->conf->mddev->thread);
+}
+
+static void r5l_end_sync_io(struct bio *bio, int error)
+{
+	complete((struct completion *)bio->bi_private);
+}
+
+static int r5l_sync_page_io(struct r5l_log *log, sector_t sector,
+			    struct page *page, int rw)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, 1);
+	struct completion event;
+	int ret;
+
+	bio->bi_bdev = log->bdev;
+	bio->bi_sector = sector;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	init_completion(&event);
+	bio->bi_private = &event;
+	bio->bi_end_io = r5l_end_sync_io;
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&event);
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_put(bio);
+	return ret ? 0 : -EIO;
+}
+
+static int r5l_write_super(struct r5l_log *log, sector_t tail, u64 seq)
+{
+	struct r5l_super *sb = page_address(log->sb_page);
+
+	clear_page(sb);
+	sb->magic = cpu_to_le32(R5L_MAGIC);
+	sb->version = cpu_to_le32(R5L_VERSION);
+	memcpy(sb->uuid, log->conf->mddev->uuid, sizeof(sb->uuid));
+	sb->data_start = cpu_to_le64(log->data_start);
+	sb->data_end = cpu_to_le64(log->data_end);
+	sb->tail = cpu_to_le64(tail);
+	sb->tail_seq = cpu_to_le64(seq);
+	sb->checksum = cpu_to_le32(r5l_page_checksum(log->sb_page));
+
+	if (r5l_sync_page_io(log, 0, log->sb_page, WRITE_FLUSH_FUA)) {
+		r5l_log_failed(log);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Make completed writes to the members stable before the log forgets them */
+static void r5l_flush_members(struct r5conf *conf)
+{
+	int i;
+
+	for (i = 0; i < conf->raid_disks; i++) {
+		struct md_rdev *rdev;
+
+		rcu_read_lock();
+		rdev = rcu_dereference(conf->disks[i].rdev);
+		if (rdev && !test_bit(Faulty, &rdev->flags))
+			atomic_inc(&rdev->nr_pending);
+		else
+			rdev = NULL;
+		rcu_read_unlock();
+		if (!rdev)
+			continue;
+		blkdev_issue_flush(rdev->bdev, GFP_NOIO, NULL);
+		rdev_dec_pending(rdev, conf->mddev);
+	}
+}
+
+/* The journal holds the stripe: carry on with the disk writes */
+static void r5l_stripe_logged(struct stripe_head *sh)
+{
+	set_bit(STRIPE_LOG_WRITEOUT, &sh->state);
+	clear_bit(STRIPE_LOG_TRAPPED, &sh->state);
+	set_bit(STRIPE_HANDLE, &sh->state);
+	raid5_release_stripe(sh);
+}
+
+static void r5l_io_finish(struct r5l_io_unit *io)
+{
+	struct r5l_log *log = io->log;
+
+	while (!list_empty(&io->stripe_list)) {
+		struct stripe_head *sh;
+
+		sh = list_first_entry(&io->stripe_list, struct stripe_head,
+				      log_io_list);
+		list_del_init(&sh->log_io_list);
+		r5l_stripe_logged(sh);
+	}
+	mempool_free(io->meta_page, log->meta_pool);
+	mempool_free(io, log->io_pool);
+}
+
+/*
+ * Records complete in any order but replay stops at the first missing
+ * one, so stripes are only let go in sequence.
+ */
+static void r5l_io_written(struct r5l_io_unit *io)
+{
+	struct r5l_log *log = io->log;
+	struct r5l_io_unit *next;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int flush = 0;
+
+	if (io->error)
+		r5l_log_failed(log);
+
+	spin_lock_irqsave(&log->io_list_lock, flags);
+	io->done = 1;
+	while (!list_empty(&log->running_ios)) {
+		io = list_first_entry(&log->running_ios, struct r5l_io_unit,
+				      list);
+		if (!io->done)
+			break;
+		if (log->need_flush && !log->failed) {
+			list_move_tail(&io->list, &log->io_end_ios);
+			flush = 1;
+		} else
+			list_move_tail(&io->list, &done);
+	}
+	spin_unlock_irqrestore(&log->io_list_lock, flags);
+
+	if (flush)
+		md_wakeup_thread(log->conf->mddev->thread);
+	list_for_each_entry_safe(io, next, &done, list)
+		r5l_io_finish(io);
+}
+
+static void r5l_log_endio(struct bio *bio, int error)
+{
+	struct r5l_io_unit *io = bio->bi_private;
+
+	if (error)
+		io->error = 1;
+	bio_put(bio);
+	if (atomic_dec_and_test(&io->pending_bios))
+		r5l_io_written(io);
+}
+
+static struct bio *r5l_bio_alloc(struct r5l_log *log, struct r5l_io_unit *io,
+				 sector_t sector)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, BIO_MAX_PAGES);
+
+	bio->bi_bdev = log->bdev;
+	bio->bi_sector = sector;
+	bio->bi_end_io = r5l_log_endio;
+	bio->bi_private = io;
+	return bio;
+}
+
+/* io_mutex held */
+static void r5l_submit_io(struct r5l_log *log, struct r5l_io_unit *io)
+{
+	struct r5l_meta *meta = page_address(io->meta_page);
+	sector_t sector = io->pos;
+	struct bio *bio;
+	int i;
+
+	log->current_io = NULL;
+	log->head = io->pos + (1 + io->nr_entries) * STRIPE_SECTORS;
+
+	meta->magic = cpu_to_le32(R5L_META_MAGIC);
+	meta->seq = cpu_to_le64(io->seq);
+	meta->position = cpu_to_le64(io->pos);
+	meta->nr_entries = cpu_to_le32(io->nr_entries);
+	memcpy(meta->uuid, log->conf->mddev->uuid, sizeof(meta->uuid));
+	meta->checksum = cpu_to_le32(r5l_page_checksum(io->meta_page));
+
+	spin_lock_irq(&log->io_list_lock);
+	list_add_tail(&io->list, &log->running_ios);
+	spin_unlock_irq(&log->io_list_lock);
+
+	atomic_set(&io->pending_bios, 1);
+	bio = r5l_bio_alloc(log, io, sector);
+	for (i = -1; i < io->nr_entries; i++) {
+		struct page *page = i < 0 ? io->meta_page : io->pages[i];
+
+		if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+			atomic_inc(&io->pending_bios);
+			submit_bio(WRITE, bio);
+			bio = r5l_bio_alloc(log, io, sector);
+			bio_add_page(bio, page, PAGE_SIZE, 0);
+		}
+		sector += STRIPE_SECTORS;
+	}
+	atomic_inc(&io->pending_bios);
+	submit_bio(WRITE, bio);
+
+	if (atomic_dec_and_test(&io->pending_bios))
+		r5l_io_written(io);
+}
+
+/* io_mutex held */
+static struct r5l_io_unit *r5l_new_io(struct r5l_log *log)
+{
+	struct r5l_io_unit *io;
+
+	io = mempool_alloc(log->io_pool, GFP_NOIO);
+	memset(io, 0, sizeof(*io));
+	io->log = log;
+	INIT_LIST_HEAD(&io->stripe_list);
+	INIT_LIST_HEAD(&io->list);
+	io->meta_page = mempool_alloc(log->meta_pool, GFP_NOIO);
+	clear_page(page_address(io->meta_page));
+
+	log->head = r5l_ring_wrap(log, log->head);
+	io->pos = log->head;
+	io->seq = log->seq++;
+	log->current_io = io;
+	return io;
+}
+
+/* Blocks of a stripe to log: the new data and the parity */
+static int r5l_stripe_blocks(struct stripe_head *sh)
+{
+	int i, cnt = 0;
+
+	for (i = sh->disks; i--; )
+		if (i == sh->pd_idx || i == sh->qd_idx || sh->dev[i].written)
+			cnt++;
+	return cnt;
+}
+
+static void r5l_add_block(struct r5l_io_unit *io, struct stripe_head *sh,
+			  int disk, int type)
+{
+	struct r5l_meta *meta = page_address(io->meta_page);
+	struct r5l_entry *e = &meta->entries[io->nr_entries];
+	struct page *page = sh->dev[disk].page;
+
+	e->sector = cpu_to_le64(sh->sector);
+	e->disk = cpu_to_le16(disk);
+	e->type = cpu_to_le16(type);
+	e->checksum = cpu_to_le32(r5l_page_checksum(page));
+	io->pages[io->nr_entries++] = page;
+}
+
+/*
+ * Add the blocks of a stripe to the current record; a stripe never spans
+ * two records.  The stripe is trapped, holding a reference, until the
+ * record is stable.  io_mutex held.
+ */
+static void r5l_append(struct r5l_log *log, struct stripe_head *sh)
+{
+	struct r5l_io_unit *io = log->current_io;
+	int i;
+
+	if (io && io->nr_entries + r5l_stripe_blocks(sh) > R5L_MAX_ENTRIES) {
+		r5l_submit_io(log, io);
+		io = NULL;
+	}
+	if (!io)
+		io = r5l_new_io(log);
+
+	for (i = 0; i < sh->disks; i++)
+		if (i != sh->pd_idx && i != sh->qd_idx && sh->dev[i].written)
+			r5l_add_block(io, sh, i, R5L_DATA);
+	r5l_add_block(io, sh, sh->pd_idx, R5L_PARITY);
+	if (sh->qd_idx >= 0)
+		r5l_add_block(io, sh, sh->qd_idx, R5L_PARITY);
+
+	spin_lock(&log->stripes_lock);
+	if (list_empty(&sh->log_list)) {
+		sh->log_start = io->pos;
+		sh->log_seq = io->seq;
+		list_add_tail(&sh->log_list, &log->stripe_list);
+	}
+	spin_unlock(&log->stripes_lock);
+
+	set_bit(STRIPE_LOG_TRAPPED, &sh->state);
+	atomic_inc(&sh->count);
+	list_add_tail(&sh->log_io_list, &io->stripe_list);
+
+	if (io->nr_entries == R5L_MAX_ENTRIES)
+		r5l_submit_io(log, io);
+}
+
+void r5l_submit_current_io(struct r5conf *conf)
+{
+	struct r5l_log *log = conf->log;
+
+	if (!log || !log->current_io)
+		return;
+	mutex_lock(&log->io_mutex);
+	if (log->current_io)
+		r5l_submit_io(log, log->current_io);
+	mutex_unlock(&log->io_mutex);
+}
+
+/*
+ * Log the blocks of a stripe whose parity has just been computed, before
+ * they are written to the array.  Returns 0 when the writes may go ahead
+ * and -EAGAIN while the journal write is outstanding.
+ */
+int r5l_write_stripe(struct r5conf *conf, struct stripe_head *sh)
+{
+	struct r5l_log *log = conf->log;
+	sector_t need;
+
+	if (!log || test_bit(STRIPE_LOG_WRITEOUT, &sh->state))
+		return 0;
+	if (test_bit(STRIPE_LOG_TRAPPED, &sh->state))
+		return -EAGAIN;
+	if (log->failed) {
+		set_bit(STRIPE_LOG_WRITEOUT, &sh->state);
+		return 0;
+	}
+
+	need = (r5l_stripe_blocks(sh) + 1) * STRIPE_SECTORS;
+	mutex_lock(&log->io_mutex);
+	if (r5l_free_space(log) < need) {
+		mutex_unlock(&log->io_mutex);
+		set_bit(STRIPE_LOG_TRAPPED, &sh->state);
+		atomic_inc(&sh->count);
+		spin_lock(&log->stripes_lock);
+		list_add_tail(&sh->log_io_list, &log->no_space_stripes);
+		spin_unlock(&log->stripes_lock);
+		md_wakeup_thread(conf->mddev->thread);
+		return -EAGAIN;
+	}
+	r5l_append(log, sh);
+	mutex_unlock(&log->io_mutex);
+	return -EAGAIN;
+}
+
+/* The stripe's journalled blocks are on the members now */
+void r5l_stripe_write_finished(struct r5conf *conf, struct stripe_head *sh)
+{
+	struct r5l_log *log = conf->log;
+	int empty = 0, waiting;
+
+	clear_bit(STRIPE_LOG_WRITEOUT, &sh->state);
+
+	if (!log)
+		return;
+	spin_lock(&log->stripes_lock);
+	if (!list_empty(&sh->log_list)) {
+		list_del_init(&sh->log_list);
+		empty = list_empty(&log->stripe_list);
+	}
+	waiting = !list_empty(&log->no_space_stripes);
+	spin_unlock(&log->stripes_lock);
+	if (empty)
+		wake_up(&log->wait);
+	if (waiting)
+		/* the tail may have moved */
+		md_wakeup_thread(conf->mddev->thread);
+}
+
+static void r5l_flush_endio(struct bio *bio, int error)
+{
+	struct r5l_log *log = bio->bi_private;
+	struct r5l_io_unit *io, *next;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	if (error)
+		r5l_log_failed(log);
+	bio_put(bio);
+
+	spin_lock_irqsave(&log->io_list_lock, flags);
+	list_splice_init(&log->flushing_ios, &done);
+	log->flushing = 0;
+	spin_unlock_irqrestore(&log->io_list_lock, flags);
+
+	list_for_each_entry_safe(io, next, &done, list)
+		r5l_io_finish(io);
+	md_wakeup_thread(log->conf->mddev->thread);
+}
+
+/* One cache flush of the journal device for all records written so far */
+static void r5l_flush_journal(struct r5l_log *log)
+{
+	struct bio *bio;
+
+	spin_lock_irq(&log->io_list_lock);
+	if (log->flushing || list_empty(&log->io_end_ios)) {
+		spin_unlock_irq(&log->io_list_lock);
+		return;
+	}
+	list_splice_init(&log->io_end_ios, &log->flushing_ios);
+	log->flushing = 1;
+	spin_unlock_irq(&log->io_list_lock);
+
+	bio = bio_alloc(GFP_NOIO, 0);
+	bio->bi_bdev = log->bdev;
+	bio->bi_end_io = r5l_flush_endio;
+	bio->bi_private = log;
+	submit_bio(WRITE_FLUSH, bio);
+}
+
+/*
+ * Move the superblock tail up to the oldest stripe still in the log, and
+ * retry the stripes that found the ring full.
+ */
+static void r5l_reclaim(struct r5l_log *log)
+{
+	struct r5conf *conf = log->conf;
+	struct stripe_head *sh;
+	sector_t tail, reclaimable, free;
+	u64 seq;
+	int waiting;
+	LIST_HEAD(retry);
+
+	mutex_lock(&log->io_mutex);
+	spin_lock(&log->stripes_lock);
+	if (list_empty(&log->stripe_list)) {
+		tail = log->head;
+		seq = log->seq;
+	} else {
+		sh = list_first_entry(&log->stripe_list, struct stripe_head,
+				      log_list);
+		tail = sh->log_start;
+		seq = sh->log_seq;
+	}
+	waiting = !list_empty(&log->no_space_stripes);
+	spin_unlock(&log->stripes_lock);
+	reclaimable = r5l_ring_distance(log, log->sb_tail, tail);
+	free = r5l_free_space(log);
+	mutex_unlock(&log->io_mutex);
+
+	if (log->failed)
+		goto retry;
+	if (seq == log->sb_tail_seq)
+		return;
+	if (!waiting && reclaimable < r5l_ring_size(log) / 8 &&
+	    free > r5l_ring_size(log) / 4)
+		return;
+
+	r5l_flush_members(conf);
+	mutex_lock(&log->io_mutex);
+	if (!r5l_write_super(log, tail, seq)) {
+		log->sb_tail = tail;
+		log->sb_tail_seq = seq;
+	}
+	mutex_unlock(&log->io_mutex);
+
+retry:
+	if (!waiting)
+		return;
+	spin_lock(&log->stripes_lock);
+	list_splice_init(&log->no_space_stripes, &retry);
+	spin_unlock(&log->stripes_lock);
+	while (!list_empty(&retry)) {
+		sh = list_first_entry(&retry, struct stripe_head, log_io_list);
+		list_del_init(&sh->log_io_list);
+		clear_bit(STRIPE_LOG_TRAPPED, &sh->state);
+		set_bit(STRIPE_HANDLE, &sh->state);
+		raid5_release_stripe(sh);
+	}
+}
+
+/* Called by raid5d after each round of stripe handling */
+void r5l_raid5d(struct r5conf *conf)
+{
+	struct r5l_log *log = conf->log;
+
+	if (!log)
+		return;
+	r5l_submit_current_io(conf);
+	r5l_flush_journal(log);
+	r5l_reclaim(log);
+}
+
+/* Recovery */
+
+struct r5l_recovery {
+	struct page		*meta;
+	struct page		*pages[R5L_MAX_ENTRIES];
+};
+
+static void r5l_recovery_write(struct r5conf *conf, sector_t sector,
+			       int disk, struct page *page)
+{
+	struct md_rdev *rdev;
+
+	rcu_read_lock();
+	rdev = rcu_dereference(conf->disks[disk].rdev);
+	if (rdev && !test_bit(Faulty, &rdev->flags))
+		atomic_inc(&rdev->nr_pending);
+	else
+		rdev = NULL;
+	rcu_read_unlock();
+	if (!rdev)
+		return;
+	if (!sync_page_io(rdev, sector, STRIPE_SIZE, page, WRITE, false))
+		md_error(conf->mddev, rdev);
+	rdev_dec_pending(rdev, conf->mddev);
+}
+
+/*
+ * Read the record at @pos and check that it is the one expected.  Returns
+ * the number of blocks in it, or 0 at the end of the log.
+ */
+static int r5l_recovery_read(struct r5l_log *log, struct r5l_recovery *rc,
+			     sector_t pos, u64 seq)
+{
+	struct r5l_meta *meta = page_address(rc->meta);
+	u32 checksum;
+	int i, cnt;
+
+	if (r5l_sync_page_io(log, pos, rc->meta, READ))
+		return 0;
+	checksum = le32_to_cpu(meta->checksum);
+	meta->checksum = 0;
+	cnt = le32_to_cpu(meta->nr_entries);
+	if (le32_to_cpu(meta->magic) != R5L_META_MAGIC ||
+	    checksum != r5l_page_checksum(rc->meta) ||
+	    le64_to_cpu(meta->seq) != seq ||
+	    le64_to_cpu(meta->position) != pos ||
+	    memcmp(meta->uuid, log->conf->mddev->uuid, sizeof(meta->uuid)) ||
+	    cnt <= 0 || cnt > R5L_MAX_ENTRIES)
+		return 0;
+
+	for (i = 0; i < cnt; i++) {
+		struct r5l_entry *e = &meta->entries[i];
+
+		if (le16_to_cpu(e->disk) >= log->conf->raid_disks)
+			return 0;
+		if (!rc->pages[i]) {
+			rc->pages[i] = alloc_page(GFP_KERNEL);
+			if (!rc->pages[i])
+				return 0;
+		}
+		pos += STRIPE_SECTORS;
+		if (r5l_sync_page_io(log, pos, rc->pages[i], READ) ||
+		    r5l_page_checksum(rc->pages[i]) !=
+		    le32_to_cpu(e->checksum))
+			return 0;
+	}
+	return cnt;
+}
+
+/* Write every block of a record back to its member */
+static void r5l_recovery_apply(struct r5l_log *log, struct r5l_recovery *rc,
+			       int cnt)
+{
+	struct r5l_meta *meta = page_address(rc->meta);
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		struct r5l_entry *e = &meta->entries[i];
+
+		r5l_recovery_write(log->conf, le64_to_cpu(e->sector),
+				   le16_to_cpu(e->disk), rc->pages[i]);
+	}
+}
+
+static struct r5l_recovery *r5l_recovery_alloc(void)
+{
+	struct r5l_recovery *rc;
+
+	rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+	if (!rc)
+		return NULL;
+	rc->meta = alloc_page(GFP_KERNEL);
+	if (!rc->meta) {
+		kfree(rc);
+		return NULL;
+	}
+	return rc;
+}
+
+static void r5l_recovery_free(struct r5l_recovery *rc)
+{
+	int i;
+
+	for (i = 0; i < R5L_MAX_ENTRIES; i++)
+		if (rc->pages[i])
+			put_page(rc->pages[i]);
+	put_page(rc->meta);
+	kfree(rc);
+}
+
+/*
+ * Replay the log from the superblock tail and start a clean one after
+ * it.  The caller has suspended the array; conf->log is set once the
+ * journal is ready.
+ */
+static int r5l_recover(struct r5l_log *log)
+{
+	struct r5conf *conf = log->conf;
+	struct r5l_recovery *rc;
+	sector_t pos = log->sb_tail;
+	u64 seq = log->sb_tail_seq;
+	int records = 0, cnt, ret;
+
+	rc = r5l_recovery_alloc();
+	if (!rc)
+		return -ENOMEM;
+
+	while (1) {
+		pos = r5l_ring_wrap(log, pos);
+		cnt = r5l_recovery_read(log, rc, pos, seq);
+		if (!cnt)
+			break;
+		r5l_recovery_apply(log, rc, cnt);
+		pos += (1 + cnt) * STRIPE_SECTORS;
+		seq++;
+		records++;
+	}
+	r5l_recovery_free(rc);
+
+	/* stale records from before the crash must never look current */
+	log->head = pos;
+	log->seq = seq + R5L_SEQ_SKIP;
+	if (records) {
+		printk(KERN_INFO "md/raid:%s: replayed %d journal records\n",
+		       mdname(conf->mddev), records);
+		r5l_flush_members(conf);
+	}
+
+	ret = r5l_write_super(log, log->head, log->seq);
+	if (ret)
+		return ret;
+	log->sb_tail = log->head;
+	log->sb_tail_seq = log->seq;
+
+	smp_wmb();
+	conf->log = log;
+	return 0;
+}
+
+static int r5l_load_super(struct r5l_log *log, sector_t sectors)
+{
+	struct r5conf *conf = log->conf;
+	struct r5l_super *sb = page_address(log->sb_page);
+	char b[BDEVNAME_SIZE];
+	u32 checksum;
+
+	if (r5l_sync_page_io(log, 0, log->sb_page, READ))
+		return -EIO;
+	checksum = le32_to_cpu(sb->checksum);
+	sb->checksum = 0;
+	if (le32_to_cpu(sb->magic) != R5L_MAGIC ||
+	    checksum != r5l_page_checksum(log->sb_page)) {
+		/* a new journal */
+		log->data_start = STRIPE_SECTORS;
+		log->data_end = sectors & ~(sector_t)(STRIPE_SECTORS - 1);
+		get_random_bytes(&log->seq, sizeof(log->seq));
+		log->head = log->sb_tail = log->data_start;
+		log->sb_tail_seq = log->seq;
+		return r5l_write_super(log, log->head, log->seq);
+	}
+
+	if (memcmp(sb->uuid, conf->mddev->uuid, sizeof(sb->uuid))) {
+		printk(KERN_ERR "md/raid:%s: journal %s belongs to another "
+		       "array\n", mdname(conf->mddev), bdevname(log->bdev, b));
+		return -EINVAL;
+	}
+	log->data_start = le64_to_cpu(sb->data_start);
+	log->data_end = le64_to_cpu(sb->data_end);
+	log->sb_tail = le64_to_cpu(sb->tail);
+	log->sb_tail_seq = le64_to_cpu(sb->tail_seq);
+	if (le32_to_cpu(sb->version) != R5L_VERSION ||
+	    log->data_start < STRIPE_SECTORS ||
+	    log->data_end > sectors ||
+	    log->data_end - log->data_start < R5L_MIN_SECTORS / 2 ||
+	    log->sb_tail < log->data_start || log->sb_tail >= log->data_end) {
+		printk(KERN_ERR "md/raid:%s: journal %s has an invalid "
+		       "superblock\n", mdname(conf->mddev),
+		       bdevname(log->bdev, b));
+		return -EINVAL;
+	}
+	log->head = log->sb_tail;
+	log->seq = log->sb_tail_seq;
+	return 0;
+}
+
+/* Does the log start with a record, i.e. is there anything to replay? */
+static int r5l_log_live(struct r5l_log *log)
+{
+	struct r5l_recovery *rc;
+	int live;
+
+	rc = r5l_recovery_alloc();
+	if (!rc)
+		return -ENOMEM;
+	live = r5l_recovery_read(log, rc, r5l_ring_wrap(log, log->sb_tail),
+				 log->sb_tail_seq) > 0;
+	r5l_recovery_free(rc);
+	return live;
+}
+
+/* Close and free a journal that nothing references any more */
+void r5l_free_log(struct r5l_log *log)
+{
+	if (log->bdev)
+		blkdev_put(log->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	if (log->sb_page)
+		put_page(log->sb_page);
+	if (log->meta_pool)
+		mempool_destroy(log->meta_pool);
+	if (log->io_pool)
+		mempool_destroy(log->io_pool);
+	kfree(log);
+}
+
+/*
+ * Attach @dev as the journal, replaying it first if it holds records.
+ * Called with the mddev locked.
+ */
+int r5l_init_log(struct r5conf *conf, dev_t dev)
+{
+	struct mddev *mddev = conf->mddev;
+	struct r5l_log *log;
+	sector_t sectors;
+	int live, ret;
+
+	if (conf->log)
+		return -EBUSY;
+	if (mddev->bitmap || mddev->reshape_position != MaxSector) {
+		printk(KERN_ERR "md/raid:%s: a journal cannot be used with a "
+		       "bitmap or during a reshape\n", mdname(mddev));
+		return -EBUSY;
+	}
+	if (conf->raid_disks > R5L_MAX_ENTRIES)
+		return -EINVAL;
+
+	log = kzalloc(sizeof(*log), GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+	log->conf = conf;
+	mutex_init(&log->io_mutex);
+	spin_lock_init(&log->stripes_lock);
+	INIT_LIST_HEAD(&log->stripe_list);
+	INIT_LIST_HEAD(&log->no_space_stripes);
+	spin_lock_init(&log->io_list_lock);
+	INIT_LIST_HEAD(&log->running_ios);
+	INIT_LIST_HEAD(&log->io_end_ios);
+	INIT_LIST_HEAD(&log->flushing_ios);
+	init_waitqueue_head(&log->wait);
+
+	log->bdev = blkdev_get_by_dev(dev, FMODE_READ | FMODE_WRITE |
+				      FMODE_EXCL, log);
+	if (IS_ERR(log->bdev)) {
+		ret = PTR_ERR(log->bdev);
+		log->bdev = NULL;
+		goto abort;
+	}
+	ret = -EINVAL;
+	sectors = i_size_read(log->bdev->bd_inode) >> 9;
+	if (sectors < R5L_MIN_SECTORS) {
+		printk(KERN_ERR "md/raid:%s: journal must be at least %dMB\n",
+		       mdname(mddev), R5L_MIN_SECTORS >> (20 - 9));
+		goto abort;
+	}
+	log->need_flush =
+		!!(bdev_get_queue(log->bdev)->flush_flags & REQ_FLUSH);
+
+	ret = -ENOMEM;
+	log->io_pool = mempool_create_kmalloc_pool(4,
+					sizeof(struct r5l_io_unit));
+	log->meta_pool = mempool_create_page_pool(4, 0);
+	log->sb_page = alloc_page(GFP_KERNEL);
+	if (!log->io_pool || !log->meta_pool || !log->sb_page)
+		goto abort;
+
+	ret = r5l_load_super(log, sectors);
+	if (ret)
+		goto abort;
+
+	live = r5l_log_live(log);
+	if (live < 0) {
+		ret = live;
+		goto abort;
+	}
+	if (live && (conf->seen_write || mddev->ro == 1)) {
+		printk(KERN_ERR "md/raid:%s: journal needs replay, which is "
+		       "only possible before the array is written\n",
+		       mdname(mddev));
+		ret = -EBUSY;
+		goto abort;
+	}
+
+	mddev_suspend(mddev);
+	ret = r5l_recover(log);
+	mddev_resume(mddev);
+	if (ret)
+		goto abort;
+	return 0;
+
+abort:
+	r5l_free_log(log);
+	return ret;
+}
+
+static int r5l_drained(struct r5l_log *log)
+{
+	int empty;
+
+	spin_lock(&log->stripes_lock);
+	empty = list_empty(&log->stripe_list);
+	spin_unlock(&log->stripes_lock);
+	return empty;
+}
+
+/*
+ * Wait for every stripe in the journal to reach the members and leave it
+ * clean.  raid5d must be running; new writes are still logged, so the caller keeps them
+ * away by suspending or stopping the array.
+ */
+void r5l_exit_log(struct r5conf *conf)
+{
+	struct r5l_log *log = conf->log;
+
+	wait_event(log->wait, r5l_drained(log));
+	if (log->failed)
+		return;
+	r5l_flush_members(conf);
+	mutex_lock(&log->io_mutex);
+	if (!r5l_write_super(log, log->head, log->seq)) {
+		log->sb_tail = log->head;
+		log->sb_tail_seq = log->seq;
+	}
+	mutex_unlock(&log->io_mutex);
+}
+
+ssize_t r5l_show_journal(struct r5conf *conf, char *page)
+{
+	struct r5l_log *log = conf->log;
+
+	if (!log)
+		return sprintf(page, "none\n");
+	return sprintf(page, "%d:%d%s\n", MAJOR(log->bdev->bd_dev),
+		       MINOR(log->bdev->bd_dev), log->failed ? " faulty" : "");
+}
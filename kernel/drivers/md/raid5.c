@@ -63,13 +63,13 @@
  */
 
 #define NR_STRIPES		256
-#define STRIPE_SIZE		PAGE_SIZE
-#define STRIPE_SHIFT		(PAGE_SHIFT - 9)
-#define STRIPE_SECTORS		(STRIPE_SIZE>>9)
 #define	IO_THRESHOLD		1
 #define BYPASS_THRESHOLD	1
 #define NR_HASH			(PAGE_SIZE / sizeof(struct hlist_head))
 #define HASH_MASK		(NR_HASH - 1)
+#define MAX_STRIPE_BATCH	8
+
+static struct workqueue_struct *raid5_wq;
 
 static inline struct hlist_head *stripe_hash(struct r5conf *conf, sector_t sect)
 {
@@ -77,6 +77,42 @@ static inline struct hlist_head *stripe_hash(struct r5conf *conf, sector_t sect)
 	return &conf->stripe_hashtbl[hash];
 }
 
+static inline int stripe_hash_locks_hash(sector_t sect)
+{
+	return (sect >> STRIPE_SHIFT) & STRIPE_HASH_LOCKS_MASK;
+}
+
+static inline void lock_device_hash_lock(struct r5conf *conf, int hash)
+{
+	spin_lock_irq(conf->hash_locks + hash);
+	spin_lock(&conf->device_lock);
+}
+
+static inline void unlock_device_hash_lock(struct r5conf *conf, int hash)
+{
+	spin_unlock(&conf->device_lock);
+	spin_unlock_irq(conf->hash_locks + hash);
+}
+
+static inline void lock_all_device_hash_locks_irq(struct r5conf *conf)
+{
+	int i;
+	local_irq_disable();
+	spin_lock(conf->hash_locks);
+	for (i = 1; i < NR_STRIPE_HASH_LOCKS; i++)
+		spin_lock_nest_lock(conf->hash_locks + i, conf->hash_locks);
+	spin_lock(&conf->device_lock);
+}
+
+static inline void unlock_all_device_hash_locks_irq(struct r5conf *conf)
+{
+	int i;
+	spin_unlock(&conf->device_lock);
+	for (i = NR_STRIPE_HASH_LOCKS; i; i--)
+		spin_unlock(conf->hash_locks + i - 1);
+	local_irq_enable();
+}
+
 /* bio's attached to a stripe+device for I/O are linked together in bi_sector
  * order without overlap.  There may be several bio's per stripe+device, and
  * a bio could span several devices.
@@ -190,7 +226,40 @@ static int stripe_operations_active(struct stripe_head *sh)
 	       test_bit(STRIPE_COMPUTE_RUN, &sh->state);
 }
 
-static void __release_stripe(struct r5conf *conf, struct stripe_head *sh)
+/* Queue the first idle worker, if any.  device_lock is held. */
+static void raid5_wakeup_worker(struct r5conf *conf)
+{
+	int i;
+
+	for (i = 0; i < conf->worker_cnt; i++) {
+		struct r5worker *worker = &conf->workers[i];
+
+		if (worker->working)
+			continue;
+		worker->working = 1;
+		conf->active_workers++;
+		if (cpu_online(worker->cpu))
+			queue_work_on(worker->cpu, raid5_wq, &worker->work);
+		else
+			queue_work(raid5_wq, &worker->work);
+		return;
+	}
+}
+
+/* Something was added to the handle_list: get a worker going, or raid5d
+ * if there are none.  A running worker drains the list itself and wakes
+ * more workers when it finds more than one batch.  device_lock is held.
+ */
+static void raid5_wakeup_stripe_thread(struct r5conf *conf)
+{
+	if (!conf->worker_cnt)
+		md_wakeup_thread(conf->mddev->thread);
+	else if (!conf->active_workers)
+		raid5_wakeup_worker(conf);
+}
+
+static void __release_stripe(struct r5conf *conf, struct stripe_head *sh,
+			     struct list_head *temp_inactive_list)
 {
 	if (atomic_dec_and_test(&sh->count)) {
 		BUG_ON(!list_empty(&sh->lru));
@@ -206,7 +275,10 @@ static void __release_stripe(struct r5conf *conf, struct stripe_head *sh)
 				clear_bit(STRIPE_DELAYED, &sh->state);
 				clear_bit(STRIPE_BIT_DELAY, &sh->state);
 				list_add_tail(&sh->lru, &conf->handle_list);
+				raid5_wakeup_stripe_thread(conf);
+				return;
 			}
+			/* only raid5d moves delayed and bitmap stripes on */
 			md_wakeup_thread(conf->mddev->thread);
 		} else {
 			BUG_ON(stripe_operations_active(sh));
@@ -216,24 +288,65 @@ static void __release_stripe(struct r5conf *conf, struct stripe_head *sh)
 					md_wakeup_thread(conf->mddev->thread);
 			}
 			atomic_dec(&conf->active_stripes);
-			if (!test_bit(STRIPE_EXPANDING, &sh->state)) {
-				list_add_tail(&sh->lru, &conf->inactive_list);
-				wake_up(&conf->wait_for_stripe);
-				if (conf->retry_read_aligned)
-					md_wakeup_thread(conf->mddev->thread);
-			}
+			if (!test_bit(STRIPE_EXPANDING, &sh->state))
+				list_add_tail(&sh->lru, temp_inactive_list);
 		}
 	}
 }
 
-static void release_stripe(struct stripe_head *sh)
+/*
+ * Move stripes released under the device_lock onto their inactive_list.
+ * @hash is the hash_lock_index of the single list in @temp_inactive_list,
+ * or NR_STRIPE_HASH_LOCKS for an array with one list per hash lock.
+ * get_active_stripe() may take stripes off these lists until they are
+ * spliced, so only the hash lock protects them here.
+ */
+static void release_inactive_stripe_list(struct r5conf *conf,
+					 struct list_head *temp_inactive_list,
+					 int hash)
+{
+	int size;
+	int do_wakeup = 0;
+	unsigned long flags;
+
+	if (hash == NR_STRIPE_HASH_LOCKS) {
+		size = NR_STRIPE_HASH_LOCKS;
+		hash = NR_STRIPE_HASH_LOCKS - 1;
+	} else
+		size = 1;
+	while (size) {
+		struct list_head *list = &temp_inactive_list[size - 1];
+
+		if (!list_empty_careful(list)) {
+			spin_lock_irqsave(conf->hash_locks + hash, flags);
+			list_splice_tail_init(list, conf->inactive_list + hash);
+			do_wakeup = 1;
+			spin_unlock_irqrestore(conf->hash_locks + hash, flags);
+		}
+		size--;
+		hash--;
+	}
+
+	if (do_wakeup) {
+		wake_up(&conf->wait_for_stripe);
+		if (conf->retry_read_aligned)
+			md_wakeup_thread(conf->mddev->thread);
+	}
+}
+
+void raid5_release_stripe(struct stripe_head *sh)
 {
 	struct r5conf *conf = sh->raid_conf;
 	unsigned long flags;
+	struct list_head list;
+	int hash;
 
+	INIT_LIST_HEAD(&list);
+	hash = sh->hash_lock_index;
 	spin_lock_irqsave(&conf->device_lock, flags);
-	__release_stripe(conf, sh);
+	__release_stripe(conf, sh, &list);
 	spin_unlock_irqrestore(&conf->device_lock, flags);
+	release_inactive_stripe_list(conf, &list, hash);
 }
 
 static inline void remove_hash(struct stripe_head *sh)
@@ -256,18 +369,19 @@ static inline void insert_hash(struct r5conf *conf, struct stripe_head *sh)
 
 
 /* find an idle stripe, make sure it is unhashed, and return it. */
-static struct stripe_head *get_free_stripe(struct r5conf *conf)
+static struct stripe_head *get_free_stripe(struct r5conf *conf, int hash)
 {
 	struct stripe_head *sh = NULL;
 	struct list_head *first;
 
-	if (list_empty(&conf->inactive_list))
+	if (list_empty(conf->inactive_list + hash))
 		goto out;
-	first = conf->inactive_list.next;
+	first = (conf->inactive_list + hash)->next;
 	sh = list_entry(first, struct stripe_head, lru);
 	list_del_init(first);
 	remove_hash(sh);
 	atomic_inc(&conf->active_stripes);
+	BUG_ON(hash != sh->hash_lock_index);
 out:
 	return sh;
 }
@@ -431,34 +545,39 @@ get_active_stripe(struct r5conf *conf, sector_t sector,
 		  int previous, int noblock, int noquiesce)
 {
 	struct stripe_head *sh;
+	int hash = stripe_hash_locks_hash(sector);
 
 	pr_debug("get_stripe, sector %llu\n", (unsigned long long)sector);
 
-	spin_lock_irq(&conf->device_lock);
+	spin_lock_irq(conf->hash_locks + hash);
 
 	do {
 		wait_event_lock_irq(conf->wait_for_stripe,
 				    conf->quiesce == 0 || noquiesce,
-				    conf->device_lock, /* nothing */);
+				    conf->hash_locks[hash], /* nothing */);
 		sh = __find_stripe(conf, sector, conf->generation - previous);
 		if (!sh) {
 			if (!conf->inactive_blocked)
-				sh = get_free_stripe(conf);
+				sh = get_free_stripe(conf, hash);
 			if (noblock && sh == NULL)
 				break;
 			if (!sh) {
 				conf->inactive_blocked = 1;
 				wait_event_lock_irq(conf->wait_for_stripe,
-						    !list_empty(&conf->inactive_list) &&
+						    !list_empty(conf->inactive_list + hash) &&
 						    (atomic_read(&conf->active_stripes)
 						     < (conf->max_nr_stripes *3/4)
 						     || !conf->inactive_blocked),
-						    conf->device_lock,
+						    conf->hash_locks[hash],
 						    );
 				conf->inactive_blocked = 0;
 			} else
 				init_stripe(sh, sector, previous);
 		} else {
+			/* the stripe may be on the handle_list or one of
+			 * the other device_lock lists
+			 */
+			spin_lock(&conf->device_lock);
 			if (atomic_read(&sh->count)) {
 				BUG_ON(!list_empty(&sh->lru)
 				    && !test_bit(STRIPE_EXPANDING, &sh->state));
@@ -470,13 +589,14 @@ get_active_stripe(struct r5conf *conf, sector_t sector,
 					BUG();
 				list_del_init(&sh->lru);
 			}
+			spin_unlock(&conf->device_lock);
 		}
 	} while (sh == NULL);
 
 	if (sh)
 		atomic_inc(&sh->count);
 
-	spin_unlock_irq(&conf->device_lock);
+	spin_unlock_irq(conf->hash_locks + hash);
 	return sh;
 }
 
@@ -691,7 +811,7 @@ static void ops_complete_biofill(void *stripe_head_ref)
 	return_io(return_bi);
 
 	set_bit(STRIPE_HANDLE, &sh->state);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 static void ops_run_biofill(struct stripe_head *sh)
@@ -754,7 +874,7 @@ static void ops_complete_compute(void *stripe_head_ref)
 	if (sh->check_state == check_state_compute_run)
 		sh->check_state = check_state_compute_result;
 	set_bit(STRIPE_HANDLE, &sh->state);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 /* return a pointer to the address conversion region of the scribble buffer */
@@ -1103,7 +1223,7 @@ static void ops_complete_reconstruct(void *stripe_head_ref)
 	}
 
 	set_bit(STRIPE_HANDLE, &sh->state);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 static void
@@ -1187,7 +1307,7 @@ static void ops_complete_check(void *stripe_head_ref)
 
 	sh->check_state = check_state_check_result;
 	set_bit(STRIPE_HANDLE, &sh->state);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 static void ops_run_check_p(struct stripe_head *sh, struct raid5_percpu *percpu)
@@ -1319,7 +1439,7 @@ static void async_run_ops(void *param, async_cookie_t cookie)
 	wake_up(&sh->ops.wait_for_ops);
 
 	__raid_run_ops(sh, ops_request);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 static void raid_run_ops(struct stripe_head *sh, unsigned long ops_request)
@@ -1339,7 +1459,7 @@ static void raid_run_ops(struct stripe_head *sh, unsigned long ops_request)
 #define raid_run_ops __raid_run_ops
 #endif
 
-static int grow_one_stripe(struct r5conf *conf)
+static int grow_one_stripe(struct r5conf *conf, int hash)
 {
 	struct stripe_head *sh;
 	sh = kmem_cache_zalloc(conf->slab_cache, GFP_KERNEL);
@@ -1347,6 +1467,7 @@ static int grow_one_stripe(struct r5conf *conf)
 		return 0;
 
 	sh->raid_conf = conf;
+	sh->hash_lock_index = hash;
 	#ifdef CONFIG_MULTICORE_RAID456
 	init_waitqueue_head(&sh->ops.wait_for_ops);
 	#endif
@@ -1360,7 +1481,9 @@ static int grow_one_stripe(struct r5conf *conf)
 	atomic_set(&sh->count, 1);
 	atomic_inc(&conf->active_stripes);
 	INIT_LIST_HEAD(&sh->lru);
-	release_stripe(sh);
+	INIT_LIST_HEAD(&sh->log_list);
+	INIT_LIST_HEAD(&sh->log_io_list);
+	raid5_release_stripe(sh);
 	return 1;
 }
 
@@ -1368,6 +1491,7 @@ static int grow_stripes(struct r5conf *conf, int num)
 {
 	struct kmem_cache *sc;
 	int devs = max(conf->raid_disks, conf->previous_raid_disks);
+	int i;
 
 	if (conf->mddev->gendisk)
 		sprintf(conf->cache_name[0],
@@ -1385,9 +1509,15 @@ static int grow_stripes(struct r5conf *conf, int num)
 		return 1;
 	conf->slab_cache = sc;
 	conf->pool_size = devs;
-	while (num--)
-		if (!grow_one_stripe(conf))
+	/* stripe i lives in hash group i % NR_STRIPE_HASH_LOCKS, so the
+	 * groups stay balanced as the cache grows and shrinks
+	 */
+	for (i = 0; i < num; i++)
+		if (!grow_one_stripe(conf, i % NR_STRIPE_HASH_LOCKS)) {
+			/* let shrink_stripes() find what we did get */
+			conf->max_nr_stripes = i;
 			return 1;
+		}
 	return 0;
 }
 
@@ -1445,6 +1575,7 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 	int err;
 	struct kmem_cache *sc;
 	int i;
+	int hash;
 
 	if (newsize <= conf->pool_size)
 		return 0; /* never bother to shrink */
@@ -1484,17 +1615,23 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 	}
 	/* Step 2 - Must use GFP_NOIO now.
 	 * OK, we have enough stripes, start collecting inactive
-	 * stripes and copying them over
+	 * stripes and copying them over.  Stripes were handed out to the
+	 * hash groups round-robin, so collect them the same way.
 	 */
+	hash = 0;
 	list_for_each_entry(nsh, &newstripes, lru) {
-		spin_lock_irq(&conf->device_lock);
+		spin_lock_irq(conf->hash_locks + hash);
 		wait_event_lock_irq(conf->wait_for_stripe,
-				    !list_empty(&conf->inactive_list),
-				    conf->device_lock,
+				    !list_empty(conf->inactive_list + hash),
+				    conf->hash_locks[hash],
 				    );
-		osh = get_free_stripe(conf);
-		spin_unlock_irq(&conf->device_lock);
+		osh = get_free_stripe(conf, hash);
+		spin_unlock_irq(conf->hash_locks + hash);
 		atomic_set(&nsh->count, 1);
+		nsh->hash_lock_index = hash;
+		INIT_LIST_HEAD(&nsh->log_list);
+		INIT_LIST_HEAD(&nsh->log_io_list);
+		hash = (hash + 1) % NR_STRIPE_HASH_LOCKS;
 		for(i=0; i<conf->pool_size; i++)
 			nsh->dev[i].page = osh->dev[i].page;
 		for( ; i<newsize; i++)
@@ -1548,7 +1685,7 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 				if (!p)
 					err = -ENOMEM;
 			}
-		release_stripe(nsh);
+		raid5_release_stripe(nsh);
 	}
 	/* critical section pass, GFP_NOIO no longer needed */
 
@@ -1561,10 +1698,11 @@ static int resize_stripes(struct r5conf *conf, int newsize)
 static int drop_one_stripe(struct r5conf *conf)
 {
 	struct stripe_head *sh;
+	int hash = (conf->max_nr_stripes - 1) % NR_STRIPE_HASH_LOCKS;
 
-	spin_lock_irq(&conf->device_lock);
-	sh = get_free_stripe(conf);
-	spin_unlock_irq(&conf->device_lock);
+	spin_lock_irq(conf->hash_locks + hash);
+	sh = get_free_stripe(conf, hash);
+	spin_unlock_irq(conf->hash_locks + hash);
 	if (!sh)
 		return 0;
 	BUG_ON(atomic_read(&sh->count));
@@ -1576,8 +1714,9 @@ static int drop_one_stripe(struct r5conf *conf)
 
 static void shrink_stripes(struct r5conf *conf)
 {
-	while (drop_one_stripe(conf))
-		;
+	while (conf->max_nr_stripes &&
+	       drop_one_stripe(conf))
+		conf->max_nr_stripes--;
 
 	if (conf->slab_cache)
 		kmem_cache_destroy(conf->slab_cache);
@@ -1668,7 +1807,7 @@ static void raid5_end_read_request(struct bio * bi, int error)
 	rdev_dec_pending(conf->disks[i].rdev, conf->mddev);
 	clear_bit(R5_LOCKED, &sh->dev[i].flags);
 	set_bit(STRIPE_HANDLE, &sh->state);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 static void raid5_end_write_request(struct bio *bi, int error)
@@ -1703,7 +1842,7 @@ static void raid5_end_write_request(struct bio *bi, int error)
 	
 	clear_bit(R5_LOCKED, &sh->dev[i].flags);
 	set_bit(STRIPE_HANDLE, &sh->state);
-	release_stripe(sh);
+	raid5_release_stripe(sh);
 }
 
 
@@ -2936,7 +3075,7 @@ static void handle_stripe_expansion(struct r5conf *conf, struct stripe_head *sh)
 			if (!test_bit(STRIPE_EXPANDING, &sh2->state) ||
 			   test_bit(R5_Expanded, &sh2->dev[dd_idx].flags)) {
 				/* must have already done this block */
-				release_stripe(sh2);
+				raid5_release_stripe(sh2);
 				continue;
 			}
 
@@ -2957,7 +3096,7 @@ static void handle_stripe_expansion(struct r5conf *conf, struct stripe_head *sh)
 				set_bit(STRIPE_EXPAND_READY, &sh2->state);
 				set_bit(STRIPE_HANDLE, &sh2->state);
 			}
-			release_stripe(sh2);
+			raid5_release_stripe(sh2);
 
 		}
 	/* done submitting copies, wait for them to complete */
@@ -3182,8 +3321,17 @@ static void handle_stripe(struct stripe_head *sh)
 			handle_failed_stripe(conf, sh, &s, disks, &s.return_bi);
 		if (s.syncing)
 			handle_failed_sync(conf, sh, &s);
+		/* the journal cannot help this stripe any more */
+		if (test_bit(STRIPE_LOG_WRITEOUT, &sh->state) &&
+		    !test_bit(STRIPE_LOG_TRAPPED, &sh->state))
+			r5l_stripe_write_finished(conf, sh);
 	}
 
+	/* the journalled blocks of this stripe have reached the members */
+	if (test_bit(STRIPE_LOG_WRITEOUT, &sh->state) &&
+	    !sh->reconstruct_state && !s.locked)
+		r5l_stripe_write_finished(conf, sh);
+
 	/*
 	 * might be able to return some write requests if the parity blocks
 	 * are safe, or on a failed drive
@@ -3196,7 +3344,7 @@ static void handle_stripe(struct stripe_head *sh)
 		|| (s.failed >= 2 && s.failed_num[1] == sh->qd_idx)
 		|| conf->level < 6;
 
-	if (s.written &&
+	if (s.written && !test_bit(STRIPE_LOG_TRAPPED, &sh->state) &&
 	    (s.p_failed || ((test_bit(R5_Insync, &pdev->flags)
 			     && !test_bit(R5_LOCKED, &pdev->flags)
 			     && test_bit(R5_UPTODATE, &pdev->flags)))) &&
@@ -3220,8 +3368,9 @@ static void handle_stripe(struct stripe_head *sh)
 	prexor = 0;
 	if (sh->reconstruct_state == reconstruct_state_prexor_drain_result)
 		prexor = 1;
-	if (sh->reconstruct_state == reconstruct_state_drain_result ||
-	    sh->reconstruct_state == reconstruct_state_prexor_drain_result) {
+	if ((sh->reconstruct_state == reconstruct_state_drain_result ||
+	     sh->reconstruct_state == reconstruct_state_prexor_drain_result) &&
+	    !r5l_write_stripe(conf, sh)) {
 		sh->reconstruct_state = reconstruct_state_idle;
 
 		/* All the 'written' buffers and the parity block are ready to
@@ -3316,11 +3465,11 @@ static void handle_stripe(struct stripe_head *sh)
 			if (!test_and_set_bit(STRIPE_PREREAD_ACTIVE,
 					      &sh_src->state))
 				atomic_inc(&conf->preread_active_stripes);
-			release_stripe(sh_src);
+			raid5_release_stripe(sh_src);
 			goto finish;
 		}
 		if (sh_src)
-			release_stripe(sh_src);
+			raid5_release_stripe(sh_src);
 
 		sh->reconstruct_state = reconstruct_state_idle;
 		clear_bit(STRIPE_EXPANDING, &sh->state);
@@ -3410,7 +3559,8 @@ static void raid5_activate_delayed(struct r5conf *conf)
 	}
 }
 
-static void activate_bit_delay(struct r5conf *conf)
+static void activate_bit_delay(struct r5conf *conf,
+			       struct list_head *temp_inactive_list)
 {
 	/* device_lock is held */
 	struct list_head head;
@@ -3418,15 +3568,18 @@ static void activate_bit_delay(struct r5conf *conf)
 	list_del_init(&conf->bitmap_list);
 	while (!list_empty(&head)) {
 		struct stripe_head *sh = list_entry(head.next, struct stripe_head, lru);
+		int hash;
 		list_del_init(&sh->lru);
 		atomic_inc(&sh->count);
-		__release_stripe(conf, sh);
+		hash = sh->hash_lock_index;
+		__release_stripe(conf, sh, &temp_inactive_list[hash]);
 	}
 }
 
 int md_raid5_congested(struct mddev *mddev, int bits)
 {
 	struct r5conf *conf = mddev->private;
+	int i;
 
 	/* No difference between reads and writes.  Just check
 	 * how busy the stripe_cache is
@@ -3436,8 +3589,9 @@ int md_raid5_congested(struct mddev *mddev, int bits)
 		return 1;
 	if (conf->quiesce)
 		return 1;
-	if (list_empty_careful(&conf->inactive_list))
-		return 1;
+	for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++)
+		if (list_empty_careful(conf->inactive_list + i))
+			return 1;
 
 	return 0;
 }
@@ -3729,6 +3883,9 @@ static void make_request(struct mddev *mddev, struct bio * bi)
 
 	md_write_start(mddev, bi);
 
+	if (rw == WRITE)
+		conf->seen_write = 1;
+
 	if (rw == READ &&
 	     mddev->reshape_position == MaxSector &&
 	     chunk_aligned_read(mddev,bi))
@@ -3805,7 +3962,7 @@ static void make_request(struct mddev *mddev, struct bio * bi)
 					must_retry = 1;
 				spin_unlock_irq(&conf->device_lock);
 				if (must_retry) {
-					release_stripe(sh);
+					raid5_release_stripe(sh);
 					schedule();
 					goto retry;
 				}
@@ -3814,7 +3971,7 @@ static void make_request(struct mddev *mddev, struct bio * bi)
 			if (rw == WRITE &&
 			    logical_sector >= mddev->suspend_lo &&
 			    logical_sector < mddev->suspend_hi) {
-				release_stripe(sh);
+				raid5_release_stripe(sh);
 				/* As the suspend_* range is controlled by
 				 * userspace, we want an interruptible
 				 * wait.
@@ -3835,7 +3992,7 @@ static void make_request(struct mddev *mddev, struct bio * bi)
 				 * and wait a while
 				 */
 				md_wakeup_thread(mddev->thread);
-				release_stripe(sh);
+				raid5_release_stripe(sh);
 				schedule();
 				goto retry;
 			}
@@ -3845,7 +4002,7 @@ static void make_request(struct mddev *mddev, struct bio * bi)
 			if ((bi->bi_rw & REQ_SYNC) &&
 			    !test_and_set_bit(STRIPE_PREREAD_ACTIVE, &sh->state))
 				atomic_inc(&conf->preread_active_stripes);
-			release_stripe(sh);
+			raid5_release_stripe(sh);
 		} else {
 			/* cannot get stripe for read-ahead, just give-up */
 			clear_bit(BIO_UPTODATE, &bi->bi_flags);
@@ -4051,7 +4208,7 @@ static sector_t reshape_request(struct mddev *mddev, sector_t sector_nr, int *sk
 		sh = get_active_stripe(conf, first_sector, 1, 0, 1);
 		set_bit(STRIPE_EXPAND_SOURCE, &sh->state);
 		set_bit(STRIPE_HANDLE, &sh->state);
-		release_stripe(sh);
+		raid5_release_stripe(sh);
 		first_sector += STRIPE_SECTORS;
 	}
 	/* Now that the sources are clearly marked, we can release
@@ -4060,7 +4217,7 @@ static sector_t reshape_request(struct mddev *mddev, sector_t sector_nr, int *sk
 	while (!list_empty(&stripes)) {
 		sh = list_entry(stripes.next, struct stripe_head, lru);
 		list_del_init(&sh->lru);
-		release_stripe(sh);
+		raid5_release_stripe(sh);
 	}
 	/* If this takes us to the resync_max point where we have to pause,
 	 * then we need to write out the superblock.
@@ -4171,7 +4328,8 @@ static inline sector_t sync_request(struct mddev *mddev, sector_t sector_nr, int
 	set_bit(STRIPE_SYNC_REQUESTED, &sh->state);
 
 	handle_stripe(sh);
-	release_stripe(sh);
+	r5l_submit_current_io(conf);
+	raid5_release_stripe(sh);
 
 	return STRIPE_SECTORS;
 }
@@ -4220,14 +4378,15 @@ static int  retry_aligned_read(struct r5conf *conf, struct bio *raid_bio)
 
 		set_bit(R5_ReadError, &sh->dev[dd_idx].flags);
 		if (!add_stripe_bio(sh, raid_bio, dd_idx, 0)) {
-			release_stripe(sh);
+			raid5_release_stripe(sh);
 			raid5_set_bi_hw_segments(raid_bio, scnt);
 			conf->retry_read_aligned = raid_bio;
 			return handled;
 		}
 
 		handle_stripe(sh);
-		release_stripe(sh);
+		r5l_submit_current_io(conf);
+		raid5_release_stripe(sh);
 		handled++;
 	}
 	spin_lock_irq(&conf->device_lock);
@@ -4241,6 +4400,146 @@ static int  retry_aligned_read(struct r5conf *conf, struct bio *raid_bio)
 }
 
 
+/*
+ * Take up to MAX_STRIPE_BATCH stripes off the handle lists and handle
+ * them with the device_lock dropped.  Called and returns with the
+ * device_lock held; inactive stripes collected in @temp_inactive_list
+ * (one list per hash lock) by earlier calls are put back on the way.
+ */
+static int handle_active_stripes(struct r5conf *conf,
+				 struct list_head *temp_inactive_list)
+{
+	struct stripe_head *batch[MAX_STRIPE_BATCH], *sh;
+	int i, batch_size = 0, hash;
+
+	while (batch_size < MAX_STRIPE_BATCH &&
+	       (sh = __get_priority_stripe(conf)) != NULL)
+		batch[batch_size++] = sh;
+
+	if (batch_size == 0)
+		return batch_size;
+
+	/* more than one batch queued: let another worker share it */
+	if (conf->worker_cnt &&
+	    (!list_empty(&conf->handle_list) || !list_empty(&conf->hold_list)))
+		raid5_wakeup_worker(conf);
+	spin_unlock_irq(&conf->device_lock);
+
+	release_inactive_stripe_list(conf, temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
+
+	for (i = 0; i < batch_size; i++)
+		handle_stripe(batch[i]);
+	r5l_submit_current_io(conf);
+
+	cond_resched();
+
+	spin_lock_irq(&conf->device_lock);
+	for (i = 0; i < batch_size; i++) {
+		hash = batch[i]->hash_lock_index;
+		__release_stripe(conf, batch[i], &temp_inactive_list[hash]);
+	}
+	return batch_size;
+}
+
+/*
+ * Stripe handling worker.  Drains the handle lists alongside raid5d and
+ * any other worker, then goes idle until raid5_wakeup_stripe_thread()
+ * queues it again.  Everything else (bitmap batching, delayed stripes,
+ * aligned read retries, recovery) stays with raid5d.
+ */
+static void raid5_do_work(struct work_struct *work)
+{
+	struct r5worker *worker = container_of(work, struct r5worker, work);
+	struct r5conf *conf = worker->conf;
+	struct list_head temp_inactive_list[NR_STRIPE_HASH_LOCKS];
+	int handled = 0;
+	struct blk_plug plug;
+	int i;
+
+	pr_debug("+++ raid5worker active\n");
+
+	for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++)
+		INIT_LIST_HEAD(temp_inactive_list + i);
+
+	blk_start_plug(&plug);
+	spin_lock_irq(&conf->device_lock);
+	while (1) {
+		int batch_size;
+
+		batch_size = handle_active_stripes(conf, temp_inactive_list);
+		if (!batch_size)
+			break;
+		handled += batch_size;
+	}
+	worker->working = 0;
+	conf->active_workers--;
+	spin_unlock_irq(&conf->device_lock);
+
+	release_inactive_stripe_list(conf, temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
+	pr_debug("%d stripes handled\n", handled);
+
+	async_tx_issue_pending_all();
+	blk_finish_plug(&plug);
+
+	pr_debug("--- raid5worker inactive\n");
+}
+
+static struct r5worker *raid5_alloc_workers(struct r5conf *conf, int cnt)
+{
+	struct r5worker *workers;
+	int i, cpu;
+
+	workers = kcalloc(cnt, sizeof(struct r5worker), GFP_KERNEL);
+	if (!workers)
+		return NULL;
+
+	/* one worker per online cpu, wrapping if there are more */
+	get_online_cpus();
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < cnt; i++) {
+		struct r5worker *worker = &workers[i];
+
+		INIT_WORK(&worker->work, raid5_do_work);
+		worker->conf = conf;
+		worker->cpu = cpu;
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+	put_online_cpus();
+	return workers;
+}
+
+static void raid5_free_workers(struct r5worker *workers, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		cancel_work_sync(&workers[i].work);
+	kfree(workers);
+}
+
+/*
+ * Free a journal that r5l_exit_log() has drained.  The array is suspended
+ * and raid5d is not in the journal code; once the workers have finished
+ * nothing can see conf->log any more.
+ */
+static void raid5_drop_log(struct r5conf *conf)
+{
+	struct completion *done = conf->log_exit;
+	struct r5l_log *log = conf->log;
+	int i;
+
+	conf->log = NULL;
+	for (i = 0; i < conf->worker_cnt; i++)
+		flush_work(&conf->workers[i].work);
+	r5l_free_log(log);
+	conf->log_exit = NULL;
+	complete(done);
+}
+
 /*
  * This is our raid5 kernel thread.
  *
@@ -4250,20 +4549,28 @@ static int  retry_aligned_read(struct r5conf *conf, struct bio *raid_bio)
  */
 static void raid5d(struct mddev *mddev)
 {
-	struct stripe_head *sh;
 	struct r5conf *conf = mddev->private;
+	struct list_head temp_inactive_list[NR_STRIPE_HASH_LOCKS];
 	int handled;
 	struct blk_plug plug;
+	int i;
 
 	pr_debug("+++ raid5d active\n");
 
+	if (conf->log_exit)
+		raid5_drop_log(conf);
+
 	md_check_recovery(mddev);
 
+	for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++)
+		INIT_LIST_HEAD(temp_inactive_list + i);
+
 	blk_start_plug(&plug);
 	handled = 0;
 	spin_lock_irq(&conf->device_lock);
 	while (1) {
 		struct bio *bio;
+		int batch_size;
 
 		if (atomic_read(&mddev->plug_cnt) == 0 &&
 		    !list_empty(&conf->bitmap_list)) {
@@ -4273,7 +4580,7 @@ static void raid5d(struct mddev *mddev)
 			bitmap_unplug(mddev->bitmap);
 			spin_lock_irq(&conf->device_lock);
 			conf->seq_write = conf->seq_flush;
-			activate_bit_delay(conf);
+			activate_bit_delay(conf, temp_inactive_list);
 		}
 		if (atomic_read(&mddev->plug_cnt) == 0)
 			raid5_activate_delayed(conf);
@@ -4288,26 +4595,26 @@ static void raid5d(struct mddev *mddev)
 			handled++;
 		}
 
-		sh = __get_priority_stripe(conf);
-
-		if (!sh)
+		batch_size = handle_active_stripes(conf, temp_inactive_list);
+		if (!batch_size)
 			break;
-		spin_unlock_irq(&conf->device_lock);
-		
-		handled++;
-		handle_stripe(sh);
-		release_stripe(sh);
-		cond_resched();
+		handled += batch_size;
 
-		if (mddev->flags & ~(1<<MD_CHANGE_PENDING))
+		if (mddev->flags & ~(1<<MD_CHANGE_PENDING)) {
+			spin_unlock_irq(&conf->device_lock);
 			md_check_recovery(mddev);
-
-		spin_lock_irq(&conf->device_lock);
+			spin_lock_irq(&conf->device_lock);
+		}
 	}
 	pr_debug("%d stripes handled\n", handled);
 
 	spin_unlock_irq(&conf->device_lock);
 
+	release_inactive_stripe_list(conf, temp_inactive_list,
+				     NR_STRIPE_HASH_LOCKS);
+
+	r5l_raid5d(conf);
+
 	async_tx_issue_pending_all();
 	blk_finish_plug(&plug);
 
@@ -4342,7 +4649,8 @@ raid5_set_cache_size(struct mddev *mddev, int size)
 	if (err)
 		return err;
 	while (size > conf->max_nr_stripes) {
-		if (grow_one_stripe(conf))
+		if (grow_one_stripe(conf,
+				    conf->max_nr_stripes % NR_STRIPE_HASH_LOCKS))
 			conf->max_nr_stripes++;
 		else break;
 	}
@@ -4422,10 +4730,123 @@ stripe_cache_active_show(struct mddev *mddev, char *page)
 static struct md_sysfs_entry
 raid5_stripecache_active = __ATTR_RO(stripe_cache_active);
 
+static ssize_t
+raid5_show_stripe_workers(struct mddev *mddev, char *page)
+{
+	struct r5conf *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "%d\n", conf->worker_cnt);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_stripe_workers(struct mddev *mddev, const char *page, size_t len)
+{
+	struct r5conf *conf = mddev->private;
+	struct r5worker *workers = NULL, *old;
+	unsigned long new;
+	int old_cnt;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new))
+		return -EINVAL;
+	if (new > num_possible_cpus())
+		return -EINVAL;
+	if (new == conf->worker_cnt)
+		return len;
+
+	if (new) {
+		workers = raid5_alloc_workers(conf, new);
+		if (!workers)
+			return -ENOMEM;
+	}
+
+	/* no stripe is active while suspended, so nothing can queue a
+	 * worker once the old ones have finished
+	 */
+	mddev_suspend(mddev);
+	old = conf->workers;
+	old_cnt = conf->worker_cnt;
+	raid5_free_workers(old, old_cnt);
+
+	spin_lock_irq(&conf->device_lock);
+	conf->workers = workers;
+	conf->worker_cnt = new;
+	conf->active_workers = 0;
+	spin_unlock_irq(&conf->device_lock);
+	mddev_resume(mddev);
+
+	return len;
+}
+
+static struct md_sysfs_entry
+raid5_stripe_workers = __ATTR(stripe_workers, S_IRUGO | S_IWUSR,
+			      raid5_show_stripe_workers,
+			      raid5_store_stripe_workers);
+
+static ssize_t
+raid5_show_journal(struct mddev *mddev, char *page)
+{
+	struct r5conf *conf = mddev->private;
+	if (conf)
+		return r5l_show_journal(conf, page);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_journal(struct mddev *mddev, const char *page, size_t len)
+{
+	struct r5conf *conf = mddev->private;
+	DECLARE_COMPLETION_ONSTACK(done);
+	unsigned int major, minor;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (sysfs_streq(page, "none")) {
+		if (!conf->log)
+			return len;
+		/* write everything out, then let raid5d drop the journal
+		 * while no stripe can reach it
+		 */
+		mddev_suspend(mddev);
+		r5l_exit_log(conf);
+		conf->log_exit = &done;
+		md_wakeup_thread(mddev->thread);
+		wait_for_completion(&done);
+		mddev_resume(mddev);
+		return len;
+	}
+
+	if (sscanf(page, "%u:%u", &major, &minor) != 2)
+		return -EINVAL;
+	if (MAJOR(MKDEV(major, minor)) != major ||
+	    MINOR(MKDEV(major, minor)) != minor)
+		return -EOVERFLOW;
+	err = r5l_init_log(conf, MKDEV(major, minor));
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+raid5_journal = __ATTR(journal, S_IRUGO | S_IWUSR,
+		       raid5_show_journal,
+		       raid5_store_journal);
+
 static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_size.attr,
 	&raid5_stripecache_active.attr,
 	&raid5_preread_bypass_threshold.attr,
+	&raid5_stripe_workers.attr,
+	&raid5_journal.attr,
 	NULL,
 };
 static struct attribute_group raid5_attrs_group = {
@@ -4473,6 +4894,9 @@ static void raid5_free_percpu(struct r5conf *conf)
 
 static void free_conf(struct r5conf *conf)
 {
+	raid5_free_workers(conf->workers, conf->worker_cnt);
+	if (conf->log)
+		r5l_free_log(conf->log);
 	shrink_stripes(conf);
 	raid5_free_percpu(conf);
 	kfree(conf->disks);
@@ -4567,6 +4991,7 @@ static struct r5conf *setup_conf(struct mddev *mddev)
 	int raid_disk, memory, max_disks;
 	struct md_rdev *rdev;
 	struct disk_info *disk;
+	int i;
 
 	if (mddev->new_level != 5
 	    && mddev->new_level != 4
@@ -4601,13 +5026,16 @@ static struct r5conf *setup_conf(struct mddev *mddev)
 	if (conf == NULL)
 		goto abort;
 	spin_lock_init(&conf->device_lock);
+	for (i = 0; i < NR_STRIPE_HASH_LOCKS; i++) {
+		spin_lock_init(conf->hash_locks + i);
+		INIT_LIST_HEAD(conf->inactive_list + i);
+	}
 	init_waitqueue_head(&conf->wait_for_stripe);
 	init_waitqueue_head(&conf->wait_for_overlap);
 	INIT_LIST_HEAD(&conf->handle_list);
 	INIT_LIST_HEAD(&conf->hold_list);
 	INIT_LIST_HEAD(&conf->delayed_list);
 	INIT_LIST_HEAD(&conf->bitmap_list);
-	INIT_LIST_HEAD(&conf->inactive_list);
 	atomic_set(&conf->active_stripes, 0);
 	atomic_set(&conf->preread_active_stripes, 0);
 	atomic_set(&conf->active_aligned_reads, 0);
@@ -4968,6 +5396,8 @@ static int stop(struct mddev *mddev)
 {
 	struct r5conf *conf = mddev->private;
 
+	if (conf->log)
+		r5l_exit_log(conf);
 	md_unregister_thread(&mddev->thread);
 	if (mddev->queue)
 		mddev->queue->backing_dev_info.congested_fn = NULL;
@@ -5220,6 +5650,12 @@ static int raid5_start_reshape(struct mddev *mddev)
 	if (test_bit(MD_RECOVERY_RUNNING, &mddev->recovery))
 		return -EBUSY;
 
+	if (conf->log) {
+		printk(KERN_ERR "md/raid:%s: cannot reshape with a journal\n",
+		       mdname(mddev));
+		return -EBUSY;
+	}
+
 	if (!check_stripe_cache(mddev))
 		return -ENOSPC;
 
@@ -5399,27 +5835,28 @@ static void raid5_quiesce(struct mddev *mddev, int state)
 		break;
 
 	case 1: /* stop all writes */
-		spin_lock_irq(&conf->device_lock);
+		lock_all_device_hash_locks_irq(conf);
 		/* '2' tells resync/reshape to pause so that all
 		 * active stripes can drain
 		 */
 		conf->quiesce = 2;
-		wait_event_lock_irq(conf->wait_for_stripe,
-				    atomic_read(&conf->active_stripes) == 0 &&
-				    atomic_read(&conf->active_aligned_reads) == 0,
-				    conf->device_lock, /* nothing */);
+		unlock_all_device_hash_locks_irq(conf);
+		wait_event(conf->wait_for_stripe,
+			   atomic_read(&conf->active_stripes) == 0 &&
+			   atomic_read(&conf->active_aligned_reads) == 0);
+		lock_all_device_hash_locks_irq(conf);
 		conf->quiesce = 1;
-		spin_unlock_irq(&conf->device_lock);
+		unlock_all_device_hash_locks_irq(conf);
 		/* allow reshape to continue */
 		wake_up(&conf->wait_for_overlap);
 		break;
 
 	case 0: /* re-enable writes */
-		spin_lock_irq(&conf->device_lock);
+		lock_all_device_hash_locks_irq(conf);
 		conf->quiesce = 0;
 		wake_up(&conf->wait_for_stripe);
 		wake_up(&conf->wait_for_overlap);
-		spin_unlock_irq(&conf->device_lock);
+		unlock_all_device_hash_locks_irq(conf);
 		break;
 	}
 }
@@ -5732,6 +6169,10 @@ static struct md_personality raid4_personality =
 
 static int __init raid5_init(void)
 {
+	raid5_wq = alloc_workqueue("raid5wq",
+				   WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 0);
+	if (!raid5_wq)
+		return -ENOMEM;
 	register_md_personality(&raid6_personality);
 	register_md_personality(&raid5_personality);
 	register_md_personality(&raid4_personality);
@@ -5743,6 +6184,7 @@ static void raid5_exit(void)
 	unregister_md_personality(&raid6_personality);
 	unregister_md_personality(&raid5_personality);
 	unregister_md_personality(&raid4_personality);
+	destroy_workqueue(raid5_wq);
 }
 
 module_init(raid5_init);
@@ -3,6 +3,7 @@
 
 #include <linux/raid/xor.h>
 #include <linux/dmaengine.h>
+#include <linux/workqueue.h>
 
 /*
  *
@@ -92,8 +93,12 @@
  * not hashed must be on the inactive_list, and will normally be at
  * the front.  All stripes start life this way.
  *
- * The inactive_list, handle_list and hash bucket lists are all protected by the
- * device_lock.
+ * The handle_list is protected by the device_lock.  The inactive_list and
+ * hash bucket lists are split into NR_STRIPE_HASH_LOCKS groups by the low
+ * bits of the stripe number; each group is protected by its own hash_lock,
+ * and a stripe only ever moves between the lists of its own group
+ * (sh->hash_lock_index).  A hash_lock may be held while taking the
+ * device_lock, never the other way round.
  *  - stripes have a reference counter. If count==0, they are on a list.
  *  - If a stripe might need handling, STRIPE_HANDLE is set.
  *  - When refcount reaches zero, then if STRIPE_HANDLE it is put on
@@ -107,9 +112,9 @@
  *
  * The possible transitions are:
  *  activate an unhashed/inactive stripe (get_active_stripe())
- *     lockdev check-hash unlink-stripe cnt++ clean-stripe hash-stripe unlockdev
+ *     lockhash check-hash unlink-stripe cnt++ clean-stripe hash-stripe unlockhash
  *  activate a hashed, possibly active stripe (get_active_stripe())
- *     lockdev check-hash if(!cnt++)unlink-stripe unlockdev
+ *     lockhash check-hash if(!cnt++)(lockdev unlink-stripe unlockdev) unlockhash
  *  attach a request to an active stripe (add_stripe_bh())
  *     lockdev attach-buffer unlockdev
  *  handle a stripe (handle_stripe())
@@ -118,7 +123,8 @@
  *		change-state ..
  *		record io/ops needed clearSTRIPE_ACTIVE schedule io/ops
  *  release an active stripe (release_stripe())
- *     lockdev if (!--cnt) { if  STRIPE_HANDLE, add to handle_list else add to inactive-list } unlockdev
+ *     lockdev if (!--cnt) { if  STRIPE_HANDLE, add to handle_list else add to temp-list } unlockdev
+ *     lockhash splice temp-list onto inactive-list unlockhash
  *
  * The refcount counts each thread that have activated the stripe,
  * plus raid5d if it is handling it, plus one for each active request
@@ -206,6 +212,14 @@ struct stripe_head {
 	short			ddf_layout;/* use DDF ordering to calculate Q */
 	unsigned long		state;		/* state flags */
 	atomic_t		count;	      /* nr of active thread/requests */
+	int			hash_lock_index; /* inactive_list/hash_lock group */
+	/* journal: position and sequence of the oldest record still
+	 * needed by this stripe, valid while on the log's stripe_list
+	 */
+	sector_t		log_start;
+	u64			log_seq;
+	struct list_head	log_list;	/* log stripe_list */
+	struct list_head	log_io_list;	/* journal write in flight */
 	int			bm_seq;	/* sequence number for bitmap flushes */
 	int			disks;		/* disks in stripe */
 	enum check_states	check_state;
@@ -306,6 +320,9 @@ enum {
 	STRIPE_BIOFILL_RUN,
 	STRIPE_COMPUTE_RUN,
 	STRIPE_OPS_REQ_PENDING,
+	STRIPE_LOG_TRAPPED,	/* waiting for a journal write to be stable */
+	STRIPE_LOG_WRITEOUT,	/* parity is in the journal, disk writes
+				 * may go ahead */
 };
 
 /*
@@ -347,6 +364,28 @@ struct disk_info {
 	struct md_rdev	*rdev;
 };
 
+/* NOTE NR_STRIPE_HASH_LOCKS must remain below 64.
+ * This is because we sometimes take all the spinlocks
+ * and creating that much locking depth can cause
+ * problems.
+ */
+#define NR_STRIPE_HASH_LOCKS	8
+#define STRIPE_HASH_LOCKS_MASK	(NR_STRIPE_HASH_LOCKS - 1)
+
+#define STRIPE_SIZE		PAGE_SIZE
+#define STRIPE_SHIFT		(PAGE_SHIFT - 9)
+#define STRIPE_SECTORS		(STRIPE_SIZE>>9)
+
+/* A stripe handling worker.  Workers run on raid5_wq, each bound to
+ * its own cpu, and take stripes off the shared handle_list in batches.
+ */
+struct r5worker {
+	struct work_struct	work;
+	struct r5conf		*conf;
+	int			cpu;
+	int			working;	/* queued or running, under device_lock */
+};
+
 struct r5conf {
 	struct hlist_head	*stripe_hashtbl;
 	struct mddev		*mddev;
@@ -423,7 +462,7 @@ struct r5conf {
 	 * Free stripes pool
 	 */
 	atomic_t		active_stripes;
-	struct list_head	inactive_list;
+	struct list_head	inactive_list[NR_STRIPE_HASH_LOCKS];
 	wait_queue_head_t	wait_for_stripe;
 	wait_queue_head_t	wait_for_overlap;
 	int			inactive_blocked;	/* release of inactive stripes blocked,
@@ -431,8 +470,22 @@ struct r5conf {
 							 */
 	int			pool_size; /* number of disks in stripeheads in pool */
 	spinlock_t		device_lock;
+	spinlock_t		hash_locks[NR_STRIPE_HASH_LOCKS];
 	struct disk_info	*disks;
 
+	/* Stripe handling workers, in addition to raid5d.  Changed only
+	 * while the array is suspended; active_workers is protected by
+	 * the device_lock.
+	 */
+	struct r5worker		*workers;
+	int			worker_cnt;
+	int			active_workers;
+
+	/* Write journal, see raid5-log.c */
+	struct r5l_log		*log;
+	int			seen_write;	/* array written since start */
+	struct completion	*log_exit;	/* raid5d to drop the log */
+
 	/* When taking over an array from a different personality, we store
 	 * the new thread here until we fully activate the array.
 	 */
@@ -504,4 +557,16 @@ static inline int algorithm_is_DDF(int layout)
 extern int md_raid5_congested(struct mddev *mddev, int bits);
 extern void md_raid5_kick_device(struct r5conf *conf);
 extern int raid5_set_cache_size(struct mddev *mddev, int size);
+extern void raid5_release_stripe(struct stripe_head *sh);
+
+/* raid5-log.c */
+extern int r5l_init_log(struct r5conf *conf, dev_t dev);
+extern void r5l_exit_log(struct r5conf *conf);
+extern void r5l_free_log(struct r5l_log *log);
+extern int r5l_write_stripe(struct r5conf *conf, struct stripe_head *sh);
+extern void r5l_stripe_write_finished(struct r5conf *conf,
+				      struct stripe_head *sh);
+extern void r5l_submit_current_io(struct r5conf *conf);
+extern void r5l_raid5d(struct r5conf *conf);
+extern ssize_t r5l_show_journal(struct r5conf *conf, char *page);
 #endif
@@ -26,10 +26,15 @@
 #include <linux/scatterlist.h>
 #include <linux/if_vlan.h>
 #include <linux/slab.h>
+#include <linux/skb_recycle.h>
 
 static int napi_weight = 128;
 module_param(napi_weight, int, 0444);
 
+/* Per-cpu depth of the small receive buffer cache, 0 disables it */
+static int recycle_depth = 256;
+module_param(recycle_depth, int, 0444);
+
 static int csum = 1, gso = 1;
 module_param(csum, bool, 0444);
 module_param(gso, bool, 0444);
@@ -74,6 +79,9 @@ struct virtnet_info {
 	/* Chain pages by the private ptr. */
 	struct page *pages;
 
+	/* Small receive buffers freed by the stack come back here. */
+	struct skb_recycle_pool *rx_pool;
+
 	/* fragments + linear part + virtio header */
 	struct scatterlist rx_sg[MAX_SKB_FRAGS + 2];
 	struct scatterlist tx_sg[MAX_SKB_FRAGS + 2];
@@ -357,7 +365,14 @@ static int add_recvbuf_small(struct virtnet_info *vi, gfp_t gfp)
 	struct skb_vnet_hdr *hdr;
 	int err;
 
-	skb = netdev_alloc_skb_ip_align(vi->dev, MAX_PACKET_LEN);
+	if (vi->rx_pool) {
+		skb = skb_recycle_alloc(vi->rx_pool, gfp);
+		if (likely(skb)) {
+			skb->dev = vi->dev;
+			skb_reserve(skb, NET_IP_ALIGN);
+		}
+	} else
+		skb = netdev_alloc_skb_ip_align(vi->dev, MAX_PACKET_LEN);
 	if (unlikely(!skb))
 		return -ENOMEM;
 
@@ -1034,6 +1049,11 @@ static int virtnet_probe(struct virtio_device *vdev)
 	if (virtio_has_feature(vdev, VIRTIO_NET_F_MRG_RXBUF))
 		vi->mergeable_rx_bufs = true;
 
+	if (!vi->mergeable_rx_bufs && !vi->big_packets && recycle_depth > 0)
+		vi->rx_pool = skb_recycle_pool_create(dev_name(&vdev->dev),
+						      MAX_PACKET_LEN + NET_IP_ALIGN,
+						      recycle_depth, NULL, NULL, vi);
+
 	/* We expect two virtqueues, receive then send,
 	 * and optionally control. */
 	nvqs = virtio_has_feature(vi->vdev, VIRTIO_NET_F_CTRL_VQ) ? 3 : 2;
@@ -1086,6 +1106,7 @@ unregister:
 free_vqs:
 	vdev->config->del_vqs(vdev);
 free_stats:
+	skb_recycle_pool_destroy(vi->rx_pool);
 	free_percpu(vi->stats);
 free:
 	free_netdev(dev);
@@ -1130,6 +1151,9 @@ static void __devexit virtnet_remove(struct virtio_device *vdev)
 
 	vdev->config->del_vqs(vi->vdev);
 
+	/* Buffers still in the stack are freed when they come back. */
+	skb_recycle_pool_destroy(vi->rx_pool);
+
 	while (vi->pages)
 		__free_pages(get_a_page(vi, GFP_KERNEL), 0);
 
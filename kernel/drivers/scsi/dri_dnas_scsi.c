@@ -30,6 +30,12 @@
 #include <linux/completion.h>
 #include <linux/stat.h>
 #include <linux/mutex.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmaengine.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
@@ -43,6 +49,7 @@
 #include <linux/shared_mem_interface.h>
 
 #include <linux/dri_dnas_j1pool.h>
+#include <linux/dri_dnas_intercore.h>
 
 #define __EXT4_SUPPORT__      1
 
@@ -64,12 +71,17 @@
 /*
  * Define some driver parameters that might change
  */
+/*
+ * Commands over 1024 sectors go to the Vx core as a J1 SGL, which its
+ * firmware must support, so bigger ones (up to 8192, 4MB) are opt in.
+ */
 #ifndef DRI_MAX_SECTORS
-#define DRI_MAX_SECTORS 1024
+#define DRI_MAX_SECTORS 1024     /* 512KB */
 #endif
+#define DRI_MAX_SECTORS_LIMIT 32768
 
 #ifndef DRI_USE_CLUSTERING
-#define DRI_USE_CLUSTERING DISABLE_CLUSTERING
+#define DRI_USE_CLUSTERING ENABLE_CLUSTERING
 #endif
 
 static int dnas_debug_level = 0;
@@ -84,244 +96,6 @@ static int dnas_debug_mode  = 0;
     } \
   }
 
-/*
- * Intercore structs ... move to an include file!
- */
-#define INTER_CORE_SGL_MAX_ELEMENTS                   520  /* Max size returable from RTP */
-
-typedef struct core_ctl_lx_user_recv_ {
-	int no_response;  /* 0 = send appropriate repsonse from userland 1 = don't send response since driver had to do early response */
-	void *cmd_buf;  /* Buffer allocated by user space to recv  */
-	unsigned int cmd_size;  /* Size of the buffer allocated by*/
-	unsigned int cmd_recv_size;    /* Size of the InterCoreCtrlVxToLx 
-					struct actually received by the LLD 
-					over intercore core ctl queue */
-	void *data_buf;  /* Data buffer allocated in user space to receive 
-			    data related to InterCoreCtrlVxToLx struct that 
-			    is based on offsets/pointers in the 
-			    InterCoreCtrlVxToLx struct */
-	unsigned int data_size; /* Size of the data buffer allocated in user 
-				space */
-	unsigned int data_recv_size;  /* Size of the data related to 
-					InterCoreCtrlVxToLx struct actually 
-					received by the LLD */
-} __packed core_ctl_lx_user_recv;
-
-typedef struct core_ctl_lx_user_send_ {
-	void *cmd_buf;  /* Buffer allocated by user space to send the 
-			   InterCoreCtrlVxToLx struct */
-	unsigned int cmd_size;  /* Size of the buffer allocated by user space 
-				to send the InterCoreCtrlVxToLx struct */
-	unsigned int cmd_sent_size; /* Size of the InterCoreCtrlVxToLx struct 
-				       actually sent by the LLD over intercore 
-				       core ctl queue */
-	void *data_buf; /* Data buffer allocated in user space to send data 
-			related to InterCoreCtrlVxToLx struct that is based on 
-			offsets/pointers in the InterCoreCtrlVxToLx struct */
-	unsigned int data_size; /* Size of the data buffer allocated in user 
-				space */
-	unsigned int data_sent_size;  /* Size of the data related to 
-					InterCoreCtrlVxToLx struct actually 
-					sent by the LLD */
-} __packed core_ctl_lx_user_send;
-
-
-#define DRI_NAS_GET_MSG	        _IOR(0xF1, 0xF1, core_ctl_lx_user_recv)
-#define DRI_NAS_SEND_MSG        _IOW(0xF1, 0xF2, core_ctl_lx_user_send)
-
-typedef unsigned int InterCoreCmdTag;
-
-typedef struct InterCoreSGLElement
-{
-  unsigned int bufOffset;
-  unsigned int bufLength;
-  unsigned int bufSrc;    /* Only valid if the bufSrc in InterCoreSGL is invalid */
-} __packed InterCoreSGLElement;
-
-/* NOTE: If bufSrc is Invalid that means each element defines its own bufSrc.
- *  * Otherwise all elements come from the bufSrc in InterCoreSGL structure
- *   */
-typedef struct InterCoreSGL
-{
-  unsigned int status;
-  unsigned int numElements;
-  unsigned int bufSrc;
-  unsigned int totalLength;
-  InterCoreSGLElement elements[INTER_CORE_SGL_MAX_ELEMENTS];
-} __packed InterCoreSGL;
-
-typedef struct InterCoreBufferId
-{
-  unsigned int bufOffset;     /* This offset is from the bufSrc base address */
-  unsigned int length;
-  unsigned int bufSrc;
-} __packed InterCoreBufferId;
-
-/* Send from Vx To Lx Core */
-typedef struct InterCoreSCSIResp {
-	unsigned int version;
-	InterCoreCmdTag tag;
-	unsigned int backEndTag;      /* Resource tag set by back-end stack */
-	unsigned int status;
-	InterCoreBufferId bufId1;
-	InterCoreBufferId bufId2;
-} __packed InterCoreSCSIResp;
-
-/* Sent from Lx To Vx core */
-typedef struct InterCoreSCSICmd
-{
-	unsigned int version;
-	InterCoreCmdTag tag;
-	unsigned char lun[8];
-	unsigned char cdb[16];
-	InterCoreBufferId bufId;
-} __packed InterCoreSCSICmd;
-
-/* Lx Resource are cmd are sent from Vx To Lx when Vx Core is done
- *  * using Lx Core resource and Lx core can free its resources
- *   */
-typedef struct InterCoreLxResource {
- 	unsigned int version;
-	InterCoreCmdTag tag;
-	InterCoreBufferId bufId1;
-	InterCoreBufferId bufId2;
-} __packed InterCoreLxResource;
-
-/* Vx Resource are cmd are sent from Lx To Vx for when Lx Core is done
- *  * using Vx Core resource and Vx Core can free its resources
- *   */
-typedef struct InterCoreVxResource {
-	unsigned int version;
-	InterCoreCmdTag tag;
-	unsigned int backEndTag;      /* Resource tag set by back-end stack */
-	InterCoreBufferId bufId1;
-	InterCoreBufferId bufId2;
-} __packed InterCoreVxResource;
-
-/* Message for Vx to Lx core control queue usage. */
-typedef struct InterCoreCtrlVxToLx
-{
-	unsigned int version;
-	InterCoreCmdTag tag;
-	unsigned int flags;
-	time_t secondsSinceEpoch;    /* Seconds since Unix epoch, see flags */
-/*  InterCoreSCSIResp scsiResp; */
-	union {
-		struct {
-			unsigned int fileNum;
-			unsigned int cmd;
-			InterCoreBufferId bufId;
-		} fileReq; // request
-		struct {
-			unsigned int version;
-			unsigned int cmd;
-			InterCoreBufferId bufId;
-		} netReq; // request
-		struct {
-            		uint64_t diskPackId;
-                        unsigned int FSMigrationFlag;
-                        unsigned int reserved[2];
-                } migReq; // request
-                struct {
-                        uint32_t seqNum;
-                        uint32_t crc;
-                        InterCoreBufferId bufId;
-                        uint32_t buffSize;
-                        void*    pBuff;
-                } FwReq;
-	} u;
-} __packed InterCoreCtrlVxToLx;
-
-/* Message for Lx to Vx core control queue usage. */
-typedef struct InterCoreCtrlLxToVx {
-	unsigned int version;
-	InterCoreCmdTag tag;
-	unsigned int flags;
-/*   InterCoreSCSICmd scsiCmd; */
-	union {
-    		struct {
-			unsigned int status;
-			unsigned int len;
-			unsigned int eof;
-		} fileReq; // response
-		struct {
-			unsigned int version;
-			unsigned int status;
-		} netReq; //response
-   		struct
-    		{
-      			unsigned int version;
-      			unsigned code;
-      			unsigned lun;
-    		} hostLunUsageInfo;
-	} u;
-} __packed InterCoreCtrlLxToVx;
-
-typedef struct VxToLxCommonInfo
-{
-       unsigned char serialNumber[32];
-} __packed VX_TO_LX_COMMON_INFO;
-
-#define SCSI_VALID    0x00000001  /* SCSI cmd/resp is valid */
-#define ISCSI_UP      0x00000002  /* iSCSI stack has come up (lx->vx) */
-#define ISCSI_DOWN    0x00000004  /* iSCSI stack has gone down (lx->vx) */
-#define ISCSI_ENABLE  0x00000008  /* iSCSI stack ENABLE request (vx->lx) */
-#define ISCSI_DISABLE 0x00000010  /* iSCSI stack DISABLE request (vx->lx) */
-#define TIME_VALID    0x00000020  /* secondsSinceEpoch is valid (vx->lx) */
-#define REQ_LOGS      0x00000040  /* Request Lx logs (vx->lx + resp) */
-#define RTN_RESOURCE  0x00000080  /* Return resource (lx->vx) */
-#define ISCSI_CRASH   0x00000100  /* iSCSI stack has crashed (lx->vx) */
-#define NET_INFO           0x00000200  /* Get/Set network Info */
-#define UNEXPECTED_REBOOT  0x00000400  /* The last reboot was unexpectd; copy last log to crash file (vx->lx) */
-#define FLUSH_DISKS   0x00000800  /* Request disks are flushed (lx->vx) */
-#define HOST_LUN_USAGE    0x00001000  /* Send host lun usage info (lx->vx) */
-#define GET_BLADE_INFO    0x00002000  /* Get Blade related serial numbers from LX */
-#define LX_SHUTDOWN       0x00004000  /* Request that Linux shut down       */
-#define LX_DOWN           0x00008000  /* Lx->Vx LX SHUTDOWN processing done */
-#define LX_CLEARDISK      0x00010000  /* Request that Linux dor cleardisk processing */
-#define LX_CLEARFLASH     0x00020000  /* Request from Vx to clear flash only */
-#define FS_MIGRATION      0x00040000  /* Message informing of this is a migration */
-#define FW_DOWNLOAD       0x00080000
-#define FW_STATUS         0x00100000
-
-#define HOST_LUN_USAGE_INFO_VERSION 1
-#define HOST_LUN_USAGE_STARTED 1 /* Send one of these for each host that logs in */
-#define HOST_LUN_USAGE_ENDED   2 /* Send one of these for each host that logs out */ 
-#define HOST_LUN_USAGE_RESET   3 /* Send one of these if the LUN is deleted */
-
-#define REQ_LOG_OPEN  0x00000001  /* Open a file */
-#define REQ_LOG_NEXT  0x00000002  /* Get the next chunk of the open file */
-#define REQ_LOG_CLOSE 0x00000003  /* Close the file */
-
-#define REQ_LOG_FILE_DMESG          0x00000001 /* Logs from the dmesg log */
-#define REQ_LOG_FILE_ISCSITGT       0x00000002 /* Logs from the iscsitgt output */
-#define REQ_LOG_FILE_LAST_CRASH     0x00000003 /* Logs from the last crash */
-#define REQ_LOG_FILE_LAST_BOOT      0x00000004 /* Logs from the last boot */
-
-#define REQ_LOG_STAT_OK             0x00000000
-#define REQ_LOG_STAT_CANT_OPEN_FILE 0x00000001
-
-#define SET_NET_INFO       0x00000001  /* Set Network Info to Lx Core */
-#define GET_NET_INFO       0x00000002  /* Get Network Info from Lx Core */
-#define SET_LX_COMMON_INFO 0x00000003  /* Set Other info, currently only Serial Number  */
-#define SET_IMMED_NET_INFO 0x00000004  /* Set the Network Info to Lx Core and take effect immediately */
-#define SET_ESX_CERT       0x00000005  /* Set ESX certification mode on Lx core */
-
-#define NET_INFO_OK        0x00000001
-#define NET_INFO_ERROR     0x00000002
-
-#define NETWORK_INFO_CUR_VERSION (2)
-
-#define INTER_CORE_CMD_PARTITION_ID_INVALID           0x01
-#define INTER_CORE_CMD_PARTITION_ID_J1                0x10
-#define INTER_CORE_CMD_PARTITION_ID_HLBAT_CACHE       0x11
-#define INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM     0x12
-#define INTER_CORE_CMD_PARTITION_ID_VXWORKS_DYN_MEM   0x13
-#define INTER_CORE_CMD_PARTITION_ID_SGL_MEM           0x14
-
-#define INTER_CORE_CMD_PROTOCOL_VERSION_1             0x2
-#define INTER_CORE_CMD_PROTOCOL_CUR_VERSION           INTER_CORE_CMD_PROTOCOL_VERSION_1
-
 /*
  * Allow for 16 LUNs by default.
  */
@@ -329,11 +103,42 @@ typedef struct VxToLxCommonInfo
 #define DEF_MAX_LUNS 16
 
 /*
- * 129 SG segments allows for 512kB all of 4kB pages 
+ * 129 SG segments allows for 512kB all of 4kB pages, the host gets enough
+ * for max_sectors all of 4kB pages, chained.
  * The queue size on the VxCore for SCSI requests is 64
  */
 #define DRI_DNAS_MAX_SG_SEGMENTS 129 
 #define DRI_DNAS_MAX_QUEUE 32 
+#define DRI_DNAS_QUEUE_LIMIT 256
+
+/*
+ * Writes bigger than this many bulk J1 buffers go as an InterCoreSGL of
+ * single buffers rather than one contiguous run.
+ */
+#define DRI_DNAS_J1_CONTIG_MAX 2
+#define DRI_DNAS_J1_SGL_MAX \
+	(DRI_MAX_SECTORS_LIMIT * 512 / BULK_WRITE_BUFFER_SIZE)
+
+/*
+ * Max SCSI commands we hand to the Vx core in one queue batch, and max
+ * responses we take back in one go.
+ */
+#define DRI_DNAS_REQ_BATCH 16
+#define DRI_DNAS_RESP_BATCH 16
+
+/*
+ * The tag pool. The first max_queue tags are indexed by the block
+ * layer tag of the request. Commands that come down untagged, or whose slot
+ * is still held by an aborted command the Vx core has not answered yet, get
+ * one of the spares. Spares live in small per CPU caches with a shared free
+ * list behind them.
+ *
+ * On the intercore the tag is DRI_DNAS_TAG_MAGIC | index, so we can reject
+ * anything the Vx core hands back that we did not give it.
+ */
+#define DRI_DNAS_TAG_CACHE  4
+#define DRI_DNAS_TAG_MAGIC  0x7A000000
+#define DRI_DNAS_TAG_MASK   0x0000FFFF
 
 extern void wait_for_init_shared_mem(void *dev);
 extern int shared_mem_open_main(void *dev);
@@ -341,11 +146,18 @@ extern void *dri_shm_get_dev(void);
 extern int find_region_kern_addr_from_tag(void *dev, char *tag, void **phys,
                                           void **virt,
 					  int *reg_size);
+extern int find_region_kern_direct_addr_from_tag(void *dev, char *tag,
+						 void **virt);
+extern void shm_region_sync(void *kaddr, size_t len, int dir);
 extern int shm_queue_attach(void *shm_dev, SharedMemQueueAttach *attach_args);
 extern int shm_queue_kern_send_msg(void *shm_dev, 
 			SharedMemQueueSendMsg *send_args);
 extern int shm_queue_kern_recv_msg(void *shm_dev, 
 			SharedMemQueueRecvMsg *recv_args);
+extern int shm_queue_kern_send_batch(void *shm_dev,
+			SharedMemQueueBatch *batch_args);
+extern int shm_queue_kern_recv_batch(void *shm_dev,
+			SharedMemQueueBatch *batch_args);
 
 static void dri_dnas_fake_0_release(struct device *dev);
 static int dri_dnas_fake_match(struct device *dev, struct device_driver *dev_driver);
@@ -377,6 +189,7 @@ static struct device *dri_dnas_fake_primary;
  */
 unsigned int wb_history_enabled = 1;
 unsigned int driver_debug_enabled = 0;
+unsigned int cmd_trace_enabled = 0;   /* Keep recent commands in cmd_trace */
 
 /*
  * Whether to drop requests or not and
@@ -396,8 +209,42 @@ unsigned int delay_skip = 0;   /* How many IOs to skip delays after a delay */
 unsigned int no_read_acceleration = 1;
 unsigned int no_write_acceleration = 1;
 
+/*
+ * How J1 write copies of j1_dma_threshold bytes or more are done. With the
+ * engine, the copy is handed to a DMA_MEMCPY channel (the XOR engines) and
+ * the request thread moves on; if there is no channel we use the CPU. The
+ * emulated engine does the copy from a work item and completes it the same
+ * way, so the async path can be exercised without the hardware. The CPU is
+ * the default, since the channel is taken from the XOR engines that RAID
+ * offload uses; it is only requested once the engine mode is chosen.
+ */
+#define DNAS_J1_DMA_CPU      0
+#define DNAS_J1_DMA_ENGINE   1
+#define DNAS_J1_DMA_EMULATED 2
+
+unsigned int j1_dma_mode = DNAS_J1_DMA_CPU;
+unsigned int j1_dma_threshold = 0x10000;
+
 static int dri_dnas_max_luns = DEF_MAX_LUNS;
 
+/*
+ * Commands outstanding to the Vx core for the host, and per LUN to start
+ * with. The per LUN depth can be changed later through the queue_depth file
+ * of the scsi device.
+ */
+static unsigned int max_queue = DRI_DNAS_MAX_QUEUE;
+module_param(max_queue, uint, S_IRUGO);
+MODULE_PARM_DESC(max_queue, "Commands outstanding for the host (32)");
+
+static unsigned int queue_depth = DRI_DNAS_MAX_QUEUE;
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "Initial commands outstanding per LUN (32)");
+
+static unsigned int max_sectors = DRI_MAX_SECTORS;
+module_param(max_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(max_sectors, "Largest command in 512 byte sectors (1024, "
+		 "8192 needs J1 SGL support in the Vx core)");
+
 #define DRI_DNAS_VERSION "2.0.0"
 static const char *dri_dnas_version_date = "20120918";
 
@@ -423,9 +270,9 @@ static DEFINE_MUTEX(dnas_sysfs_queue_mutex);
  * from the SCSI Mid Layer, Write Buffers if a write, tags, the done 
  * routine and so forth.
  *
- * We pass the address of this structure across the intercore as the tag
- * on a request. When we get a response we can look up this structure and
- * deal with the various pieces.
+ * We pass the index of this structure in the tag pool across the intercore
+ * as the tag on a request. When we get a response we can look up this
+ * structure and deal with the various pieces.
  *
  * This tag will stick around for write requests until the WriteBuffer is
  * freed, so we will never have duplicate tags. For read requests, we can
@@ -465,16 +312,95 @@ struct dnas_userland_queue_elt {
 #define DNAS_READ_IO  3
 #define DNAS_NOIO     4
 
+/*
+ * process_scsi_request finished the command itself, only the tag is left
+ */
+#define DNAS_REQ_COMPLETED 1
+
+/*
+ * Phases a command goes through, in order. Each tag gets a sched_clock()
+ * stamp as it reaches a phase, and the time between stamps goes into the
+ * per-phase histograms when the command completes. Phases a command skips
+ * (no J1 buffer for a read, say) stay 0 and their time lands in the next one.
+ */
+#define DNAS_PH_QUEUED   0  /* queuecommand */
+#define DNAS_PH_DEQUEUED 1  /* Picked up by the request thread */
+#define DNAS_PH_J1_ALLOC 2  /* Got a J1 buffer */
+#define DNAS_PH_COPIED   3  /* Write data is in the shared buffer */
+#define DNAS_PH_SENT     4  /* On the SCSI queue to the Vx core */
+#define DNAS_PH_RESP     5  /* The Vx core answered */
+#define DNAS_PH_DONE     6  /* Handed back to the mid layer */
+#define DNAS_PHASES      7
+
 struct dnas_tag_struct {
 	int request_type;
 	struct scsi_cmnd *req_p;          /* The request */
 	void (*done)(struct scsi_cmnd *);
         struct mutex tag_mutex;           /* Lock the structure when needed */
 	struct list_head req_queue_ent;   /* We queue requests to a thread */
+	unsigned int index;               /* Where we are in the tag pool */
+	atomic_t busy;                    /* Owned by a command */
+	int j1_dma_state;                 /* Offloaded J1 copy, if any */
+	void *j1_buf;                     /* The J1 buffer being copied to */
+	unsigned int j1_len;
+	struct dnas_req_ctx *j1_ctx;      /* Who sends it when it is copied */
+	struct scatterlist *j1_sgl;       /* Mapped for the engine, */
+	int j1_nents;                     /* 0 if not mapped */
+	dma_cookie_t j1_cookie;           /* The engine's last descriptor */
+	struct work_struct j1_work;       /* For the emulated engine */
+	unsigned int sgl_off;             /* Lx Dyn buffer holding a J1 SGL */
+	unsigned int sgl_len;             /* 0 if there isn't one */
+	unsigned long long ts[DNAS_PHASES]; /* When each phase was reached */
 };
 
+static inline void dnas_trace_mark(struct dnas_tag_struct *tag, int phase)
+{
+	tag->ts[phase] = sched_clock();
+}
+
+static inline void dnas_trace_start(struct dnas_tag_struct *tag)
+{
+	memset(tag->ts, 0, sizeof(tag->ts));
+	dnas_trace_mark(tag, DNAS_PH_QUEUED);
+}
+
+#define DNAS_J1_DMA_IDLE 0
+#define DNAS_J1_DMA_BUSY 1
+#define DNAS_J1_DMA_DONE 2
+
 struct buff_elt_struct;
 
+/*
+ * SCSI commands built by a request thread wait here until its request
+ * queue runs dry or the batch fills up, and then go to the Vx core with one
+ * queue lock and one doorbell.
+ */
+struct dnas_req_batch {
+	unsigned int count;
+	InterCoreSCSICmd cmd[DRI_DNAS_REQ_BATCH];
+	SharedMemQueueBatchEntry ent[DRI_DNAS_REQ_BATCH];
+};
+
+/*
+ * Per CPU request submission. queuecommand puts a command on the queue of
+ * the CPU it was called on, and that CPU's request thread (bound to it) 
+ * builds and sends it. All of them share the one SCSI queue pair to the Vx
+ * core and the one tag pool. The spare tag cache is only touched with IRQs
+ * off on its own CPU.
+ */
+struct dnas_req_ctx {
+	struct dri_dnas_device *dnas_dev;
+	struct task_struct *th;           /* Request thread, NULL if none */
+	struct list_head req_queue;       /* Queue of scsi requests */
+	int req_thread_waiting;           /* When we are waiting   */
+	struct completion req_completion;
+	spinlock_t req_spinlock;          /* Protect access to the queue */
+	struct dnas_req_batch req_batch;  /* Unsent cmds, req thread only */
+	unsigned int requests;            /* Requests queued here */
+	unsigned short tag_cache[DRI_DNAS_TAG_CACHE]; /* Free spare tags */
+	unsigned int tag_cache_cnt;
+};
+
 struct dri_dnas_device {
 	struct list_head device_list;
 	struct Scsi_Host *shost;
@@ -489,17 +415,14 @@ struct dri_dnas_device {
 	struct task_struct *comm_th;      /* Comms thread          */
 	struct task_struct *res_th;       /* Resource thread       */
 	struct task_struct *scsi_resp_th; /* scsi response thread  */
-	struct task_struct *scsi_req_th;  /* Write thread          */
+	int req_fallback_cpu;             /* For CPUs without a req thread */
 	int waiting_for_core_ctrl;
 	struct kmem_cache *core_ctrl_cache;
 	struct mutex core_ctrl_queue_mutex;
         struct mutex scsi_completion_mutex;
 	struct completion core_ctrl_completion;
 	struct list_head core_ctrl_queue;
-	struct list_head req_queue;       /* Queue of scsi requests */
-	int req_thread_waiting;           /* When we are waiting   */
-	struct completion req_completion;
-	spinlock_t req_spinlock;          /* Protect access to the queue */
+	struct dnas_req_ctx __percpu *req_ctx; /* Per CPU request queues */
 	void *shm_dev;                    /* Shared mem device ptr */
 	int scsi_queue_handle;            /* Handle for SCSI command Q */
 	int resource_queue_handle;
@@ -514,6 +437,8 @@ struct dri_dnas_device {
 	void *hlbat_buffer_start;
         void *hlbat_buffer_phys;
 	int hlbat_buffer_size;
+	void *write_buffer_direct;        /* Cached section mappings of */
+	void *hlbat_buffer_direct;        /* J1 and HLRC, or NULL       */
 	void *sgl_buffer_start;
         void *sgl_buffer_phys;
 	int sgl_buffer_size;
@@ -525,7 +450,21 @@ struct dri_dnas_device {
 	void *vx_dyn_buffer_start;
         void *vx_dyn_buffer_phys;
 	int vx_dyn_buffer_size;
-	struct kmem_cache *dnas_tag_cache;
+	unsigned int max_queue;           /* Tags indexed by block layer tag */
+	unsigned int tag_pool_size;       /* Those plus as many spares */
+	struct dnas_tag_struct *tags;
+	spinlock_t tag_lock;              /* Protects tag_free */
+	unsigned short *tag_free;
+	unsigned int tag_free_cnt;
+	atomic_t tags_in_use;
+	unsigned int tags_hwm;            /* The rest are under the host lock */
+	unsigned int tags_spare_allocs;
+	unsigned int tags_slot_busy;
+	unsigned int tags_alloc_fails;
+	struct dma_chan *j1_chan;         /* DMA_MEMCPY channel for J1 copies */
+	atomic_t j1_dma_copies;
+	atomic_t j1_dma_fallbacks;
+	atomic_t j1_sgl_writes;           /* Writes sent as a J1 SGL */
         /* Some stats */
         unsigned int scsi_requests;
         unsigned int scsi_complete;
@@ -534,10 +473,15 @@ struct dri_dnas_device {
 #define to_dri_dnas_device(d) \
 	container_of(d, struct dri_dnas_device, dev)
 
-int send_scsi_request(struct dri_dnas_device *dnas_dev, 
+int send_scsi_request(struct dnas_req_ctx *ctx, 
 			uint8_t *cdb, uint32_t lun,
 			struct dnas_tag_struct *tag, uint32_t buf, 
 			uint32_t buf_len, uint32_t src);
+int flush_scsi_requests(struct dnas_req_ctx *ctx);
+static void dnas_j1_dma_emul_work(struct work_struct *work);
+static void dnas_j1_dma_init(struct dri_dnas_device *dnas_dev);
+static void dnas_j1_dma_unmap(struct dri_dnas_device *dnas_dev,
+			struct dnas_tag_struct *tag);
 
 //static int dri_dnas_queuecommand(struct scsi_cmnd *scmd,
 //				void (*done)(struct scsi_cmnd *));
@@ -551,7 +495,15 @@ int dump_write_buffer(struct dri_dnas_device *dnas_dev, char *buf);
 int dump_lx_buffer(struct dri_dnas_device *dnas_dev, char *buf);
 int dump_write_history(struct dri_dnas_device *dnas_dev, char *buf);
 int dump_driver_stats(struct dri_dnas_device *dnas_dev, char *buf);
-int xfer_from_request_buffs(void *buf, struct scsi_cmnd *scmd,
+int dump_tag_stats(struct dri_dnas_device *dnas_dev, char *buf);
+int dump_xfer_hist(char *buf);
+void reset_xfer_hist(void);
+int dump_lat_hist(char *buf);
+void reset_lat_hist(void);
+int dump_cmd_trace(char *buf);
+static void dnas_trace_done(struct dnas_tag_struct *tag);
+int xfer_from_request_buffs(struct dri_dnas_device *dnas_dev, void *buf,
+			    struct scsi_cmnd *scmd,
                             void *base_virt, void *base_phys);
 
 static int num_luns = 0;
@@ -632,13 +584,12 @@ inline BOOL WriteBufferCheckDescriptor(WriteBufferDescriptor *descriptor)
 /****************************************************/
 void scsiTgtWritePoolInit(WriteBufferPoolInfo *PoolInfo, void *buf, void *shmem_base)
 {
-  WriteBufferDescriptor *DescStart;
+  PoolAllocatorPrivateInfo *priv = (PoolAllocatorPrivateInfo*)buf;
+  WriteBufferDescriptor *DescStart, *DescCurr;
   U8 *BufferStartAddress;
-  BufferDescListLocked *SingleList, *DoubleList;
-  WriteBufferDescriptor *DescCurr, *DescPrev;
   U32 i;
 
-  PoolInfo->LxPrivate = (PoolAllocatorPrivateInfo*)buf;
+  PoolInfo->LxPrivate = priv;
 
   // Set up the buffer descriptors 
   DescStart = (WriteBufferDescriptor*)(shmem_base + PoolInfo->DescStartOffset);
@@ -646,37 +597,39 @@ void scsiTgtWritePoolInit(WriteBufferPoolInfo *PoolInfo, void *buf, void *shmem_
 
   BufferStartAddress = shmem_base + PoolInfo->BufferStartOffset;
 
-  DoubleList = &PoolInfo->LxPrivate->FreeListDouble;
-  DoubleList->ListHead = DescStart;
-  DoubleList->NumElements = 0;
-  DescCurr = DoubleList->ListHead;
-  DescPrev = NULL;
-  for (i = 0; i <= PoolInfo->NumBuffers - 2; i += 2)
+  // The state array survives a re-setup of the partition, it is only sized once.
+  if (priv->bufState == NULL)
+    priv->bufState = kcalloc(PoolInfo->NumBuffers, sizeof(atomic_t), GFP_KERNEL);
+  else
+    memset(priv->bufState, 0x00, PoolInfo->NumBuffers * sizeof(atomic_t));
+  if (priv->bufState == NULL)
   {
-     DescCurr->prev = DescPrev;      // prev is the previous double-buffer element
-     DescCurr->buddy = DescCurr + 1; // buddy is the next descriptor 
-     DescCurr->next = DescCurr + 2;  // next is the one after the buddy
-  
+    printk(KERN_ERR "scsiTgtWritePoolInit: ERROR: No memory for %ld buffer states\n",
+           PoolInfo->NumBuffers);
+    PoolInfo->NumBuffers = 0;
+  }
+
+  for (i = 0; i < PoolInfo->NumBuffers; i++)
+  {
+     DescCurr = DescStart + i;
      DescCurr->writeBuffer = BufferStartAddress + PoolInfo->BufferSize * i;
-     DescCurr->buddy->writeBuffer = BufferStartAddress + PoolInfo->BufferSize * (i + 1);
-  
+
      /*
       * Set signatures and assign all descriptors to the allocator 
       */
      DescCurr->signature = WRITE_JOURNAL_DESCRIPTOR_MARKER + i;
-     DescCurr->buddy->signature = WRITE_JOURNAL_DESCRIPTOR_MARKER + i + 1;
-
      ATOMIC_SET32(&DescCurr->releasedToAllocator, WRITE_BUFFER_FREE);
-     ATOMIC_SET32(&DescCurr->buddy->releasedToAllocator, WRITE_BUFFER_FREE);
-  
-     DescCurr = DescCurr->next;
-     DoubleList->NumElements++;
   }
-  // Initially there is nothing on the single-buffer list
-  SingleList = &PoolInfo->LxPrivate->FreeListSingle;
-  SingleList->ListHead = NULL;
-  SingleList->NumElements = 0;
-  ATOMIC_SET64(&PoolInfo->LxPrivate->allocReleaseGenNumber, 0);
+
+  atomic_set(&priv->numFree, PoolInfo->NumBuffers);
+  priv->scanHint = 0;
+  spin_lock_init(&priv->multiLock);
+  atomic_set(&priv->allocs, 0);
+  atomic_set(&priv->magazineHits, 0);
+  atomic_set(&priv->multiAllocs, 0);
+  atomic_set(&priv->allocFails, 0);
+  atomic_set(&priv->reclaimed, 0);
+  atomic_set(&priv->staleFrees, 0);
 }
 
 void scsiTgtWriteBufferSetup(void *buffer)
@@ -705,160 +658,493 @@ void scsiTgtWriteBufferSetup(void *buffer)
 
 }
 
+/*
+ * Buffer state helpers. A buffer moves FREE -> CACHED/CLAIMED -> ISSUED and
+ * back to FREE once the Vx core has released the descriptor. Every move
+ * bumps the generation so a stale compare and swap always fails.
+ */
+static inline int j1_next_state(int old, int state)
+{
+  return ((old & ~J1_BUF_STATE_MASK) + J1_BUF_GEN_INC) | state;
+}
+
+static inline BOOL j1_move_state(atomic_t *s, int old, int state)
+{
+  return atomic_cmpxchg(s, old, j1_next_state(old, state)) == old;
+}
+
+static inline WriteBufferDescriptor *j1_pool_desc(WriteBufferPoolInfo *PoolInfo, U32 i)
+{
+  return (WriteBufferDescriptor *)(gDataRegionStart + PoolInfo->DescStartOffset) + i;
+}
+
+static inline void *j1_pool_buffer(WriteBufferPoolInfo *PoolInfo, U32 i)
+{
+  return gDataRegionStart + PoolInfo->BufferStartOffset + PoolInfo->BufferSize * i;
+}
+
+/*
+ * Per-cpu magazines of single buffers. An entry remembers the state value it
+ * was cached with; if somebody stole the buffer meanwhile the pop just fails
+ * on that entry.
+ */
+#define J1_MAG_SIZE   8
+#define J1_MAG_REFILL (J1_MAG_SIZE / 2)
+
+struct j1_mag_entry {
+  U32 idx;
+  int state;
+};
+
+struct j1_magazine {
+  U32 count;
+  struct j1_mag_entry ent[J1_MAG_SIZE];
+};
+
+struct j1_cpu_cache {
+  struct j1_magazine mag[2];    // Trans, bulk
+};
+
+static DEFINE_PER_CPU(struct j1_cpu_cache, j1_cpu_cache);
+
+/*
+ * Allocation waiters, woken when the Vx core gives buffers back. Each wakeup
+ * moves j1_release_gen on, and a waiter only retries when it has moved, so
+ * a waiter's own retries can't wake it (or anyone else) again.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(j1_wait);
+static atomic_t j1_release_gen = ATOMIC_INIT(0);
+
+static void j1_wake_waiters(void)
+{
+  atomic_inc(&j1_release_gen);
+  wake_up(&j1_wait);
+}
+
+/* Exhaustion and wait stats, wait times in log2 usecs */
+#define J1_WAIT_HIST_BUCKETS 16
+static DEFINE_SPINLOCK(j1_wait_lock);
+static atomic_t j1_exhausted = ATOMIC_INIT(0);
+static atomic_t j1_wait_timeouts = ATOMIC_INIT(0);
+static atomic_t j1_rescans = ATOMIC_INIT(0);
+static U32 j1_waits;
+static U64 j1_wait_total_ns;
+static U64 j1_wait_max_ns;
+static U32 j1_wait_hist[J1_WAIT_HIST_BUCKETS];
+
+static inline struct j1_magazine *j1_cpu_magazine(WriteBufferPoolInfo *PoolInfo)
+{
+  return &__get_cpu_var(j1_cpu_cache).mag[PoolInfo == gBulkPool];
+}
+
+// Called with preemption disabled
+static BOOL j1_mag_pop(WriteBufferPoolInfo *PoolInfo, struct j1_magazine *mag, U32 *idx)
+{
+  struct j1_mag_entry *e;
+
+  while (mag->count > 0)
+  {
+    e = &mag->ent[--mag->count];
+    if (j1_move_state(&PoolInfo->LxPrivate->bufState[e->idx], e->state, J1_BUF_CLAIMED))
+    {
+      *idx = e->idx;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// Called with preemption disabled
+static void j1_mag_drain(WriteBufferPoolInfo *PoolInfo, struct j1_magazine *mag)
+{
+  struct j1_mag_entry *e;
+
+  while (mag->count > 0)
+  {
+    e = &mag->ent[--mag->count];
+    if (j1_move_state(&PoolInfo->LxPrivate->bufState[e->idx], e->state, J1_BUF_FREE))
+      atomic_inc(&PoolInfo->LxPrivate->numFree);
+  }
+}
+
+/*
+ * Claim up to want free buffers starting at the scan hint. Claimed buffers
+ * are put in the given state and returned in ent[].
+ */
+static U32 j1_claim_scan(WriteBufferPoolInfo *PoolInfo, U32 want, int state,
+                         struct j1_mag_entry *ent)
+{
+  PoolAllocatorPrivateInfo *priv = PoolInfo->LxPrivate;
+  U32 n = PoolInfo->NumBuffers;
+  U32 i, idx, got = 0;
+  int s;
+
+  if (n == 0)
+    return 0;
+
+  idx = ACCESS_ONCE(priv->scanHint);
+  for (i = 0; i < n && got < want; i++, idx++)
+  {
+    if (idx >= n)
+      idx = 0;
+    s = atomic_read(&priv->bufState[idx]);
+    if ((s & J1_BUF_STATE_MASK) != J1_BUF_FREE)
+      continue;
+    if (!j1_move_state(&priv->bufState[idx], s, state))
+      continue;
+    atomic_dec(&priv->numFree);
+    ent[got].idx = idx;
+    ent[got].state = j1_next_state(s, state);
+    got++;
+  }
+  priv->scanHint = idx;
+  return got;
+}
+
+// Nothing free, take a buffer sitting in some other cpu's magazine.
+static BOOL j1_steal_cached(WriteBufferPoolInfo *PoolInfo, U32 *idx)
+{
+  PoolAllocatorPrivateInfo *priv = PoolInfo->LxPrivate;
+  U32 i;
+  int s;
+
+  for (i = 0; i < PoolInfo->NumBuffers; i++)
+  {
+    s = atomic_read(&priv->bufState[i]);
+    if ((s & J1_BUF_STATE_MASK) != J1_BUF_CACHED)
+      continue;
+    if (j1_move_state(&priv->bufState[i], s, J1_BUF_CLAIMED))
+    {
+      *idx = i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * Claim num physically contiguous buffers. Multi-buffer claimers serialise
+ * on the pool's multiLock so two of them cannot keep undoing each other;
+ * single buffer allocations still race with us through the state words.
+ */
+static BOOL j1_claim_multi(WriteBufferPoolInfo *PoolInfo, U32 num, U32 *first)
+{
+  PoolAllocatorPrivateInfo *priv = PoolInfo->LxPrivate;
+  BOOL found = FALSE;
+  U32 i, k, busy;
+  int s;
+
+  spin_lock(&priv->multiLock);
+  for (i = 0; i + num <= PoolInfo->NumBuffers; i += k + 1)
+  {
+    for (k = 0; k < num; k++)
+    {
+      s = atomic_read(&priv->bufState[i + k]);
+      if ((s & J1_BUF_STATE_MASK) != J1_BUF_FREE &&
+          (s & J1_BUF_STATE_MASK) != J1_BUF_CACHED)
+        break;
+      if (!j1_move_state(&priv->bufState[i + k], s, J1_BUF_CLAIMED))
+        break;
+      if ((s & J1_BUF_STATE_MASK) == J1_BUF_FREE)
+        atomic_dec(&priv->numFree);
+    }
+
+    if (k == num)
+    {
+      *first = i;
+      found = TRUE;
+      break;
+    }
+
+    // Give back what we got of this run and start after the busy buffer.
+    busy = k;
+    while (k-- > 0)
+    {
+      atomic_set(&priv->bufState[i + k],
+                 j1_next_state(atomic_read(&priv->bufState[i + k]), J1_BUF_FREE));
+      atomic_inc(&priv->numFree);
+    }
+    k = busy;
+  }
+  spin_unlock(&priv->multiLock);
+
+  return found;
+}
+
+// Hand a claimed buffer to a command.
+static void j1_issue(WriteBufferPoolInfo *PoolInfo, U32 i)
+{
+  WriteBufferDescriptor *desc = j1_pool_desc(PoolInfo, i);
+  atomic_t *state = &PoolInfo->LxPrivate->bufState[i];
+
+  // Need to set this flag so the buffer won't get picked up by a rescan.
+  ATOMIC_SET32(&desc->releasedToAllocator, WRITE_BUFFER_IN_USE);
+    
+  ATOMIC_SET32(&desc->pCmd, 0);
+  ATOMIC_SET32(&desc->initTaskTag, 0);
+  ATOMIC_SET32(&desc->intercoreTag, 0);
+  ATOMIC_SET32(&desc->pConnection, 0);
+  ATOMIC_SET32(&desc->stateFlags, 0);         // Track where in the system the buffer is
+  ATOMIC_SET32(&desc->free_intent_time, 0);   // When we start to free this obj
+  ATOMIC_SET32(&desc->alloc_dealloc_time, 0); // When it was touched.
+  ATOMIC_SET32(&desc->cmdFlags, 0);           // Command flags ...
+  ATOMIC_SET32(&desc->iscsiCmd, 0);           // The iSCSI cmd that caused this
+  ATOMIC_SET32(&desc->scsiCmd, 0);            // And the scsiCmd ...
+
+  // The descriptor must read in use before anybody can reclaim it.
+  smp_wmb();
+  atomic_set(state, j1_next_state(atomic_read(state), J1_BUF_ISSUED));
+}
+
+// Take an issued buffer back if the Vx core has released it.
+static BOOL j1_reclaim(WriteBufferPoolInfo *PoolInfo, U32 i)
+{
+  PoolAllocatorPrivateInfo *priv = PoolInfo->LxPrivate;
+  int s = atomic_read(&priv->bufState[i]);
+
+  if ((s & J1_BUF_STATE_MASK) != J1_BUF_ISSUED)
+    return FALSE;
+  smp_rmb();
+  if (ATOMIC_GET32(&j1_pool_desc(PoolInfo, i)->releasedToAllocator) != WRITE_BUFFER_FREE)
+    return FALSE;
+  if (!j1_move_state(&priv->bufState[i], s, J1_BUF_FREE))
+    return FALSE;
+
+  atomic_inc(&priv->numFree);
+  atomic_inc(&priv->reclaimed);
+  return TRUE;
+}
+
 /****************************************************/
 /* scsiTgtWriteBufferAllocate */
 /****************************************************/
 void * scsiTgtWriteBufferAllocate(U32 numberBytes)
 {
-  WriteBufferDescriptor *allocPtr = NULL, *desc;
-  void *returnPtr = NULL;
-  U32 numTries;
-  U32 i;
+  struct j1_mag_entry ent[J1_MAG_REFILL];
+  struct j1_magazine *mag;
+  PoolAllocatorPrivateInfo *priv;
+  BOOL found;
   U32 blocks_to_alloc; 
-  BOOL buddySplit = FALSE;
-  BufferDescListLocked *freeList;
+  U32 i, idx = 0, got;
   
   // First calculate which pool to use.
   WriteBufferPoolInfo *poolInfo;
   poolInfo = (numberBytes > TRANS_THRESHOLD) ? gBulkPool : gTransPool;
+  priv = poolInfo->LxPrivate;
 
-  blocks_to_alloc = (numberBytes % poolInfo->BufferSize) ? 
-              ((numberBytes / poolInfo->BufferSize) + 1) :
-              (numberBytes / poolInfo->BufferSize);
-  numTries = 0;
+  blocks_to_alloc = numberBytes ? DIV_ROUND_UP(numberBytes, poolInfo->BufferSize) : 1;
+  atomic_inc(&priv->allocs);
 
-//retry:  
-  buddySplit = FALSE;
-  switch (blocks_to_alloc)
+  if (blocks_to_alloc > poolInfo->NumBuffers)
   {
-  case 1:
-    if (poolInfo->LxPrivate->FreeListSingle.NumElements > 0)
-    {
-      freeList = &(poolInfo->LxPrivate->FreeListSingle);
-    }
-    else
+    printk(KERN_INFO "scsiTgtWriteBufferAllocate: ERROR: Cannot alloc %ld buffers in one alloc\n", blocks_to_alloc);
+    atomic_inc(&priv->allocFails);
+    return NULL;
+  }
+
+  if (blocks_to_alloc > 1)
+  {
+    if (!j1_claim_multi(poolInfo, blocks_to_alloc, &idx))
     {
-      freeList = &(poolInfo->LxPrivate->FreeListDouble);
-      buddySplit = TRUE;
+      atomic_inc(&priv->allocFails);
+      return NULL;
     }
-    
-    // Even though we can take a pair of buddies and split them,
-    // wait for singles first. When pairs get freed, also signal
-    // the singles wait list just in case.
-    //retryWaitCondition = &(poolInfo->LxPrivate->noFreeSingle);
-    
-    break;
-    
-  case 2:
-    freeList = &(poolInfo->LxPrivate->FreeListDouble);
-    //retryWaitCondition = &(poolInfo->LxPrivate->noFreeDouble);
-    break;
-    
-  default:
-  printk(KERN_INFO "scsiTgtWriteBufferAllocate: ERROR: Cannot alloc %ld buffers in one alloc\n", blocks_to_alloc);
-  return NULL;
+    atomic_inc(&priv->multiAllocs);
+    for (i = 0; i < blocks_to_alloc; i++)
+      j1_issue(poolInfo, idx + i);
+    return j1_pool_buffer(poolInfo, idx);
   }
 
-  if (freeList->NumElements > 0)
+  // Single buffer, from this cpu's magazine if we can.
+  preempt_disable();
+  mag = j1_cpu_magazine(poolInfo);
+  found = j1_mag_pop(poolInfo, mag, &idx);
+  if (found)
   {
-    allocPtr = freeList->ListHead;
-    freeList->ListHead = freeList->ListHead->next;
-    if (freeList->ListHead)
-      freeList->ListHead->prev = NULL;
-    
-    freeList->NumElements--;
-    
-    returnPtr = allocPtr->writeBuffer;
-    
-      // If we are splitting buddies apart, return
-      // the remaining buddy to the single list.
-      if (buddySplit)
-      {
-        BufferDescListLocked *singleFreeList = &poolInfo->LxPrivate->FreeListSingle;
-        // Insert remaining buddy at the head of the singles list
-        WriteBufferDescriptor *freeBuddy = allocPtr->buddy;
-        freeBuddy->next = singleFreeList->ListHead;
-        if (singleFreeList->ListHead)
-          singleFreeList->ListHead->prev = freeBuddy;
-        
-        singleFreeList->ListHead = freeBuddy;
-        singleFreeList->ListHead->prev = NULL;
-        singleFreeList->NumElements++;
-        
-        // Clear the buddy pointer so there's no confusion later when freeing.
-        allocPtr->buddy = NULL;
-      }
+    atomic_inc(&priv->magazineHits);
   }
-
- 
-  // If we've not been able to allocate, wait a bit and try again...
-  if (NULL == returnPtr)
+  else
   {
-    ++numTries;
-    
-    // Release the pool mutex. Allow the allocator to rebuild the free list.
+    got = j1_claim_scan(poolInfo, J1_MAG_REFILL, J1_BUF_CACHED, ent);
+    for (i = 0; i < got; i++)
+      mag->ent[mag->count++] = ent[i];
+    found = j1_mag_pop(poolInfo, mag, &idx);
+  }
+  preempt_enable();
 
-    // We will wake and check if the vx core sends a buffer release message.
-    //schedule_timeout(1);
-    
-    /* Try to allocate the buffer again */
-    //goto retry;
+  if (!found)
+    found = j1_steal_cached(poolInfo, &idx);
+
+  if (!found)
+  {
+    atomic_inc(&priv->allocFails);
     return NULL;
   }
-  
-  
-  // Mark the buffer(s) as in use so they won't get picked up by a rescan.
-  desc = allocPtr;
-  for (i = 0; i < blocks_to_alloc; i++)
+
+  j1_issue(poolInfo, idx);
+  return j1_pool_buffer(poolInfo, idx);
+}
+
+static void j1_account_wait(U64 ns)
+{
+  U32 usecs = (U32)min_t(U64, div_u64(ns, 1000), 0xffffffff);
+  U32 bucket = usecs ? min(fls(usecs), J1_WAIT_HIST_BUCKETS - 1) : 0;
+  unsigned long flags;
+
+  spin_lock_irqsave(&j1_wait_lock, flags);
+  j1_waits++;
+  j1_wait_total_ns += ns;
+  if (ns > j1_wait_max_ns)
+    j1_wait_max_ns = ns;
+  j1_wait_hist[bucket]++;
+  spin_unlock_irqrestore(&j1_wait_lock, flags);
+}
+
+// A waiter being stopped or signalled gives up rather than sleep on.
+static int j1_wait_interrupted(void)
+{
+  return ((current->flags & PF_KTHREAD) && kthread_should_stop()) ||
+         signal_pending(current);
+}
+
+/*
+ * Allocate, sleeping until the Vx core gives back enough buffers. We are
+ * woken by the resource thread; the timeout is only a safety net for a
+ * release we were never told about. Returns NULL if we are stopped or
+ * signalled first.
+ */
+void *scsiTgtWriteBufferAllocateWait(U32 numberBytes)
+{
+  WriteBufferPoolInfo *poolInfo;
+  void *buf;
+  U64 start;
+
+  if ((buf = scsiTgtWriteBufferAllocate(numberBytes)) != NULL)
+    return buf;
+
+  atomic_inc(&j1_exhausted);
+  start = sched_clock();
+
+  // Don't sit on cached buffers while we wait for more.
+  poolInfo = (numberBytes > TRANS_THRESHOLD) ? gBulkPool : gTransPool;
+  preempt_disable();
+  j1_mag_drain(poolInfo, j1_cpu_magazine(poolInfo));
+  preempt_enable();
+
+  for (;;)
   {
-#if TRACK_WRITE_BUFFER_ALLOC_RELEASE
-    uint64 allocGenNumber = ATOMIC_GET64(&desc->allocGenNumber);
-    uint64 rescanGenNumber = ATOMIC_GET64(&desc->rescanGenNumber);
-    if ((ATOMIC_GET32(&desc->releasedToAllocator) != WRITE_BUFFER_FREE) ||
-        ((allocGenNumber > rescanGenNumber) && (rescanGenNumber > 0)))
+    U32 gen = atomic_read(&j1_release_gen);
+
+    if ((buf = scsiTgtWriteBufferAllocate(numberBytes)) != NULL || j1_wait_interrupted())
+      break;
+    if (!wait_event_timeout(j1_wait, atomic_read(&j1_release_gen) != gen, HZ))
     {
-      printk(KERN_INFO "******Double Buffer Alloc: alloc gen = %llu, rescan gen = %llu, current gen = %llu, i = %x\n",
-         allocGenNumber, 
-         rescanGenNumber, 
-         ATOMIC_GET64(&poolInfo->LxPrivate->allocReleaseGenNumber), 
-         (unsigned int)i);
-      printk(KERN_INFO "alloc ptr = %p, buddy = %p, desc = %p\n", allocPtr, allocPtr->buddy, desc);
-      
-      //ASSERT_EQ(ATOMIC_GET32(&desc->releasedToAllocator), WRITE_BUFFER_FREE);
-      //if (rescanGenNumber > 0)
-       // ASSERT_LTE(allocGenNumber, rescanGenNumber);
+      atomic_inc(&j1_wait_timeouts);
+      rescanJ1CommandHandler();
     }
-    else
+  }
+
+  j1_account_wait(sched_clock() - start);
+  return buf;
+}
+
+static void j1_free_buffer(void *inBuffer, U32 numberBytes);
+
+/*
+ * Allocate numberBytes as single bulk buffers, one per element of an
+ * InterCoreSGL, for writes too big to find contiguously. All or nothing,
+ * so two writers can't each sit on half of what the other needs. Returns
+ * the number of buffers, 0 if there aren't enough free. Undoing a partial
+ * claim frees nothing anyone was waiting for, so it wakes no one.
+ */
+U32 scsiTgtWriteBufferAllocateList(U32 numberBytes, void **bufs, U32 maxBufs)
+{
+  U32 bufSize = gBulkPool->BufferSize;
+  U32 num = DIV_ROUND_UP(numberBytes, bufSize);
+  U32 i;
+
+  if (num == 0 || num > maxBufs || num > gBulkPool->NumBuffers)
+  {
+    printk(KERN_INFO "scsiTgtWriteBufferAllocateList: ERROR: Cannot alloc %u buffers in one list\n", num);
+    return 0;
+  }
+
+  for (i = 0; i < num; i++)
+  {
+    bufs[i] = scsiTgtWriteBufferAllocate(bufSize);
+    if (bufs[i] == NULL)
     {
-      ATOMIC_SET64(&desc->allocGenNumber, ATOMIC_INC_RETURN64(&poolInfo->LxPrivate->allocReleaseGenNumber));
+      while (i--)
+        j1_free_buffer(bufs[i], bufSize);
+      return 0;
     }
-#endif
+  }
 
-    //ASSERT_EQ(ATOMIC_GET32(&desc->releasedToAllocator), WRITE_BUFFER_FREE);
-    // Need to set this flag wehther we are tracking alloc/release or not.
-    ATOMIC_SET32(&desc->releasedToAllocator, WRITE_BUFFER_IN_USE);
-    
-    ATOMIC_SET32(&desc->pCmd, 0);
-    ATOMIC_SET32(&desc->initTaskTag, 0);
-    ATOMIC_SET32(&desc->intercoreTag, 0);
-    ATOMIC_SET32(&desc->pConnection, 0);
-    ATOMIC_SET32(&desc->stateFlags, 0);         // Track where in the system the buffer is
-    ATOMIC_SET32(&desc->free_intent_time, 0);   // When we start to free this obj
-    ATOMIC_SET32(&desc->alloc_dealloc_time, 0); // When it was touched.
-    ATOMIC_SET32(&desc->cmdFlags, 0);           // Command flags ...
-    ATOMIC_SET32(&desc->iscsiCmd, 0);           // The iSCSI cmd that caused this
-    ATOMIC_SET32(&desc->scsiCmd, 0);            // And the scsiCmd ...
-    
-    desc++;
+  return num;
+}
+
+// As above, sleeping until the Vx core gives back enough, or we are stopped.
+U32 scsiTgtWriteBufferAllocateListWait(U32 numberBytes, void **bufs, U32 maxBufs)
+{
+  U32 num;
+  U64 start;
+
+  if ((num = scsiTgtWriteBufferAllocateList(numberBytes, bufs, maxBufs)) != 0)
+    return num;
+  if (DIV_ROUND_UP(numberBytes, gBulkPool->BufferSize) > min(maxBufs, gBulkPool->NumBuffers))
+    return 0;
+
+  atomic_inc(&j1_exhausted);
+  start = sched_clock();
+
+  preempt_disable();
+  j1_mag_drain(gBulkPool, j1_cpu_magazine(gBulkPool));
+  preempt_enable();
+
+  for (;;)
+  {
+    U32 gen = atomic_read(&j1_release_gen);
+
+    if ((num = scsiTgtWriteBufferAllocateList(numberBytes, bufs, maxBufs)) != 0 || j1_wait_interrupted())
+      break;
+    if (!wait_event_timeout(j1_wait, atomic_read(&j1_release_gen) != gen, HZ))
+    {
+      atomic_inc(&j1_wait_timeouts);
+      rescanJ1CommandHandler();
+    }
+  }
+
+  j1_account_wait(sched_clock() - start);
+  return num;
+}
+
+static int dump_j1_wait_stats(char *buf, int size)
+{
+  unsigned long flags;
+  U64 total, max;
+  U32 waits, hist[J1_WAIT_HIST_BUCKETS];
+  int len = 0, i;
+
+  spin_lock_irqsave(&j1_wait_lock, flags);
+  waits = j1_waits;
+  total = j1_wait_total_ns;
+  max = j1_wait_max_ns;
+  memcpy(hist, j1_wait_hist, sizeof(hist));
+  spin_unlock_irqrestore(&j1_wait_lock, flags);
+
+  len += snprintf(&buf[len], size - len, 
+  "--------Allocation waits\nExhausted: %d timeouts: %d rescans: %d\n",
+  atomic_read(&j1_exhausted), atomic_read(&j1_wait_timeouts), atomic_read(&j1_rescans));
+  len += snprintf(&buf[len], size - len, 
+  "Waits: %u avg: %llu us max: %llu us\n", waits,
+  waits ? div_u64(div_u64(total, waits), 1000) : 0ULL, div_u64(max, 1000));
+  for (i = 0; i < J1_WAIT_HIST_BUCKETS; i++)
+  {
+    if (hist[i])
+      len += snprintf(&buf[len], size - len, "  < %8u us: %u\n", 1U << i, hist[i]);
   }
-  
-  //if (blocks_to_alloc > 1)
-    //ASSERT_PTR_NEQ(allocPtr->buddy, NULL);
-  
-  // If we requested a flush request, then we had started a timer
-  // that we need to stop here.  - FIXME SWV
 
-  return returnPtr; 
+  return len;
 }
 
 /****************************************************
@@ -916,133 +1202,31 @@ uint32 scsiTgtWriteBufferGetDelay(void * buffer)
   else
     return 0;
 }
-// Assume that the caller is NOT holding the pool lock
-static BOOL scsiTgtWriteBufferPoolCanSkipScan(WriteBufferPoolInfo *PoolInfo)
-{
-  BOOL skip = FALSE;
-  
-  // Use the double buffer pool as the metric since we can use it for single allocations too
-  // For now if we have all the buffers left, skip the scan.
-  if (PoolInfo->LxPrivate->FreeListDouble.NumElements >= PoolInfo->NumBuffers/2)
-    skip = TRUE;
-  else
-    skip = FALSE;
-  
-    return skip;
-}
-
-// Scan the buffers and rebuild free lists
+// Reclaim every buffer the Vx core has released. Lock free, the
+// incremental path below usually makes this unnecessary.
 static void scsiTgtWriteBufferRescanPool(WriteBufferPoolInfo *PoolInfo)
 {
-  BOOL poolLocked = FALSE;
-  U32 i = 0;
+  U32 i;
   U32 count = 0;
-  WriteBufferDescriptor *DescStart, *DescCurr;
-  U64 currGenNumber;
-  BufferDescListLocked *freeList;
    
-  if (scsiTgtWriteBufferPoolCanSkipScan(PoolInfo))
-    return;
-  
-  // Only take the lock when we start seeing released buffers.
-  DescStart = (WriteBufferDescriptor*)(gDataRegionStart + PoolInfo->DescStartOffset);
-  while (i < PoolInfo->NumBuffers)
+  atomic_inc(&j1_rescans);
+  for (i = 0; i < PoolInfo->NumBuffers; i++)
   {
-    DescCurr = DescStart + i;
     // Check the signature.
-    if (WRITE_JOURNAL_DESCRIPTOR_MARKER + i != DescCurr->signature)
+    if (WRITE_JOURNAL_DESCRIPTOR_MARKER + i != j1_pool_desc(PoolInfo, i)->signature)
     {
       // Something's wrong! TODO: Should we assert here?
-      printk(KERN_INFO "scsiTgtWriteBufferRescanPool: prescan ERROR: Getting desc %lx in %s pool\n",
-                   i, (Trans == PoolInfo->Type) ? "trans" : "bulk");
-      return;
-    }
-    
-    if (ATOMIC_GET32(&DescCurr->releasedToAllocator) == WRITE_BUFFER_FREE)
-      break;
-    
-    i++;
-  }
-  
-  currGenNumber = ATOMIC_GET64(&PoolInfo->LxPrivate->allocReleaseGenNumber);
-  
-  PoolInfo->LxPrivate->FreeListDouble.ListHead = NULL;
-  PoolInfo->LxPrivate->FreeListDouble.NumElements = 0;
-  PoolInfo->LxPrivate->FreeListSingle.ListHead = NULL;
-  PoolInfo->LxPrivate->FreeListSingle.NumElements = 0;
-  
-  poolLocked = TRUE;
-  
-  for (/* continue from while loop above */; i < PoolInfo->NumBuffers; i++)
-  {
-    WriteBufferDescriptor *DescCurr = DescStart + i;
-    
-    // Check the signature.
-    if (WRITE_JOURNAL_DESCRIPTOR_MARKER + i != DescCurr->signature)
-    {
-      // Something's wrong! TODO: Should we assert here?
-      printk(KERN_INFO "scsiTgtWriteBufferRescanPool: scan ERROR Getting desc %lx in %s pool\n",
+      printk(KERN_INFO "scsiTgtWriteBufferRescanPool: scan ERROR Getting desc %lx in %s pool\n",
                    i, (Trans == PoolInfo->Type) ? "trans" : "bulk");
       break;
     }
 
-    // Is this one free? Add it to the freelist if so.
-    if (ATOMIC_GET32(&DescCurr->releasedToAllocator) == WRITE_BUFFER_FREE)
-    {
+    if (j1_reclaim(PoolInfo, i))
       count++;
-
-#if TRACK_WRITE_BUFFER_ALLOC_RELEASE
-      // Check and record the release time and threadID
-      ATOMIC_SET64(&DescCurr->rescanGenNumber, currGenNumber);
-      
-      // There should be no allocations while we do the rescan.
-      // If the global gen number changes, then someting is wrong!
-      //ASSERT_EQ(currGenNumber, ATOMIC_GET64(&PoolInfo->LxPrivate->allocReleaseGenNumber));
-#endif
-        
-      // See if its neighbor is also free, if so make them buddies.
-      if (i < PoolInfo->NumBuffers - 1)
-      {
-        WriteBufferDescriptor *DescBuddy = DescCurr + 1;
-        
-        if (ATOMIC_GET32(&DescBuddy->releasedToAllocator) == WRITE_BUFFER_FREE)
-        {
-          DescCurr->buddy = DescBuddy;
-          i++; // Skip the buddy next round since we already got it.
-          count++;
-          
-          // The buddy cannot have another trailing buddy.
-          DescBuddy->buddy = NULL;
-          
-#if TRACK_WRITE_BUFFER_ALLOC_RELEASE
-          // Check and record the release time and threadID
-          ATOMIC_SET64(&DescBuddy->rescanGenNumber, currGenNumber);
-        
-          // There should be no allocations while we do the rescan.
-          // If the global gen number changes, then someting is wrong!
-          //ASSERT_EQ(currGenNumber, ATOMIC_GET64(&PoolInfo->LxPrivate->allocReleaseGenNumber));
-#endif
-        }
-        else
-        {
-          // Clear the buddy pointer
-          DescCurr->buddy = NULL;
-        }
-      }
-      
-      // Now add the buffer(s) to the head of the list.
-      freeList = (DescCurr->buddy == NULL) ? 
-		 	&PoolInfo->LxPrivate->FreeListSingle :
-			&PoolInfo->LxPrivate->FreeListDouble;
-      
-      DescCurr->next = freeList->ListHead;
-      DescCurr->prev = NULL;
-      if (freeList->ListHead)
-        freeList->ListHead->prev = DescCurr;
-      freeList->ListHead = DescCurr;
-      freeList->NumElements++;
-    }
   } 
+
+  if (count)
+    j1_wake_waiters();
 }
 
 /****************************************************/
@@ -1072,40 +1256,69 @@ int rescanJ1CommandHandler()
   return 0;
 }
 
-uint32 scsiTgtWriteBufferFreeBuffer(void *inBuffer, U32 numberBytes)
+/*
+ * The Vx core released the buffers at buffer, take back just those. If
+ * the notification doesn't name anything we can reclaim, fall back to a
+ * rescan of the pool. Returns the number of buffers reclaimed.
+ */
+uint32 scsiTgtWriteBufferReclaim(void *buffer, U32 numberBytes)
 {
-  static uint32 buffersFreedSinceRescan = 0;
-  uint32 i;
+  WriteBufferPoolInfo *poolInfo = WriteBufferToPool(buffer);
+  WriteBufferDescriptor *desc = WriteBufferToDescriptor(buffer);
+  U32 first, num, i, count = 0;
 
-  WriteBufferDescriptor *desc = WriteBufferToDescriptor((uint8*)inBuffer);
-  uint numBuffers = 1;
+  if (NULL == poolInfo || NULL == desc)
+  {
+    rescanJ1CommandHandler();
+    return 0;
+  }
 
-  if (NULL != desc->buddy)
+  first = desc - j1_pool_desc(poolInfo, 0);
+  num = numberBytes ? DIV_ROUND_UP(numberBytes, poolInfo->BufferSize) : 1;
+  for (i = 0; i < num && first + i < poolInfo->NumBuffers; i++)
   {
-    numBuffers = 2;
-    //ASSERT_GT(numberBytes, poolInfo->BufferSize);
+    if (j1_reclaim(poolInfo, first + i))
+      count++;
   }
 
-  for (i = 0; i < numBuffers; i++)
+  if (count)
   {
-    if (NULL != desc)
-    {
-      
-      //ASSERT_EQ(ATOMIC_GET32(&desc->releasedToAllocator), WRITE_BUFFER_IN_USE);
-      ATOMIC_SET32(&desc->releasedToAllocator, WRITE_BUFFER_FREE);
-      
-      desc++;
-    }
+    j1_wake_waiters();
   }
+  else
+  {
+    atomic_inc(&poolInfo->LxPrivate->staleFrees);
+    scsiTgtWriteBufferRescanPool(poolInfo);
+  }
+
+  return count;
+}
+
+// Put buffers back in the pool, without waking allocation waiters.
+static void j1_free_buffer(void *inBuffer, U32 numberBytes)
+{
+  WriteBufferPoolInfo *poolInfo = WriteBufferToPool(inBuffer);
+  WriteBufferDescriptor *desc = WriteBufferToDescriptor((uint8*)inBuffer);
+  U32 first, num, i;
 
-  if (buffersFreedSinceRescan > 100)
+  if (NULL == poolInfo || NULL == desc)
+    return;
+
+  first = desc - j1_pool_desc(poolInfo, 0);
+  num = numberBytes ? DIV_ROUND_UP(numberBytes, poolInfo->BufferSize) : 1;
+  for (i = 0; i < num && first + i < poolInfo->NumBuffers; i++)
   {
-    scsiTgtWriteBufferRescanBuffers(TRANS_WRITE_BUFFER_SIZE);
-    scsiTgtWriteBufferRescanBuffers(BULK_WRITE_BUFFER_SIZE);
-    buffersFreedSinceRescan = 0;
+    //ASSERT_EQ(ATOMIC_GET32(&desc->releasedToAllocator), WRITE_BUFFER_IN_USE);
+    ATOMIC_SET32(&desc[i].releasedToAllocator, WRITE_BUFFER_FREE);
+    j1_reclaim(poolInfo, first + i);
   }
-  
-  buffersFreedSinceRescan += numBuffers;
+}
+
+// Free from the Linux side, for a command that never made it to the Vx core.
+uint32 scsiTgtWriteBufferFreeBuffer(void *inBuffer, U32 numberBytes)
+{
+  j1_free_buffer(inBuffer, numberBytes);
+  j1_wake_waiters();
   
   return 0;
 }
@@ -1304,6 +1517,118 @@ static ssize_t dnas_stats_show(struct device_driver *ddp, char *buf)
 	return len;
 }
 
+/*
+ * Set and show how big J1 copies are done. Write the mode and optionally
+ * the threshold in bytes.
+ */
+static ssize_t dnas_j1_dma_show(struct device_driver *ddp, char *buf)
+{
+	int len = 0;
+	struct dri_dnas_device *dnas_dev = NULL, *tmp = NULL;
+
+	len = snprintf(buf, PAGE_SIZE, "j1_dma = %u (0 cpu, 1 engine, "
+			"2 emulated engine), threshold = %u\n", 
+			j1_dma_mode, j1_dma_threshold);
+
+	list_for_each_entry_safe(dnas_dev, tmp, &dri_dnas_device_list,
+		device_list) {
+		len += snprintf(&buf[len], PAGE_SIZE - len, "channel: %s, "
+			"offloaded: %d, fallbacks: %d\n", dnas_dev->j1_chan ? 
+			dma_chan_name(dnas_dev->j1_chan) : "none",
+			atomic_read(&dnas_dev->j1_dma_copies),
+			atomic_read(&dnas_dev->j1_dma_fallbacks));
+	}
+
+	return len;
+}
+
+static ssize_t dnas_j1_dma_set(struct device_driver *ddp, const char *buf,
+				size_t count)
+{
+	unsigned int lcl_mode = 0, lcl_threshold = j1_dma_threshold;
+
+	if (sscanf(buf, "%u %u", &lcl_mode, &lcl_threshold) < 1 ||
+	    lcl_mode > DNAS_J1_DMA_EMULATED)
+		return -EINVAL;
+
+	j1_dma_mode = lcl_mode;
+	j1_dma_threshold = lcl_threshold;
+
+	/* Devices not up yet get their channel when they start */
+	if (j1_dma_mode == DNAS_J1_DMA_ENGINE) {
+		struct dri_dnas_device *dnas_dev = NULL, *tmp = NULL;
+
+		list_for_each_entry_safe(dnas_dev, tmp, &dri_dnas_device_list,
+			device_list) {
+			if (dnas_dev->write_buffer_start)
+				dnas_j1_dma_init(dnas_dev);
+		}
+	}
+
+	return count;
+}
+
+static ssize_t dnas_xfer_hist_show(struct device_driver *ddp, char *buf)
+{
+	return dump_xfer_hist(buf);
+}
+
+static ssize_t dnas_xfer_hist_set(struct device_driver *ddp, const char *buf,
+				size_t count)
+{
+	reset_xfer_hist();
+
+	return count;
+}
+
+static ssize_t dnas_lat_hist_show(struct device_driver *ddp, char *buf)
+{
+	return dump_lat_hist(buf);
+}
+
+static ssize_t dnas_lat_hist_set(struct device_driver *ddp, const char *buf,
+				size_t count)
+{
+	reset_lat_hist();
+
+	return count;
+}
+
+static ssize_t dnas_cmd_trace_show(struct device_driver *ddp, char *buf)
+{
+	return dump_cmd_trace(buf);
+}
+
+/*
+ * 1 starts recording completed commands, 0 stops, and the ring keeps what
+ * it has so it can be read after the event.
+ */
+static ssize_t dnas_cmd_trace_set(struct device_driver *ddp, const char *buf,
+				size_t count)
+{
+	unsigned int lcl_enabled = 0;
+
+	if (sscanf(buf, "%u", &lcl_enabled) != 1)
+		return -EINVAL;
+
+	cmd_trace_enabled = lcl_enabled;
+
+	return count;
+}
+
+static ssize_t dnas_tags_show(struct device_driver *ddp, char *buf)
+{
+	int len = 0;
+	struct dri_dnas_device *dnas_dev = NULL, *tmp = NULL;
+
+	list_for_each_entry_safe(dnas_dev, tmp, &dri_dnas_device_list,
+		device_list) {
+		len += dump_tag_stats(dnas_dev, &buf[len]);
+	}
+
+	return len;
+}
+
 static ssize_t dnas_read_serial_number(struct device_driver *ddp, char *buf)
 {
         int len = 0;
@@ -1434,6 +1759,15 @@ static DRIVER_ATTR(lx_buffer, S_IRUGO, dnas_lx_show, NULL);
 static DRIVER_ATTR(wb_history, S_IRUGO, dnas_wb_hist_show, NULL);
 static DRIVER_ATTR(read_history, S_IRUGO, dnas_read_hist_show, NULL);
 static DRIVER_ATTR(stats, S_IRUGO, dnas_stats_show, NULL);
+static DRIVER_ATTR(tags, S_IRUGO, dnas_tags_show, NULL);
+static DRIVER_ATTR(j1_dma, S_IRUGO | S_IWUSR, dnas_j1_dma_show, 
+                                              dnas_j1_dma_set);
+static DRIVER_ATTR(xfer_hist, S_IRUGO | S_IWUSR, dnas_xfer_hist_show, 
+                                                 dnas_xfer_hist_set);
+static DRIVER_ATTR(latency_hist, S_IRUGO | S_IWUSR, dnas_lat_hist_show, 
+                                                    dnas_lat_hist_set);
+static DRIVER_ATTR(cmd_trace, S_IRUGO | S_IWUSR, dnas_cmd_trace_show, 
+                                                 dnas_cmd_trace_set);
 static DRIVER_ATTR(serial, S_IRUGO, dnas_read_serial_number, NULL);
 static DRIVER_ATTR(icore_control, S_IRUGO | S_IWUSR, dnas_icctl_get, 
                                                      dnas_icctl_set);
@@ -1488,6 +1822,36 @@ void dnas_create_driverfs_files(void)
 		printk(KERN_INFO "%s: Error registering driver file "
 			"read_history: %u\n", __func__, ret);
 	}
+        ret = driver_create_file(&dri_dnas_driverfs_driver,
+                &driver_attr_j1_dma);
+        if (ret) {
+                printk(KERN_INFO "%s: Error registering driver file "
+                        "j1_dma: %u\n", __func__, ret);
+        }
+        ret = driver_create_file(&dri_dnas_driverfs_driver,
+                &driver_attr_xfer_hist);
+        if (ret) {
+                printk(KERN_INFO "%s: Error registering driver file "
+                        "xfer_hist: %u\n", __func__, ret);
+        }
+        ret = driver_create_file(&dri_dnas_driverfs_driver,
+                &driver_attr_latency_hist);
+        if (ret) {
+                printk(KERN_INFO "%s: Error registering driver file "
+                        "latency_hist: %u\n", __func__, ret);
+        }
+        ret = driver_create_file(&dri_dnas_driverfs_driver,
+                &driver_attr_cmd_trace);
+        if (ret) {
+                printk(KERN_INFO "%s: Error registering driver file "
+                        "cmd_trace: %u\n", __func__, ret);
+        }
+        ret = driver_create_file(&dri_dnas_driverfs_driver,
+                &driver_attr_tags);
+        if (ret) {
+                printk(KERN_INFO "%s: Error registering driver file "
+                        "tags: %u\n", __func__, ret);
+        }
         ret = driver_create_file(&dri_dnas_driverfs_driver,
                 &driver_attr_serial);
         if (ret) {
@@ -1599,6 +1963,24 @@ int dri_dnas_abort(struct scsi_cmnd *cmd)
                  * threads at a time.
                  */
                 mutex_lock(&tag->tag_mutex);
+
+		/*
+		 * The engine may still be reading the command's pages. Wait
+		 * for it and give them back before the mid layer does; if it
+		 * does not finish, the abort fails and the command stays.
+		 */
+		if (tag->j1_nents) {
+			if (dma_sync_wait(dnas_dev->j1_chan, tag->j1_cookie) !=
+			    DMA_SUCCESS) {
+				printk(KERN_INFO "%s: J1 copy for %p did not "
+					"finish\n", __func__, cmd);
+				mutex_unlock(&tag->tag_mutex);
+				mutex_unlock(&dnas_dev->scsi_completion_mutex);
+				return FAILED;
+			}
+			dnas_j1_dma_unmap(dnas_dev, tag);
+		}
+
                 tag->req_p = NULL;   /* Command aborted! */
                 mutex_unlock(&tag->tag_mutex);
         }
@@ -1852,146 +2234,426 @@ static int process_get_msg(struct dri_dnas_device *dnas_dev, void __user *arg)
 	return 0;
 }
 
-static int dri_dnas_ioctl(struct scsi_device *dev, int cmd, void __user *arg)
+/*
+ * A reply from userland to a core control message, through the ioctl on the
+ * disk or on the dri_dnas_ctl device.
+ */
+static int process_send_msg(struct dri_dnas_device *dnas_dev, void __user *arg)
 {
-	struct dri_dnas_device *dnas_dev = NULL;
-	int ret = 0, size = 0, len = 0;
+	core_ctl_lx_user_send send_msg;
+	InterCoreCtrlLxToVx reply;
+	SharedMemQueueSendMsg send_args;
 	struct dnas_userland_queue_elt *ul_elt;
 	void *buf = NULL;
+	int ret = 0, len = 0;
+	int size = _IOC_SIZE(DRI_NAS_SEND_MSG);
 
-	dnas_dev = to_dri_dnas_device(scsi_get_device(dev->host));
+	DBG(5, KERN_INFO "Begin DRI_NAS_SEND_MSG\n");
+	/*
+	 * We need to write to this area later
+	 */
+	if (!access_ok(VERIFY_WRITE, arg, size)) {
+	    DBG(5, KERN_INFO "Access not OK\n");
+		return -EFAULT;
+	}
 
-	DBG(5, KERN_INFO "%s: ioctl cmd: %u, device: %p\n", 
-		__func__, cmd, dnas_dev);
+	len = copy_from_user((void *)&send_msg, 
+			(void __user *)arg,
+			sizeof(core_ctl_lx_user_send));
+	if (len) {
+	    DBG(5, KERN_INFO "failed to copy_from_user len %d\n", len);
+		return -EFAULT;
+	}
 
-	if (!arg) {
+	if (send_msg.cmd_size < sizeof(InterCoreCtrlLxToVx)){
+		DBG(5, KERN_INFO "%s: buffer to send"
+			"intercore ctrl reply too small: %u "
+			" should be: %u\n", __func__,
+			send_msg.cmd_size,
+			sizeof(InterCoreCtrlLxToVx));
 		return -EINVAL;
 	}
 
-	size = _IOC_SIZE(cmd);
+	DBG(5, KERN_INFO "%s: Got the send_msg ...\n", 
+		__func__);
 
-	switch (cmd) {
-        case BLKFLSBUF:
-                /* 
-                 * We will send a SYNC CACHE request soon, but for now ignore
-                 * this to quieten the error message.
-                 */
+	/*
+	 * Copy the reply from userspace
+	 */
+	size = MIN(send_msg.cmd_size, 
+		sizeof(InterCoreCtrlLxToVx));
+	len = copy_from_user((void *)&reply, 
+			(void *)send_msg.cmd_buf,
+			size);
 
-                break;
+	/*
+	 * We need to find the original message
+	 * Then we copy the data to its buffer as specified
+	 * in send_msg or the original command
+	 * Then send it directly from here and delete the
+	 * original message.
+	 */
 
-	case DRI_NAS_GET_MSG:
-		ret = process_get_msg(dnas_dev, arg);
-		break;
+	mutex_lock(&dnas_dev->core_ctrl_queue_mutex);
 
-	case DRI_NAS_SEND_MSG:
-		{
-			core_ctl_lx_user_send send_msg;
-			InterCoreCtrlLxToVx reply;
-			SharedMemQueueSendMsg send_args;
-                        DBG(5, KERN_INFO "Begin DRI_NAS_SEND_MSG\n");
-			/*
-			 * We need to write to this area later
-			 */
-			if (!access_ok(VERIFY_WRITE, arg, size)) {
-                            DBG(5, KERN_INFO "Access not OK\n");
-				return -EFAULT;
-			}
+	if (!(ul_elt = find_core_ctrl(reply.tag, 
+				dnas_dev))) {
+		mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+		DBG(5, KERN_INFO "%s: Unable to find command "
+			"message relates to: %0X\n", __func__,
+			reply.tag);
+		return -EINVAL;
+	}
 
-			len = copy_from_user((void *)&send_msg, 
-					(void __user *)arg,
-					sizeof(core_ctl_lx_user_send));
-			if (len) {
-                            DBG(5, KERN_INFO "failed to copy_from_user len %d\n", len);
-				return -EFAULT;
-			}
+	list_del(&ul_elt->core_ctrl_elt);
 
-			if (send_msg.cmd_size < sizeof(InterCoreCtrlLxToVx)){
-				DBG(5, KERN_INFO "%s: buffer to send"
-					"intercore ctrl reply too small: %u "
-					" should be: %u\n", __func__,
-					send_msg.cmd_size,
-					sizeof(InterCoreCtrlLxToVx));
-				return -EINVAL;
-			}
+	mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
 
-			DBG(5, KERN_INFO "%s: Got the send_msg ...\n", 
-				__func__);
+	DBG(5, KERN_INFO "%s: Got the core ctrl queue elt\n",
+		__func__);
 
-			/*
-			 * Copy the reply from userspace
-			 */
-			size = MIN(send_msg.cmd_size, 
-				sizeof(InterCoreCtrlLxToVx));
-			len = copy_from_user((void *)&reply, 
-					(void *)send_msg.cmd_buf,
-					size);
+	buf = dnas_dev->vx_dyn_buffer_start + 
+		ul_elt->msg.u.fileReq.bufId.bufOffset;
 
+	/*
+	 * Now, copy the data from userland.
+	 */
+	if (send_msg.data_buf) {
+		size = MIN(ul_elt->msg.u.fileReq.bufId.length,
+			send_msg.data_size);
+		len = copy_from_user(
+			(void *)buf,
+			(void __user *)send_msg.data_buf,
+			 size);
+		if (len) {
+			DBG(5, KERN_INFO "%s: failed to copy_from_user "
+			"return len %d\n", __func__, len);
 			/*
-			 * We need to find the original message
-			 * Then we copy the data to its buffer as specified
-			 * in send_msg or the original command
-			 * Then send it directly from here and delete the
-			 * original message.
+			 * Still unanswered: keep it for a retry, or for the
+			 * next reader if this one goes away.
 			 */
-
 			mutex_lock(&dnas_dev->core_ctrl_queue_mutex);
+			list_add(&ul_elt->core_ctrl_elt,
+				 &dnas_dev->core_ctrl_queue);
+			mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+			return -EFAULT;
+		}
+	}
 
-			if (!(ul_elt = find_core_ctrl(reply.tag, 
-						dnas_dev))) {
-				mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
-				DBG(5, KERN_INFO "%s: Unable to find command "
-					"message relates to: %0X\n", __func__,
-					reply.tag);
-				return -EINVAL;
-			}
+	/*
+	 * Now send the response and free the structure 
+	 */
+	send_args.handle = dnas_dev->core_ctrl_queue_handle;
+	send_args.msg         = (void *)&reply;
+	send_args.msgSize     = sizeof(send_msg);
+	send_args.flags       = SHMQ_SEND_FLAG_WAIT_FOREVER;
+	send_args.timeoutInMS = 0;
+	ret = shm_queue_kern_send_msg(dnas_dev->shm_dev,
+				&send_args);
+	if (ret) {
+		DBG(5, KERN_INFO "%s: failed to send response "
+			"to core ctrl message: %d, ignored!\n",
+			__func__, ret);
+	}
 
-			list_del(&ul_elt->core_ctrl_elt);
+	kmem_cache_free(dnas_dev->core_ctrl_cache, ul_elt);
 
-			mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+	return ret;
+}
 
-			DBG(5, KERN_INFO "%s: Got the core ctrl queue elt\n",
-				__func__);
+/*
+ * The dri_dnas_ctl device. Core control messages are copied, together with
+ * their Vx dyn data, into a ring that the single reader has mmapped, so a
+ * poll() wakeup can be followed by a whole batch of messages and one
+ * DRI_NAS_CTL_ACK instead of a DRI_NAS_GET_MSG per message. Elements that
+ * need no reply are taken off core_ctrl_queue while they sit in the ring
+ * and freed on the ack; the rest stay queued for DRI_NAS_SEND_MSG.
+ * Everything is under core_ctrl_queue_mutex.
+ */
+#define DNAS_CTL_RING_SIZE (PAGE_SIZE + \
+			    DRI_NAS_CTL_SLOTS * DRI_NAS_CTL_SLOT_SIZE)
+
+struct dnas_ctl_ring {
+	struct dri_dnas_device *dnas_dev;
+	dri_nas_ctl_ring *ring;
+	struct dnas_userland_queue_elt *elt[DRI_NAS_CTL_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	wait_queue_head_t wait;
+	int open;
+};
 
-			buf = dnas_dev->vx_dyn_buffer_start + 
-				ul_elt->msg.u.fileReq.bufId.bufOffset;
+static struct dnas_ctl_ring dnas_ctl;
 
-			/*
-			 * Now, copy the data from userland.
-			 */
-			if (send_msg.data_buf) {
-				size = MIN(ul_elt->msg.u.fileReq.bufId.length,
-					send_msg.data_size);
-				len = copy_from_user(
-					(void *)buf,
-					(void __user *)send_msg.data_buf,
-					 size);
-				if (len) {
-                                        DBG(5, KERN_INFO "%s: failed to copy_from_user "
-                                        "return len %d\n", __func__, len);
-					// FIXME: leaking ul_elt!
-					return -EFAULT;
-				}
-			}
+static inline dri_nas_ctl_slot *dnas_ctl_slot(unsigned int idx)
+{
+	return (dri_nas_ctl_slot *)((char *)dnas_ctl.ring + PAGE_SIZE +
+		(idx & (DRI_NAS_CTL_SLOTS - 1)) * DRI_NAS_CTL_SLOT_SIZE);
+}
 
-			/*
-			 * Now send the response and free the structure 
-			 */
-			send_args.handle = dnas_dev->core_ctrl_queue_handle;
-			send_args.msg         = (void *)&reply;
-			send_args.msgSize     = sizeof(send_msg);
-			send_args.flags       = SHMQ_SEND_FLAG_WAIT_FOREVER;
-			send_args.timeoutInMS = 0;
-			ret = shm_queue_kern_send_msg(dnas_dev->shm_dev,
-						&send_args);
-			if (ret) {
-				DBG(5, KERN_INFO "%s: failed to send response "
-					"to core ctrl message: %d, ignored!\n",
-					__func__, ret);
+/*
+ * Move unsent messages into free slots. Called with core_ctrl_queue_mutex.
+ */
+static void dnas_ctl_ring_fill(struct dri_dnas_device *dnas_dev)
+{
+	struct dnas_userland_queue_elt *ul_elt;
+	dri_nas_ctl_slot *slot;
+	unsigned int len;
+	unsigned int head = dnas_ctl.head;
+
+	if (!dnas_ctl.open || dnas_ctl.dnas_dev != dnas_dev)
+		return;
+
+	while (head - dnas_ctl.tail < DRI_NAS_CTL_SLOTS &&
+	       (ul_elt = find_unsent_core_ctrl(dnas_dev))) {
+		slot = dnas_ctl_slot(head);
+
+		slot->status = ul_elt->status;
+		slot->no_response = ul_elt->no_response;
+		slot->data_len = 0;
+		if (ul_elt->status) {
+			memset(&slot->msg, 0, sizeof(slot->msg));
+		} else {
+			memcpy(&slot->msg, &ul_elt->msg, sizeof(slot->msg));
+			if (ul_elt->msg.u.fileReq.bufId.bufSrc !=
+				INTER_CORE_CMD_PARTITION_ID_INVALID) {
+				len = MIN(ul_elt->msg.u.fileReq.bufId.length,
+					  sizeof(slot->data));
+				memcpy(slot->data, dnas_dev->vx_dyn_buffer_start +
+					ul_elt->msg.u.fileReq.bufId.bufOffset,
+					len);
+				slot->data_len = len;
 			}
+		}
 
+		ul_elt->sent_to_userland = 1;
+		if (ul_elt->status || ul_elt->no_response) {
+			list_del(&ul_elt->core_ctrl_elt);
+			dnas_ctl.elt[head & (DRI_NAS_CTL_SLOTS - 1)] = ul_elt;
+		} else {
+			dnas_ctl.elt[head & (DRI_NAS_CTL_SLOTS - 1)] = NULL;
+		}
+		head++;
+	}
+
+	if (head != dnas_ctl.head) {
+		smp_wmb();  /* Slots before head */
+		dnas_ctl.head = head;
+		dnas_ctl.ring->head = head;
+		wake_up_interruptible(&dnas_ctl.wait);
+	}
+}
+
+static int dnas_ctl_ack(unsigned int tail)
+{
+	struct dri_dnas_device *dnas_dev = dnas_ctl.dnas_dev;
+	struct dnas_userland_queue_elt *ul_elt;
+	unsigned int idx;
+
+	mutex_lock(&dnas_dev->core_ctrl_queue_mutex);
+
+	if (tail - dnas_ctl.tail > dnas_ctl.head - dnas_ctl.tail) {
+		mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+		return -EINVAL;
+	}
+
+	for (; dnas_ctl.tail != tail; dnas_ctl.tail++) {
+		idx = dnas_ctl.tail & (DRI_NAS_CTL_SLOTS - 1);
+		ul_elt = dnas_ctl.elt[idx];
+		dnas_ctl.elt[idx] = NULL;
+		if (ul_elt)
 			kmem_cache_free(dnas_dev->core_ctrl_cache, ul_elt);
+	}
+	dnas_ctl.ring->tail = tail;
 
-		}
+	dnas_ctl_ring_fill(dnas_dev);
+
+	mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+
+	return 0;
+}
+
+static int dnas_ctl_open(struct inode *inode, struct file *file)
+{
+	struct dri_dnas_device *dnas_dev = dnas_ctl.dnas_dev;
+	dri_nas_ctl_ring *ring;
+
+	ring = vmalloc_user(DNAS_CTL_RING_SIZE);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->version = DRI_NAS_CTL_RING_VERSION;
+	ring->num_slots = DRI_NAS_CTL_SLOTS;
+	ring->slot_size = DRI_NAS_CTL_SLOT_SIZE;
+	ring->slot_offset = PAGE_SIZE;
+
+	mutex_lock(&dnas_dev->core_ctrl_queue_mutex);
+
+	if (dnas_ctl.open) {
+		mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+		vfree(ring);
+		return -EBUSY;
+	}
+
+	dnas_ctl.ring = ring;
+	dnas_ctl.head = dnas_ctl.tail = 0;
+	memset(dnas_ctl.elt, 0, sizeof(dnas_ctl.elt));
+	dnas_ctl.open = 1;
+
+	dnas_ctl_ring_fill(dnas_dev);
+
+	mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+
+	return nonseekable_open(inode, file);
+}
+
+/*
+ * Whatever was not acked goes back on the queue for the next reader, and so
+ * does whatever is still waiting for a reply, acked or not: the Vx core
+ * waits for that reply, and this reader will never send it.
+ */
+static int dnas_ctl_release(struct inode *inode, struct file *file)
+{
+	struct dri_dnas_device *dnas_dev = dnas_ctl.dnas_dev;
+	struct dnas_userland_queue_elt *ul_elt;
+	unsigned int idx;
+	dri_nas_ctl_ring *ring;
+
+	mutex_lock(&dnas_dev->core_ctrl_queue_mutex);
+
+	while (dnas_ctl.head != dnas_ctl.tail) {
+		dnas_ctl.head--;
+		idx = dnas_ctl.head & (DRI_NAS_CTL_SLOTS - 1);
+		ul_elt = dnas_ctl.elt[idx];
+		dnas_ctl.elt[idx] = NULL;
+		if (ul_elt)
+			list_add(&ul_elt->core_ctrl_elt,
+				 &dnas_dev->core_ctrl_queue);
+	}
+
+	/* Only messages that need a reply stay queued once sent */
+	list_for_each_entry(ul_elt, &dnas_dev->core_ctrl_queue, core_ctrl_elt)
+		ul_elt->sent_to_userland = 0;
+
+	ring = dnas_ctl.ring;
+	dnas_ctl.ring = NULL;
+	dnas_ctl.open = 0;
+
+	mutex_unlock(&dnas_dev->core_ctrl_queue_mutex);
+
+	vfree(ring);
+
+	return 0;
+}
+
+static int dnas_ctl_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > PAGE_ALIGN(DNAS_CTL_RING_SIZE))
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, dnas_ctl.ring, 0);
+}
+
+static unsigned int dnas_ctl_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &dnas_ctl.wait, wait);
+
+	if (ACCESS_ONCE(dnas_ctl.head) != ACCESS_ONCE(dnas_ctl.tail))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static long dnas_ctl_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	unsigned int tail;
+
+	switch (cmd) {
+	case DRI_NAS_CTL_ACK:
+		if (get_user(tail, (unsigned int __user *)arg))
+			return -EFAULT;
+		return dnas_ctl_ack(tail);
+
+	case DRI_NAS_SEND_MSG:
+		return process_send_msg(dnas_ctl.dnas_dev, (void __user *)arg);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations dnas_ctl_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dnas_ctl_open,
+	.release	= dnas_ctl_release,
+	.mmap		= dnas_ctl_mmap,
+	.poll		= dnas_ctl_poll,
+	.unlocked_ioctl	= dnas_ctl_ioctl,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice dnas_ctl_miscdev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= "dri_dnas_ctl",
+	.fops	= &dnas_ctl_fops,
+};
+
+static int dnas_ctl_register(struct dri_dnas_device *dnas_dev)
+{
+	int ret;
+
+	if (dnas_ctl.dnas_dev)
+		return 0;
+
+	init_waitqueue_head(&dnas_ctl.wait);
+	dnas_ctl.dnas_dev = dnas_dev;
+
+	ret = misc_register(&dnas_ctl_miscdev);
+	if (ret) {
+		printk(KERN_WARNING "%s: Unable to register %s: %d\n",
+			__func__, dnas_ctl_miscdev.name, ret);
+		dnas_ctl.dnas_dev = NULL;
+	}
+
+	return ret;
+}
+
+static int dri_dnas_ioctl(struct scsi_device *dev, int cmd, void __user *arg)
+{
+	struct dri_dnas_device *dnas_dev = NULL;
+	int ret = 0;
+
+	dnas_dev = to_dri_dnas_device(scsi_get_device(dev->host));
+
+	DBG(5, KERN_INFO "%s: ioctl cmd: %u, device: %p\n", 
+		__func__, cmd, dnas_dev);
+
+	if (!arg) {
+		return -EINVAL;
+	}
+
+	switch (cmd) {
+        case BLKFLSBUF:
+                /* 
+                 * We will send a SYNC CACHE request soon, but for now ignore
+                 * this to quieten the error message.
+                 */
+
+                break;
+
+	case DRI_NAS_GET_MSG:
+		ret = process_get_msg(dnas_dev, arg);
+		break;
+
+	case DRI_NAS_SEND_MSG:
+		ret = process_send_msg(dnas_dev, arg);
 		break;
 
 	default:
@@ -2050,10 +2712,192 @@ static int dri_dnas_send_resp(struct scsi_cmnd *cmd,
 	return ret;
 }
 
+/*
+ * Set up the tag pool, sized by max_queue. The tag mutexes are initialised
+ * once here rather than per command, and all the spares start out on the
+ * shared free list.
+ */
+static int dnas_tag_pool_init(struct dri_dnas_device *dnas_dev)
+{
+	int i;
+
+	if (max_queue < 1 || max_queue > DRI_DNAS_QUEUE_LIMIT) {
+		printk(KERN_WARNING "%s: max_queue %u out of range, using %u\n",
+			__func__, max_queue, DRI_DNAS_MAX_QUEUE);
+		max_queue = DRI_DNAS_MAX_QUEUE;
+	}
+	dnas_dev->max_queue = max_queue;
+	dnas_dev->tag_pool_size = 2 * max_queue;
+
+	dnas_dev->tags = kcalloc(dnas_dev->tag_pool_size, 
+				sizeof(struct dnas_tag_struct), GFP_KERNEL);
+	dnas_dev->tag_free = kcalloc(dnas_dev->max_queue, 
+				sizeof(unsigned short), GFP_KERNEL);
+	if (!dnas_dev->tags || !dnas_dev->tag_free) {
+		printk(KERN_ERR "%s: out of memory allocating %u tags\n",
+			__func__, dnas_dev->tag_pool_size);
+		kfree(dnas_dev->tags);
+		kfree(dnas_dev->tag_free);
+		dnas_dev->tags = NULL;
+		dnas_dev->tag_free = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < dnas_dev->tag_pool_size; i++) {
+		struct dnas_tag_struct *tag = &dnas_dev->tags[i];
+
+		mutex_init(&tag->tag_mutex);
+		INIT_LIST_HEAD(&tag->req_queue_ent);
+		tag->index = i;
+		atomic_set(&tag->busy, 0);
+		INIT_WORK(&tag->j1_work, dnas_j1_dma_emul_work);
+	}
+
+	spin_lock_init(&dnas_dev->tag_lock);
+	for (i = 0; i < dnas_dev->max_queue; i++)
+		dnas_dev->tag_free[i] = dnas_dev->tag_pool_size - 1 - i;
+	dnas_dev->tag_free_cnt = dnas_dev->max_queue;
+	atomic_set(&dnas_dev->tags_in_use, 0);
+
+	return 0;
+}
+
+/*
+ * Get a tag for a command. Called from queuecommand with the host lock held
+ * and IRQs off, so this CPU's spare cache is ours.
+ */
+static struct dnas_tag_struct *dnas_get_tag(struct dri_dnas_device *dnas_dev,
+					struct scsi_cmnd *scmd)
+{
+	struct dnas_req_ctx *ctx = this_cpu_ptr(dnas_dev->req_ctx);
+	struct dnas_tag_struct *tag = NULL;
+	struct request *rq = scmd->request;
+	unsigned int in_use;
+
+	if (rq && blk_rq_tagged(rq) && rq->tag >= 0 && 
+	    rq->tag < dnas_dev->max_queue) {
+		tag = &dnas_dev->tags[rq->tag];
+		if (atomic_cmpxchg(&tag->busy, 0, 1) == 0)
+			goto got_tag;
+		/*
+		 * An aborted command still holds this slot until the Vx core
+		 * answers for it.
+		 */
+		dnas_dev->tags_slot_busy++;
+	}
+
+	if (!ctx->tag_cache_cnt) {
+		spin_lock(&dnas_dev->tag_lock);
+		while (dnas_dev->tag_free_cnt && 
+		       ctx->tag_cache_cnt < DRI_DNAS_TAG_CACHE / 2)
+			ctx->tag_cache[ctx->tag_cache_cnt++] = 
+				dnas_dev->tag_free[--dnas_dev->tag_free_cnt];
+		spin_unlock(&dnas_dev->tag_lock);
+	}
+
+	if (!ctx->tag_cache_cnt) {
+		dnas_dev->tags_alloc_fails++;
+		return NULL;
+	}
+
+	tag = &dnas_dev->tags[ctx->tag_cache[--ctx->tag_cache_cnt]];
+	atomic_set(&tag->busy, 1);
+	dnas_dev->tags_spare_allocs++;
+
+got_tag:
+	in_use = atomic_inc_return(&dnas_dev->tags_in_use);
+	if (in_use > dnas_dev->tags_hwm)
+		dnas_dev->tags_hwm = in_use;
+
+	return tag;
+}
+
+/*
+ * Give a tag back. Tags indexed by the block layer tag just go idle, spares
+ * go back on this CPU's cache, spilling half of it to the shared list when
+ * it is full.
+ */
+static void dnas_put_tag(struct dri_dnas_device *dnas_dev,
+			struct dnas_tag_struct *tag)
+{
+	struct dnas_req_ctx *ctx = NULL;
+	unsigned long flags;
+
+	tag->req_p = NULL;
+	tag->done  = NULL;
+	atomic_dec(&dnas_dev->tags_in_use);
+
+	smp_mb();
+	atomic_set(&tag->busy, 0);
+	if (tag->index < dnas_dev->max_queue)
+		return;
+
+	local_irq_save(flags);
+	ctx = this_cpu_ptr(dnas_dev->req_ctx);
+	if (ctx->tag_cache_cnt == DRI_DNAS_TAG_CACHE) {
+		spin_lock(&dnas_dev->tag_lock);
+		while (ctx->tag_cache_cnt > DRI_DNAS_TAG_CACHE / 2)
+			dnas_dev->tag_free[dnas_dev->tag_free_cnt++] = 
+				ctx->tag_cache[--ctx->tag_cache_cnt];
+		spin_unlock(&dnas_dev->tag_lock);
+	}
+	ctx->tag_cache[ctx->tag_cache_cnt++] = tag->index;
+	local_irq_restore(flags);
+}
+
+/*
+ * Look up the tag the Vx core gave back to us. Returns NULL if it is not one
+ * we handed out.
+ */
+static struct dnas_tag_struct *dnas_find_tag(struct dri_dnas_device *dnas_dev,
+					InterCoreCmdTag ic_tag)
+{
+	unsigned int index = ic_tag & DRI_DNAS_TAG_MASK;
+
+	if ((ic_tag & ~DRI_DNAS_TAG_MASK) != DRI_DNAS_TAG_MAGIC ||
+	    index >= dnas_dev->tag_pool_size ||
+	    !atomic_read(&dnas_dev->tags[index].busy))
+		return NULL;
+
+	return &dnas_dev->tags[index];
+}
+
+int dump_tag_stats(struct dri_dnas_device *dnas_dev, char *buf)
+{
+	unsigned len = 0;
+	int cpu;
+
+	len += snprintf(&buf[len], PAGE_SIZE - len,
+			"Tags: %u (%u spare)\n"
+			"In use: %d\n"
+			"High water: %u\n"
+			"Spare allocs: %u\n"
+			"Slot held by aborted cmd: %u\n"
+			"Alloc failures: %u\n"
+			"Shared free list: %u\n",
+			dnas_dev->tag_pool_size, dnas_dev->max_queue,
+			atomic_read(&dnas_dev->tags_in_use),
+			dnas_dev->tags_hwm, dnas_dev->tags_spare_allocs,
+			dnas_dev->tags_slot_busy, dnas_dev->tags_alloc_fails,
+			dnas_dev->tag_free_cnt);
+
+	for_each_possible_cpu(cpu) {
+		struct dnas_req_ctx *ctx = per_cpu_ptr(dnas_dev->req_ctx, cpu);
+
+		if (!ctx->tag_cache_cnt)
+			continue;
+		len += snprintf(&buf[len], PAGE_SIZE - len,
+				"CPU %d cached: %u\n", cpu, 
+				ctx->tag_cache_cnt);
+	}
+
+	return len;
+}
+
 /*
  * The Queue Command function called by the mid layer ...
  *
- * We allocate a tag structure to tie this command together with other stuff
+ * We take a tag from the pool to tie this command together with other stuff
  * we need, do some initial processing and then pass it the Vx core. The rest
  * of the processing is handled in the scsi thread.
  */
@@ -2064,6 +2908,7 @@ static int dri_dnas_queuecommand_lck(struct scsi_cmnd *scmd,
 	int ret = 0;
 	struct dri_dnas_device *dnas_dev = NULL;
 	struct dnas_tag_struct *tag = NULL;
+	struct dnas_req_ctx *ctx = NULL;
 	unsigned char cmd = scmd->cmnd[0];
 
 	dnas_dev = to_dri_dnas_device(scsi_get_device(scmd->device->host));
@@ -2093,65 +2938,447 @@ static int dri_dnas_queuecommand_lck(struct scsi_cmnd *scmd,
 	scsi_set_resid(scmd, 0);
 
 	/*
-	 * We need ATOMIC here, we ARE in ATOMIC
-	 * context here because our caller has done spin_lock_irqsave.
-	 *
-	 * We could unlock and allow others to preempt us, but we do so
-	 * little work here that it does not seem worth it.
+	 * We are in ATOMIC context here because our caller has done
+	 * spin_lock_irqsave, so the tag comes from the pool. If even the
+	 * spares are gone, have the mid layer try again later.
 	 */
-	tag = kmem_cache_alloc(dnas_dev->dnas_tag_cache, GFP_ATOMIC);
+	tag = dnas_get_tag(dnas_dev, scmd);
 	if (!tag) {
-		printk(KERN_ERR "%s: out of memory at line %d\n",
-			__func__, __LINE__);
-                dump_stack();
-		return -ENOMEM;
+		DBG(1, KERN_INFO "%s: out of tags, %d in use\n", __func__,
+			atomic_read(&dnas_dev->tags_in_use));
+		return SCSI_MLQUEUE_HOST_BUSY;
+	}
+
+	tag->req_p = scmd;
+	tag->done  = done;
+	dnas_trace_start(tag);
+
+        /*
+         * We link back to the tag so that we can find the tag when we are
+         * asked to abort the command
+         */
+        scmd->host_scribble = (unsigned char *)tag;
+
+	/*
+	 * Now queue the request to this CPU's request thread. Our caller is
+	 * holding a spin_lock_irqsave which protects us. No one can preempt or 
+	 * interrupt us, so we stay on this CPU.
+	 */
+
+	//mutex_lock(&dnas_dev->lx_db_mutex);
+	//mutex_unlock(&dnas_dev->lx_db_mutex);
+
+	ctx = per_cpu_ptr(dnas_dev->req_ctx, smp_processor_id());
+	if (!ctx->th)
+		ctx = per_cpu_ptr(dnas_dev->req_ctx, dnas_dev->req_fallback_cpu);
+
+	spin_lock_irqsave(&ctx->req_spinlock, flags);
+	list_add_tail(&tag->req_queue_ent, &ctx->req_queue);
+	ctx->requests++;
+
+	if (ctx->req_thread_waiting) {
+		/*
+		 * Make sure we only come through here once per sleep event
+		 * for the other thread
+		 */
+		ctx->req_thread_waiting = 0;
+		complete(&ctx->req_completion);
+	}
+	spin_unlock_irqrestore(&ctx->req_spinlock, flags);
+
+	return ret;
+}
+
+static DEF_SCSI_QCMD(dri_dnas_queuecommand)
+
+/*
+ * Transfer the data from the scsi request to the buffer provided.
+ *
+ * We assume that the buffer has the correct size.
+ *
+ * We return 0 for success, a SCSI error otherwise
+ */
+static int write_block_count = 0;
+
+/*
+ * Time spent in xfer_from_request_buffs and xfer_to_request_buffs per IO,
+ * in log2 ns buckets, split by direction and size so 4K random and large
+ * sequential IO can be told apart. Per CPU since every request thread
+ * copies on its own CPU.
+ */
+#define DNAS_XFER_HIST_BUCKETS 24      /* Last bucket is 8ms and up */
+#define DNAS_XFER_TO_J1        0
+#define DNAS_XFER_FROM_VX      1
+#define DNAS_XFER_DIRS         2
+#define DNAS_XFER_SIZES        3       /* <= 4K, <= 64K, larger */
+
+struct dnas_xfer_hist {
+	unsigned int count;
+	unsigned long long total_ns;
+	unsigned int bucket[DNAS_XFER_HIST_BUCKETS];
+};
+
+struct dnas_xfer_stats {
+	struct dnas_xfer_hist hist[DNAS_XFER_DIRS][DNAS_XFER_SIZES];
+};
+
+static DEFINE_PER_CPU(struct dnas_xfer_stats, dnas_xfer_stats);
+
+static void dnas_xfer_account(int dir, unsigned int size, 
+			unsigned long long start)
+{
+	unsigned long long ns = sched_clock() - start;
+	struct dnas_xfer_hist *h;
+	int b = ns ? fls64(ns) - 1 : 0;
+	int s = (size <= 0x1000) ? 0 : (size <= 0x10000) ? 1 : 2;
+
+	if (b >= DNAS_XFER_HIST_BUCKETS)
+		b = DNAS_XFER_HIST_BUCKETS - 1;
+
+	h = &get_cpu_var(dnas_xfer_stats).hist[dir][s];
+	h->count++;
+	h->total_ns += ns;
+	h->bucket[b]++;
+	put_cpu_var(dnas_xfer_stats);
+}
+
+int dump_xfer_hist(char *buf)
+{
+	static const char *dir_name[DNAS_XFER_DIRS] = { "to J1", "from Vx" };
+	static const char *size_name[DNAS_XFER_SIZES] = 
+		{ "<= 4K", "<= 64K", "> 64K" };
+	unsigned len = 0;
+	int d, s, b, cpu;
+
+	for (d = 0; d < DNAS_XFER_DIRS; d++) {
+		for (s = 0; s < DNAS_XFER_SIZES; s++) {
+			struct dnas_xfer_hist sum;
+			unsigned long long avg;
+
+			memset(&sum, 0, sizeof(sum));
+			for_each_possible_cpu(cpu) {
+				struct dnas_xfer_hist *h = 
+				  &per_cpu(dnas_xfer_stats, cpu).hist[d][s];
+
+				sum.count += h->count;
+				sum.total_ns += h->total_ns;
+				for (b = 0; b < DNAS_XFER_HIST_BUCKETS; b++)
+					sum.bucket[b] += h->bucket[b];
+			}
+			if (!sum.count)
+				continue;
+
+			avg = sum.total_ns;
+			do_div(avg, sum.count);
+			len += snprintf(&buf[len], PAGE_SIZE - len,
+					"Copy %s %s: %u IOs, avg %lluns\n",
+					dir_name[d], size_name[s], sum.count,
+					avg);
+			for (b = 0; b < DNAS_XFER_HIST_BUCKETS; b++) {
+				if (!sum.bucket[b])
+					continue;
+				len += snprintf(&buf[len], PAGE_SIZE - len,
+						"  < %10luns: %u\n", 
+						2UL << b, sum.bucket[b]);
+			}
+		}
+	}
+
+	return len;
+}
+
+void reset_xfer_hist(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(dnas_xfer_stats, cpu), 0, 
+			sizeof(struct dnas_xfer_stats));
+}
+
+/*
+ * Command latency, from queuecommand to done. Each phase gets a log2 ns
+ * histogram of the time since the previous phase, so a slow tail can be
+ * pinned on the request queue, the J1 pool, the copy or the Vx core, and
+ * the whole command gets one per opcode class and size.
+ */
+#define DNAS_LAT_HIST_BUCKETS 32       /* Last bucket is 2s and up */
+#define DNAS_LAT_READ         0
+#define DNAS_LAT_WRITE        1
+#define DNAS_LAT_OTHER        2
+#define DNAS_LAT_OPS          3
+
+struct dnas_lat_hist {
+	unsigned int count;
+	unsigned long long total_ns;
+	unsigned int bucket[DNAS_LAT_HIST_BUCKETS];
+};
+
+struct dnas_lat_stats {
+	struct dnas_lat_hist phase[DNAS_PHASES];
+	struct dnas_lat_hist op[DNAS_LAT_OPS][DNAS_XFER_SIZES];
+};
+
+static DEFINE_PER_CPU(struct dnas_lat_stats, dnas_lat_stats);
+
+/*
+ * The last few completed commands, phase by phase, when cmd_trace is on
+ */
+#define DNAS_TRACE_RING 256
+
+struct dnas_trace_rec {
+	unsigned char opcode;
+	unsigned char lun;
+	unsigned short tag;
+	unsigned int len;
+	unsigned int ns[DNAS_PHASES];     /* [0] is the whole command */
+};
+
+static struct dnas_trace_rec dnas_trace_ring[DNAS_TRACE_RING];
+static unsigned int dnas_trace_head;  /* Total records ever written */
+static DEFINE_SPINLOCK(dnas_trace_lock);
+
+static const char *dnas_phase_name[DNAS_PHASES] = 
+	{ "total", "dequeue", "j1 alloc", "copy", "send", "vx", "done" };
+
+static void dnas_lat_account(struct dnas_lat_hist *h, unsigned long long ns)
+{
+	int b = ns ? fls64(ns) - 1 : 0;
+
+	if (b >= DNAS_LAT_HIST_BUCKETS)
+		b = DNAS_LAT_HIST_BUCKETS - 1;
+
+	h->count++;
+	h->total_ns += ns;
+	h->bucket[b]++;
+}
+
+/*
+ * Called by the response thread just before the command goes back to the
+ * mid layer, while req_p is still ours.
+ */
+static void dnas_trace_done(struct dnas_tag_struct *tag)
+{
+	struct scsi_cmnd *scmd = tag->req_p;
+	struct dnas_lat_stats *st;
+	struct dnas_trace_rec rec;
+	unsigned long long prev, total;
+	unsigned int len = scsi_bufflen(scmd);
+	int p, op;
+
+	dnas_trace_mark(tag, DNAS_PH_DONE);
+
+	switch (scmd->cmnd[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_16:
+		op = DNAS_LAT_READ;
+		break;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_16:
+		op = DNAS_LAT_WRITE;
+		break;
+	default:
+		op = DNAS_LAT_OTHER;
+		break;
 	}
 
-        mutex_init(&tag->tag_mutex);
-	tag->req_p = scmd;
-	tag->done  = done;
+	memset(&rec, 0, sizeof(rec));
+	st = &get_cpu_var(dnas_lat_stats);
+	prev = tag->ts[DNAS_PH_QUEUED];
+	for (p = DNAS_PH_DEQUEUED; p < DNAS_PHASES; p++) {
+		unsigned long long ns;
 
-        /*
-         * We link back to the tag so that we can find the tag when we are
-         * asked to abort the command
-         */
-        scmd->host_scribble = (unsigned char *)tag;
+		if (!tag->ts[p] || tag->ts[p] < prev)
+			continue;
 
-	/*
-	 * Now queue the request to the request thread. Our caller is holding
-	 * a spin_lock_irqsave which protects us. No one can preempt or 
-	 * interrupt us.
-	 */
+		ns = tag->ts[p] - prev;
+		prev = tag->ts[p];
+		dnas_lat_account(&st->phase[p], ns);
+		rec.ns[p] = ns > 0xFFFFFFFFULL ? 0xFFFFFFFF : ns;
+	}
+	total = tag->ts[DNAS_PH_DONE] - tag->ts[DNAS_PH_QUEUED];
+	dnas_lat_account(&st->phase[DNAS_PH_QUEUED], total);
+	dnas_lat_account(&st->op[op][(len <= 0x1000) ? 0 : 
+				     (len <= 0x10000) ? 1 : 2], total);
+	put_cpu_var(dnas_lat_stats);
+
+	if (!cmd_trace_enabled)
+		return;
+
+	rec.opcode = scmd->cmnd[0];
+	rec.lun = scmd->device->lun;
+	rec.tag = tag->index;
+	rec.len = len;
+	rec.ns[0] = total > 0xFFFFFFFFULL ? 0xFFFFFFFF : total;
+
+	spin_lock_bh(&dnas_trace_lock);
+	dnas_trace_ring[dnas_trace_head % DNAS_TRACE_RING] = rec;
+	dnas_trace_head++;
+	spin_unlock_bh(&dnas_trace_lock);
+}
 
-	//mutex_lock(&dnas_dev->lx_db_mutex);
-	//mutex_unlock(&dnas_dev->lx_db_mutex);
+static int dump_lat_hist_one(char *buf, unsigned len, const char *name,
+			struct dnas_lat_hist *(*get)(int cpu, int i), int i)
+{
+	struct dnas_lat_hist sum;
+	unsigned long long avg;
+	int b, cpu;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct dnas_lat_hist *h = get(cpu, i);
+
+		sum.count += h->count;
+		sum.total_ns += h->total_ns;
+		for (b = 0; b < DNAS_LAT_HIST_BUCKETS; b++)
+			sum.bucket[b] += h->bucket[b];
+	}
+	if (!sum.count)
+		return len;
+
+	avg = sum.total_ns;
+	do_div(avg, sum.count);
+	len += snprintf(&buf[len], PAGE_SIZE - len,
+			"%s: %u cmds, avg %lluns\n ", name, sum.count, avg);
+
+	/* One line of "< limit:count" pairs, to fit them all in a page */
+	for (b = 0; b < DNAS_LAT_HIST_BUCKETS; b++) {
+		if (!sum.bucket[b])
+			continue;
+		len += snprintf(&buf[len], PAGE_SIZE - len, " <%lu:%u", 
+				2UL << b, sum.bucket[b]);
+	}
+	len += snprintf(&buf[len], PAGE_SIZE - len, "\n");
 
-	spin_lock_irqsave(&dnas_dev->req_spinlock, flags);
-	list_add_tail(&tag->req_queue_ent, &dnas_dev->req_queue);
-	spin_unlock_irqrestore(&dnas_dev->req_spinlock, flags);
+	return len;
+}
 
-	if (dnas_dev->req_thread_waiting) {
-		/*
-		 * Make sure we only come through here once per sleep event
-		 * for the other thread
-		 */
-		dnas_dev->req_thread_waiting = 0;
-		complete(&dnas_dev->req_completion);
+static struct dnas_lat_hist *dnas_lat_phase(int cpu, int i)
+{
+	return &per_cpu(dnas_lat_stats, cpu).phase[i];
+}
+
+static struct dnas_lat_hist *dnas_lat_op(int cpu, int i)
+{
+	return &per_cpu(dnas_lat_stats, cpu).op[i / DNAS_XFER_SIZES]
+						[i % DNAS_XFER_SIZES];
+}
+
+int dump_lat_hist(char *buf)
+{
+	static const char *op_name[DNAS_LAT_OPS] = 
+		{ "READ", "WRITE", "Other" };
+	static const char *size_name[DNAS_XFER_SIZES] = 
+		{ "<= 4K", "<= 64K", "> 64K" };
+	char name[32];
+	unsigned len = 0;
+	int p, o, s;
+
+	len += snprintf(&buf[len], PAGE_SIZE - len,
+			"Time since the previous phase (ns):\n");
+	for (p = 0; p < DNAS_PHASES; p++)
+		len = dump_lat_hist_one(buf, len, dnas_phase_name[p], 
+					dnas_lat_phase, p);
+
+	len += snprintf(&buf[len], PAGE_SIZE - len,
+			"Whole command by opcode (ns):\n");
+	for (o = 0; o < DNAS_LAT_OPS; o++) {
+		for (s = 0; s < DNAS_XFER_SIZES; s++) {
+			snprintf(name, sizeof(name), "%s %s", 
+				 op_name[o], size_name[s]);
+			len = dump_lat_hist_one(buf, len, name, dnas_lat_op,
+						o * DNAS_XFER_SIZES + s);
+		}
 	}
 
-	return ret;
+	return len;
 }
 
-static DEF_SCSI_QCMD(dri_dnas_queuecommand)
+void reset_lat_hist(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(dnas_lat_stats, cpu), 0, 
+			sizeof(struct dnas_lat_stats));
+}
 
 /*
- * Transfer the data from the scsi request to the buffer provided.
- *
- * We assume that the buffer has the correct size.
- *
- * We return 0 for success, a SCSI error otherwise
+ * Newest first, as many as fit in the page
  */
-static int write_block_count = 0;
+int dump_cmd_trace(char *buf)
+{
+	unsigned len = 0;
+	unsigned int head, n;
+	int p;
+
+	len += snprintf(&buf[len], PAGE_SIZE - len,
+			"tag lun op       len");
+	for (p = 0; p < DNAS_PHASES; p++)
+		len += snprintf(&buf[len], PAGE_SIZE - len, " %8.8s", 
+				dnas_phase_name[p]);
+	len += snprintf(&buf[len], PAGE_SIZE - len, " (us)\n");
+
+	spin_lock_bh(&dnas_trace_lock);
+	head = dnas_trace_head;
+	for (n = 0; n < DNAS_TRACE_RING && n < head; n++) {
+		struct dnas_trace_rec *rec = 
+			&dnas_trace_ring[(head - n - 1) % DNAS_TRACE_RING];
+
+		if (PAGE_SIZE - len < 128)
+			break;
+
+		len += snprintf(&buf[len], PAGE_SIZE - len, 
+				"%3u %3u %02x %9u", rec->tag, rec->lun,
+				rec->opcode, rec->len);
+		for (p = 0; p < DNAS_PHASES; p++)
+			len += snprintf(&buf[len], PAGE_SIZE - len, " %8u", 
+					rec->ns[p] / 1000);
+		len += snprintf(&buf[len], PAGE_SIZE - len, "\n");
+	}
+	spin_unlock_bh(&dnas_trace_lock);
+
+	return len;
+}
+
+/*
+ * J1 and the read cache are also section mapped cacheable (shm_section_map in
+ * shared_mem), which is what request data is copied through when there is
+ * one. The uncached mapping stays for the allocator state the Vx core
+ * updates in place. dnas_direct_addr() gives the direct alias of a shared
+ * buffer address, NULL when its region has none.
+ */
+
+static inline void *dnas_direct_addr(struct dri_dnas_device *dnas_dev,
+				     void *addr)
+{
+	if (dnas_dev->hlbat_buffer_direct && addr >= dnas_dev->hlbat_buffer_start &&
+	    addr < dnas_dev->hlbat_buffer_start + dnas_dev->hlbat_buffer_size)
+		return dnas_dev->hlbat_buffer_direct + 
+			(addr - dnas_dev->hlbat_buffer_start);
+
+	if (dnas_dev->write_buffer_direct && addr >= dnas_dev->write_buffer_start &&
+	    addr < dnas_dev->write_buffer_start + dnas_dev->write_buffer_size)
+		return dnas_dev->write_buffer_direct + 
+			(addr - dnas_dev->write_buffer_start);
+
+	return NULL;
+}
+
+/* Copy out of a shared buffer, through the direct mapping if it has one */
+static inline void dnas_shared_read(struct dri_dnas_device *dnas_dev,
+				    void *to, void *from, size_t n)
+{
+	void *direct = dnas_direct_addr(dnas_dev, from);
+
+	if (direct) {
+		shm_region_sync(direct, n, DMA_FROM_DEVICE);
+		from = direct;
+	}
+	memcpy(to, from, n);
+}
 
 //extern void dri_memcpy(void *to, void *from, __kernel_size_t n, 
 //                       void *base_virt, void *base_phys);
@@ -2161,17 +3388,88 @@ void dri_memcpy(void *to, void *from, __kernel_size_t n,
 	memcpy(to, from, n);
 }
 
-int xfer_from_request_buffs(void *buf, struct scsi_cmnd *scmd, 
+/*
+ * Copy one piece of a request, no more than a page, to a shared buffer. size
+ * is the whole request, small ones are just memcpy'd.
+ */
+static void xfer_to_shared_buff(struct dri_dnas_device *dnas_dev, void *buf,
+				void *kaddr_off, uint32_t cur_len,
+				unsigned int size)
+{
+	uint8_t *vx_addr, *vx_addr_next, *vx_low_mem;
+	uint32_t xfer_cnt, vx_offset;
+	struct page *vx_page;
+
+	vx_addr = dnas_debug_mode != 1 ? dnas_direct_addr(dnas_dev, buf) : NULL;
+	if (vx_addr) {
+		memcpy(vx_addr, kaddr_off, cur_len);
+		shm_region_sync(vx_addr, cur_len, DMA_TO_DEVICE);
+		return;
+	}
+
+	if (unlikely((uint)kaddr_off & 7)) {
+		/* Report any unaligned user buffer and perform byte copy */
+		uint32_t b;
+		uint8_t *src = (uint8_t *)kaddr_off;
+		uint8_t *dst = (uint8_t *)buf;
+		printk(KERN_INFO "%s: user buffer not aligned %p\n", __func__, 
+			kaddr_off);
+		for (b = 0; b < cur_len; b++) 
+			dst[b] = src[b];
+		return;
+	}
+
+	if (size < 0x1000 || (dnas_debug_mode == 1)) {
+		memcpy(buf, kaddr_off, cur_len);
+		return;
+	}
+
+	vx_addr = buf;
+	vx_offset = (uint)vx_addr & 0xfff;
+	vx_addr = (uint8_t *)((uint)vx_addr & 0xfffff000);
+	vx_addr_next = vx_addr + 0x1000;
+
+	/*
+	 * We copy through the cached lowmem alias of the J1 page, so clean
+	 * just the bytes we wrote out of L1 and L2 for the Vx core.
+	 */
+	vx_page = vmalloc_to_page(vx_addr);
+	vx_low_mem = (unsigned char *) kmap_atomic(vx_page, KM_IRQ1);
+	DBG(5, KERN_INFO "Write request vx_high_mem=0x%p vx_low_addr=0x%p "
+		"len=%d\n", vx_addr, vx_low_mem, cur_len);
+	xfer_cnt = min(0x1000 - vx_offset, cur_len);
+	memcpy(vx_low_mem + vx_offset, kaddr_off, xfer_cnt);
+	kunmap_atomic(vx_low_mem, KM_IRQ1);
+	__dma_page_cpu_to_dev(vx_page, vx_offset, xfer_cnt, DMA_TO_DEVICE);
+
+	if (cur_len > xfer_cnt) {
+		vx_page = vmalloc_to_page(vx_addr_next);
+		vx_low_mem = (unsigned char *) kmap_atomic(vx_page, KM_IRQ1);
+		DBG(5, KERN_INFO "Write request vx_high_mem=0x%p "
+			"vx_low_addr=0x%p len=%d\n", vx_addr_next, vx_low_mem,
+			cur_len);
+		memcpy(vx_low_mem, kaddr_off + xfer_cnt, cur_len - xfer_cnt);
+		kunmap_atomic(vx_low_mem, KM_IRQ1);
+		__dma_page_cpu_to_dev(vx_page, 0, cur_len - xfer_cnt, 
+				DMA_TO_DEVICE);
+	}
+}
+
+int xfer_from_request_buffs(struct dri_dnas_device *dnas_dev, void *buf,
+			    struct scsi_cmnd *scmd, 
                             void *base_virt, void *base_phys)
 {
 	int nseg, i, ret = 0;
 	unsigned int size = scsi_bufflen(scmd);
 	unsigned int tot_size = 0;
+	unsigned long long start;
 
         /* Drop write if in debug mode and size >= 64K */
         if ((size >= 0x10000) && (dnas_debug_level == 1)) 
            return 0;
 
+	start = sched_clock();
+
         nseg = scsi_dma_map(scmd);
 
 	if (nseg < 0) {  /* XXX: Turn this into a macro */
@@ -2215,8 +3513,6 @@ int xfer_from_request_buffs(void *buf, struct scsi_cmnd *scmd,
 #endif
                 sgp = scsi_sglist(scmd);
                 scsi_for_each_sg(scmd, sgp, nseg, i) {
-                        uint8_t *vx_addr, *vx_addr_next, *vx_low_mem;
-                        uint32_t cur_len, xfer_cnt, vx_offset;
 // Try new code...
                         kaddr = (unsigned char *) kmap_atomic(sg_page(sgp), KM_IRQ0);
                         if (!kaddr) {
@@ -2226,47 +3522,8 @@ int xfer_from_request_buffs(void *buf, struct scsi_cmnd *scmd,
                         }
                         kaddr_off = (unsigned char *)kaddr + sgp->offset;
 #if  1 
-                        cur_len = sg_dma_len(sgp);
-                        if (unlikely(sgp->offset & 7)) 
-                        {
-                           /* Report any unaligned user buffer and perform byte copy */
-                           uint32_t b;
-                           uint8_t *src = (uint8_t *)kaddr_off;
-                           uint8_t *dst = (uint8_t *)(buf + tot_size);
-                           printk(KERN_INFO "%s: user buffer not aligned %p\n", __func__, kaddr_off);
-                           for (b=0; b < cur_len; b++) dst[b] = src[b];
-                        }
-                        else
-                        if (size < 0x1000 || (dnas_debug_mode == 1)) 
-                        {
-                           memcpy(buf + tot_size, (void *)kaddr_off, sg_dma_len(sgp));
-                        }
-                        else
-                        {
-
-                           vx_addr = buf + tot_size;
-                           vx_offset = (uint)vx_addr & 0xfff;
-                           vx_addr = (uint8_t *)((uint)vx_addr & 0xfffff000);
-                           vx_addr_next = vx_addr + 0x1000;
-
-                           //cur_len = sg_dma_len(sgp);
-
-                           vx_low_mem = (unsigned char *) kmap_atomic(vmalloc_to_page(vx_addr), KM_IRQ1);
-                           DBG(5, KERN_INFO "Write request vx_high_mem=0x%p vx_low_addr=0x%p len=%d\n", vx_addr, vx_low_mem, cur_len);
-                           xfer_cnt = min(0x1000 - vx_offset, cur_len);
-                           memcpy(vx_low_mem+vx_offset, kaddr_off, xfer_cnt);
-			   flush_dcache_page(vmalloc_to_page(vx_addr));
-                           kunmap_atomic(vx_low_mem, KM_IRQ1);
-
-                           if (cur_len > xfer_cnt) 
-                           {
-                              vx_low_mem = (unsigned char *) kmap_atomic(vmalloc_to_page(vx_addr_next), KM_IRQ1);
-                              DBG(5, KERN_INFO "Write request vx_high_mem=0x%p vx_low_addr=0x%p len=%d\n", vx_addr_next, vx_low_mem, cur_len);
-                              memcpy(vx_low_mem, kaddr_off+xfer_cnt, cur_len-xfer_cnt);
-			      flush_dcache_page(vmalloc_to_page(vx_addr_next));
-                              kunmap_atomic(vx_low_mem, KM_IRQ1);
-                          } 
-                       }
+                        xfer_to_shared_buff(dnas_dev, buf + tot_size, kaddr_off, 
+                                            sg_dma_len(sgp), size);
 #else
 
                         memcpy(buf + tot_size, (void *)kaddr_off, sg_dma_len(sgp));
@@ -2278,9 +3535,12 @@ int xfer_from_request_buffs(void *buf, struct scsi_cmnd *scmd,
 			write_block_count++;
                 }
 	}
-        //if (size >= 0x10000) {
-                flush_cache_all();
-        //}
+	/*
+	 * No flush_cache_all here. Copies through the lowmem alias of J1 were
+	 * cleaned above, range by range, and the small copies went through
+	 * the uncached mapping of the shared window.
+	 */
+	dnas_xfer_account(DNAS_XFER_TO_J1, size, start);
 
 	if (tot_size != size) {
 		printk(KERN_INFO "%s: Unable to transfer all requested data!"
@@ -2292,12 +3552,90 @@ int xfer_from_request_buffs(void *buf, struct scsi_cmnd *scmd,
 	return ret;
 }
 
+/*
+ * The same for a write spread over the J1 buffers of an InterCoreSGL. A
+ * request segment can straddle two of them.
+ */
+int xfer_from_request_buffs_sgl(struct dri_dnas_device *dnas_dev,
+				InterCoreSGL *sgl, struct scsi_cmnd *scmd)
+{
+	InterCoreSGLElement *sgle = sgl->elements;
+	InterCoreSGLElement *sgle_end = sgl->elements + sgl->numElements;
+	unsigned int size = scsi_bufflen(scmd);
+	unsigned int tot_size = 0, elt_off = 0;
+	struct scatterlist *sgp;
+	unsigned long long start;
+	int nseg, i;
+
+	start = sched_clock();
+
+	nseg = scsi_dma_map(scmd);
+	if (nseg < 0)
+		return -1;
+
+	scsi_for_each_sg(scmd, sgp, nseg, i) {
+		unsigned int seg_off = 0, seg_len = sg_dma_len(sgp);
+		uint8_t *kaddr;
+
+		kaddr = (uint8_t *) kmap_atomic(sg_page(sgp), KM_IRQ0);
+		while (seg_off < seg_len) {
+			unsigned int cur_len;
+
+			if (elt_off == sgle->bufLength) {
+				if (++sgle == sgle_end)
+					break;
+				elt_off = 0;
+			}
+
+			cur_len = MIN(seg_len - seg_off, 
+				      sgle->bufLength - elt_off);
+			xfer_to_shared_buff(dnas_dev,
+					dnas_dev->write_buffer_start + 
+					sgle->bufOffset + elt_off,
+					kaddr + sgp->offset + seg_off, 
+					cur_len, size);
+			seg_off += cur_len;
+			elt_off += cur_len;
+		}
+		flush_dcache_page(sg_page(sgp));
+		kunmap_atomic(kaddr, KM_IRQ0);
+		tot_size += seg_off;
+		write_block_count++;
+		if (sgle == sgle_end)
+			break;
+	}
+	dnas_xfer_account(DNAS_XFER_TO_J1, size, start);
+
+	if (tot_size != size) {
+		printk(KERN_INFO "%s: Unable to transfer all requested data!"
+			"size = %u, tot_size = %u\n", __func__, size, 
+			tot_size);
+		return (DID_ERROR << 16);
+	}
+
+	return 0;
+}
+
 int dump_driver_stats(struct dri_dnas_device *dnas_dev, char *buf)
 {
 	unsigned len = 0;
+	int cpu;
 
 	len += snprintf(&buf[len], PAGE_SIZE - len, 
 			"Pages copied to J1: %u\n", write_block_count);
+	len += snprintf(&buf[len], PAGE_SIZE - len, 
+			"Writes sent as a J1 SGL: %d\n", 
+			atomic_read(&dnas_dev->j1_sgl_writes));
+
+	for_each_possible_cpu(cpu) {
+		struct dnas_req_ctx *ctx = per_cpu_ptr(dnas_dev->req_ctx, cpu);
+
+		if (!ctx->th && !ctx->requests)
+			continue;
+		len += snprintf(&buf[len], PAGE_SIZE - len,
+				"CPU %d requests queued: %u%s\n", cpu,
+				ctx->requests, ctx->th ? "" : " (no thread)");
+	}
 	return len;
 }
 
@@ -2424,7 +3762,7 @@ int xfer_to_request_buffs(struct dri_dnas_device *dnas_dev,
 	unsigned int sgl_count = 1;
         int nseg;
         void *base_virt = NULL, *base_phys = NULL;
-
+	unsigned long long start = sched_clock();
 
 	/*if (id->bufSrc == INTER_CORE_CMD_PARTITION_ID_VXWORKS_DYN_MEM) {
 		returned_len = id->length;
@@ -2529,12 +3867,23 @@ int xfer_to_request_buffs(struct dri_dnas_device *dnas_dev,
                                 	if (no_read_acceleration)
                                         {
                                                 vx_addr = vx_buffer + start_vxsgle;
-                                                if (((int)vx_addr & 0xfff) == 0 && (dnas_debug_mode != 2)) 
+                                                if (dnas_direct_addr(dnas_dev, vx_addr))
+                                                {
+                                                   dnas_shared_read(dnas_dev, kaddr_off, vx_addr, cur_len);
+                                                }
+                                                else if (((int)vx_addr & 0xfff) == 0 && (dnas_debug_mode != 2)) 
                                                 {
-                                                   vx_low_mem = (unsigned char *) kmap_atomic(vmalloc_to_page(vx_addr), KM_IRQ1);
+                                                   /*
+                                                    * Reading through the cached
+                                                    * alias, so drop any stale
+                                                    * lines for this range first.
+                                                    */
+                                                   struct page *vx_page = vmalloc_to_page(vx_addr);
+
+                                                   __dma_page_dev_to_cpu(vx_page, 0, cur_len, DMA_FROM_DEVICE);
+                                                   vx_low_mem = (unsigned char *) kmap_atomic(vx_page, KM_IRQ1);
 				                   DBG(5, KERN_INFO "Read request vx_high_addr=0x%p vx_low_addr=0x%p len=%d\n", vx_addr, vx_low_mem, cur_len);
                                                    memcpy(kaddr_off, vx_low_mem, cur_len);
-							flush_dcache_page(virt_to_page(vx_low_mem));
                                                    kunmap_atomic(vx_low_mem, KM_IRQ1); 
                                                 }
                                                 else
@@ -2579,7 +3928,8 @@ int xfer_to_request_buffs(struct dri_dnas_device *dnas_dev,
                                 	{
                                         //printk("copy to %x from %x\n", kaddr_off+start_lxsgle, 
                                         //       vx_buffer + start_vxsgle);
-                                        	memcpy(kaddr_off + start_lxsgle,
+                                        	dnas_shared_read(dnas_dev,
+                                                         kaddr_off + start_lxsgle,
                                                		 vx_buffer + start_vxsgle,
                                                		 cur_len);
                                 	}
@@ -2644,8 +3994,12 @@ cleanup:
 #endif
                         kunmap_atomic(kaddr_save, KM_IRQ0); 
 		}
-                /* flush the whole cache in case vmap flushes don't work as expected  SWV-383 */
-                flush_cache_all();
+                /*
+                 * SWV-383 used to flush the whole cache here. Reads through
+                 * the alias of the Vx buffers are invalidated above, range by
+                 * range, and the rest come through the uncached mapping.
+                 */
+                dnas_xfer_account(DNAS_XFER_FROM_VX, returned_len, start);
 
 		/* Set the resid correctly, I think */
 		scsi_set_resid(scmd, scsi_bufflen(scmd) - returned_len);
@@ -2731,6 +4085,7 @@ static unsigned int wb_alloc_hist_next = 0;
 
 static void WriteBufferPrintPoolInfo(WriteBufferPoolInfo *PoolInfo, int *length, char *buf)
 {
+  PoolAllocatorPrivateInfo *priv = PoolInfo->LxPrivate;
   int len = *length;
 
   len += snprintf(&buf[len], PAGE_SIZE - len, 
@@ -2740,12 +4095,14 @@ static void WriteBufferPrintPoolInfo(WriteBufferPoolInfo *PoolInfo, int *length,
   len += snprintf(&buf[len], PAGE_SIZE - len, 
   "Descriptor start address: %p (%lx)\n", gDataRegionStart + PoolInfo->DescStartOffset, PoolInfo->DescStartOffset);
   len += snprintf(&buf[len], PAGE_SIZE - len, "NumBuffers: %ld\n", PoolInfo->NumBuffers);
-  len += snprintf(&buf[len], PAGE_SIZE - len, "Free singles: %ld\n", PoolInfo->LxPrivate->FreeListSingle.NumElements);
+  len += snprintf(&buf[len], PAGE_SIZE - len, "Free: %d\n", atomic_read(&priv->numFree));
   len += snprintf(&buf[len], PAGE_SIZE - len, 
-  "Free doubles: %ld\n", PoolInfo->LxPrivate->FreeListDouble.NumElements);
+  "Allocs: %d magazine hits: %d multi: %d failed: %d\n",
+  atomic_read(&priv->allocs), atomic_read(&priv->magazineHits),
+  atomic_read(&priv->multiAllocs), atomic_read(&priv->allocFails));
   len += snprintf(&buf[len], PAGE_SIZE - len, 
-  "Free total: %ld\n", PoolInfo->LxPrivate->FreeListSingle.NumElements + 
-                       PoolInfo->LxPrivate->FreeListDouble.NumElements * 2);
+  "Reclaimed: %d stale frees: %d\n",
+  atomic_read(&priv->reclaimed), atomic_read(&priv->staleFrees));
   
   *length = len; 
   return;
@@ -2763,6 +4120,7 @@ int dump_write_buffer(struct dri_dnas_device *dnas_dev, char *buf)
 
         WriteBufferPrintPoolInfo(gTransPool, &len, buf);
         WriteBufferPrintPoolInfo(gBulkPool, &len, buf);
+        len += dump_j1_wait_stats(&buf[len], PAGE_SIZE - len);
 #if 0
         while ((uint32)buffers < (uint32)SharedPartitionInfo->LxSharedPartitionDataStart +
                          (uint32)SharedPartitionInfo->SharedPartitionDataRegionSize)
@@ -3498,83 +4856,406 @@ int free_vx_dyn_buffer(struct dri_dnas_device *dnas_dev, unsigned int tag,
 }
 
 /*
- * Send a SCSI Command to the Vx core ...
+ * Give back the buffers of a command the Vx core never got, since it is
+ * not going to release them. A J1 SGL is read before its Lx Dyn buffer goes.
+ */
+static void dnas_free_unsent_bufs(struct dri_dnas_device *dnas_dev,
+				InterCoreBufferId *id)
+{
+	InterCoreSGL *sgl;
+	unsigned int i;
+
+	switch (id->bufSrc) {
+	case INTER_CORE_CMD_PARTITION_ID_J1:
+		scsiTgtWriteBufferFreeBuffer(dnas_dev->write_buffer_start + 
+				id->bufOffset, id->length);
+		break;
+
+	case INTER_CORE_CMD_PARTITION_ID_LINUX_SGL:
+		sgl = dnas_dev->lx_dyn_buffer_start + id->bufOffset;
+		for (i = 0; i < sgl->numElements; i++)
+			scsiTgtWriteBufferFreeBuffer(dnas_dev->write_buffer_start
+					+ sgl->elements[i].bufOffset,
+					gBulkPool->BufferSize);
+		break;
+
+	case INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM:
+		free_lx_dyn_buffer(dnas_dev, id);
+		break;
+	}
+}
+
+/*
+ * Hand the batched SCSI commands to the Vx core. Anything that could not be
+ * sent is failed back to the mid layer here, since the request thread has
+ * long moved on from those tags.
+ */
+int flush_scsi_requests(struct dnas_req_ctx *ctx)
+{
+	int ret = 0;
+	unsigned int i;
+	struct dri_dnas_device *dnas_dev = ctx->dnas_dev;
+	struct dnas_req_batch *batch = &ctx->req_batch;
+	SharedMemQueueBatch send_args;
+
+	if (batch->count == 0)
+		return 0;
+
+	send_args.flags       = SHMQ_SEND_FLAG_WAIT_FOREVER;
+	send_args.timeoutInMS = 0;
+	send_args.handle      = dnas_dev->scsi_queue_handle;
+	send_args.entries     = batch->ent;
+	send_args.numEntries  = batch->count;
+
+	ret = shm_queue_kern_send_batch(dnas_dev->shm_dev, &send_args);
+
+	/*
+	 * The Vx core may already have answered some of these, and the tag
+	 * may even be on its next command, so only stamp the ones still
+	 * waiting. It is only statistics if we lose that race.
+	 */
+	for (i = 0; i < send_args.numDone; i++) {
+		struct dnas_tag_struct *tag =
+			dnas_find_tag(dnas_dev, batch->cmd[i].tag);
+
+		if (tag && !tag->ts[DNAS_PH_SENT] && !tag->ts[DNAS_PH_RESP])
+			dnas_trace_mark(tag, DNAS_PH_SENT);
+	}
+
+	if (ret || send_args.numDone != batch->count) {
+		printk(KERN_INFO "%s: Error sending scsi cmds: %d, sent %u of "
+			"%u\n", __func__, ret, send_args.numDone, batch->count);
+
+		for (i = send_args.numDone; i < batch->count; i++) {
+			struct dnas_tag_struct *tag =
+				dnas_find_tag(dnas_dev, batch->cmd[i].tag);
+
+			dnas_free_unsent_bufs(dnas_dev, &batch->cmd[i].bufId);
+			if (!tag) {
+				printk(KERN_WARNING "%s: Unsent command for "
+					"unknown tag: %0X, dropped\n", __func__,
+					batch->cmd[i].tag);
+				continue;
+			}
+			mutex_lock(&tag->tag_mutex);
+			if (tag->req_p)
+				dri_dnas_send_resp(tag->req_p, NULL, 0,
+					tag->done, DID_ERROR << 16);
+			mutex_unlock(&tag->tag_mutex);
+			if (tag->sgl_len) {
+				free_lx_dyn_buffer_noid(dnas_dev, tag->sgl_off,
+							tag->sgl_len);
+				tag->sgl_len = 0;
+			}
+			dnas_put_tag(dnas_dev, tag);
+		}
+
+		if (!ret)
+			ret = -EIO;
+	}
+
+	batch->count = 0;
+
+	return ret;
+}
+
+/*
+ * Send a SCSI Command to the Vx core ... the command is only queued on the
+ * request batch here, flush_scsi_requests() does the actual send.
  */
-int send_scsi_request(struct dri_dnas_device *dnas_dev, 
+int send_scsi_request(struct dnas_req_ctx *ctx, 
 			uint8_t *cdb, uint32_t lun,
 			struct dnas_tag_struct *tag, uint32_t buf, 
 			uint32_t buf_len, uint32_t src)
 {
 	int ret = 0;
-	InterCoreSCSICmd ic_scsi_cmd;
-	SharedMemQueueSendMsg send_args;
+	struct dnas_req_batch *batch = &ctx->req_batch;
+	InterCoreSCSICmd *ic_scsi_cmd;
+
+	if (batch->count == DRI_DNAS_REQ_BATCH)
+		(void)flush_scsi_requests(ctx);
+
+	ic_scsi_cmd = &batch->cmd[batch->count];
+
+	ic_scsi_cmd->tag = DRI_DNAS_TAG_MAGIC | tag->index;
+	memcpy(&ic_scsi_cmd->cdb, cdb, 16);  /* XXX: May need to be fixed */
+	ic_scsi_cmd->lun[2] = ic_scsi_cmd->lun[3] = 0;
+	ic_scsi_cmd->lun[0] = lun >> 16;
+	ic_scsi_cmd->lun[1] = lun & 0xFFFF;
+
+	DBG(5, KERN_INFO "REQ: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x"
+                         ":%02x\n",
+			cdb[0], cdb[1], cdb[2], cdb[3], cdb[4], cdb[5], cdb[6],
+                        cdb[7], cdb[8], cdb[9]);
+
+	ic_scsi_cmd->bufId.bufOffset = buf;
+	ic_scsi_cmd->bufId.length = buf_len;
+	ic_scsi_cmd->bufId.bufSrc = src;
+
+	batch->ent[batch->count].msg     = (void *)ic_scsi_cmd;
+	batch->ent[batch->count].msgSize = sizeof(*ic_scsi_cmd);
+	batch->count++;
+
+	return ret;
+}
+
+/*
+ * Create the nospace file ... 
+ */
+static char *nospace_path = "/var/nasd.nospace";
+
+void create_nospace_file(void)
+{
+        struct file *fd;
+        int res = 0;
+
+        fd = filp_open(nospace_path, O_CREAT | O_SYNC, 0666);
+        if (IS_ERR(fd)) {
+                res = PTR_ERR(fd);
+                DBG(0, KERN_INFO "%s: unable to create file %s, %d\n",
+                        __func__, nospace_path, res);
+                return;
+        }
+
+        filp_close(fd, NULL);
+}
+
+/*
+ * Handle one SCSI response from the Vx core.
+ *
+ * Note, commands could be cancelled by the SCSI layer before we get called
+ * here. If a request takes too long, for example. In that case, we detect it
+ * because the req_p in the tag structure is NULL. For IOs that have been 
+ * cancelled, do not transfer any data and do not call the done routine!
+ */
+static void dri_dnas_handle_scsi_resp(struct dri_dnas_device *dnas_dev,
+                                      InterCoreSCSIResp *ic_rsp)
+{
+	static int created_nospace_file = 0;
+	int ret = 0;
+	struct dnas_tag_struct *dnas_tag = NULL;
+        int io_abort = 0;
+        char *sens_buff = NULL;
+        unsigned int sens_len = 0;
+
+	/*
+	 * What we have in the tag is the index of our dnas_tag_struct
+	 * Get that and then deal with the IO ... however, we need
+	 * to figure out if the IO was aborted ... by the cmd being
+	 * set to NULL.
+	 */
+	dnas_tag = dnas_find_tag(dnas_dev, ic_rsp->tag);
+	if (!dnas_tag) {
+		printk(KERN_WARNING "%s: Response for unknown tag: %0X, "
+			"status: %0X, dropped\n", __func__, ic_rsp->tag, 
+			ic_rsp->status);
+		return;
+	}
+	dnas_trace_mark(dnas_tag, DNAS_PH_RESP);
+
+	DBG(10, "%s: Processing the next SCSI Response!\n", __func__);
+	if (ic_rsp->bufId2.length > 0 && ic_rsp->bufId2.bufSrc !=
+		INTER_CORE_CMD_PARTITION_ID_INVALID) {
+
+		DBG(5, KERN_INFO "%s: We got a sense buffer, status: "
+                    "%0X!\n", __func__, ic_rsp->status);
+		/*
+                 * We set up sens_buff and sens_len for the actual code
+                 * below to use ... It could be possible for the Vx
+                 * core to return a partially complete read with a
+                 * sense buffer ... I imagine.
+                 */
+
+                /* The sense buff is pointed to by bufId2 */
+		sens_buff = dnas_dev->vx_dyn_buffer_start +
+				ic_rsp->bufId2.bufOffset;
+
+                sens_len = ic_rsp->bufId2.length;
+
+                /*
+                 * If we have an out-of-memory response from VxWorks
+                 * then create a file /var/nasd.nospace ... to
+                 * signal to NASd that on the next boot we cannot 
+                 * write.
+                 */
+                if (sens_buff[0] == 0x70 && sens_buff[2] == 3 &&
+                    sens_buff[12] == 0x0C && sens_buff[13] == 2) {
+                        DBG(0, KERN_INFO "%s: NoSpace sense buffer "
+                                "from VxWorks. Creating special file\n",
+                                __func__);
+                        if (!created_nospace_file) {
+                                create_nospace_file();
+                                created_nospace_file = 1;
+                        }
+                }
+
+	}
+
+	/*
+	 * XXX: Todo, if we have both data and sense buffer ...
+	 */
+
+	/*
+	 * If we got an SGL response, then verify that it looks 
+	 * reasonable. If not, we have to abort the IO ...???
+	 */
+	if (ic_rsp->bufId1.bufSrc == 
+		INTER_CORE_CMD_PARTITION_ID_SGL_MEM) {
+		void *sgl = NULL;
+
+		if (ic_rsp->bufId1.length < sizeof(InterCoreSGL)) {
+			printk(KERN_WARNING "%s: Invalid SGL len: %d\n",
+				__func__, ic_rsp->bufId1.length);
+                        dump_stack();
+			/* Abort the IO ... how?*/
+
+		}
+
+		sgl = dnas_dev->sgl_buffer_start + 
+		ic_rsp->bufId1.bufOffset;
+		if (ic_rsp->bufId1.bufOffset > 
+			dnas_dev->sgl_buffer_size ||
+			(ic_rsp->bufId1.bufOffset + 
+				sizeof(InterCoreSGL)) > 
+				dnas_dev->sgl_buffer_size) {
+			printk(KERN_WARNING "%s: SGL or part of the "
+				"SGL falls outside the shared region:"
+				"tag: %0X, offset: %0X\n", __func__,
+				ic_rsp->tag, ic_rsp->bufId1.bufOffset);
+                        dump_stack();
+			/* Abort the IO ... how?*/
+		}
+
+	}
+
+	/*
+	 * Now we figure out what type of command it was. If 
+	 * a READ or READ_IO we have to move the data from the
+	 * intercore buffer (HLBAT or LX Dyn area) to the SGL or
+	 * request we were given. Then we can call the IO done 
+	 * routine and free the resources (HLBAT frees involve 
+	 * telling the Vx core), and then free the tag.
+	 *
+	 * For writes, if it is a WRITE_IO, we cannot free the
+	 * resource until the buffer is freed. However, we can
+	 * complete the IO and free up the tag and dyn buffer in the
+	 * case of a WRITE.
+	 */
+
+        /*
+         * Lock out any command abort processing until we are done
+         * This simplifies the handling of aborts and prevents 
+         * races ... it ensures that resources we expect to be there,
+         * eg the pages pointed to by the SG list in the request
+         * stick around until we have copied any data into them.
+         *
+         * The only contention for this lock will be from command
+         * abort requests, which should not be that frequent.
+         */
+        mutex_lock(&dnas_dev->scsi_completion_mutex);
+
+        io_abort = dnas_tag->req_p == NULL;
+	switch (dnas_tag->request_type) {
+	case DNAS_WRITE:    /* Data in Lx Dyn buffers */
+		DBG(5, "%s: Handled SCSI Write Response!\n", __func__);
+                if (!io_abort) {
+			dnas_trace_done(dnas_tag);
+		        (void)dri_dnas_send_resp(dnas_tag->req_p, 
+                                        sens_buff, sens_len,
+					dnas_tag->done,
+					(ret) ? ret : ic_rsp->status);
+		}
 
-	send_args.flags       = SHMQ_SEND_FLAG_WAIT_FOREVER;
-	send_args.timeoutInMS = 0;
-	send_args.handle      = dnas_dev->scsi_queue_handle;
-	send_args.msg         = (void *)&ic_scsi_cmd;
-	send_args.msgSize     = sizeof(ic_scsi_cmd);
+		if (ic_rsp->bufId1.bufSrc == 
+			INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM) {
+			/*
+			 * Free up the LX Dyn buffer ... J1 buffers
+			 * are freed in the resource thread
+			 */
+			free_lx_dyn_buffer(dnas_dev, &ic_rsp->bufId1);
+		}
+		if (dnas_tag->sgl_len) {
+			free_lx_dyn_buffer_noid(dnas_dev, dnas_tag->sgl_off,
+						dnas_tag->sgl_len);
+			dnas_tag->sgl_len = 0;
+		}
+                /* Free this, or we leak ... */
+		dnas_put_tag(dnas_dev, dnas_tag);
 
-	ic_scsi_cmd.tag = (int)tag;
-	memcpy(&ic_scsi_cmd.cdb, cdb, 16);  /* XXX: May need to be fixed */
-	ic_scsi_cmd.lun[2] = ic_scsi_cmd.lun[3] = 0;
-	ic_scsi_cmd.lun[0] = lun >> 16;
-	ic_scsi_cmd.lun[1] = lun & 0xFFFF;
+		break;
 
-	DBG(5, KERN_INFO "REQ: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x"
-                         ":%02x\n",
-			cdb[0], cdb[1], cdb[2], cdb[3], cdb[4], cdb[5], cdb[6],
-                        cdb[7], cdb[8], cdb[9]);
+	case DNAS_WRITE_IO:  /* Data in Write Buffers, AKA J1 */
 
-	ic_scsi_cmd.bufId.bufOffset = buf;
-	ic_scsi_cmd.bufId.length = buf_len;
-	ic_scsi_cmd.bufId.bufSrc = src;
+		break;
 
-	ret = shm_queue_kern_send_msg(dnas_dev->shm_dev, &send_args);
-	if (ret) {
-		printk(KERN_INFO "%s: Error sending scsi cmd\n",
-		__func__);
-	}
+	case DNAS_READ:      /* Data in Vx Dyn or HLBAT buffers */
+		DBG(5, "%s: Handled SCSI Read Response!\n", __func__);
+
+                if (!io_abort)
+		        ret = xfer_to_request_buffs(dnas_dev, dnas_tag, 
+			        &ic_rsp->bufId1);
+		free_vx_dyn_buffer(dnas_dev, ic_rsp->tag, 
+				ic_rsp->backEndTag, &ic_rsp->bufId1, 
+				NULL);
+                if (!io_abort) {
+			dnas_trace_done(dnas_tag);
+		        (void)dri_dnas_send_resp(dnas_tag->req_p, 
+                                        sens_buff, sens_len, 
+					dnas_tag->done, 
+					(ret) ? ret : ic_rsp->status);
+		}
+		
+		dnas_put_tag(dnas_dev, dnas_tag);
+		break;
 
-	return ret;
-}
+	case DNAS_READ_IO:
 
-/*
- * Create the nospace file ... 
- */
-static char *nospace_path = "/var/nasd.nospace";
+		break;
 
-void create_nospace_file(void)
-{
-        struct file *fd;
-        int res = 0;
+	case DNAS_NOIO:      /* No data at all    */
+                if (!io_abort) {
+			dnas_trace_done(dnas_tag);
+		        (void)dri_dnas_send_resp(dnas_tag->req_p, 
+                                        NULL, 0, 
+					dnas_tag->done, ic_rsp->status);
+		}
+		dnas_put_tag(dnas_dev, dnas_tag);
+		break;
 
-        fd = filp_open(nospace_path, O_CREAT | O_SYNC, 0666);
-        if (IS_ERR(fd)) {
-                res = PTR_ERR(fd);
-                DBG(0, KERN_INFO "%s: unable to create file %s, %d\n",
-                        __func__, nospace_path, res);
-                return;
+	default:
+
+		break;
+	}
+
+        /*
+         * If there is a sense buffer, we have to free it.
+         */
+        if (sens_buff) {
+                DBG(5, KERN_INFO "%s: freeing sense buffer\n",
+                        __func__);
+                free_vx_dyn_buffer(dnas_dev, ic_rsp->tag, 
+				ic_rsp->backEndTag, &ic_rsp->bufId2, 
+				NULL);
         }
 
-        filp_close(fd, NULL);
+        mutex_unlock(&dnas_dev->scsi_completion_mutex);
 }
 
 /*
  * The SCSI Queue handler ... waits for messages from that queue
  * and handles them
  *
- * Note, commands could be cancelled by the SCSI layer before we get called
- * here. If a request takes too long, for example. In that case, we detect it
- * because the req_p in the tag structure is NULL. For IOs that have been 
- * cancelled, do not transfer any data and do not call the done routine!
+ * Responses are pulled off the queue in batches: we wait for the first one
+ * and take whatever else the Vx core has queued up behind it in the same
+ * shm_queue_kern_recv_batch() call.
  */
 int dri_dnas_shared_mem_scsi_thread(void *data)
 {
-	int ret = 0, created_nospace_file = 0;
+	int ret = 0, i;
 	struct dri_dnas_device *dnas_dev = (struct dri_dnas_device *)data;
-	SharedMemQueueRecvMsg recv_args;
-	InterCoreSCSIResp ic_rsp;
+	SharedMemQueueBatch recv_args;
+	SharedMemQueueBatchEntry rsp_ent[DRI_DNAS_RESP_BATCH];
+	InterCoreSCSIResp ic_rsp[DRI_DNAS_RESP_BATCH];
 
 	DBG(5, KERN_INFO "%s: Started\n", __func__);
 
@@ -3585,17 +5266,17 @@ int dri_dnas_shared_mem_scsi_thread(void *data)
 	recv_args.flags       = SHMQ_RECV_FLAG_WAIT_FOREVER_INT;
 	recv_args.timeoutInMS = 0;
 	recv_args.handle      = dnas_dev->scsi_queue_handle;
-	recv_args.buf         = (void *)&ic_rsp;
-	recv_args.bufSize     = sizeof(ic_rsp);
+	recv_args.entries     = rsp_ent;
+	recv_args.numEntries  = DRI_DNAS_RESP_BATCH;
 
-	while (!kthread_should_stop()) {
-	        struct dnas_tag_struct *dnas_tag = NULL;
-                int io_abort = 0;
-                char *sens_buff = NULL;
-                unsigned int sens_len = 0;
+	for (i = 0; i < DRI_DNAS_RESP_BATCH; i++) {
+		rsp_ent[i].msg     = (void *)&ic_rsp[i];
+		rsp_ent[i].msgSize = sizeof(ic_rsp[i]);
+	}
 
+	while (!kthread_should_stop()) {
 		DBG(10, "%s: Waiting for next SCSI Response!\n", __func__);
-		ret = shm_queue_kern_recv_msg(dnas_dev->shm_dev, &recv_args);
+		ret = shm_queue_kern_recv_batch(dnas_dev->shm_dev, &recv_args);
 		if (ret) {
 			printk(KERN_ERR "%s: Unable to receive message from "
 				"other core: %d\n", __func__, ret);
@@ -3603,191 +5284,309 @@ int dri_dnas_shared_mem_scsi_thread(void *data)
 			return ret;
 		}
 
-		/*
-		 * What we have in the tag is a pointer to our dnas_tag_struct
-		 * Get that and then deal with the IO ... however, we need
-		 * to figure out if the IO was aborted ... by the cmd being
-		 * set to NULL.
-		 */
-		dnas_tag = (struct dnas_tag_struct *)ic_rsp.tag;
+		for (i = 0; i < recv_args.numDone; i++)
+			dri_dnas_handle_scsi_resp(dnas_dev, &ic_rsp[i]);
+	}
 
-		DBG(10, "%s: Processing the next SCSI Response!\n", __func__);
-		if (ic_rsp.bufId2.length > 0 && ic_rsp.bufId2.bufSrc !=
-			INTER_CORE_CMD_PARTITION_ID_INVALID) {
+	return ret;
+}
 
-			DBG(5, KERN_INFO "%s: We got a sense buffer, status: "
-                            "%0X!\n", __func__, ic_rsp.status);
-			/*
-                         * We set up sens_buff and sens_len for the actual code
-                         * below to use ... It could be possible for the Vx
-                         * core to return a partially complete read with a
-                         * sense buffer ... I imagine.
-                         */
+/*
+ * Find a DMA_MEMCPY channel for J1 copies. If there is none, the engine mode
+ * just falls back to the CPU.
+ */
+static void dnas_j1_dma_init(struct dri_dnas_device *dnas_dev)
+{
+	dma_cap_mask_t mask;
 
-                        /* The sense buff is pointed to by bufId2 */
-			sens_buff = dnas_dev->vx_dyn_buffer_start +
-					ic_rsp.bufId2.bufOffset;
+	if (dnas_dev->j1_chan)
+		return;
 
-                        sens_len = ic_rsp.bufId2.length;
+	/* A software peer's J1 has no bus address to hand to an engine */
+	if (!dnas_dev->write_buffer_phys) {
+		printk(KERN_INFO "%s: J1 has no physical address, copies "
+			"use the CPU\n", __func__);
+		return;
+	}
 
-                        /*
-                         * If we have an out-of-memory response from VxWorks
-                         * then create a file /var/nasd.nospace ... to
-                         * signal to NASd that on the next boot we cannot 
-                         * write.
-                         */
-                        if (sens_buff[0] == 0x70 && sens_buff[2] == 3 &&
-                            sens_buff[12] == 0x0C && sens_buff[13] == 2) {
-                                DBG(0, KERN_INFO "%s: NoSpace sense buffer "
-                                        "from VxWorks. Creating special file\n",
-                                        __func__);
-                                if (!created_nospace_file) {
-                                        create_nospace_file();
-                                        created_nospace_file = 1;
-                                }
-                        }
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+	dnas_dev->j1_chan = dma_request_channel(mask, NULL, NULL);
 
-		}
+	printk(KERN_INFO "%s: J1 copies of %u bytes or more use %s\n", 
+		__func__, j1_dma_threshold, dnas_dev->j1_chan ? 
+		dma_chan_name(dnas_dev->j1_chan) : "the CPU");
+}
 
-		/*
-		 * XXX: Todo, if we have both data and sense buffer ...
-		 */
+/*
+ * The whole J1 copy for this tag is done. Hand the tag back to the request
+ * thread that started it, at the front of its queue, to go to the Vx core.
+ * Called from the DMA engine's completion tasklet or the emulation work.
+ */
+static void dnas_j1_dma_done(void *arg)
+{
+	struct dnas_tag_struct *tag = (struct dnas_tag_struct *)arg;
+	struct dnas_req_ctx *ctx = tag->j1_ctx;
+	unsigned long flags;
 
-		/*
-		 * If we got an SGL response, then verify that it looks 
-		 * reasonable. If not, we have to abort the IO ...???
-		 */
-		if (ic_rsp.bufId1.bufSrc == 
-			INTER_CORE_CMD_PARTITION_ID_SGL_MEM) {
-			void *sgl = NULL;
+	spin_lock_irqsave(&ctx->req_spinlock, flags);
+	tag->j1_dma_state = DNAS_J1_DMA_DONE;
+	list_add(&tag->req_queue_ent, &ctx->req_queue);
+	if (ctx->req_thread_waiting) {
+		ctx->req_thread_waiting = 0;
+		complete(&ctx->req_completion);
+	}
+	spin_unlock_irqrestore(&ctx->req_spinlock, flags);
+}
 
-			if (ic_rsp.bufId1.length < sizeof(InterCoreSGL)) {
-				printk(KERN_WARNING "%s: Invalid SGL len: %d\n",
-					__func__, ic_rsp.bufId1.length);
-                                dump_stack();
-				/* Abort the IO ... how?*/
+/*
+ * Release the request's pages from the engine. The copy must be over.
+ */
+static void dnas_j1_dma_unmap(struct dri_dnas_device *dnas_dev,
+			struct dnas_tag_struct *tag)
+{
+	if (!tag->j1_nents)
+		return;
 
-			}
+	dma_unmap_sg(dnas_dev->j1_chan->device->dev, tag->j1_sgl, 
+		tag->j1_nents, DMA_TO_DEVICE);
+	tag->j1_nents = 0;
+}
 
-			sgl = dnas_dev->sgl_buffer_start + 
-			ic_rsp.bufId1.bufOffset;
-			if (ic_rsp.bufId1.bufOffset > 
-				dnas_dev->sgl_buffer_size ||
-				(ic_rsp.bufId1.bufOffset + 
-					sizeof(InterCoreSGL)) > 
-					dnas_dev->sgl_buffer_size) {
-				printk(KERN_WARNING "%s: SGL or part of the "
-					"SGL falls outside the shared region:"
-					"tag: %0X, offset: %0X\n", __func__,
-					ic_rsp.tag, ic_rsp.bufId1.bufOffset);
-                                dump_stack();
-				/* Abort the IO ... how?*/
-			}
+/*
+ * Queue the J1 copy to the engine as a chain of memcpy descriptors, one per
+ * mapped SG element, into the physically contiguous J1 buffer. Only the last
+ * one interrupts and calls us back; they complete in order on one channel.
+ */
+static int dnas_j1_dma_engine(struct dri_dnas_device *dnas_dev,
+			struct dnas_tag_struct *tag, int nseg, dma_addr_t dst)
+{
+	struct dma_chan *chan = dnas_dev->j1_chan;
+	struct dma_device *dma_dev = chan->device;
+	struct dma_async_tx_descriptor *tx = NULL;
+	struct scatterlist *sgp;
+	dma_cookie_t cookie = 0;
+	int i;
+
+	for_each_sg(tag->j1_sgl, sgp, nseg, i) {
+		unsigned long flags = DMA_CTRL_ACK | DMA_COMPL_SKIP_SRC_UNMAP |
+				DMA_COMPL_SKIP_DEST_UNMAP;
+
+		if (i == nseg - 1)
+			flags |= DMA_PREP_INTERRUPT;
 
+		tx = dma_dev->device_prep_dma_memcpy(chan, dst, 
+				sg_dma_address(sgp), sg_dma_len(sgp), flags);
+		if (!tx)
+			goto fail;
+
+		if (i == nseg - 1) {
+			tx->callback = dnas_j1_dma_done;
+			tx->callback_param = tag;
 		}
 
-		/*
-		 * Now we figure out what type of command it was. If 
-		 * a READ or READ_IO we have to move the data from the
-		 * intercore buffer (HLBAT or LX Dyn area) to the SGL or
-		 * request we were given. Then we can call the IO done 
-		 * routine and free the resources (HLBAT frees involve 
-		 * telling the Vx core), and then free the tag.
-		 *
-		 * For writes, if it is a WRITE_IO, we cannot free the
-		 * resource until the buffer is freed. However, we can
-		 * complete the IO and free up the tag and dyn buffer in the
-		 * case of a WRITE.
-		 */
+		cookie = tx->tx_submit(tx);
+		if (dma_submit_error(cookie))
+			goto fail;
+		tag->j1_cookie = cookie;
 
-                /*
-                 * Lock out any command abort processing until we are done
-                 * This simplifies the handling of aborts and prevents 
-                 * races ... it ensures that resources we expect to be there,
-                 * eg the pages pointed to by the SG list in the request
-                 * stick around until we have copied any data into them.
-                 *
-                 * The only contention for this lock will be from command
-                 * abort requests, which should not be that frequent.
-                 */
-	        mutex_lock(&dnas_dev->scsi_completion_mutex);
-
-                io_abort = dnas_tag->req_p == NULL;
-		switch (dnas_tag->request_type) {
-		case DNAS_WRITE:    /* Data in Lx Dyn buffers */
-			DBG(5, "%s: Handled SCSI Write Response!\n", __func__);
-                        if (!io_abort)
-			        (void)dri_dnas_send_resp(dnas_tag->req_p, 
-                                                sens_buff, sens_len,
-						dnas_tag->done,
-						(ret) ? ret : ic_rsp.status);
-
-			if (ic_rsp.bufId1.bufSrc == 
-				INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM) {
-				/*
-				 * Free up the LX Dyn buffer ... J1 buffers
-				 * are freed in the resource thread
-				 */
-				free_lx_dyn_buffer(dnas_dev, &ic_rsp.bufId1);
-			}
-                        /* Free this, or we leak ... */
-			kmem_cache_free(dnas_dev->dnas_tag_cache, dnas_tag);
+		dst += sg_dma_len(sgp);
+	}
 
-			break;
+	dma_async_issue_pending(chan);
 
-		case DNAS_WRITE_IO:  /* Data in Write Buffers, AKA J1 */
+	return 0;
 
-			break;
+fail:
+	/*
+	 * Let whatever we did queue finish before the CPU copies the lot, 
+	 * so no one is writing the buffer when it goes to the Vx core.
+	 */
+	if (i) {
+		dma_async_issue_pending(chan);
+		(void)dma_sync_wait(chan, cookie);
+	}
+	printk(KERN_INFO "%s: unable to queue J1 copy element %d of %d\n",
+		__func__, i, nseg);
 
-		case DNAS_READ:      /* Data in Vx Dyn or HLBAT buffers */
-			DBG(5, "%s: Handled SCSI Read Response!\n", __func__);
-
-                        if (!io_abort)
-			        ret = xfer_to_request_buffs(dnas_dev, dnas_tag, 
-				        &ic_rsp.bufId1);
-			free_vx_dyn_buffer(dnas_dev, ic_rsp.tag, 
-					ic_rsp.backEndTag, &ic_rsp.bufId1, 
-					NULL);
-                        if (!io_abort)
-			        (void)dri_dnas_send_resp(dnas_tag->req_p, 
-                                                sens_buff, sens_len, 
-						dnas_tag->done, 
-						(ret) ? ret : ic_rsp.status);
-			
-			kmem_cache_free(dnas_dev->dnas_tag_cache, dnas_tag);
-			break;
+	return -EIO;
+}
 
-		case DNAS_READ_IO:
+/*
+ * The emulated engine. We hold the tag lock while copying, so an abort
+ * waits for us rather than the command going away under the copy.
+ */
+static void dnas_j1_dma_emul_work(struct work_struct *work)
+{
+	struct dnas_tag_struct *tag = 
+		container_of(work, struct dnas_tag_struct, j1_work);
 
-			break;
+	mutex_lock(&tag->tag_mutex);
+	if (tag->req_p)
+		scsi_sg_copy_to_buffer(tag->req_p, tag->j1_buf, tag->j1_len);
+	mutex_unlock(&tag->tag_mutex);
 
-		case DNAS_NOIO:      /* No data at all    */
-                        if (!io_abort)
-			        (void)dri_dnas_send_resp(dnas_tag->req_p, 
-                                                NULL, 0, 
-						dnas_tag->done, ic_rsp.status);
-			kmem_cache_free(dnas_dev->dnas_tag_cache, dnas_tag);
-			break;
+	dnas_j1_dma_done(tag);
+}
 
-		default:
+/*
+ * Start an offloaded J1 copy. Returns 0 if it is in flight, in which case
+ * the request thread sends the command when dnas_j1_dma_done hands it back.
+ * Otherwise the caller copies with the CPU.
+ */
+static int dnas_j1_dma_start(struct dnas_req_ctx *ctx, 
+			struct dnas_tag_struct *tag, void *buf)
+{
+	struct dri_dnas_device *dnas_dev = ctx->dnas_dev;
+	struct scsi_cmnd *scmd = tag->req_p;
+	int nseg, ret = -ENODEV;
+
+	tag->j1_buf = buf;
+	tag->j1_len = scsi_bufflen(scmd);
+	tag->j1_ctx = ctx;
+	tag->j1_dma_state = DNAS_J1_DMA_BUSY;
+
+	switch (j1_dma_mode) {
+	case DNAS_J1_DMA_ENGINE:
+		if (!dnas_dev->j1_chan)
+			break;
 
+		/* The pages are read by the engine, not the SCSI host */
+		nseg = dma_map_sg(dnas_dev->j1_chan->device->dev, 
+			scsi_sglist(scmd), scsi_sg_count(scmd), DMA_TO_DEVICE);
+		if (nseg <= 0) {
+			ret = -EINVAL;
 			break;
 		}
+		tag->j1_sgl = scsi_sglist(scmd);
+		tag->j1_nents = scsi_sg_count(scmd);
+
+		ret = dnas_j1_dma_engine(dnas_dev, tag, nseg,
+			(dma_addr_t)(dnas_dev->write_buffer_phys + 
+				(buf - dnas_dev->write_buffer_start)));
+		if (ret)
+			dnas_j1_dma_unmap(dnas_dev, tag);
+		break;
 
-                /*
-                 * If there is a sense buffer, we have to free it.
-                 */
-                if (sens_buff) {
-                        DBG(5, KERN_INFO "%s: freeing sense buffer\n",
-                                __func__);
-	                free_vx_dyn_buffer(dnas_dev, ic_rsp.tag, 
-					ic_rsp.backEndTag, &ic_rsp.bufId2, 
-					NULL);
-                }
+	case DNAS_J1_DMA_EMULATED:
+		schedule_work(&tag->j1_work);
+		ret = 0;
+		break;
+	}
+
+	if (ret) {
+		tag->j1_dma_state = DNAS_J1_DMA_IDLE;
+		atomic_inc(&dnas_dev->j1_dma_fallbacks);
+	} else {
+		atomic_inc(&dnas_dev->j1_dma_copies);
+	}
+
+	return ret;
+}
+
+/*
+ * The offloaded copy is done, so send the command on, unless it was aborted
+ * while the copy was in flight, in which case the J1 buffer goes back. An
+ * abort has already unmapped the pages.
+ */
+static int dnas_j1_dma_finish(struct dnas_req_ctx *ctx,
+			struct dnas_tag_struct *tag)
+{
+	struct dri_dnas_device *dnas_dev = ctx->dnas_dev;
+	struct scsi_cmnd *scmd = tag->req_p;
+
+	tag->j1_dma_state = DNAS_J1_DMA_IDLE;
+	dnas_j1_dma_unmap(dnas_dev, tag);
+
+	if (!scmd) {
+		scsiTgtWriteBufferFreeBuffer(tag->j1_buf, tag->j1_len);
+		return DNAS_REQ_COMPLETED;
+	}
+
+	dnas_trace_mark(tag, DNAS_PH_COPIED);
+
+	return send_scsi_request(ctx, scmd->cmnd, scmd->device->lun, tag, 
+			tag->j1_buf - dnas_dev->write_buffer_start, 
+			tag->j1_len, INTER_CORE_CMD_PARTITION_ID_J1);
+}
+
+/*
+ * The SCSI result for a write that got no J1 buffers: the mid layer retries
+ * it if the wait was cut short by a stop or a signal.
+ */
+static inline int dnas_j1_alloc_failed(void)
+{
+	return (j1_wait_interrupted() ? DID_REQUEUE : DID_ERROR) << 16;
+}
+
+/*
+ * Send a write too big for a contiguous run of J1 buffers. The data goes in
+ * single bulk buffers and an InterCoreSGL in Lx Dyn memory says where. The
+ * SGL is freed when the response comes back, the J1 buffers are released
+ * by the Vx core as usual.
+ */
+static int dnas_send_j1_sgl(struct dnas_req_ctx *ctx, 
+			struct dnas_tag_struct *tag)
+{
+	struct dri_dnas_device *dnas_dev = ctx->dnas_dev;
+	struct scsi_cmnd *scmd = tag->req_p;
+	unsigned int len = scsi_bufflen(scmd);
+	unsigned int buf_size = gBulkPool->BufferSize;
+	unsigned int num, sgl_off, sgl_len, i;
+	void *bufs[DRI_DNAS_J1_SGL_MAX];
+	InterCoreSGL *sgl;
+	int ret;
 
-	        mutex_unlock(&dnas_dev->scsi_completion_mutex);
+	num = scsiTgtWriteBufferAllocateList(len, bufs, DRI_DNAS_J1_SGL_MAX);
+	if (!num) {
+		/* As for a single buffer, see process_scsi_request */
+		(void)flush_scsi_requests(ctx);
+		num = scsiTgtWriteBufferAllocateListWait(len, bufs, 
+						DRI_DNAS_J1_SGL_MAX);
+		if (!num)
+			return dnas_j1_alloc_failed();
+	}
+	dnas_trace_mark(tag, DNAS_PH_J1_ALLOC);
+
+	sgl_len = (offsetof(InterCoreSGL, elements) + 
+		   num * sizeof(InterCoreSGLElement) + 511) & ~511;
+	sgl = alloc_lx_dyn_buffer(dnas_dev, sgl_len);
+	if (!sgl) {
+		printk(KERN_INFO "%s: Unable to allocate LX dyn buffer for an "
+			"SGL of %u elements\n", __func__, num);
+		ret = -ENOMEM;
+		goto free_bufs;
+	}
+	sgl_off = (unsigned int)((void *)sgl - dnas_dev->lx_dyn_buffer_start);
+
+	sgl->status = 0;
+	sgl->numElements = num;
+	sgl->bufSrc = INTER_CORE_CMD_PARTITION_ID_J1;
+	sgl->totalLength = len;
+	for (i = 0; i < num; i++) {
+		sgl->elements[i].bufOffset = 
+			bufs[i] - dnas_dev->write_buffer_start;
+		sgl->elements[i].bufLength = MIN(len - i * buf_size, buf_size);
+		sgl->elements[i].bufSrc = INTER_CORE_CMD_PARTITION_ID_J1;
+	}
 
+	ret = xfer_from_request_buffs_sgl(dnas_dev, sgl, scmd);
+	if (ret) {
+		free_lx_dyn_buffer_noid(dnas_dev, sgl_off, sgl_len);
+		goto free_bufs;
 	}
+	dnas_trace_mark(tag, DNAS_PH_COPIED);
+
+	tag->sgl_off = sgl_off;
+	tag->sgl_len = sgl_len;
+	atomic_inc(&dnas_dev->j1_sgl_writes);
+
+	return send_scsi_request(ctx, scmd->cmnd, scmd->device->lun, tag, 
+			sgl_off, sgl_len, INTER_CORE_CMD_PARTITION_ID_LINUX_SGL);
+
+free_bufs:
+	for (i = 0; i < num; i++)
+		scsiTgtWriteBufferFreeBuffer(bufs[i], buf_size);
 
 	return ret;
 }
@@ -3797,15 +5596,18 @@ int dri_dnas_shared_mem_scsi_thread(void *data)
  * buffer, because this could take a while. However, we will do that later.
  */
 int process_scsi_request(struct dnas_tag_struct *tag, 
-			struct dri_dnas_device *dnas_dev)
+			struct dnas_req_ctx *ctx)
 {
 	int ret = 0;
+	struct dri_dnas_device *dnas_dev = ctx->dnas_dev;
 	struct scsi_cmnd *scmd = tag->req_p;
 	unsigned char cmd = scmd->cmnd[0];
 
 	DBG(4, "%s: Processing SCSI Request: %02X, LUN: %u, len: %u\n", 
 		__func__, cmd, scmd->device->lun, scsi_bufflen(scmd));
 
+	dnas_trace_mark(tag, DNAS_PH_DEQUEUED);
+
 	//return dri_dnas_send_resp(scmd, NULL, 0, tag->done, 0); // Hack - Amir
 
 	/*
@@ -3837,25 +5639,42 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 		case WRITE_16:
                         if ((scsi_bufflen(scmd) >= 0x40000) && (dnas_debug_level == 2)) 
                         {
-	                   return dri_dnas_send_resp(scmd, NULL, 0, tag->done, 0); // debug write perf. in loopback mode 
+	                   (void)dri_dnas_send_resp(scmd, NULL, 0, tag->done, 0); // debug write perf. in loopback mode 
+	                   return DNAS_REQ_COMPLETED;
                         }
 
-                        buf = NULL;
-                        while (buf == NULL)
-                        {
-		            mutex_lock(&dnas_dev->wb_mutex);
-			    if ((buf = scsiTgtWriteBufferAllocate( scsi_bufflen(scmd))) == 
-				NULL) 
-			    {
-		                mutex_unlock(&dnas_dev->wb_mutex);
+			if (scsi_bufflen(scmd) > 
+			    DRI_DNAS_J1_CONTIG_MAX * BULK_WRITE_BUFFER_SIZE) {
+				ret = dnas_send_j1_sgl(ctx, tag);
+				break;
+			}
+
+			if ((buf = scsiTgtWriteBufferAllocate( scsi_bufflen(scmd))) == 
+			    NULL) 
+			{
 				DBG(5, KERN_INFO "%s: Unable to allocate J1 "
 					"buffer of size: %u!\n", __func__, scsi_bufflen(scmd));
-				//return -ENOMEM; /* XXX: Fixme */
-				schedule_timeout(1);
-			    }
-                        }
-		        mutex_unlock(&dnas_dev->wb_mutex);
+				/*
+				 * Batched writes hold J1 buffers too, get
+				 * them to the Vx core so they can be freed,
+				 * then sleep until it gives some back.
+				 */
+				(void)flush_scsi_requests(ctx);
+				buf = scsiTgtWriteBufferAllocateWait(scsi_bufflen(scmd));
+				if (!buf)
+					return dnas_j1_alloc_failed();
+			}
                         DBG (5, KERN_INFO "Write request buf= %p !!! \n", buf);
+			dnas_trace_mark(tag, DNAS_PH_J1_ALLOC);
+
+			/*
+			 * Big copies go to the DMA engine if we can, and the
+			 * command is sent when the copy is done.
+			 */
+			if (j1_dma_mode != DNAS_J1_DMA_CPU &&
+			    scsi_bufflen(scmd) >= j1_dma_threshold &&
+			    !dnas_j1_dma_start(ctx, tag, buf))
+				break;
 
 			/*
 			 * Now, transfer the data to the buffer and then
@@ -3865,7 +5684,7 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 					//dnas_dev->write_buffer_start);
 
 
-			ret = xfer_from_request_buffs(buf, scmd, 
+			ret = xfer_from_request_buffs(dnas_dev, buf, scmd, 
                                         dnas_dev->write_buffer_start,
                                         dnas_dev->write_buffer_phys);
 			if (ret) {
@@ -3874,9 +5693,10 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 				//	scsi_bufflen(scmd), 1);
 				return ret; /* XXX: Fixme, what to do here */
 			}
+			dnas_trace_mark(tag, DNAS_PH_COPIED);
 
                         buf_off = buf - dnas_dev->write_buffer_start;
-			ret = send_scsi_request(dnas_dev, scmd->cmnd,
+			ret = send_scsi_request(ctx, scmd->cmnd,
 				scmd->device->lun, tag, buf_off,
 				//scmd->device->lun, tag, (uint32) buf,
 				scsi_bufflen(scmd),
@@ -3891,7 +5711,7 @@ int process_scsi_request(struct dnas_tag_struct *tag,
                   // where it's non-zero.
 
                   // Send the request, the validation will be done in vx kernel side.
-                  ret = send_scsi_request(dnas_dev, scmd->cmnd,
+                  ret = send_scsi_request(ctx, scmd->cmnd,
                                   scmd->device->lun, tag, 0,
                                   0,
                                   INTER_CORE_CMD_PARTITION_ID_INVALID);
@@ -3927,7 +5747,7 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 			 * send the request.
 			 */
 
-			ret = xfer_from_request_buffs(buf, scmd, 
+			ret = xfer_from_request_buffs(dnas_dev, buf, scmd, 
                                         dnas_dev->lx_dyn_buffer_start,
                                         dnas_dev->lx_dyn_buffer_phys);
 			if (ret) {
@@ -3935,8 +5755,9 @@ int process_scsi_request(struct dnas_tag_struct *tag,
                                                         buf_len);
 				return ret;
 			}
+			dnas_trace_mark(tag, DNAS_PH_COPIED);
 
-			ret = send_scsi_request(dnas_dev, scmd->cmnd,
+			ret = send_scsi_request(ctx, scmd->cmnd,
 				scmd->device->lun, tag, buf_off, buf_len,
 				INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM);
 
@@ -3954,7 +5775,8 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 		tag->request_type = DNAS_READ;
                 if ((scsi_bufflen(scmd) >= 0x40000) && (dnas_debug_level == 2)) 
                 {
-	                return dri_dnas_send_resp(scmd, NULL, 0, tag->done, 0); // debug write perf. in loopback mode 
+	                (void)dri_dnas_send_resp(scmd, NULL, 0, tag->done, 0); // debug write perf. in loopback mode 
+	                return DNAS_REQ_COMPLETED;
                 }
 
 
@@ -3962,7 +5784,7 @@ int process_scsi_request(struct dnas_tag_struct *tag,
                         printk(KERN_INFO "vendor specific upload diags command\n");
                 }
 
-		ret = send_scsi_request(dnas_dev, scmd->cmnd, 
+		ret = send_scsi_request(ctx, scmd->cmnd, 
 				scmd->device->lun, tag, 0,
 				scsi_bufflen(scmd), 
 				INTER_CORE_CMD_PARTITION_ID_INVALID);
@@ -3974,9 +5796,9 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 	case DMA_BIDIRECTIONAL:
 		printk(KERN_ERR "%s: BIDI command rejected: %0X\n",
 			__func__, cmd);
-		return dri_dnas_send_resp(scmd, NULL, 0, tag->done, 
+		(void)dri_dnas_send_resp(scmd, NULL, 0, tag->done, 
 					DID_NO_CONNECT << 16);
-		break;
+		return DNAS_REQ_COMPLETED;
 	/*
 	 * No data with this, just send the command.
 	 */
@@ -3984,7 +5806,7 @@ int process_scsi_request(struct dnas_tag_struct *tag,
 	default:
 		tag->request_type = DNAS_NOIO;
 
-		ret = send_scsi_request(dnas_dev, scmd->cmnd, 
+		ret = send_scsi_request(ctx, scmd->cmnd, 
 				scmd->device->lun, tag, 0,
 				0, INTER_CORE_CMD_PARTITION_ID_INVALID);
 		break;
@@ -4002,12 +5824,14 @@ int process_scsi_request(struct dnas_tag_struct *tag,
  */
 int dri_dnas_scsi_request_thread(void *data)
 {
-	struct dri_dnas_device *dnas_dev = (struct dri_dnas_device *)data;  
+	struct dnas_req_ctx *ctx = (struct dnas_req_ctx *)data;
+	struct dri_dnas_device *dnas_dev = ctx->dnas_dev;  
 	struct dnas_tag_struct *tag = NULL;
 	unsigned long flags;
 	int ret = 0, d_skip = delay_skip;
 
-	DBG(5, KERN_INFO "%s: Started\n", __func__);
+	DBG(5, KERN_INFO "%s: Started on CPU %d\n", __func__, 
+		smp_processor_id());
 
 	while (!kthread_should_stop()) {
 
@@ -4016,13 +5840,27 @@ int dri_dnas_scsi_request_thread(void *data)
 		 * When woken up, grab the spinlock and work and do it.
 		 */
 
-		spin_lock_irqsave(&dnas_dev->req_spinlock, flags);
-		if (list_empty(&dnas_dev->req_queue)) {
-			dnas_dev->req_thread_waiting = 1;
-			spin_unlock_irqrestore(&dnas_dev->req_spinlock, flags);
+		spin_lock_irqsave(&ctx->req_spinlock, flags);
+		if (list_empty(&ctx->req_queue) && ctx->req_batch.count) {
+			/*
+			 * Nothing more to batch up, send what we have
+			 */
+			spin_unlock_irqrestore(&ctx->req_spinlock, flags);
+			(void)flush_scsi_requests(ctx);
+			spin_lock_irqsave(&ctx->req_spinlock, flags);
+		}
+		if (list_empty(&ctx->req_queue)) {
+			ctx->req_thread_waiting = 1;
+			spin_unlock_irqrestore(&ctx->req_spinlock, flags);
 			wait_for_completion_interruptible(
-				&dnas_dev->req_completion);
-			spin_lock_irqsave(&dnas_dev->req_spinlock, flags);
+				&ctx->req_completion);
+			spin_lock_irqsave(&ctx->req_spinlock, flags);
+			if (list_empty(&ctx->req_queue)) {
+				/* Signal or spurious wakeup */
+				spin_unlock_irqrestore(&ctx->req_spinlock,
+					flags);
+				continue;
+			}
 		}
 
 		/*
@@ -4046,12 +5884,12 @@ int dri_dnas_scsi_request_thread(void *data)
                         }
                 }
 
-		tag = list_entry(dnas_dev->req_queue.next, 
+		tag = list_entry(ctx->req_queue.next, 
 			struct dnas_tag_struct, req_queue_ent);
 
 
 		list_del(&tag->req_queue_ent);
-		spin_unlock_irqrestore(&dnas_dev->req_spinlock, flags);
+		spin_unlock_irqrestore(&ctx->req_spinlock, flags);
 
                 /*
                  * Lock the tag whie we are working on it ... we do this after
@@ -4072,21 +5910,30 @@ int dri_dnas_scsi_request_thread(void *data)
 		 * now have the lock. We only have to free the tag in the case
 		 * that the IO has been cancelled.
 		 */
-                if (tag->req_p == NULL) {
+		if (tag->j1_dma_state == DNAS_J1_DMA_DONE) {
+			/* Its J1 copy finished, send it on */
+			ret = dnas_j1_dma_finish(ctx, tag);
+		} else if (tag->req_p == NULL) {
                         mutex_unlock(&tag->tag_mutex);
-			kmem_cache_free(dnas_dev->dnas_tag_cache, tag);
+			dnas_put_tag(dnas_dev, tag);
                         continue;
-                }
-
-		ret = process_scsi_request(tag, dnas_dev);
+                } else {
+			ret = process_scsi_request(tag, ctx);
+		}
 
 		/*
 		 * Error handling ... if the IO failed, tell the SCSI mid layer
-		 * and free the tag struct.
+		 * and free the tag struct. If it was completed without going
+		 * to the Vx core, just free the tag.
 		 */
 		if (ret) {
-			dri_dnas_send_resp(tag->req_p, NULL, 0, tag->done, ret);
-			kmem_cache_free(dnas_dev->dnas_tag_cache, tag);
+			if (ret != DNAS_REQ_COMPLETED)
+				dri_dnas_send_resp(tag->req_p, NULL, 0, 
+						tag->done, ret);
+			mutex_unlock(&tag->tag_mutex);
+			dnas_put_tag(dnas_dev, tag);
+			ret = 0;
+			continue;
 		}
 
                 mutex_unlock(&tag->tag_mutex);
@@ -4137,9 +5984,10 @@ int dri_dnas_shared_mem_resource_thread(void *data)
                         if (ic_lxr.bufId1.length == 0) {
                                 printk(KERN_INFO "Got write buffer len 0\n");
                         }
-		        mutex_lock(&dnas_dev->wb_mutex);
-                        scsiTgtWriteBufferRescanBuffers(ic_lxr.bufId1.length);
-		        mutex_unlock(&dnas_dev->wb_mutex);
+			/* Only the released buffers, not the whole pool */
+                        scsiTgtWriteBufferReclaim(
+				get_write_buff_addr(dnas_dev, ic_lxr.bufId1.bufOffset),
+				ic_lxr.bufId1.length);
 			//free_write_buffer(dnas_dev, &ic_lxr.bufId1);
 		} else if (ic_lxr.bufId1.bufSrc ==
 				INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM) {
@@ -4233,6 +6081,8 @@ int queue_to_userland(int status, InterCoreCtrlVxToLx *msg,
 
 	list_add_tail(&ul_elt->core_ctrl_elt, &dnas_dev->core_ctrl_queue);
 
+	dnas_ctl_ring_fill(dnas_dev);
+
 	if (dnas_dev->waiting_for_core_ctrl) {
 		dnas_dev->waiting_for_core_ctrl = 0;
 		complete_all(&dnas_dev->core_ctrl_completion);
@@ -4276,6 +6126,8 @@ int queue_to_userland_possible_resp(int status, InterCoreCtrlVxToLx *msg,
 
 	list_add_tail(&ul_elt->core_ctrl_elt, &dnas_dev->core_ctrl_queue);
 
+	dnas_ctl_ring_fill(dnas_dev);
+
 	if (dnas_dev->waiting_for_core_ctrl) {
 		dnas_dev->waiting_for_core_ctrl = 0;
 		complete_all(&dnas_dev->core_ctrl_completion);
@@ -4438,6 +6290,7 @@ int handle_intercore_msg(InterCoreCtrlVxToLx *msg,
 	//if (msg->flags & (ISCSI_ENABLE | NET_INFO)) {
 	if (msg->flags & ISCSI_ENABLE) {
 		struct task_struct *th;
+		int cpu;
 		InterCoreCtrlLxToVx send_msg;
 		SharedMemQueueSendMsg send_args;
 
@@ -4487,18 +6340,38 @@ int handle_intercore_msg(InterCoreCtrlVxToLx *msg,
 
 
 			/* 
-			 * Now, start the start the SCSI Request handling queue
+			 * Now, start the SCSI Request handling threads, one
+			 * bound to each CPU
 			 */
-			th = kthread_run(dri_dnas_scsi_request_thread, 
-				dnas_dev, "dri_scsi_req_%d", 3);
-			if (IS_ERR(th)) {
-				printk(KERN_ERR "%s: unable to start thread to "					"handle SCSI requests: %ld\n", 
-					__func__, PTR_ERR(th));
-				ret = PTR_ERR(th);
-				return ret;
+			if (j1_dma_mode == DNAS_J1_DMA_ENGINE)
+				dnas_j1_dma_init(dnas_dev);
+
+		dnas_dev->req_fallback_cpu = -1;
+			for_each_online_cpu(cpu) {
+				struct dnas_req_ctx *ctx = 
+					per_cpu_ptr(dnas_dev->req_ctx, cpu);
+
+				th = kthread_create(dri_dnas_scsi_request_thread,
+					ctx, "dri_scsi_req/%d", cpu);
+				if (IS_ERR(th)) {
+					printk(KERN_ERR "%s: unable to start "
+						"thread to handle SCSI requests"
+						" on CPU %d: %ld\n", __func__,
+						cpu, PTR_ERR(th));
+					continue;
+				}
+				kthread_bind(th, cpu);
+				ctx->th = th;
+				if (dnas_dev->req_fallback_cpu < 0)
+					dnas_dev->req_fallback_cpu = cpu;
+				wake_up_process(th);
 			}
 
-			dnas_dev->scsi_req_th = th;
+			if (dnas_dev->req_fallback_cpu < 0) {
+				printk(KERN_ERR "%s: no SCSI request threads\n",
+					__func__);
+				return -ENOMEM;
+			}
 
                         /*
                          * Queue to sysfs
@@ -4776,6 +6649,16 @@ int dri_dnas_shared_mem_comms_thread(void *data)
 		return ret;
 	}
 
+	/*
+	 * The section mapped aliases for data copies, if shared_mem made them
+	 */
+	if (find_region_kern_direct_addr_from_tag(dnas_dev->shm_dev, "SHJ1",
+					&dnas_dev->write_buffer_direct))
+		dnas_dev->write_buffer_direct = NULL;
+	if (find_region_kern_direct_addr_from_tag(dnas_dev->shm_dev, "read",
+					&dnas_dev->hlbat_buffer_direct))
+		dnas_dev->hlbat_buffer_direct = NULL;
+
 	printk("Shared Memory Partition Map Addresses:\n");
 	printk("-----------------------------------------------------------------------------\n");
 	printk("SHJ1: Start:\t 0x%x, End:\t 0x%x, Phys:\t 0x%x\n", (unsigned int) dnas_dev->write_buffer_start, ((unsigned int) dnas_dev->write_buffer_start) + dnas_dev->write_buffer_size, (unsigned int)dnas_dev->write_buffer_phys);
@@ -4830,18 +6713,6 @@ int dri_dnas_shared_mem_comms_thread(void *data)
 
 	dnas_dev->resource_queue_handle = attach_args.handle;
 
-	/*
-	 * Allocate a cahce for our tags first ...
-	 */
-	dnas_dev->dnas_tag_cache = kmem_cache_create("dnas_tag_cache",
-				sizeof(struct dnas_tag_struct),
-				0, 0, NULL);
-	if (!dnas_dev->dnas_tag_cache) {
-		printk(KERN_WARNING "%s: We're fucked! No memory for our "
-			"tag cache.", __func__);
-		return -ENOMEM;
-	}
-
 	/*
 	 * Allocate a cache for core ctrl messages to userspace
 	 */
@@ -4854,6 +6725,11 @@ int dri_dnas_shared_mem_comms_thread(void *data)
 		return -ENOMEM;
 	}
 
+	/*
+	 * The poll()able path for the userland core control daemon.
+	 */
+	dnas_ctl_register(dnas_dev);
+
 	/*
 	 * Now, process events on the Core Control Command queue.
 	 */
@@ -4887,6 +6763,55 @@ int dri_dnas_shared_mem_comms_thread(void *data)
  * Init and exit routines
  */
 
+/*
+ * Turn on block layer tagging for each LUN, using the host wide tag map.
+ * The Vx core does its own ordering, so these are only used to index the
+ * tag pool.
+ */
+static int dri_dnas_slave_configure(struct scsi_device *sdev)
+{
+	struct request_queue *q = sdev->request_queue;
+
+	if (sdev->host->bqt && !blk_queue_tagged(q) &&
+	    blk_queue_init_tags(q, sdev->host->can_queue, sdev->host->bqt))
+		printk(KERN_WARNING "%s: unable to enable tagging, lun %u\n",
+			__func__, sdev->lun);
+
+	if (blk_queue_tagged(q))
+		scsi_adjust_queue_depth(sdev, MSG_SIMPLE_TAG, 
+					sdev->host->cmd_per_lun);
+
+	/*
+	 * Clustering merges small buffers into one segment, but the copies
+	 * to and from the shared buffers map one page at a time, so keep
+	 * every segment inside a page.
+	 */
+	blk_queue_max_segment_size(q, PAGE_SIZE);
+	blk_queue_segment_boundary(q, PAGE_SIZE - 1);
+
+	return 0;
+}
+
+/*
+ * Writes to the queue_depth file of the scsi device end up here. The host
+ * wide tag map still bounds the total.
+ */
+static int dri_dnas_change_queue_depth(struct scsi_device *sdev, int depth,
+				int reason)
+{
+	if (reason != SCSI_QDEPTH_DEFAULT)
+		return -EOPNOTSUPP;
+
+	if (depth < 1)
+		depth = 1;
+	if (depth > sdev->host->can_queue)
+		depth = sdev->host->can_queue;
+
+	scsi_adjust_queue_depth(sdev, scsi_get_tag_type(sdev), depth);
+
+	return sdev->queue_depth;
+}
+
 /*
  *  *  * The host template we will register
  *   *   */
@@ -4899,12 +6824,14 @@ static struct scsi_host_template dri_dnas_host_template = {
         .ioctl                          = dri_dnas_ioctl,
         .eh_abort_handler               = dri_dnas_abort,
         .eh_device_reset_handler        = dri_dnas_device_reset,
+        .slave_configure                = dri_dnas_slave_configure,
+        .change_queue_depth             = dri_dnas_change_queue_depth,
         .sg_tablesize                   = DRI_DNAS_MAX_SG_SEGMENTS,
         .can_queue                      = DRI_DNAS_MAX_QUEUE,
         .this_id                        = 15,
         .cmd_per_lun                    = 32,
-        .max_sectors                    = 1024,  /* 512KB */
-        .use_clustering                 = DISABLE_CLUSTERING,
+        .max_sectors                    = 1024,  /* 512KB, see probe */
+        .use_clustering                 = DRI_USE_CLUSTERING,
         .skip_settle_delay              = 1,
         .module                         = THIS_MODULE,
 /*
@@ -4950,6 +6877,34 @@ static int dri_dnas_fake_probe(struct device *dev)
 
 	host->max_cmd_len = 16; /* Make sure we accept 16-byte CDBs, Jane! */
 
+	/*
+	 * Queue depth and transfer size come from the module parameters.
+	 * Anything over two bulk J1 buffers goes to the Vx core as an SGL.
+	 */
+	if (max_sectors < 8 || max_sectors > DRI_MAX_SECTORS_LIMIT) {
+		printk(KERN_WARNING "%s: max_sectors %u out of range, using "
+			"%u\n", __func__, max_sectors, DRI_MAX_SECTORS);
+		max_sectors = DRI_MAX_SECTORS;
+	}
+	host->can_queue = dnas_dev->max_queue;
+	host->cmd_per_lun = MIN(MAX(queue_depth, 1), dnas_dev->max_queue);
+	host->max_sectors = max_sectors;
+	host->sg_tablesize = MIN(MAX(max_sectors / (PAGE_SIZE >> 9) + 1, 
+				DRI_DNAS_MAX_SG_SEGMENTS), 
+				SCSI_MAX_SG_CHAIN_SEGMENTS);
+
+	/*
+	 * One tag map for the whole host, so block layer tags index our tag
+	 * pool directly. See dri_dnas_slave_configure.
+	 */
+	ret = scsi_init_shared_tag_map(host, host->can_queue);
+	if (ret) {
+		printk(KERN_ERR "%s: unable to allocate host tag map: %d\n",
+			__func__, ret);
+		scsi_host_put(host);
+		return ret;
+	}
+
 	*((struct dri_dnas_device **)host->hostdata) = dnas_dev;
 	host->max_id = 1;  /* Only one target out there */
 	host->max_lun = dri_dnas_max_luns - 1;
@@ -5010,7 +6965,7 @@ static struct device dri_dnas_fake_primary = {
 
 static __init int dri_dnas_scsi_init(void)
 {
-	int ret = 0;
+	int ret = 0, cpu;
 	struct task_struct *th = NULL;
 	struct dri_dnas_device *dev = NULL;
 
@@ -5024,6 +6979,14 @@ static __init int dri_dnas_scsi_init(void)
 		return -ENOMEM;
 	}
 
+	dev->req_ctx = alloc_percpu(struct dnas_req_ctx);
+	if (NULL == dev->req_ctx) {
+		printk(KERN_ERR "%s: out of memory allocating"
+			" request queues at line %d\n", __func__, __LINE__);
+		kfree(dev);
+		return -ENOMEM;
+	}
+
         //dri_dnas_fake_primary = root_device_register("drobo_nas_scsi");
         dri_dnas_fake_primary = root_device_register("dri_dnas_primary");
         if (IS_ERR(dri_dnas_fake_primary)) {
@@ -5070,16 +7033,23 @@ static __init int dri_dnas_scsi_init(void)
 	mutex_init(&dev->scsi_completion_mutex);
 	mutex_init(&dev->wb_mutex);
 	mutex_init(&dev->lx_db_mutex);
-	spin_lock_init(&dev->req_spinlock);
-	init_completion(&dev->req_completion);
 	init_completion(&dev->buffer_completion);
-	dev->req_thread_waiting = 0;
 	dev->threads_waiting_for_buffers = 0;
 
 	/*
 	 * Init the various queues since one is needed early
 	 */
-	INIT_LIST_HEAD(&dev->req_queue);
+	for_each_possible_cpu(cpu) {
+		struct dnas_req_ctx *ctx = per_cpu_ptr(dev->req_ctx, cpu);
+
+		ctx->dnas_dev = dev;
+		spin_lock_init(&ctx->req_spinlock);
+		init_completion(&ctx->req_completion);
+		INIT_LIST_HEAD(&ctx->req_queue);
+	}
+	ret = dnas_tag_pool_init(dev);
+	if (ret)
+		goto unregister_driver;
 	INIT_LIST_HEAD(&dev->core_ctrl_queue);
 
 	/*
@@ -5109,6 +7079,9 @@ unregister_bus:
 	bus_unregister(&dri_dnas_fake_lld_bus);
 unregister_primary:
 	device_unregister(dri_dnas_fake_primary);
+	kfree(dev->tags);
+	kfree(dev->tag_free);
+	free_percpu(dev->req_ctx);
 	kfree(dev);
 
 	goto done;
@@ -33,6 +33,7 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
 #include <scsi/scsi.h>
 #include <scsi/scsi_host.h>
 
@@ -136,9 +137,12 @@ static struct se_device *fd_create_virtdevice(
 	}
 	/*
 	 * Use O_DSYNC by default instead of O_SYNC to forgo syncing
-	 * of pure timestamp updates.
+	 * of pure timestamp updates.  With fd_buffered_io=1 WRITEs go
+	 * to the page cache and the WCE bit is emulated instead.
 	 */
-	flags = O_RDWR | O_CREAT | O_LARGEFILE | O_DSYNC;
+	flags = O_RDWR | O_CREAT | O_LARGEFILE;
+	if (!(fd_dev->fbd_flags & FBDF_USE_BUFFERED_IO))
+		flags |= O_DSYNC;
 
 	file = filp_open(dev_p, flags, 0600);
 	if (IS_ERR(file)) {
@@ -200,6 +204,17 @@ static struct se_device *fd_create_virtdevice(
 	dev_limits.hw_queue_depth = FD_MAX_DEVICE_QUEUE_DEPTH;
 	dev_limits.queue_depth = FD_DEVICE_QUEUE_DEPTH;
 
+	if (fd_dev->fd_async_io) {
+		fd_dev->fd_wq = alloc_workqueue("fd_async_io", WQ_UNBOUND,
+						fd_dev->fd_async_io);
+		if (!fd_dev->fd_wq) {
+			pr_err("FILEIO: Unable to allocate fd_async_io"
+				" workqueue\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	dev = transport_add_device_to_core_hba(hba, &fileio_template,
 				se_dev, dev_flags, fd_dev,
 				&dev_limits, "FILEIO", FD_VERSION);
@@ -209,6 +224,12 @@ static struct se_device *fd_create_virtdevice(
 	fd_dev->fd_dev_id = fd_host->fd_host_dev_id_count++;
 	fd_dev->fd_queue_depth = dev->queue_depth;
 
+	if (fd_dev->fbd_flags & FBDF_USE_BUFFERED_IO) {
+		pr_debug("FILEIO: Forcing setting of emulate_write_cache=1"
+			" with FBDF_USE_BUFFERED_IO\n");
+		dev->se_sub_dev->se_dev_attrib.emulate_write_cache = 1;
+	}
+
 	pr_debug("CORE_FILE[%u] - Added TCM FILEIO Device ID: %u at %s,"
 		" %llu total bytes\n", fd_host->fd_host_id, fd_dev->fd_dev_id,
 			fd_dev->fd_dev_name, fd_dev->fd_dev_size);
@@ -216,6 +237,10 @@ static struct se_device *fd_create_virtdevice(
 	putname(dev_p);
 	return dev;
 fail:
+	if (fd_dev->fd_wq) {
+		destroy_workqueue(fd_dev->fd_wq);
+		fd_dev->fd_wq = NULL;
+	}
 	if (fd_dev->fd_file) {
 		filp_close(fd_dev->fd_file, NULL);
 		fd_dev->fd_file = NULL;
@@ -232,6 +257,9 @@ static void fd_free_device(void *p)
 {
 	struct fd_dev *fd_dev = (struct fd_dev *) p;
 
+	if (fd_dev->fd_wq)
+		destroy_workqueue(fd_dev->fd_wq);
+
 	if (fd_dev->fd_file) {
 		filp_close(fd_dev->fd_file, NULL);
 		fd_dev->fd_file = NULL;
@@ -390,10 +418,11 @@ static void fd_emulate_sync_cache(struct se_task *task)
 		transport_complete_sync_cache(cmd, ret == 0);
 }
 
-static int fd_do_task(struct se_task *task)
+static int fd_do_rw(struct se_task *task)
 {
 	struct se_cmd *cmd = task->task_se_cmd;
 	struct se_device *dev = cmd->se_dev;
+	struct fd_dev *fd_dev = dev->dev_ptr;
 	int ret = 0;
 
 	/*
@@ -408,16 +437,25 @@ static int fd_do_task(struct se_task *task)
 		 * Perform implict vfs_fsync_range() for fd_do_writev() ops
 		 * for SCSI WRITEs with Forced Unit Access (FUA) set.
 		 * Allow this to happen independent of WCE=0 setting.
+		 * Without O_DSYNC, also make every WRITE stable once the
+		 * initiator has turned the emulated write cache off.
 		 */
 		if (ret > 0 &&
-		    dev->se_sub_dev->se_dev_attrib.emulate_fua_write > 0 &&
-		    (cmd->se_cmd_flags & SCF_FUA)) {
-			struct fd_dev *fd_dev = dev->dev_ptr;
+		    ((dev->se_sub_dev->se_dev_attrib.emulate_fua_write > 0 &&
+		      (cmd->se_cmd_flags & SCF_FUA)) ||
+		     ((fd_dev->fbd_flags & FBDF_USE_BUFFERED_IO) &&
+		      !dev->se_sub_dev->se_dev_attrib.emulate_write_cache))) {
 			loff_t start = task->task_lba *
 				dev->se_sub_dev->se_dev_attrib.block_size;
 			loff_t end = start + task->task_size;
+			int err;
 
-			vfs_fsync_range(fd_dev->fd_file, start, end, 1);
+			err = vfs_fsync_range(fd_dev->fd_file, start, end, 1);
+			if (err) {
+				pr_err("FILEIO: vfs_fsync_range() failed: %d\n",
+					err);
+				ret = err;
+			}
 		}
 	}
 
@@ -432,6 +470,33 @@ static int fd_do_task(struct se_task *task)
 	return 0;
 }
 
+static void fd_do_work(struct work_struct *work)
+{
+	struct fd_request *req = container_of(work, struct fd_request,
+					      fd_work);
+
+	if (fd_do_rw(&req->fd_task) < 0)
+		transport_complete_task(&req->fd_task, 0);
+}
+
+/*	fd_do_task(): (Part of se_subsystem_api_t template)
+ *
+ *	With fd_async_io= the READ or WRITE is handed to fd_wq and
+ *	completes from there, so several can be in flight at once.
+ */
+static int fd_do_task(struct se_task *task)
+{
+	struct fd_dev *fd_dev = task->task_se_cmd->se_dev->dev_ptr;
+	struct fd_request *req = FILE_REQ(task);
+
+	if (!fd_dev->fd_wq)
+		return fd_do_rw(task);
+
+	INIT_WORK(&req->fd_work, fd_do_work);
+	queue_work(fd_dev->fd_wq, &req->fd_work);
+	return 0;
+}
+
 /*	fd_free_task(): (Part of se_subsystem_api_t template)
  *
  *
@@ -444,12 +509,15 @@ static void fd_free_task(struct se_task *task)
 }
 
 enum {
-	Opt_fd_dev_name, Opt_fd_dev_size, Opt_fd_buffered_io, Opt_err
+	Opt_fd_dev_name, Opt_fd_dev_size, Opt_fd_buffered_io, Opt_fd_async_io,
+	Opt_err
 };
 
 static match_table_t tokens = {
 	{Opt_fd_dev_name, "fd_dev_name=%s"},
 	{Opt_fd_dev_size, "fd_dev_size=%s"},
+	{Opt_fd_buffered_io, "fd_buffered_io=%d"},
+	{Opt_fd_async_io, "fd_async_io=%d"},
 	{Opt_err, NULL}
 };
 
@@ -461,7 +529,7 @@ static ssize_t fd_set_configfs_dev_params(
 	struct fd_dev *fd_dev = se_dev->se_dev_su_ptr;
 	char *orig, *ptr, *arg_p, *opts;
 	substring_t args[MAX_OPT_ARGS];
-	int ret = 0, token;
+	int ret = 0, arg, token;
 
 	opts = kstrdup(page, GFP_KERNEL);
 	if (!opts)
@@ -505,6 +573,34 @@ static ssize_t fd_set_configfs_dev_params(
 					" bytes\n", fd_dev->fd_dev_size);
 			fd_dev->fbd_flags |= FBDF_HAS_SIZE;
 			break;
+		case Opt_fd_buffered_io:
+			ret = match_int(args, &arg);
+			if (ret)
+				goto out;
+			if (arg != 0 && arg != 1) {
+				pr_err("bogus fd_buffered_io=%d value\n", arg);
+				ret = -EINVAL;
+				goto out;
+			}
+			pr_debug("FILEIO: Using buffered I/O: %d\n", arg);
+			if (arg)
+				fd_dev->fbd_flags |= FBDF_USE_BUFFERED_IO;
+			else
+				fd_dev->fbd_flags &= ~FBDF_USE_BUFFERED_IO;
+			break;
+		case Opt_fd_async_io:
+			ret = match_int(args, &arg);
+			if (ret)
+				goto out;
+			if (arg < 0 || arg > FD_MAX_DEVICE_QUEUE_DEPTH) {
+				pr_err("fd_async_io=%d must be between 0 and"
+					" %d\n", arg, FD_MAX_DEVICE_QUEUE_DEPTH);
+				ret = -EINVAL;
+				goto out;
+			}
+			pr_debug("FILEIO: Using async I/O depth: %d\n", arg);
+			fd_dev->fd_async_io = arg;
+			break;
 		default:
 			break;
 		}
@@ -536,8 +632,13 @@ static ssize_t fd_show_configfs_dev_params(
 	ssize_t bl = 0;
 
 	bl = sprintf(b + bl, "TCM FILEIO ID: %u", fd_dev->fd_dev_id);
-	bl += sprintf(b + bl, "        File: %s  Size: %llu  Mode: O_DSYNC\n",
-		fd_dev->fd_dev_name, fd_dev->fd_dev_size);
+	bl += sprintf(b + bl, "        File: %s  Size: %llu  Mode: %s",
+		fd_dev->fd_dev_name, fd_dev->fd_dev_size,
+		(fd_dev->fbd_flags & FBDF_USE_BUFFERED_IO) ?
+		"Buffered-WCE" : "O_DSYNC");
+	if (fd_dev->fd_async_io)
+		bl += sprintf(b + bl, "  Async: %u", fd_dev->fd_async_io);
+	bl += sprintf(b + bl, "\n");
 	return bl;
 }
 
@@ -14,10 +14,13 @@
 
 struct fd_request {
 	struct se_task	fd_task;
+	/* Queued to fd_dev->fd_wq for fd_async_io= */
+	struct work_struct fd_work;
 };
 
 #define FBDF_HAS_PATH		0x01
 #define FBDF_HAS_SIZE		0x02
+#define FBDF_USE_BUFFERED_IO	0x04
 
 struct fd_dev {
 	u32		fbd_flags;
@@ -29,6 +32,9 @@ struct fd_dev {
 	u32		fd_queue_depth;
 	u32		fd_block_size;
 	unsigned long long fd_dev_size;
+	/* Tasks run at once from fd_wq, 0 runs them in the caller */
+	u32		fd_async_io;
+	struct workqueue_struct *fd_wq;
 	struct file	*fd_file;
 	/* FILEIO HBA device is connected to */
 	struct fd_host *fd_host;
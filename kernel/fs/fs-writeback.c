@@ -515,6 +515,52 @@ static long writeback_chunk_size(struct backing_dev_info *bdi,
 	return pages;
 }
 
+/*
+ * DROBO: drop page cache behind the flusher, as per the bdi's wb_drop_cache
+ * policy. With range_cyclic writeback write_cache_pages() leaves
+ * writeback_index just past what it wrote, so [@start, writeback_index) is
+ * the range this pass covered, wrapping if it went round the end of the file.
+ * Pages still under writeback can't go yet, they are deactivated so reclaim
+ * takes them first once the IO is done.
+ */
+static void wb_drop_written_pages(struct backing_dev_info *bdi,
+				  struct address_space *mapping,
+				  struct writeback_control *wbc,
+				  pgoff_t start, long written)
+{
+	unsigned long dropped = 0, retained = 0, deactivated = 0;
+	pgoff_t end = mapping->writeback_index;
+
+	if (bdi->wb_drop_cache == BDI_WB_DROP_NONE || written <= 0)
+		return;
+
+	if (bdi->wb_drop_free_pages &&
+	    global_page_state(NR_FREE_PAGES) > bdi->wb_drop_free_pages)
+		return;
+
+	if (bdi->wb_drop_cache == BDI_WB_DROP_ALL) {
+		dropped = invalidate_mapping_pages(mapping, 0, -1);
+	} else if (!wbc->range_cyclic || start == end) {
+		dropped = invalidate_mapping_pages_once(mapping, 0, -1,
+						&retained, &deactivated);
+	} else {
+		if (end < start) {
+			dropped = invalidate_mapping_pages_once(mapping,
+						start, -1,
+						&retained, &deactivated);
+			start = 0;
+		}
+		if (end)
+			dropped += invalidate_mapping_pages_once(mapping,
+						start, end - 1,
+						&retained, &deactivated);
+	}
+
+	atomic_long_add(dropped, &bdi->wb_pages_dropped);
+	atomic_long_add(deactivated, &bdi->wb_pages_deactivated);
+	atomic_long_add(retained, &bdi->wb_pages_retained);
+}
+
 /*
  * Write a portion of b_io inodes which belong to @sb.
  *
@@ -542,6 +588,7 @@ static long writeback_sb_inodes(struct super_block *sb,
 	long wrote = 0;  /* count both pages and inodes */
 
   bool dumpBlocks = false; /* DROBO */
+  pgoff_t wb_index; /* DROBO */
 
 	while (!list_empty(&wb->b_io)) {
 		struct inode *inode = wb_inode(wb->b_io.prev);
@@ -582,6 +629,7 @@ static long writeback_sb_inodes(struct super_block *sb,
 		write_chunk = writeback_chunk_size(wb->bdi, work);
 		wbc.nr_to_write = write_chunk;
 		wbc.pages_skipped = 0;
+		wb_index = inode->i_mapping->writeback_index; /* DROBO */
 
 		writeback_single_inode(inode, wb, &wbc);
 
@@ -610,7 +658,8 @@ static long writeback_sb_inodes(struct super_block *sb,
     /* DROBO vvv */
 
     if (dumpBlocks) 
-      invalidate_mapping_pages (inode->i_mapping, 0, -1);
+      wb_drop_written_pages(wb->bdi, inode->i_mapping, &wbc, wb_index,
+                            write_chunk - wbc.nr_to_write);
 
     /* DROBO ^^^ */
 
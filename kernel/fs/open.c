@@ -241,6 +241,13 @@ int do_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 	if (IS_IMMUTABLE(inode))
 		return -EPERM;
 
+	/*
+	 * The blocks of an active swapfile (or a loop device in direct
+	 * mode) are used without the filesystem, they must not move.
+	 */
+	if (IS_SWAPFILE(inode))
+		return -ETXTBSY;
+
 	/*
 	 * Revalidate the write permissions, in case security policy has
 	 * changed since the files were opened.
@@ -95,6 +95,17 @@ struct backing_dev_info {
 	unsigned int min_ratio;
 	unsigned int max_ratio, max_prop_frac;
 
+	/*
+	 * What the flusher drops from the page cache of an inode it has just
+	 * written back, see BDI_WB_DROP_*. Only done while free memory is
+	 * below wb_drop_free_pages (0: always).
+	 */
+	unsigned int wb_drop_cache;
+	unsigned long wb_drop_free_pages;
+	atomic_long_t wb_pages_dropped;
+	atomic_long_t wb_pages_deactivated;
+	atomic_long_t wb_pages_retained;
+
 	struct bdi_writeback wb;  /* default writeback info for this bdi */
 	spinlock_t wb_lock;	  /* protects work_list */
 
@@ -215,6 +226,10 @@ static inline unsigned long bdi_stat_error(struct backing_dev_info *bdi)
 #endif
 }
 
+#define BDI_WB_DROP_NONE	0	/* keep the page cache */
+#define BDI_WB_DROP_WRITTEN	1	/* use-once pages of the range written */
+#define BDI_WB_DROP_ALL		2	/* the whole mapping */
+
 int bdi_set_min_ratio(struct backing_dev_info *bdi, unsigned int min_ratio);
 int bdi_set_max_ratio(struct backing_dev_info *bdi, unsigned int max_ratio);
 
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) Data Robotics, Inc, 2009
+ *
+ * Messages passed between the Lx and Vx cores over the shared memory
+ * queue pairs, shared by the DNAS LLD and the loopback peer.
+ */
+
+#ifndef _DRI_DNAS_INTERCORE_H_
+#define _DRI_DNAS_INTERCORE_H_
+
+#include <linux/types.h>
+
+#define INTER_CORE_SGL_MAX_ELEMENTS                   520  /* Max size returable from RTP */
+
+typedef struct core_ctl_lx_user_recv_ {
+	int no_response;  /* 0 = send appropriate repsonse from userland 1 = don't send response since driver had to do early response */
+	void *cmd_buf;  /* Buffer allocated by user space to recv  */
+	unsigned int cmd_size;  /* Size of the buffer allocated by*/
+	unsigned int cmd_recv_size;    /* Size of the InterCoreCtrlVxToLx 
+					struct actually received by the LLD 
+					over intercore core ctl queue */
+	void *data_buf;  /* Data buffer allocated in user space to receive 
+			    data related to InterCoreCtrlVxToLx struct that 
+			    is based on offsets/pointers in the 
+			    InterCoreCtrlVxToLx struct */
+	unsigned int data_size; /* Size of the data buffer allocated in user 
+				space */
+	unsigned int data_recv_size;  /* Size of the data related to 
+					InterCoreCtrlVxToLx struct actually 
+					received by the LLD */
+} __packed core_ctl_lx_user_recv;
+
+typedef struct core_ctl_lx_user_send_ {
+	void *cmd_buf;  /* Buffer allocated by user space to send the 
+			   InterCoreCtrlVxToLx struct */
+	unsigned int cmd_size;  /* Size of the buffer allocated by user space 
+				to send the InterCoreCtrlVxToLx struct */
+	unsigned int cmd_sent_size; /* Size of the InterCoreCtrlVxToLx struct 
+				       actually sent by the LLD over intercore 
+				       core ctl queue */
+	void *data_buf; /* Data buffer allocated in user space to send data 
+			related to InterCoreCtrlVxToLx struct that is based on 
+			offsets/pointers in the InterCoreCtrlVxToLx struct */
+	unsigned int data_size; /* Size of the data buffer allocated in user 
+				space */
+	unsigned int data_sent_size;  /* Size of the data related to 
+					InterCoreCtrlVxToLx struct actually 
+					sent by the LLD */
+} __packed core_ctl_lx_user_send;
+
+
+#define DRI_NAS_GET_MSG	        _IOR(0xF1, 0xF1, core_ctl_lx_user_recv)
+#define DRI_NAS_SEND_MSG        _IOW(0xF1, 0xF2, core_ctl_lx_user_send)
+
+typedef unsigned int InterCoreCmdTag;
+
+typedef struct InterCoreSGLElement
+{
+  unsigned int bufOffset;
+  unsigned int bufLength;
+  unsigned int bufSrc;    /* Only valid if the bufSrc in InterCoreSGL is invalid */
+} __packed InterCoreSGLElement;
+
+/* NOTE: If bufSrc is Invalid that means each element defines its own bufSrc.
+ *  * Otherwise all elements come from the bufSrc in InterCoreSGL structure
+ *   */
+typedef struct InterCoreSGL
+{
+  unsigned int status;
+  unsigned int numElements;
+  unsigned int bufSrc;
+  unsigned int totalLength;
+  InterCoreSGLElement elements[INTER_CORE_SGL_MAX_ELEMENTS];
+} __packed InterCoreSGL;
+
+typedef struct InterCoreBufferId
+{
+  unsigned int bufOffset;     /* This offset is from the bufSrc base address */
+  unsigned int length;
+  unsigned int bufSrc;
+} __packed InterCoreBufferId;
+
+/* Send from Vx To Lx Core */
+typedef struct InterCoreSCSIResp {
+	unsigned int version;
+	InterCoreCmdTag tag;
+	unsigned int backEndTag;      /* Resource tag set by back-end stack */
+	unsigned int status;
+	InterCoreBufferId bufId1;
+	InterCoreBufferId bufId2;
+} __packed InterCoreSCSIResp;
+
+/* Sent from Lx To Vx core */
+typedef struct InterCoreSCSICmd
+{
+	unsigned int version;
+	InterCoreCmdTag tag;
+	unsigned char lun[8];
+	unsigned char cdb[16];
+	InterCoreBufferId bufId;
+} __packed InterCoreSCSICmd;
+
+/* Lx Resource are cmd are sent from Vx To Lx when Vx Core is done
+ *  * using Lx Core resource and Lx core can free its resources
+ *   */
+typedef struct InterCoreLxResource {
+ 	unsigned int version;
+	InterCoreCmdTag tag;
+	InterCoreBufferId bufId1;
+	InterCoreBufferId bufId2;
+} __packed InterCoreLxResource;
+
+/* Vx Resource are cmd are sent from Lx To Vx for when Lx Core is done
+ *  * using Vx Core resource and Vx Core can free its resources
+ *   */
+typedef struct InterCoreVxResource {
+	unsigned int version;
+	InterCoreCmdTag tag;
+	unsigned int backEndTag;      /* Resource tag set by back-end stack */
+	InterCoreBufferId bufId1;
+	InterCoreBufferId bufId2;
+} __packed InterCoreVxResource;
+
+/* Message for Vx to Lx core control queue usage. */
+typedef struct InterCoreCtrlVxToLx
+{
+	unsigned int version;
+	InterCoreCmdTag tag;
+	unsigned int flags;
+	time_t secondsSinceEpoch;    /* Seconds since Unix epoch, see flags */
+/*  InterCoreSCSIResp scsiResp; */
+	union {
+		struct {
+			unsigned int fileNum;
+			unsigned int cmd;
+			InterCoreBufferId bufId;
+		} fileReq; // request
+		struct {
+			unsigned int version;
+			unsigned int cmd;
+			InterCoreBufferId bufId;
+		} netReq; // request
+		struct {
+            		uint64_t diskPackId;
+                        unsigned int FSMigrationFlag;
+                        unsigned int reserved[2];
+                } migReq; // request
+                struct {
+                        uint32_t seqNum;
+                        uint32_t crc;
+                        InterCoreBufferId bufId;
+                        uint32_t buffSize;
+                        void*    pBuff;
+                } FwReq;
+	} u;
+} __packed InterCoreCtrlVxToLx;
+
+/*
+ * Core control messages are also delivered through /dev/dri_dnas_ctl. The
+ * device is opened by one reader, which mmaps a read-only ring: a header
+ * page followed by num_slots slots at slot_offset, each holding a message
+ * and its Vx dyn data. The driver advances head as it fills slots and the
+ * reader polls for head != tail, consumes slots up to head and hands back
+ * the new tail with DRI_NAS_CTL_ACK. Replies still go through
+ * DRI_NAS_SEND_MSG, which the device also accepts. Slots whose data did
+ * not fit carry data_len < msg.u.fileReq.bufId.length.
+ */
+#define DRI_NAS_CTL_RING_VERSION	1
+#define DRI_NAS_CTL_SLOTS		64	/* Power of two */
+#define DRI_NAS_CTL_SLOT_SIZE		4096
+
+typedef struct dri_nas_ctl_ring_ {
+	unsigned int version;
+	unsigned int num_slots;
+	unsigned int slot_size;
+	unsigned int slot_offset;   /* Of slot 0 from the start of the mapping */
+	unsigned int head;          /* Free running, written by the driver */
+	unsigned int tail;          /* Free running, last DRI_NAS_CTL_ACK */
+} __packed dri_nas_ctl_ring;
+
+typedef struct dri_nas_ctl_slot_ {
+	InterCoreCtrlVxToLx msg;
+	int status;                 /* Non zero: msg is not valid */
+	unsigned int no_response;   /* As in core_ctl_lx_user_recv */
+	unsigned int data_len;
+	unsigned char data[DRI_NAS_CTL_SLOT_SIZE - sizeof(InterCoreCtrlVxToLx) -
+			   3 * sizeof(unsigned int)];
+} __packed dri_nas_ctl_slot;
+
+#define DRI_NAS_CTL_ACK         _IOW(0xF1, 0xF3, unsigned int)
+
+/* Message for Lx to Vx core control queue usage. */
+typedef struct InterCoreCtrlLxToVx {
+	unsigned int version;
+	InterCoreCmdTag tag;
+	unsigned int flags;
+/*   InterCoreSCSICmd scsiCmd; */
+	union {
+    		struct {
+			unsigned int status;
+			unsigned int len;
+			unsigned int eof;
+		} fileReq; // response
+		struct {
+			unsigned int version;
+			unsigned int status;
+		} netReq; //response
+   		struct
+    		{
+      			unsigned int version;
+      			unsigned code;
+      			unsigned lun;
+    		} hostLunUsageInfo;
+	} u;
+} __packed InterCoreCtrlLxToVx;
+
+typedef struct VxToLxCommonInfo
+{
+       unsigned char serialNumber[32];
+} __packed VX_TO_LX_COMMON_INFO;
+
+#define SCSI_VALID    0x00000001  /* SCSI cmd/resp is valid */
+#define ISCSI_UP      0x00000002  /* iSCSI stack has come up (lx->vx) */
+#define ISCSI_DOWN    0x00000004  /* iSCSI stack has gone down (lx->vx) */
+#define ISCSI_ENABLE  0x00000008  /* iSCSI stack ENABLE request (vx->lx) */
+#define ISCSI_DISABLE 0x00000010  /* iSCSI stack DISABLE request (vx->lx) */
+#define TIME_VALID    0x00000020  /* secondsSinceEpoch is valid (vx->lx) */
+#define REQ_LOGS      0x00000040  /* Request Lx logs (vx->lx + resp) */
+#define RTN_RESOURCE  0x00000080  /* Return resource (lx->vx) */
+#define ISCSI_CRASH   0x00000100  /* iSCSI stack has crashed (lx->vx) */
+#define NET_INFO           0x00000200  /* Get/Set network Info */
+#define UNEXPECTED_REBOOT  0x00000400  /* The last reboot was unexpectd; copy last log to crash file (vx->lx) */
+#define FLUSH_DISKS   0x00000800  /* Request disks are flushed (lx->vx) */
+#define HOST_LUN_USAGE    0x00001000  /* Send host lun usage info (lx->vx) */
+#define GET_BLADE_INFO    0x00002000  /* Get Blade related serial numbers from LX */
+#define LX_SHUTDOWN       0x00004000  /* Request that Linux shut down       */
+#define LX_DOWN           0x00008000  /* Lx->Vx LX SHUTDOWN processing done */
+#define LX_CLEARDISK      0x00010000  /* Request that Linux dor cleardisk processing */
+#define LX_CLEARFLASH     0x00020000  /* Request from Vx to clear flash only */
+#define FS_MIGRATION      0x00040000  /* Message informing of this is a migration */
+#define FW_DOWNLOAD       0x00080000
+#define FW_STATUS         0x00100000
+
+#define HOST_LUN_USAGE_INFO_VERSION 1
+#define HOST_LUN_USAGE_STARTED 1 /* Send one of these for each host that logs in */
+#define HOST_LUN_USAGE_ENDED   2 /* Send one of these for each host that logs out */ 
+#define HOST_LUN_USAGE_RESET   3 /* Send one of these if the LUN is deleted */
+
+#define REQ_LOG_OPEN  0x00000001  /* Open a file */
+#define REQ_LOG_NEXT  0x00000002  /* Get the next chunk of the open file */
+#define REQ_LOG_CLOSE 0x00000003  /* Close the file */
+
+#define REQ_LOG_FILE_DMESG          0x00000001 /* Logs from the dmesg log */
+#define REQ_LOG_FILE_ISCSITGT       0x00000002 /* Logs from the iscsitgt output */
+#define REQ_LOG_FILE_LAST_CRASH     0x00000003 /* Logs from the last crash */
+#define REQ_LOG_FILE_LAST_BOOT      0x00000004 /* Logs from the last boot */
+
+#define REQ_LOG_STAT_OK             0x00000000
+#define REQ_LOG_STAT_CANT_OPEN_FILE 0x00000001
+
+#define SET_NET_INFO       0x00000001  /* Set Network Info to Lx Core */
+#define GET_NET_INFO       0x00000002  /* Get Network Info from Lx Core */
+#define SET_LX_COMMON_INFO 0x00000003  /* Set Other info, currently only Serial Number  */
+#define SET_IMMED_NET_INFO 0x00000004  /* Set the Network Info to Lx Core and take effect immediately */
+#define SET_ESX_CERT       0x00000005  /* Set ESX certification mode on Lx core */
+
+#define NET_INFO_OK        0x00000001
+#define NET_INFO_ERROR     0x00000002
+
+#define NETWORK_INFO_CUR_VERSION (2)
+
+#define INTER_CORE_CMD_PARTITION_ID_INVALID           0x01
+#define INTER_CORE_CMD_PARTITION_ID_J1                0x10
+#define INTER_CORE_CMD_PARTITION_ID_HLBAT_CACHE       0x11
+#define INTER_CORE_CMD_PARTITION_ID_LINUX_DYN_MEM     0x12
+#define INTER_CORE_CMD_PARTITION_ID_VXWORKS_DYN_MEM   0x13
+#define INTER_CORE_CMD_PARTITION_ID_SGL_MEM           0x14
+/* An InterCoreSGL in Linux Dyn memory, its elements say where the data is */
+#define INTER_CORE_CMD_PARTITION_ID_LINUX_SGL         0x15
+
+#define INTER_CORE_CMD_PROTOCOL_VERSION_1             0x2
+#define INTER_CORE_CMD_PROTOCOL_CUR_VERSION           INTER_CORE_CMD_PROTOCOL_VERSION_1
+
+#endif /* _DRI_DNAS_INTERCORE_H_ */
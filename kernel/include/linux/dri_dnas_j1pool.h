@@ -80,7 +80,7 @@ typedef unsigned long TD_ATOMIC32;
 #define SYNC __asm__ __volatile__ ("sync" : : :"memory")
 #endif
 
-inline void iscsiTgtAtomicSet32(TD_ATOMIC32 *var, U32 val)
+static inline void iscsiTgtAtomicSet32(TD_ATOMIC32 *var, U32 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var = val;
@@ -96,7 +96,7 @@ inline void iscsiTgtAtomicSet32(TD_ATOMIC32 *var, U32 val)
 #endif
 }
 
-inline void iscsiTgtAtomicSet64(TD_ATOMIC64 *var, U64 val)
+static inline void iscsiTgtAtomicSet64(TD_ATOMIC64 *var, U64 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var = val;
@@ -112,17 +112,17 @@ inline void iscsiTgtAtomicSet64(TD_ATOMIC64 *var, U64 val)
 #endif
 }
 
-inline U32 iscsiTgtAtomicGet32(TD_ATOMIC32 *var)
+static inline U32 iscsiTgtAtomicGet32(TD_ATOMIC32 *var)
 {
   return *var;
 }
 
-inline U64 iscsiTgtAtomicGet64(TD_ATOMIC64 *var)
+static inline U64 iscsiTgtAtomicGet64(TD_ATOMIC64 *var)
 {
   return *var;
 }
 
-inline void iscsiTgtAtomicAdd32(TD_ATOMIC32 *var, U32 val)
+static inline void iscsiTgtAtomicAdd32(TD_ATOMIC32 *var, U32 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var += val;
@@ -139,7 +139,7 @@ inline void iscsiTgtAtomicAdd32(TD_ATOMIC32 *var, U32 val)
 #endif
 }
 
-inline void iscsiTgtAtomicAdd64(TD_ATOMIC64 *var, U64 val)
+static inline void iscsiTgtAtomicAdd64(TD_ATOMIC64 *var, U64 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var += val;
@@ -156,7 +156,7 @@ inline void iscsiTgtAtomicAdd64(TD_ATOMIC64 *var, U64 val)
 #endif
 }
 
-inline void iscsiTgtAtomicSub32(TD_ATOMIC32 *var, U32 val)
+static inline void iscsiTgtAtomicSub32(TD_ATOMIC32 *var, U32 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var -= val;
@@ -173,7 +173,7 @@ inline void iscsiTgtAtomicSub32(TD_ATOMIC32 *var, U32 val)
 #endif
 }
 
-inline void iscsiTgtAtomicSub64(TD_ATOMIC64 *var, U64 val)
+static inline void iscsiTgtAtomicSub64(TD_ATOMIC64 *var, U64 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var -= val;
@@ -190,7 +190,7 @@ inline void iscsiTgtAtomicSub64(TD_ATOMIC64 *var, U64 val)
 #endif
 }
 
-inline U32 iscsiTgtAtomicAddReturn32(TD_ATOMIC32 *var, U32 val)
+static inline U32 iscsiTgtAtomicAddReturn32(TD_ATOMIC32 *var, U32 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var += val;
@@ -215,7 +215,7 @@ inline U32 iscsiTgtAtomicAddReturn32(TD_ATOMIC32 *var, U32 val)
 #endif
 }
 
-inline U64 iscsiTgtAtomicAddReturn64(TD_ATOMIC64 *var, U64 val)
+static inline U64 iscsiTgtAtomicAddReturn64(TD_ATOMIC64 *var, U64 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var += val;
@@ -240,7 +240,7 @@ inline U64 iscsiTgtAtomicAddReturn64(TD_ATOMIC64 *var, U64 val)
 #endif
 }
 
-inline U32 iscsiTgtAtomicSubReturn32(TD_ATOMIC32 *var, U32 val)
+static inline U32 iscsiTgtAtomicSubReturn32(TD_ATOMIC32 *var, U32 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var -= val;
@@ -265,7 +265,7 @@ inline U32 iscsiTgtAtomicSubReturn32(TD_ATOMIC32 *var, U32 val)
 #endif
 }
 
-inline U64 iscsiTgtAtomicSubReturn64(TD_ATOMIC64 *var, U64 val)
+static inline U64 iscsiTgtAtomicSubReturn64(TD_ATOMIC64 *var, U64 val)
 {
 #if (CPU_FAMILY == DROBO_ARM)
   *var -= val;
@@ -347,14 +347,32 @@ typedef struct BufferDescListLocked {
 
 // Allocator private info does not need to be in shared memory.
 // These are things used only on a live system and not across reboots.
+//
+// Each buffer has a Linux side state. Free buffers are claimed with a
+// compare and swap, parked in a CPU's magazine or issued to a command, and
+// come back when the Vx core marks the descriptor released and tells us so.
+// The state carries a generation so a late or repeated free notification
+// cannot reclaim a buffer that has been issued again since.
+#define J1_BUF_FREE       0
+#define J1_BUF_CLAIMED    1   // Being handed out
+#define J1_BUF_CACHED     2   // In a CPU's magazine
+#define J1_BUF_ISSUED     3   // Owned by a command, then the Vx core
+#define J1_BUF_STATE_MASK 3
+#define J1_BUF_GEN_INC    4
 
 typedef struct PoolAllocatorPrivateInfo{
-  BufferDescListLocked FreeListSingle;
-  BufferDescListLocked FreeListDouble;
-  U32  noFreeSingle;
-  U32  noFreeDouble;
-  U64 allocReleaseGenNumber;
-} __packed PoolAllocatorPrivateInfo;
+  atomic_t *bufState;          // One per buffer, J1_BUF_*
+  atomic_t numFree;
+  U32 scanHint;                // Where the next search for free buffers starts
+  spinlock_t multiLock;        // Serialises multi-buffer allocations
+  // Stats
+  atomic_t allocs;
+  atomic_t magazineHits;
+  atomic_t multiAllocs;
+  atomic_t allocFails;
+  atomic_t reclaimed;
+  atomic_t staleFrees;         // Free notifications that reclaimed nothing
+} PoolAllocatorPrivateInfo;
 
 
 typedef struct WriteBufferPoolInfo{
@@ -399,6 +417,10 @@ typedef struct iscsiTgtWriteBufferInfo
 
 void scsiTgtWriteBufferInit(void * buffer, U32 size);
 void *scsiTgtWriteBufferAllocate(U32 numberBytes);
+void *scsiTgtWriteBufferAllocateWait(U32 numberBytes);
+U32 scsiTgtWriteBufferAllocateList(U32 numberBytes, void **bufs, U32 maxBufs);
+U32 scsiTgtWriteBufferAllocateListWait(U32 numberBytes, void **bufs, U32 maxBufs);
+U32 scsiTgtWriteBufferReclaim(void *buffer, U32 numberBytes);
 void scsiTgtWriteBufferSetTag(void * buffer, U32 tag);
 void scsiTgtWriteBufferSetState(void * buffer, U32 state);
 void scsiTgtWriteBufferSetFlags(void * buffer, U32 flags);
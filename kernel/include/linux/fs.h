@@ -2229,6 +2229,10 @@ extern int invalidate_partition(struct gendisk *, int);
 #endif
 unsigned long invalidate_mapping_pages(struct address_space *mapping,
 					pgoff_t start, pgoff_t end);
+unsigned long invalidate_mapping_pages_once(struct address_space *mapping,
+					pgoff_t start, pgoff_t end,
+					unsigned long *nr_retained,
+					unsigned long *nr_deactivated);
 
 static inline void invalidate_remote_inode(struct inode *inode)
 {
@@ -27,6 +27,7 @@ enum {
 };
 
 struct loop_func_table;
+struct loop_map;
 
 struct loop_device {
 	int		lo_number;
@@ -64,6 +65,8 @@ struct loop_device {
 
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
+
+	struct loop_map		*lo_map;	/* direct I/O, under lo_lock */
 };
 
 #endif /* __KERNEL__ */
@@ -75,6 +78,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_AUTOCLEAR	= 4,
 	LO_FLAGS_PARTSCAN	= 8,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
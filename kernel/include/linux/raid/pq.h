@@ -67,6 +67,11 @@ extern const char raid6_empty_zero_page[PAGE_SIZE];
 #define MODULE_DESCRIPTION(desc)
 #define subsys_initcall(x)
 #define module_exit(x)
+
+/* The kernel Makefile defines the ARM architecture level, take the compiler's */
+#if defined(__arm__) && !defined(__LINUX_ARM_ARCH__) && defined(__ARM_ARCH)
+# define __LINUX_ARM_ARCH__ __ARM_ARCH
+#endif
 #endif /* __KERNEL__ */
 
 /* Routine choices */
@@ -98,6 +103,9 @@ extern const struct raid6_calls raid6_altivec1;
 extern const struct raid6_calls raid6_altivec2;
 extern const struct raid6_calls raid6_altivec4;
 extern const struct raid6_calls raid6_altivec8;
+extern const struct raid6_calls raid6_armv6x1;
+extern const struct raid6_calls raid6_armv6x2;
+extern const struct raid6_calls raid6_armv6x4;
 
 /* Algorithm list */
 extern const struct raid6_calls * const raid6_algos[];
@@ -61,6 +61,98 @@ typedef struct _SharedMemQueueRecvMsg
 	unsigned int status;									/* OUT */
 } SharedMemQueueRecvMsg;
 
+typedef struct _SharedMemQueueSetSpin
+{
+	SharedMemQHandle handle;								/* IN */
+	unsigned int spinUsecs;									/* IN */
+} SharedMemQueueSetSpin;
+
+/*
+ * Batched send/recv. The whole batch is done under one queue lock and the other
+ * core gets one doorbell for it. For a send msgSize is the size of msg, for a
+ * recv msg is the buffer, msgSize its size and msgRecvSize the size received.
+ * A recv waits (as per flags) for the first message only and then takes what
+ * is already queued, up to numEntries.
+ */
+#define SHM_QUEUE_MAX_BATCH						64
+
+typedef struct _SharedMemQueueBatchEntry
+{
+	unsigned char *msg;										/* IN */
+	unsigned int msgSize;									/* IN */
+	unsigned int msgRecvSize;								/* OUT */
+} SharedMemQueueBatchEntry;
+
+typedef struct _SharedMemQueueBatch
+{
+	SharedMemQHandle handle;								/* IN */
+	SharedMemQueueBatchEntry *entries;						/* IN */
+	unsigned int numEntries;								/* IN */
+	unsigned int flags;										/* IN */
+	unsigned int timeoutInMS;								/* IN */
+	unsigned int numDone;									/* OUT */
+	unsigned int status;									/* OUT */
+} SharedMemQueueBatch;
+
+/*
+ * Bulk data regions (J1, HLBAT read cache, the dyn pools) may be mmapped
+ * cacheable or write-combined instead of uncached. The mode is set per region
+ * and applies to mmaps made after it. The queue pool and SGL descriptors stay
+ * uncached. A cacheable mapping is kept coherent with the other core by hand:
+ * clean a range before handing it over, invalidate it before reading what the
+ * other core wrote. Ranges should be cache line aligned, an invalidate of a
+ * partial line also writes back the rest of the line.
+ */
+#define SHM_MAP_UNCACHED						0
+#define SHM_MAP_WRITECOMBINE					1
+#define SHM_MAP_CACHED							2
+#define SHM_MAP_MODES							3
+
+#define SHM_CACHE_CLEAN							0x1
+#define SHM_CACHE_INVALIDATE					0x2
+#define SHM_CACHE_FLUSH							(SHM_CACHE_CLEAN | SHM_CACHE_INVALIDATE)
+
+typedef struct _SharedMemRegionCache
+{
+	char tag[4];											/* IN */
+	unsigned int mode;										/* IN SHM_MAP_xxx */
+} SharedMemRegionCache;
+
+typedef struct _SharedMemCacheSync
+{
+	unsigned char *addr;									/* IN, in a shared_mem mmap */
+	unsigned int length;									/* IN */
+	unsigned int op;										/* IN SHM_CACHE_xxx */
+} SharedMemCacheSync;
+
+/*
+ * Copy bandwidth, in MB/s, of each mapping type over a scratch buffer of size
+ * bytes. The cached figures include the clean (write) or invalidate (read)
+ * that sharing the data would need.
+ */
+typedef struct _SharedMemBench
+{
+	unsigned int size;										/* IN */
+	unsigned int iterations;								/* IN */
+	unsigned int readMBps[SHM_MAP_MODES];					/* OUT */
+	unsigned int writeMBps[SHM_MAP_MODES];					/* OUT */
+} SharedMemBench;
+
+/*
+ * Read bandwidth, in MB/s, of the first size bytes of a region through the
+ * uncached kernel mapping, a kmap per 4K page and the section mapping. A
+ * figure is 0 when that mapping does not exist.
+ */
+typedef struct _SharedMemMapBench
+{
+	char tag[4];											/* IN */
+	unsigned int size;										/* IN, page multiple */
+	unsigned int iterations;								/* IN */
+	unsigned int uncachedMBps;								/* OUT */
+	unsigned int kmapMBps;									/* OUT */
+	unsigned int directMBps;								/* OUT */
+} SharedMemMapBench;
+
 #define SHARED_MEM_IOC_MAGIC				0xDB		/* Our Driver's base code */
 
 #define SHARED_MEM_IOC_GET_REGION_OFFSET	_IOWR(SHARED_MEM_IOC_MAGIC, 1, SharedMemGetRegionOffset *)
@@ -68,9 +160,17 @@ typedef struct _SharedMemQueueRecvMsg
 #define SHARED_MEM_IOC_QUEUE_ATTACH			_IOWR(SHARED_MEM_IOC_MAGIC, 3, SharedMemQueueAttach *)
 #define SHARED_MEM_IOC_QUEUE_SEND_MSG		_IOWR(SHARED_MEM_IOC_MAGIC, 4, SharedMemQueueSendMsg *)
 #define SHARED_MEM_IOC_QUEUE_RECV_MSG		_IOWR(SHARED_MEM_IOC_MAGIC, 5, SharedMemQueueRecvMsg *)
+#define SHARED_MEM_IOC_DUMP_QUEUE_STATS		_IO(SHARED_MEM_IOC_MAGIC, 6)
+#define SHARED_MEM_IOC_QUEUE_SET_SPIN		_IOW(SHARED_MEM_IOC_MAGIC, 7, SharedMemQueueSetSpin *)
+#define SHARED_MEM_IOC_QUEUE_SEND_BATCH		_IOWR(SHARED_MEM_IOC_MAGIC, 8, SharedMemQueueBatch *)
+#define SHARED_MEM_IOC_QUEUE_RECV_BATCH		_IOWR(SHARED_MEM_IOC_MAGIC, 9, SharedMemQueueBatch *)
+#define SHARED_MEM_IOC_SET_REGION_CACHE		_IOW(SHARED_MEM_IOC_MAGIC, 10, SharedMemRegionCache *)
+#define SHARED_MEM_IOC_CACHE_SYNC			_IOW(SHARED_MEM_IOC_MAGIC, 11, SharedMemCacheSync *)
+#define SHARED_MEM_IOC_BENCH				_IOWR(SHARED_MEM_IOC_MAGIC, 12, SharedMemBench *)
+#define SHARED_MEM_IOC_BENCH_MAP			_IOWR(SHARED_MEM_IOC_MAGIC, 13, SharedMemMapBench *)
 
 
-#define SHARED_MEM_IOC_MAXNR				10
+#define SHARED_MEM_IOC_MAXNR				13
 
 
 #endif
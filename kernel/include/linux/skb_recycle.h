@@ -0,0 +1,132 @@
+/*
+ * Receive buffer recycling.
+ *
+ * A recycle pool hands out receive skbs to a driver and takes them back
+ * when the stack frees them, so the next refill does not pay for a new
+ * data buffer or for mapping and invalidating all of it again.
+ *
+ * Pools without ops keep freed buffers in per-cpu caches backed by one
+ * shared depot, so a buffer freed on another cpu (forwarding, tx
+ * completion, socket reader) still finds its way back to the rx path.
+ * Pools with ops hand reusable buffers to the owner instead, for NICs
+ * that keep their own buffer manager.
+ */
+#ifndef _LINUX_SKB_RECYCLE_H
+#define _LINUX_SKB_RECYCLE_H
+
+#include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/dma-mapping.h>
+
+struct skb_recycle_pool;
+
+struct skb_recycle_ops {
+	/* Take back a reset buffer, return 0 if it was accepted */
+	int	(*recycle)(struct skb_recycle_pool *pool, struct sk_buff *skb,
+			   unsigned long cookie);
+	/* The buffer is freed instead, drop the owner's state for it */
+	void	(*release)(struct skb_recycle_pool *pool, struct sk_buff *skb,
+			   unsigned long cookie);
+};
+
+struct skb_recycle_stats {
+	unsigned long	alloc_fast;	/* refills served from a cache */
+	unsigned long	alloc_slow;	/* refills that allocated a new skb */
+	unsigned long	recycled;	/* frees that kept the buffer */
+	unsigned long	remote;		/* buffers moved through the depot */
+	unsigned long	overflow;	/* frees with every cache full */
+	unsigned long	rejected;	/* cloned, nonlinear or too small */
+	unsigned long	sync_bytes;	/* bytes handed back to the device */
+	long		inflight;	/* owned by driver or stack */
+};
+
+struct skb_recycle_cache {
+	struct sk_buff_head		list;
+	struct skb_recycle_stats	stats;
+};
+
+struct skb_recycle_pool {
+	struct list_head	list;
+	char			name[32];
+	unsigned int		buf_size;	/* 0: ops->recycle checks */
+	unsigned int		depth;		/* per-cpu cache depth */
+	struct device		*dev;		/* buffers stay mapped to it */
+	const struct skb_recycle_ops *ops;
+	void			*priv;
+	struct skb_recycle_cache __percpu *cache;
+	struct sk_buff_head	depot;
+	atomic_t		dead;
+	struct rcu_head		rcu;
+};
+
+/* Valid only while the buffer is owned by the pool or its ops */
+struct skb_recycle_cb {
+	unsigned int	dirty;		/* bytes from head the cpu may have written */
+};
+
+#define SKB_RECYCLE_CB(skb)	((struct skb_recycle_cb *)((skb)->cb))
+
+#ifdef CONFIG_NET_SKB_RECYCLE
+
+extern struct skb_recycle_pool *skb_recycle_pool_create(const char *name,
+		unsigned int buf_size, unsigned int depth, struct device *dev,
+		const struct skb_recycle_ops *ops, void *priv);
+extern void skb_recycle_pool_destroy(struct skb_recycle_pool *pool);
+extern struct sk_buff *skb_recycle_alloc(struct skb_recycle_pool *pool,
+					 gfp_t gfp_mask);
+extern void skb_recycle_attach(struct skb_recycle_pool *pool,
+			       struct sk_buff *skb, unsigned long cookie);
+extern int skb_recycle_put(struct sk_buff *skb);
+extern void skb_recycle_detach(struct sk_buff *skb);
+extern void skb_recycle_pool_stats(struct skb_recycle_pool *pool,
+				   struct skb_recycle_stats *stats);
+
+/* DMA address of skb->data for a buffer mapped by the pool */
+static inline dma_addr_t skb_recycle_dma_addr(const struct sk_buff *skb)
+{
+	return (dma_addr_t)skb->recycle_cookie + (skb->data - skb->head);
+}
+
+static inline void skb_recycle_sync_for_cpu(struct sk_buff *skb,
+					    unsigned int len)
+{
+	struct skb_recycle_pool *pool = skb->recycle_pool;
+
+	if (pool && pool->dev)
+		dma_sync_single_for_cpu(pool->dev, skb_recycle_dma_addr(skb),
+					len, DMA_FROM_DEVICE);
+}
+
+#else /* CONFIG_NET_SKB_RECYCLE */
+
+static inline struct skb_recycle_pool *skb_recycle_pool_create(const char *name,
+		unsigned int buf_size, unsigned int depth, struct device *dev,
+		const struct skb_recycle_ops *ops, void *priv)
+{
+	return NULL;
+}
+
+static inline void skb_recycle_pool_destroy(struct skb_recycle_pool *pool)
+{
+}
+
+static inline struct sk_buff *skb_recycle_alloc(struct skb_recycle_pool *pool,
+						gfp_t gfp_mask)
+{
+	return NULL;
+}
+
+static inline void skb_recycle_attach(struct skb_recycle_pool *pool,
+				      struct sk_buff *skb, unsigned long cookie)
+{
+}
+
+static inline void skb_recycle_sync_for_cpu(struct sk_buff *skb,
+					    unsigned int len)
+{
+}
+
+#endif /* CONFIG_NET_SKB_RECYCLE */
+
+#endif /* _LINUX_SKB_RECYCLE_H */
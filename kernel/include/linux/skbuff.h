@@ -104,6 +104,7 @@
 struct net_device;
 struct scatterlist;
 struct pipe_inode_info;
+struct skb_recycle_pool;
 
 #if defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE)
 struct nf_conntrack {
@@ -341,6 +342,8 @@ typedef unsigned char *sk_buff_data_t;
  *	@nf_trace: netfilter packet trace flag
  *	@protocol: Packet protocol from driver
  *	@destructor: Destruct function
+ *	@recycle_pool: Recycle pool that owns the data buffer, if any
+ *	@recycle_cookie: Recycle pool private data for the buffer
  *	@nfct: Associated connection, if any
  *	@nfct_reasm: netfilter conntrack re-assembly pointer
  *	@nf_bridge: Saved data about a bridged frame - see br_netfilter.c
@@ -420,8 +423,8 @@ struct sk_buff {
 
 	void			(*destructor)(struct sk_buff *skb);
 #ifdef CONFIG_NET_SKB_RECYCLE
-	int				(*skb_recycle) (struct sk_buff *skb);
-	void			*hw_cookie;
+	struct skb_recycle_pool	*recycle_pool;
+	unsigned long		recycle_cookie;
 #endif /* CONFIG_NET_SKB_RECYCLE */
 #if defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE)
 	struct nf_conntrack	*nfct;
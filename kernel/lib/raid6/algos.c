@@ -60,6 +60,11 @@ const struct raid6_calls * const raid6_algos[] = {
 	&raid6_altivec2,
 	&raid6_altivec4,
 	&raid6_altivec8,
+#endif
+#if defined(__arm__) && (__LINUX_ARM_ARCH__ >= 6)
+	&raid6_armv6x1,
+	&raid6_armv6x2,
+	&raid6_armv6x4,
 #endif
 	NULL
 };
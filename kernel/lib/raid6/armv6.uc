@@ -0,0 +1,79 @@
+/* -*- linux-c -*- ------------------------------------------------------- *
+ *
+ *   Copyright 2002-2004 H. Peter Anvin - All Rights Reserved
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 53 Temple Place Ste 330,
+ *   Boston MA 02111-1307, USA; either version 2 of the License, or
+ *   (at your option) any later version; incorporated herein by reference.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * armv6$#.c
+ *
+ * $#-way unrolled RAID-6 syndrome using the ARMv6 SIMD instructions
+ *
+ * This file is postprocessed using unroll.awk
+ */
+
+#include <linux/raid/pq.h>
+
+#if defined(__arm__) && (__LINUX_ARM_ARCH__ >= 6)
+
+#define NBYTES(x) ((x) * 0x01010101U)
+#define NSIZE  4
+
+/*
+ * Multiply each of the four bytes by {02} in GF(2^8).  uadd8 doubles
+ * every byte without carry into the next one and sets the GE flag of
+ * each byte that overflowed; sel then picks the polynomial for exactly
+ * those bytes.  The GE flags are not preserved by the compiler, so the
+ * three instructions must stay in one asm statement.
+ */
+static inline __attribute_const__ u32 GFMUL2(u32 v, u32 poly, u32 zero)
+{
+	u32 vv, mask;
+
+	asm("uadd8	%0, %2, %2\n\t"
+	    "sel	%1, %3, %4\n\t"
+	    "eor	%0, %0, %1"
+	    : "=&r" (vv), "=&r" (mask)
+	    : "r" (v), "r" (poly), "r" (zero));
+	return vv;
+}
+
+static void raid6_armv6$#_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	u8 *p, *q;
+	int d, z, z0;
+	u32 poly = NBYTES(0x1d), zero = 0;
+
+	u32 wd$$, wq$$, wp$$;
+
+	z0 = disks - 3;		/* Highest data disk */
+	p = dptr[z0+1];		/* XOR parity */
+	q = dptr[z0+2];		/* RS syndrome */
+
+	for ( d = 0 ; d < bytes ; d += NSIZE*$# ) {
+		wq$$ = wp$$ = *(u32 *)&dptr[z0][d+$$*NSIZE];
+		for ( z = z0-1 ; z >= 0 ; z-- ) {
+			wd$$ = *(u32 *)&dptr[z][d+$$*NSIZE];
+			wp$$ ^= wd$$;
+			wq$$ = GFMUL2(wq$$, poly, zero) ^ wd$$;
+		}
+		*(u32 *)&p[d+NSIZE*$$] = wp$$;
+		*(u32 *)&q[d+NSIZE*$$] = wq$$;
+	}
+}
+
+const struct raid6_calls raid6_armv6x$# = {
+	raid6_armv6$#_gen_syndrome,
+	NULL,		/* always valid on ARMv6 and later */
+	"armv6x$#",
+	0
+};
+
+#endif
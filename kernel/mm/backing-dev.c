@@ -225,12 +225,64 @@ static ssize_t max_ratio_store(struct device *dev,
 }
 BDI_SHOW(max_ratio, bdi->max_ratio)
 
+static ssize_t wb_drop_cache_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct backing_dev_info *bdi = dev_get_drvdata(dev);
+	char *end;
+	unsigned int policy;
+	ssize_t ret = -EINVAL;
+
+	policy = simple_strtoul(buf, &end, 10);
+	if (*buf && (end[0] == '\0' || (end[0] == '\n' && end[1] == '\0')) &&
+	    policy <= BDI_WB_DROP_ALL) {
+		bdi->wb_drop_cache = policy;
+		ret = count;
+	}
+	return ret;
+}
+BDI_SHOW(wb_drop_cache, bdi->wb_drop_cache)
+
+static ssize_t wb_drop_free_kb_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct backing_dev_info *bdi = dev_get_drvdata(dev);
+	char *end;
+	unsigned long free_kb;
+	ssize_t ret = -EINVAL;
+
+	free_kb = simple_strtoul(buf, &end, 10);
+	if (*buf && (end[0] == '\0' || (end[0] == '\n' && end[1] == '\0'))) {
+		bdi->wb_drop_free_pages = free_kb >> (PAGE_SHIFT - 10);
+		ret = count;
+	}
+	return ret;
+}
+BDI_SHOW(wb_drop_free_kb, K(bdi->wb_drop_free_pages))
+
+static ssize_t wb_drop_stats_show(struct device *dev,
+		struct device_attribute *attr, char *page)
+{
+	struct backing_dev_info *bdi = dev_get_drvdata(dev);
+
+	return snprintf(page, PAGE_SIZE-1,
+			"dropped:     %10lu\n"
+			"deactivated: %10lu\n"
+			"retained:    %10lu\n",
+			atomic_long_read(&bdi->wb_pages_dropped),
+			atomic_long_read(&bdi->wb_pages_deactivated),
+			atomic_long_read(&bdi->wb_pages_retained));
+}
+
 #define __ATTR_RW(attr) __ATTR(attr, 0644, attr##_show, attr##_store)
 
 static struct device_attribute bdi_dev_attrs[] = {
 	__ATTR_RW(read_ahead_kb),
 	__ATTR_RW(min_ratio),
 	__ATTR_RW(max_ratio),
+	__ATTR_RW(wb_drop_cache),
+	__ATTR_RW(wb_drop_free_kb),
+	__ATTR(wb_drop_stats, 0444, wb_drop_stats_show, NULL),
 	__ATTR_NULL,
 };
 
@@ -682,6 +734,11 @@ int bdi_init(struct backing_dev_info *bdi)
 	bdi->min_ratio = 0;
 	bdi->max_ratio = 100;
 	bdi->max_prop_frac = PROP_FRAC_BASE;
+	bdi->wb_drop_cache = BDI_WB_DROP_WRITTEN;
+	bdi->wb_drop_free_pages = 0;
+	atomic_long_set(&bdi->wb_pages_dropped, 0);
+	atomic_long_set(&bdi->wb_pages_deactivated, 0);
+	atomic_long_set(&bdi->wb_pages_retained, 0);
 	spin_lock_init(&bdi->wb_lock);
 	INIT_LIST_HEAD(&bdi->bdi_list);
 	INIT_LIST_HEAD(&bdi->work_list);
@@ -327,8 +327,9 @@ EXPORT_SYMBOL(truncate_inode_pages);
  * invalidate pages which are dirty, locked, under writeback or mapped into
  * pagetables.
  */
-unsigned long invalidate_mapping_pages(struct address_space *mapping,
-		pgoff_t start, pgoff_t end)
+static unsigned long __invalidate_mapping_pages(struct address_space *mapping,
+		pgoff_t start, pgoff_t end, bool use_once,
+		unsigned long *nr_retained, unsigned long *nr_deactivated)
 {
 	struct pagevec pvec;
 	pgoff_t index = start;
@@ -356,6 +357,12 @@ unsigned long invalidate_mapping_pages(struct address_space *mapping,
 			if (index > end)
 				break;
 
+			/* Used again since it was brought in, keep it */
+			if (use_once && PageActive(page)) {
+				(*nr_retained)++;
+				continue;
+			}
+
 			if (!trylock_page(page))
 				continue;
 			WARN_ON(page->index != index);
@@ -365,8 +372,11 @@ unsigned long invalidate_mapping_pages(struct address_space *mapping,
 			 * Invalidation is a hint that the page is no longer
 			 * of interest and try to speed up its reclaim.
 			 */
-			if (!ret)
+			if (!ret) {
 				deactivate_page(page);
+				if (nr_deactivated)
+					(*nr_deactivated)++;
+			}
 			count += ret;
 		}
 		pagevec_release(&pvec);
@@ -376,8 +386,36 @@ unsigned long invalidate_mapping_pages(struct address_space *mapping,
 	}
 	return count;
 }
+
+unsigned long invalidate_mapping_pages(struct address_space *mapping,
+		pgoff_t start, pgoff_t end)
+{
+	return __invalidate_mapping_pages(mapping, start, end, false,
+					  NULL, NULL);
+}
 EXPORT_SYMBOL(invalidate_mapping_pages);
 
+/**
+ * invalidate_mapping_pages_once - invalidate use-once pages of one inode
+ * @mapping: the address_space which holds the pages to invalidate
+ * @start: the offset 'from' which to invalidate
+ * @end: the offset 'to' which to invalidate (inclusive)
+ * @nr_retained: incremented for each page kept because it is active
+ * @nr_deactivated: incremented for each page that could only be deactivated
+ *
+ * Like invalidate_mapping_pages(), but pages that have been promoted to the
+ * active list, i.e. were referenced again after they were first touched,
+ * are left alone. Used to drop freshly written data nobody reads back.
+ */
+unsigned long invalidate_mapping_pages_once(struct address_space *mapping,
+		pgoff_t start, pgoff_t end,
+		unsigned long *nr_retained, unsigned long *nr_deactivated)
+{
+	return __invalidate_mapping_pages(mapping, start, end, true,
+					  nr_retained, nr_deactivated);
+}
+EXPORT_SYMBOL(invalidate_mapping_pages_once);
+
 /*
  * This is like invalidate_complete_page(), except it ignores the page's
  * refcount.  We do this because invalidate_inode_pages2() needs stronger
@@ -0,0 +1,485 @@
+/*
+ *	Receive buffer recycling.
+ *
+ *	A driver creates a pool per rx ring (or per port) and refills the
+ *	ring from it.  kfree_skb hands buffers of such skbs back to the
+ *	pool; they are reset with skb_recycle() and parked in the cache of
+ *	the cpu that freed them.  When that cache is full the buffer goes
+ *	to the pool's depot, where the refilling cpu picks it up again.
+ *
+ *	Buffers of pools created with a device stay DMA mapped while they
+ *	are cached.  Before reuse only the part the cpu may have written,
+ *	head up to the old tail, is handed back to the device, instead of
+ *	the whole buffer.
+ *
+ *	Statistics are in /proc/net/skb_recycle.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/skb_recycle.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <net/net_namespace.h>
+
+static LIST_HEAD(skb_recycle_pools);
+static DEFINE_MUTEX(skb_recycle_mutex);
+
+/* Depot size, in per-cpu caches */
+static unsigned int skb_recycle_depot = 2;
+module_param(skb_recycle_depot, uint, 0644);
+
+#define SKB_RECYCLE_BATCH	16
+
+static void skb_recycle_unmap(struct skb_recycle_pool *pool,
+			      struct sk_buff *skb)
+{
+	if (pool->dev)
+		dma_unmap_single(pool->dev, (dma_addr_t)skb->recycle_cookie,
+				 NET_SKB_PAD + pool->buf_size, DMA_FROM_DEVICE);
+}
+
+static long skb_recycle_inflight(struct skb_recycle_pool *pool)
+{
+	long inflight = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		inflight += per_cpu_ptr(pool->cache, cpu)->stats.inflight;
+
+	return inflight;
+}
+
+static void skb_recycle_pool_free_rcu(struct rcu_head *head)
+{
+	struct skb_recycle_pool *pool;
+
+	pool = container_of(head, struct skb_recycle_pool, rcu);
+	free_percpu(pool->cache);
+	kfree(pool);
+}
+
+/* Last buffer of a destroyed pool is back, free the pool itself */
+static void skb_recycle_pool_reap(struct skb_recycle_pool *pool)
+{
+	if (skb_recycle_inflight(pool) == 0 &&
+	    atomic_cmpxchg(&pool->dead, 1, 2) == 1)
+		call_rcu(&pool->rcu, skb_recycle_pool_free_rcu);
+}
+
+/**
+ *	skb_recycle_pool_create - create a receive buffer pool
+ *	@name: name shown in /proc/net/skb_recycle
+ *	@buf_size: receive buffer size, 0 if @ops->recycle checks it
+ *	@depth: number of buffers cached per cpu
+ *	@dev: device the buffers are mapped for, or %NULL
+ *	@ops: owner callbacks, or %NULL to use the per-cpu caches
+ *	@priv: owner private data
+ *
+ *	Returns the pool or %NULL if out of memory.
+ */
+struct skb_recycle_pool *skb_recycle_pool_create(const char *name,
+		unsigned int buf_size, unsigned int depth, struct device *dev,
+		const struct skb_recycle_ops *ops, void *priv)
+{
+	struct skb_recycle_pool *pool;
+	int cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->cache = alloc_percpu(struct skb_recycle_cache);
+	if (!pool->cache) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu)
+		skb_queue_head_init(&per_cpu_ptr(pool->cache, cpu)->list);
+	skb_queue_head_init(&pool->depot);
+
+	strlcpy(pool->name, name, sizeof(pool->name));
+	pool->buf_size = buf_size;
+	pool->depth = depth;
+	pool->dev = dev;
+	pool->ops = ops;
+	pool->priv = priv;
+	atomic_set(&pool->dead, 0);
+
+	mutex_lock(&skb_recycle_mutex);
+	list_add_tail(&pool->list, &skb_recycle_pools);
+	mutex_unlock(&skb_recycle_mutex);
+
+	return pool;
+}
+EXPORT_SYMBOL(skb_recycle_pool_create);
+
+static void skb_recycle_purge(struct skb_recycle_pool *pool,
+			      struct sk_buff_head *list)
+{
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(list)) != NULL) {
+		skb_recycle_unmap(pool, skb);
+		skb->recycle_pool = NULL;
+		kfree_skb(skb);
+	}
+}
+
+/**
+ *	skb_recycle_pool_destroy - destroy a receive buffer pool
+ *	@pool: pool to destroy
+ *
+ *	Frees the cached buffers.  Buffers still in the stack are freed
+ *	normally when they come back, the last one frees the pool.
+ *	Must be called from process context.
+ */
+void skb_recycle_pool_destroy(struct skb_recycle_pool *pool)
+{
+	int cpu;
+
+	if (!pool)
+		return;
+
+	mutex_lock(&skb_recycle_mutex);
+	list_del(&pool->list);
+	mutex_unlock(&skb_recycle_mutex);
+
+	atomic_set(&pool->dead, 1);
+	/* No put or detach still sees the pool alive after this */
+	synchronize_rcu();
+
+	for_each_possible_cpu(cpu)
+		skb_recycle_purge(pool, &per_cpu_ptr(pool->cache, cpu)->list);
+	skb_recycle_purge(pool, &pool->depot);
+
+	skb_recycle_pool_reap(pool);
+}
+EXPORT_SYMBOL(skb_recycle_pool_destroy);
+
+/* Refill an empty cache from the depot, called with irqs off */
+static struct sk_buff *skb_recycle_depot_get(struct skb_recycle_pool *pool,
+					     struct skb_recycle_cache *c)
+{
+	struct sk_buff *skb;
+	int i;
+
+	if (skb_queue_empty(&pool->depot))
+		return NULL;
+
+	spin_lock(&pool->depot.lock);
+	for (i = 0; i < SKB_RECYCLE_BATCH; i++) {
+		skb = __skb_dequeue(&pool->depot);
+		if (!skb)
+			break;
+		__skb_queue_tail(&c->list, skb);
+		c->stats.remote++;
+	}
+	spin_unlock(&pool->depot.lock);
+
+	return __skb_dequeue(&c->list);
+}
+
+/**
+ *	skb_recycle_alloc - allocate a receive buffer from a pool
+ *	@pool: pool to allocate from
+ *	@gfp_mask: allocation flags if no cached buffer is available
+ *
+ *	Returns an skb with NET_SKB_PAD headroom and room for the pool's
+ *	buffer size, owned by the pool, or %NULL.  For mapped pools the
+ *	buffer is ready for the device, see skb_recycle_dma_addr().
+ */
+struct sk_buff *skb_recycle_alloc(struct skb_recycle_pool *pool,
+				  gfp_t gfp_mask)
+{
+	struct skb_recycle_cache *c;
+	struct sk_buff *skb;
+	unsigned long flags;
+	dma_addr_t dma;
+
+	if (!pool)
+		return NULL;
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(pool->cache);
+	skb = __skb_dequeue(&c->list);
+	if (!skb)
+		skb = skb_recycle_depot_get(pool, c);
+	if (skb) {
+		c->stats.alloc_fast++;
+		c->stats.inflight++;
+	}
+	local_irq_restore(flags);
+
+	if (skb) {
+		if (pool->dev && SKB_RECYCLE_CB(skb)->dirty)
+			dma_sync_single_for_device(pool->dev,
+						   (dma_addr_t)skb->recycle_cookie,
+						   SKB_RECYCLE_CB(skb)->dirty,
+						   DMA_FROM_DEVICE);
+		return skb;
+	}
+
+	skb = __alloc_skb(NET_SKB_PAD + pool->buf_size, gfp_mask, 0,
+			  NUMA_NO_NODE);
+	if (!skb)
+		return NULL;
+	skb_reserve(skb, NET_SKB_PAD);
+
+	dma = 0;
+	if (pool->dev) {
+		dma = dma_map_single(pool->dev, skb->head,
+				     NET_SKB_PAD + pool->buf_size,
+				     DMA_FROM_DEVICE);
+		if (dma_mapping_error(pool->dev, dma)) {
+			kfree_skb(skb);
+			return NULL;
+		}
+	}
+
+	skb->recycle_pool = pool;
+	skb->recycle_cookie = (unsigned long)dma;
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(pool->cache);
+	c->stats.alloc_slow++;
+	c->stats.inflight++;
+	local_irq_restore(flags);
+
+	return skb;
+}
+EXPORT_SYMBOL(skb_recycle_alloc);
+
+/**
+ *	skb_recycle_attach - let a pool take back a driver allocated buffer
+ *	@pool: pool with ops
+ *	@skb: receive skb
+ *	@cookie: owner data passed back to @pool->ops
+ */
+void skb_recycle_attach(struct skb_recycle_pool *pool, struct sk_buff *skb,
+			unsigned long cookie)
+{
+	unsigned long flags;
+
+	skb->recycle_pool = pool;
+	skb->recycle_cookie = cookie;
+
+	local_irq_save(flags);
+	this_cpu_ptr(pool->cache)->stats.inflight++;
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(skb_recycle_attach);
+
+/**
+ *	skb_recycle_detach - release the pool's hold on a buffer
+ *	@skb: skb owned by a pool
+ *
+ *	The data buffer will be freed normally.
+ */
+void skb_recycle_detach(struct sk_buff *skb)
+{
+	struct skb_recycle_pool *pool = skb->recycle_pool;
+	unsigned long cookie = skb->recycle_cookie;
+	unsigned long flags;
+
+	skb->recycle_pool = NULL;
+	skb->recycle_cookie = 0;
+
+	/* Keeps a destroyed pool around until it has been reaped */
+	rcu_read_lock();
+	if (pool->ops && pool->ops->release)
+		pool->ops->release(pool, skb, cookie);
+	else if (pool->dev)
+		dma_unmap_single(pool->dev, (dma_addr_t)cookie,
+				 NET_SKB_PAD + pool->buf_size, DMA_FROM_DEVICE);
+
+	local_irq_save(flags);
+	this_cpu_ptr(pool->cache)->stats.inflight--;
+	local_irq_restore(flags);
+
+	if (unlikely(atomic_read(&pool->dead)))
+		skb_recycle_pool_reap(pool);
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL(skb_recycle_detach);
+
+/* Park a reset buffer, returns 0 if it was kept */
+static int skb_recycle_cache_put(struct skb_recycle_pool *pool,
+				 struct sk_buff *skb)
+{
+	struct skb_recycle_cache *c;
+	unsigned long flags;
+	int err = 0;
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(pool->cache);
+	if (skb_queue_len(&c->list) < pool->depth) {
+		/* LIFO, the next refill gets the cache-hot buffer */
+		__skb_queue_head(&c->list, skb);
+	} else {
+		spin_lock(&pool->depot.lock);
+		if (skb_queue_len(&pool->depot) <
+		    pool->depth * skb_recycle_depot)
+			__skb_queue_tail(&pool->depot, skb);
+		else
+			err = 1;
+		spin_unlock(&pool->depot.lock);
+	}
+	if (err) {
+		c->stats.overflow++;
+	} else {
+		c->stats.recycled++;
+		if (pool->dev)
+			c->stats.sync_bytes += SKB_RECYCLE_CB(skb)->dirty;
+		c->stats.inflight--;
+	}
+	local_irq_restore(flags);
+
+	return err;
+}
+
+/**
+ *	skb_recycle_put - give a freed skb back to its pool
+ *	@skb: skb owned by a pool, with no users left
+ *
+ *	Called by __kfree_skb.  Returns 0 if the pool kept the skb,
+ *	otherwise the skb is detached and must be freed normally.
+ */
+int skb_recycle_put(struct sk_buff *skb)
+{
+	struct skb_recycle_pool *pool = skb->recycle_pool;
+	unsigned long cookie = skb->recycle_cookie;
+	struct skb_recycle_cache *c;
+	unsigned int dirty;
+	unsigned long flags;
+
+	rcu_read_lock();
+	if (unlikely(atomic_read(&pool->dead)))
+		goto out;
+
+	if (!skb_is_recycleable(skb, pool->buf_size))
+		goto reject;
+
+	/* The cpu has written at most up to the tail */
+	dirty = skb_tail_pointer(skb) - skb->head;
+
+	skb_recycle(skb);
+	SKB_RECYCLE_CB(skb)->dirty = dirty;
+
+	if (pool->ops) {
+		/* The owner gets the buffer back detached */
+		if (pool->ops->recycle(pool, skb, cookie)) {
+			skb->recycle_pool = pool;
+			skb->recycle_cookie = cookie;
+			goto reject;
+		}
+
+		local_irq_save(flags);
+		c = this_cpu_ptr(pool->cache);
+		c->stats.recycled++;
+		c->stats.sync_bytes += dirty;
+		c->stats.inflight--;
+		local_irq_restore(flags);
+	} else {
+		skb->recycle_pool = pool;
+		skb->recycle_cookie = cookie;
+		if (skb_recycle_cache_put(pool, skb))
+			goto out;
+	}
+
+	rcu_read_unlock();
+	return 0;
+
+reject:
+	local_irq_save(flags);
+	this_cpu_ptr(pool->cache)->stats.rejected++;
+	local_irq_restore(flags);
+out:
+	skb_recycle_detach(skb);
+	rcu_read_unlock();
+	return 1;
+}
+EXPORT_SYMBOL(skb_recycle_put);
+
+/**
+ *	skb_recycle_pool_stats - sum the per-cpu statistics of a pool
+ *	@pool: pool
+ *	@stats: result
+ */
+void skb_recycle_pool_stats(struct skb_recycle_pool *pool,
+			    struct skb_recycle_stats *stats)
+{
+	struct skb_recycle_stats *s;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		s = &per_cpu_ptr(pool->cache, cpu)->stats;
+		stats->alloc_fast += s->alloc_fast;
+		stats->alloc_slow += s->alloc_slow;
+		stats->recycled += s->recycled;
+		stats->remote += s->remote;
+		stats->overflow += s->overflow;
+		stats->rejected += s->rejected;
+		stats->sync_bytes += s->sync_bytes;
+		stats->inflight += s->inflight;
+	}
+}
+EXPORT_SYMBOL(skb_recycle_pool_stats);
+
+#ifdef CONFIG_PROC_FS
+static int skb_recycle_seq_show(struct seq_file *seq, void *v)
+{
+	struct skb_recycle_pool *pool;
+	struct skb_recycle_stats s;
+	unsigned long cached;
+	int cpu;
+
+	seq_printf(seq, "%-16s %8s %10s %10s %10s %10s %10s %10s %8s %8s %14s\n",
+		   "pool", "bufsize", "alloc_fast", "alloc_slow", "recycled",
+		   "remote", "overflow", "rejected", "inflight", "cached",
+		   "sync_bytes");
+
+	mutex_lock(&skb_recycle_mutex);
+	list_for_each_entry(pool, &skb_recycle_pools, list) {
+		skb_recycle_pool_stats(pool, &s);
+		cached = skb_queue_len(&pool->depot);
+		for_each_possible_cpu(cpu)
+			cached += skb_queue_len(&per_cpu_ptr(pool->cache, cpu)->list);
+
+		seq_printf(seq, "%-16s %8u %10lu %10lu %10lu %10lu %10lu %10lu %8ld %8lu %14lu\n",
+			   pool->name, pool->buf_size, s.alloc_fast,
+			   s.alloc_slow, s.recycled, s.remote, s.overflow,
+			   s.rejected, s.inflight, cached, s.sync_bytes);
+	}
+	mutex_unlock(&skb_recycle_mutex);
+
+	return 0;
+}
+
+static int skb_recycle_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, skb_recycle_seq_show, NULL);
+}
+
+static const struct file_operations skb_recycle_seq_fops = {
+	.owner	 = THIS_MODULE,
+	.open    = skb_recycle_seq_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static int __init skb_recycle_proc_init(void)
+{
+	if (!proc_net_fops_create(&init_net, "skb_recycle", S_IRUGO,
+				  &skb_recycle_seq_fops))
+		return -ENOMEM;
+	return 0;
+}
+subsys_initcall(skb_recycle_proc_init);
+#endif /* CONFIG_PROC_FS */
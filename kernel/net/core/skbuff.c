@@ -51,6 +51,7 @@
 #endif
 #include <linux/string.h>
 #include <linux/skbuff.h>
+#include <linux/skb_recycle.h>
 #include <linux/splice.h>
 #include <linux/cache.h>
 #include <linux/rtnetlink.h>
@@ -334,6 +335,13 @@ static inline void skb_release_data(struct sk_buff *skb)
 	if (!skb->cloned ||
 	    !atomic_sub_return(skb->nohdr ? (1 << SKB_DATAREF_SHIFT) + 1 : 1,
 			       &skb_shinfo(skb)->dataref)) {
+#ifdef CONFIG_NET_SKB_RECYCLE
+		/* The buffer was not taken back by its pool, unmap it before
+		 * the head goes */
+		if (skb->recycle_pool)
+			skb_recycle_detach(skb);
+#endif /* CONFIG_NET_SKB_RECYCLE */
+
 		if (skb_shinfo(skb)->nr_frags) {
 			int i;
 			for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
@@ -357,14 +365,6 @@ static inline void skb_release_data(struct sk_buff *skb)
 
 		kfree(skb->head);
 	}
-#ifdef CONFIG_NET_SKB_RECYCLE
-	/* Workaround for the cases when recycle callback was not called */
-	if (skb->hw_cookie) {
-		kfree(skb->hw_cookie);
-		skb->hw_cookie = NULL;
-	}
-	skb->skb_recycle = NULL;
-#endif /* CONFIG_NET_SKB_RECYCLE */	
 }
 
 /*
@@ -450,10 +450,10 @@ static inline void skb_release_all(struct sk_buff *skb)
 void __kfree_skb(struct sk_buff *skb)
 {
 #ifdef CONFIG_NET_SKB_RECYCLE
-	if (skb->skb_recycle && !skb->skb_recycle(skb))
+	if (skb->recycle_pool && !skb_recycle_put(skb))
 		return;
 #endif /* CONFIG_NET_SKB_RECYCLE */
- 
+
 	skb_release_all(skb);
 	kfree_skbmem(skb);
 }
@@ -611,8 +611,12 @@ static struct sk_buff *__skb_clone(struct sk_buff *n, struct sk_buff *skb)
 	n->destructor = NULL;
 
 #ifdef CONFIG_NET_SKB_RECYCLE
-	n->skb_recycle = NULL;
-	n->hw_cookie = NULL;
+	n->recycle_pool = NULL;
+	n->recycle_cookie = 0;
+	/* The head is shared from here on and can't go back to the pool,
+	 * so whichever skb frees it last frees it as a plain buffer */
+	if (skb->recycle_pool)
+		skb_recycle_detach(skb);
 #endif /* CONFIG_NET_SKB_RECYCLE */
 
 	C(tail);
@@ -942,12 +946,9 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
 	if (fastpath) {
 
 #ifdef CONFIG_NET_SKB_RECYCLE
-		/* Workaround for the cases when recycle callback was not called */
-		if (skb->hw_cookie) {
-			kfree(skb->hw_cookie);
-			skb->hw_cookie = NULL;
-		}
-		skb->skb_recycle = NULL;
+		/* The head is replaced, the pool loses this buffer */
+		if (skb->recycle_pool)
+			skb_recycle_detach(skb);
 #endif /* CONFIG_NET_SKB_RECYCLE */
 
 		kfree(skb->head);